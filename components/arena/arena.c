@@ -0,0 +1,151 @@
+#include "arena.h"
+
+#include <string.h>
+
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+
+#define TASK_CAPS \
+  (MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT)  // Memory stacks must come from.
+#define STACK_ALIGNMENT 16  // Alignment of a stack after its task (bytes).
+#define OTHER_OWNER "other"  // Owner memory is counted for once the table
+                             // is full.
+
+// Long-lived buffers and task stacks are carved out of the heap while
+// booting and are never given back, so the heap settles before the first
+// report. Once the arena is sealed anything carved out is a sensor that only
+// came up late or a config that outgrew its buffers, which is still allowed
+// so the sensor keeps working but is logged and counted as late. Memory is
+// counted per owner for the memory report, and once there are too many owners
+// the rest share the last entry.
+static const char *TAG = "arena";
+static portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+static arena_usage_t usage[ARENA_MAX_OWNERS];
+static size_t num_owners = 0;
+static struct {
+  TaskHandle_t handle;
+  const char *name;
+  uint32_t stack_size;
+} tasks[ARENA_MAX_TASKS];
+static size_t num_tasks = 0;
+static bool sealed = false;
+static size_t late = 0;  // Memory carved out after the arena was sealed.
+static TaskHandle_t counted_task = NULL;  // Task allocations are counted for.
+static size_t allocations = 0;  // Heap allocations made by counted_task.
+
+#ifdef CONFIG_ARENA_COUNT_ALLOCATIONS
+// The heap functions are wrapped at link time, so that the allocations the
+// report path still makes from the heap show up in the memory report.
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+static void count_allocation() {
+  if (counted_task != NULL && xTaskGetCurrentTaskHandle() == counted_task)
+    ++allocations;
+}
+
+void *__wrap_malloc(size_t size) {
+  count_allocation();
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+  count_allocation();
+  return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+  count_allocation();
+  return __real_realloc(ptr, size);
+}
+#endif  // CONFIG_ARENA_COUNT_ALLOCATIONS
+
+static arena_usage_t *get_owner(const char *owner) {
+  // the caller holds the mux
+  for (size_t i = 0; i < num_owners; ++i)
+    if (strcmp(usage[i].owner, owner) == 0) return &usage[i];
+  if (num_owners == ARENA_MAX_OWNERS - 1) owner = OTHER_OWNER;
+  if (num_owners == ARENA_MAX_OWNERS) return &usage[ARENA_MAX_OWNERS - 1];
+  usage[num_owners] = (arena_usage_t){.owner = owner};
+  return &usage[num_owners++];
+}
+
+void *arena_alloc(const char *owner, size_t size, uint32_t caps) {
+  void *buf = heap_caps_malloc(size, caps);
+  if (buf == NULL) return NULL;
+  portENTER_CRITICAL(&mux);
+  get_owner(owner)->size += size;
+  if (sealed) late += size;
+  const bool was_sealed = sealed;
+  portEXIT_CRITICAL(&mux);
+  if (was_sealed)
+    ESP_LOGW(TAG, "%s carved out %u bytes after boot", owner,
+             (unsigned)size);
+  return buf;
+}
+
+TaskHandle_t arena_create_task(TaskFunction_t task, const char *name,
+                               uint32_t stack_size, void *arg,
+                               UBaseType_t priority, BaseType_t core) {
+  // tasks in the arena run until reset, so their stacks stay counted
+  portENTER_CRITICAL(&mux);
+  const size_t slot = num_tasks;
+  if (num_tasks < ARENA_MAX_TASKS) ++num_tasks;
+  portEXIT_CRITICAL(&mux);
+  if (slot == ARENA_MAX_TASKS) return NULL;
+
+  // the task and its stack are carved out together, so neither is left
+  // behind when there isn't room for both
+  const size_t buffer_size = (sizeof(StaticTask_t) + STACK_ALIGNMENT - 1) &
+                             ~(size_t)(STACK_ALIGNMENT - 1);
+  uint8_t *buf = arena_alloc(name, buffer_size + stack_size, TASK_CAPS);
+  if (buf == NULL) return NULL;  // the slot stays empty
+  TaskHandle_t handle = xTaskCreateStaticPinnedToCore(
+      task, name, stack_size, arg, priority, (StackType_t *)(buf + buffer_size),
+      (StaticTask_t *)buf, core);
+  tasks[slot].name = name;
+  tasks[slot].stack_size = stack_size;
+  tasks[slot].handle = handle;
+  return handle;
+}
+
+void arena_seal() {
+  size_t total = 0;
+  portENTER_CRITICAL(&mux);
+  for (size_t i = 0; i < num_owners; ++i) total += usage[i].size;
+  sealed = true;
+  portEXIT_CRITICAL(&mux);
+  ESP_LOGI(TAG, "%u bytes carved out at boot", (unsigned)total);
+}
+
+size_t arena_get_late() { return late; }
+
+void arena_count_allocations() {
+  // only the calling task is counted, from zero
+  allocations = 0;
+  counted_task = xTaskGetCurrentTaskHandle();
+}
+
+size_t arena_get_allocations() { return allocations; }
+
+size_t arena_get_usage(arena_usage_t *usage_out, size_t max) {
+  portENTER_CRITICAL(&mux);
+  const size_t count = num_owners < max ? num_owners : max;
+  memcpy(usage_out, usage, count * sizeof(arena_usage_t));
+  portEXIT_CRITICAL(&mux);
+  return count;
+}
+
+size_t arena_get_tasks(arena_task_t *tasks_out, size_t max) {
+  // slots of tasks that couldn't be created, or are being created, are empty
+  size_t count = 0;
+  for (size_t i = 0; i < num_tasks && count < max; ++i) {
+    if (tasks[i].handle == NULL) continue;
+    tasks_out[count++] = (arena_task_t){
+        .name = tasks[i].name,
+        .stack_size = tasks[i].stack_size,
+        .stack_free = uxTaskGetStackHighWaterMark(tasks[i].handle)};
+  }
+  return count;
+}
@@ -0,0 +1,4 @@
+ifdef CONFIG_ARENA_COUNT_ALLOCATIONS
+COMPONENT_ADD_LDFLAGS += -Wl,--wrap=malloc -Wl,--wrap=calloc \
+                         -Wl,--wrap=realloc
+endif
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "esp_heap_caps.h"
+#include "esp_system.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#define ARENA_MAX_OWNERS 12  // Number of subsystems memory is counted for.
+#define ARENA_MAX_TASKS 8    // Number of tasks that can be created.
+
+typedef struct {
+  const char *owner;  // Subsystem the memory was carved out for.
+  size_t size;        // Memory carved out (bytes).
+} arena_usage_t;
+
+typedef struct {
+  const char *name;     // Name the task was created with.
+  uint32_t stack_size;  // Size of the stack (bytes).
+  uint32_t stack_free;  // Least free stack since the task started (bytes).
+} arena_task_t;
+
+void *arena_alloc(const char *owner, size_t size, uint32_t caps);
+
+TaskHandle_t arena_create_task(TaskFunction_t task, const char *name,
+                               uint32_t stack_size, void *arg,
+                               UBaseType_t priority, BaseType_t core);
+
+void arena_seal();
+
+size_t arena_get_late();
+
+void arena_count_allocations();
+
+size_t arena_get_allocations();
+
+size_t arena_get_usage(arena_usage_t *usage, size_t max);
+
+size_t arena_get_tasks(arena_task_t *tasks, size_t max);
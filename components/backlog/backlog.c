@@ -0,0 +1,289 @@
+#include "backlog.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#include "esp32/rom/crc.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_partition.h"
+
+#define PARTITION_SUBTYPE 0x40  // Subtype of the data partition to use.
+#define SECTOR_SIZE 4096        // Smallest erasable size of flash (bytes).
+#define RECORD_MAGIC 0x424c     // Marks a record header that was written.
+#define STATE_MAGIC 0x424c4f47  // Marks a state that survived deep sleep.
+#define ALIGN(n) (((n) + 3) & ~3)  // Records are kept word aligned.
+
+typedef struct {
+  uint16_t magic;
+  uint16_t size;      // Size of the data that follows (bytes).
+  uint32_t seq;       // Increases with every record pushed.
+  uint32_t crc;       // CRC-32 of the data.
+  uint32_t consumed;  // All ones until the record is popped.
+} record_header_t;
+
+// Records are written one after another and never cross a sector, so a
+// sector may end in erased space too small for the next record. Popping a
+// record only clears bits in its header, which flash allows without an erase,
+// so a sector is only erased when the head wraps around to it again. The head
+// is where the next record goes and the tail is the oldest record that hasn't
+// been popped, or the head if there is none.
+static const char *TAG = "backlog";
+static const esp_partition_t *partition = NULL;
+static RTC_DATA_ATTR struct {
+  uint32_t magic;
+  uint32_t head;
+  uint32_t tail;
+  uint32_t next_seq;
+  uint32_t count;    // Records that haven't been popped.
+  uint32_t dropped;  // Records lost to overwrites or corruption.
+} state;
+
+static bool fits(uint32_t offset, size_t size) {
+  // whether a record fits between offset and the end of its sector
+  return offset % SECTOR_SIZE + sizeof(record_header_t) + ALIGN(size) <=
+         SECTOR_SIZE;
+}
+
+static uint32_t sector_of(uint32_t offset) {
+  return offset - offset % SECTOR_SIZE;
+}
+
+static uint32_t next_sector(uint32_t offset) {
+  const uint32_t next = sector_of(offset) + SECTOR_SIZE;
+  return next < partition->size ? next : 0;
+}
+
+static uint32_t next_record(uint32_t offset, const record_header_t *header) {
+  const uint32_t next = offset + sizeof(*header) + ALIGN(header->size);
+  return sector_of(next) == sector_of(offset) && fits(next, 0)
+             ? next
+             : next_sector(offset);
+}
+
+static esp_err_t read_header(uint32_t offset, record_header_t *header) {
+  // the end of a sector reads as erased
+  if (!fits(offset, 0)) {
+    memset(header, 0xff, sizeof(*header));
+    return ESP_OK;
+  }
+  return esp_partition_read(partition, offset, header, sizeof(*header));
+}
+
+static bool is_record(uint32_t offset, const record_header_t *header) {
+  return header->magic == RECORD_MAGIC && fits(offset, header->size);
+}
+
+static bool is_erased(const record_header_t *header) {
+  const uint32_t *words = (const uint32_t *)header;
+  for (size_t i = 0; i < sizeof(*header) / sizeof(*words); ++i)
+    if (words[i] != 0xffffffff) return false;
+  return true;
+}
+
+static void skip_consumed() {
+  // move the tail to the next record that hasn't been popped
+  record_header_t header;
+  while (state.tail != state.head) {
+    if (read_header(state.tail, &header)) return;
+    if (!is_record(state.tail, &header)) {
+      // erased or torn space ends the sector, unless it is the head's
+      const bool head_sector = sector_of(state.tail) == sector_of(state.head) &&
+                               state.tail < state.head;
+      state.tail = head_sector ? state.head : next_sector(state.tail);
+    } else if (header.consumed != 0) {
+      return;
+    } else {
+      state.tail = next_record(state.tail, &header);
+    }
+  }
+}
+
+static esp_err_t start_sector(uint32_t sector) {
+  // the head wrapped around, so records that weren't popped are dropped
+  record_header_t header;
+  uint32_t dropped = 0;
+  for (uint32_t offset = sector; sector_of(offset) == sector;
+       offset = next_record(offset, &header)) {
+    if (read_header(offset, &header) || !is_record(offset, &header)) break;
+    if (header.consumed != 0) ++dropped;
+  }
+  if (dropped > 0) {
+    ESP_LOGW(TAG, "backlog full, dropping %u records", dropped);
+    state.dropped += dropped;
+    state.count = state.count > dropped ? state.count - dropped : 0;
+  }
+  return esp_partition_erase_range(partition, sector, SECTOR_SIZE);
+}
+
+static esp_err_t move_head(uint32_t sector) {
+  const bool empty = state.tail == state.head && state.count == 0;
+  esp_err_t err = start_sector(sector);
+  if (err) return err;
+  state.head = sector;
+
+  // the tail follows the head if there was nothing left, and moves past the
+  // sector if its records were dropped
+  if (empty) {
+    state.tail = sector;
+  } else if (sector_of(state.tail) == sector) {
+    state.tail = next_sector(sector);
+    skip_consumed();
+  }
+  return ESP_OK;
+}
+
+static esp_err_t scan() {
+  // the head follows the newest record and the tail is the oldest record that
+  // hasn't been popped
+  bool found = false, found_tail = false;
+  uint32_t newest = 0, oldest = 0;
+  state.head = 0;
+  state.count = 0;
+  state.dropped = 0;
+  for (uint32_t sector = 0; sector < partition->size; sector += SECTOR_SIZE) {
+    record_header_t header;
+    uint32_t offset = sector;
+    while (sector_of(offset) == sector) {
+      if (read_header(offset, &header) || !is_record(offset, &header)) break;
+      if (!found || header.seq > newest) {
+        newest = header.seq;
+        state.head = next_record(offset, &header);
+      }
+      if (header.consumed != 0) {
+        ++state.count;
+        if (!found_tail || header.seq < oldest) {
+          oldest = header.seq;
+          state.tail = offset;
+          found_tail = true;
+        }
+      }
+      found = true;
+      offset = next_record(offset, &header);
+    }
+  }
+  state.next_seq = found ? newest + 1 : 0;
+  if (!found_tail) state.tail = state.head;
+
+  // the head must be erased space, so a write torn by a reset means starting
+  // over in the next sector
+  if (state.head % SECTOR_SIZE == 0) return move_head(state.head);
+  record_header_t header;
+  esp_err_t err = read_header(state.head, &header);
+  if (err) return err;
+  if (!is_erased(&header)) return move_head(next_sector(state.head));
+  return ESP_OK;
+}
+
+esp_err_t backlog_init() {
+  partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                       PARTITION_SUBTYPE, NULL);
+  if (partition == NULL || partition->size < 2 * SECTOR_SIZE) {
+    ESP_LOGE(TAG, "no backlog partition");
+    partition = NULL;
+    return ESP_ERR_NOT_FOUND;
+  }
+
+  // the state is only trusted after deep sleep, any other reset may have
+  // interrupted a write
+  if (esp_reset_reason() == ESP_RST_DEEPSLEEP && state.magic == STATE_MAGIC)
+    return ESP_OK;
+  state.magic = 0;
+  esp_err_t err = scan();
+  if (err) {
+    ESP_LOGE(TAG, "unable to scan backlog %x", err);
+    partition = NULL;
+    return err;
+  }
+  state.magic = STATE_MAGIC;
+  ESP_LOGI(TAG, "%u records backlogged", state.count);
+  return ESP_OK;
+}
+
+esp_err_t backlog_push(const void *data, size_t size) {
+  if (partition == NULL) return ESP_ERR_INVALID_STATE;
+  if (size == 0 || size > BACKLOG_MAX_SIZE) return ESP_ERR_INVALID_SIZE;
+
+  // records never cross sectors, so move to the next one when this one is full
+  if (!fits(state.head, size)) {
+    esp_err_t err = move_head(next_sector(state.head));
+    if (err) return err;
+  }
+
+  // the magic goes last so a record torn by a reset never looks complete
+  record_header_t header = {.magic = 0xffff,
+                            .size = size,
+                            .seq = state.next_seq,
+                            .crc = crc32_le(0, data, size),
+                            .consumed = 0xffffffff};
+  esp_err_t err =
+      esp_partition_write(partition, state.head, &header, sizeof(header));
+  if (!err)
+    err = esp_partition_write(partition, state.head + sizeof(header), data,
+                              size);
+  if (!err) {
+    header.magic = RECORD_MAGIC;
+    err = esp_partition_write(partition, state.head, &header.magic,
+                              sizeof(header.magic));
+  }
+  if (err) {
+    // whatever was written can't be written over, so skip the rest of the
+    // sector
+    move_head(next_sector(state.head));
+    return err;
+  }
+
+  ++state.next_seq;
+  if (state.count++ == 0) state.tail = state.head;
+  state.head = next_record(state.head, &header);
+
+  // a head at the start of a sector is always erased, which keeps a full
+  // backlog from looking empty
+  if (state.head % SECTOR_SIZE == 0) return move_head(state.head);
+  return ESP_OK;
+}
+
+esp_err_t backlog_peek(void *data, size_t *size) {
+  if (partition == NULL) return ESP_ERR_INVALID_STATE;
+  while (state.tail != state.head) {
+    record_header_t header;
+    esp_err_t err = read_header(state.tail, &header);
+    if (err) return err;
+    if (header.size <= BACKLOG_MAX_SIZE) {
+      if (header.size > *size) return ESP_ERR_INVALID_SIZE;
+      err = esp_partition_read(partition, state.tail + sizeof(header), data,
+                               header.size);
+      if (err) return err;
+      if (crc32_le(0, data, header.size) == header.crc) {
+        *size = header.size;
+        return ESP_OK;
+      }
+    }
+
+    // drop records that were corrupted
+    ESP_LOGW(TAG, "dropping corrupt record %u", header.seq);
+    ++state.dropped;
+    err = backlog_pop();
+    if (err) return err;
+  }
+  return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t backlog_pop() {
+  if (partition == NULL) return ESP_ERR_INVALID_STATE;
+  if (state.tail == state.head) return ESP_ERR_NOT_FOUND;
+
+  // clearing bits doesn't need an erase
+  const uint32_t consumed = 0;
+  esp_err_t err = esp_partition_write(
+      partition, state.tail + offsetof(record_header_t, consumed), &consumed,
+      sizeof(consumed));
+  if (err) return err;
+  if (state.count > 0) --state.count;
+  skip_consumed();
+  return ESP_OK;
+}
+
+uint32_t backlog_count() { return state.count; }
+
+uint32_t backlog_dropped() { return state.dropped; }
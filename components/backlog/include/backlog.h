@@ -0,0 +1,17 @@
+#pragma once
+
+#include "esp_system.h"
+
+#define BACKLOG_MAX_SIZE 1024  // Largest record that can be pushed (bytes).
+
+esp_err_t backlog_init();
+
+esp_err_t backlog_push(const void *data, size_t size);
+
+esp_err_t backlog_peek(void *data, size_t *size);
+
+esp_err_t backlog_pop();
+
+uint32_t backlog_count();
+
+uint32_t backlog_dropped();
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "esp_system.h"
+
+#define JSON_WRITER_MAX_DEPTH 8  // Deepest nesting of objects and arrays.
+
+typedef void (*json_number_hook_t)(void *arg, const char *key, double value);
+
+typedef struct {
+  char *buf;
+  size_t size;
+  size_t len;
+  uint8_t depth;         // Number of open objects and arrays.
+  uint32_t arrays;       // Bit per depth, set if it is an array.
+  uint32_t has_members;  // Bit per depth, set once it has a member.
+  esp_err_t err;         // First error, e.g. running out of buffer.
+  json_number_hook_t number_hook;  // Called with every top level number.
+                                   // Optional.
+  void *hook_arg;
+} json_writer_t;
+
+void json_writer_init(json_writer_t *writer, char *buf, size_t size);
+
+esp_err_t json_writer_reopen(json_writer_t *writer, char *buf, size_t size);
+
+void json_writer_set_number_hook(json_writer_t *writer,
+                                 json_number_hook_t hook, void *arg);
+
+esp_err_t json_writer_finish(json_writer_t *writer);
+
+void json_begin_object(json_writer_t *writer, const char *key);
+
+void json_end_object(json_writer_t *writer);
+
+void json_begin_array(json_writer_t *writer, const char *key);
+
+void json_end_array(json_writer_t *writer);
+
+void json_add_string(json_writer_t *writer, const char *key,
+                     const char *value);
+
+void json_add_number(json_writer_t *writer, const char *key, double value,
+                     int decimals);
+
+void json_add_int(json_writer_t *writer, const char *key, int64_t value);
+
+void json_add_bool(json_writer_t *writer, const char *key, bool value);
@@ -0,0 +1,204 @@
+#include "json_writer.h"
+
+#include <math.h>
+#include <string.h>
+
+#define MAX_DECIMALS 6  // Most digits written after the decimal point.
+
+static void put(json_writer_t *writer, char c) {
+  // room is always kept for the null
+  if (writer->len + 1 < writer->size)
+    writer->buf[writer->len++] = c;
+  else if (!writer->err)
+    writer->err = ESP_ERR_NO_MEM;
+}
+
+static void put_str(json_writer_t *writer, const char *s) {
+  while (*s) put(writer, *s++);
+}
+
+static void put_escaped(json_writer_t *writer, const char *s) {
+  static const char hex[] = "0123456789abcdef";
+  put(writer, '"');
+  for (; *s; ++s) {
+    const unsigned char c = *s;
+    if (c == '"' || c == '\\') {
+      put(writer, '\\');
+      put(writer, c);
+    } else if (c < 0x20) {
+      // control characters are the only ones that need a code, utf-8 is
+      // passed through
+      put_str(writer, "\\u00");
+      put(writer, hex[c >> 4]);
+      put(writer, hex[c & 0xf]);
+    } else {
+      put(writer, c);
+    }
+  }
+  put(writer, '"');
+}
+
+static void put_uint(json_writer_t *writer, uint64_t value, int min_digits) {
+  char digits[20];
+  int n = 0;
+  do {
+    digits[n++] = '0' + value % 10;
+    value /= 10;
+  } while (value > 0 || n < min_digits);
+  while (n > 0) put(writer, digits[--n]);
+}
+
+static void begin_member(json_writer_t *writer, const char *key) {
+  if (writer->depth == 0) {
+    if (!writer->err) writer->err = ESP_ERR_INVALID_STATE;
+    return;
+  }
+
+  // separate from the previous member, and name it unless in an array
+  const uint32_t bit = BIT(writer->depth - 1);
+  if (writer->has_members & bit) put(writer, ',');
+  writer->has_members |= bit;
+  if (!(writer->arrays & bit)) {
+    put_escaped(writer, key != NULL ? key : "");
+    put(writer, ':');
+  }
+}
+
+static void open_container(json_writer_t *writer, const char *key,
+                           bool array) {
+  if (writer->depth == JSON_WRITER_MAX_DEPTH) {
+    if (!writer->err) writer->err = ESP_ERR_INVALID_STATE;
+    return;
+  }
+  begin_member(writer, key);
+  put(writer, array ? '[' : '{');
+  const uint32_t bit = BIT(writer->depth++);
+  writer->has_members &= ~bit;
+  if (array)
+    writer->arrays |= bit;
+  else
+    writer->arrays &= ~bit;
+}
+
+static void close_container(json_writer_t *writer, bool array) {
+  // the top level object is closed by finishing
+  const bool is_array =
+      writer->depth > 0 && (writer->arrays & BIT(writer->depth - 1));
+  if (writer->depth <= 1 || is_array != array) {
+    if (!writer->err) writer->err = ESP_ERR_INVALID_STATE;
+    return;
+  }
+  --writer->depth;
+  put(writer, array ? ']' : '}');
+}
+
+static void hook_number(json_writer_t *writer, const char *key,
+                        double value) {
+  if (writer->depth == 1 && writer->number_hook != NULL && key != NULL)
+    writer->number_hook(writer->hook_arg, key, value);
+}
+
+void json_writer_init(json_writer_t *writer, char *buf, size_t size) {
+  memset(writer, 0, sizeof(*writer));
+  writer->buf = buf;
+  writer->size = size;
+  put(writer, '{');
+  writer->depth = 1;
+}
+
+esp_err_t json_writer_reopen(json_writer_t *writer, char *buf, size_t size) {
+  // continue a finished object by writing over its closing brace
+  const size_t len = strnlen(buf, size);
+  if (len < 2 || len == size || buf[0] != '{' || buf[len - 1] != '}')
+    return ESP_ERR_INVALID_ARG;
+  memset(writer, 0, sizeof(*writer));
+  writer->buf = buf;
+  writer->size = size;
+  writer->len = len - 1;
+  writer->depth = 1;
+  if (len > 2) writer->has_members = BIT(0);
+  return ESP_OK;
+}
+
+void json_writer_set_number_hook(json_writer_t *writer,
+                                 json_number_hook_t hook, void *arg) {
+  writer->number_hook = hook;
+  writer->hook_arg = arg;
+}
+
+esp_err_t json_writer_finish(json_writer_t *writer) {
+  if (writer->depth != 1 && !writer->err) writer->err = ESP_ERR_INVALID_STATE;
+  put(writer, '}');
+  writer->depth = 0;
+  if (writer->size > 0) writer->buf[writer->len] = 0;
+  return writer->err;
+}
+
+void json_begin_object(json_writer_t *writer, const char *key) {
+  open_container(writer, key, false);
+}
+
+void json_end_object(json_writer_t *writer) {
+  close_container(writer, false);
+}
+
+void json_begin_array(json_writer_t *writer, const char *key) {
+  open_container(writer, key, true);
+}
+
+void json_end_array(json_writer_t *writer) {
+  close_container(writer, true);
+}
+
+void json_add_string(json_writer_t *writer, const char *key,
+                     const char *value) {
+  begin_member(writer, key);
+  if (value != NULL)
+    put_escaped(writer, value);
+  else
+    put_str(writer, "null");
+}
+
+void json_add_number(json_writer_t *writer, const char *key, double value,
+                     int decimals) {
+  hook_number(writer, key, value);
+  begin_member(writer, key);
+
+  if (decimals < 0) decimals = 0;
+  if (decimals > MAX_DECIMALS) decimals = MAX_DECIMALS;
+  uint64_t scale = 1;
+  for (int i = 0; i < decimals; ++i) scale *= 10;
+  const double scaled = round(fabs(value) * scale);
+
+  // json has no infinity or nan
+  if (!isfinite(scaled) || scaled >= 1e18) {
+    put_str(writer, "null");
+    return;
+  }
+
+  // formatted in fixed point, without going through printf
+  const uint64_t fixed = scaled;
+  if (value < 0 && fixed != 0) put(writer, '-');
+  put_uint(writer, fixed / scale, 1);
+  uint64_t fraction = fixed % scale;
+  if (fraction == 0) return;
+  int digits = decimals;
+  while (fraction % 10 == 0) {
+    fraction /= 10;
+    --digits;
+  }
+  put(writer, '.');
+  put_uint(writer, fraction, digits);
+}
+
+void json_add_int(json_writer_t *writer, const char *key, int64_t value) {
+  hook_number(writer, key, value);
+  begin_member(writer, key);
+  if (value < 0) put(writer, '-');
+  put_uint(writer, value < 0 ? -(uint64_t)value : (uint64_t)value, 1);
+}
+
+void json_add_bool(json_writer_t *writer, const char *key, bool value) {
+  begin_member(writer, key);
+  put_str(writer, value ? "true" : "false");
+}
@@ -1,7 +1,50 @@
 #pragma once
 
-#include "cJSON.h"
+#include <sys/time.h>
+
 #include "esp_system.h"
+#include "freertos/FreeRTOS.h"
+
+#define WIRELESS_CONNECT_BUCKETS 8  // Number of connect latency buckets.
+#define MQTT_DISCOVERY_CACHE_SIZE 24  // Discovery messages whose hashes are
+                                      // kept, more are published every time.
+#define DISCOVERY_PREFIX "homeassistant"
+#define DISCOVERY_STATUS_TOPIC \
+  (DISCOVERY_PREFIX "/status")  // Home Assistant announces itself here.
+
+typedef struct {
+  uint32_t buckets[WIRELESS_CONNECT_BUCKETS];  // Connections by latency. The
+                                               // first bucket is under 250ms
+                                               // and each bucket doubles.
+  uint32_t fast_connects;  // Connections made to the cached access point.
+  uint32_t fallbacks;      // Cached access points that had to be scanned for.
+  uint32_t last_latency;   // Latency of the last connection (ms).
+} wireless_connect_stats_t;
+
+typedef enum {
+  MQTT_TELEMETRY,  // Readings, superseded by the next report.
+  MQTT_BACKLOG,    // Readings kept while offline.
+  MQTT_STATE,      // Device state, merged within a short window.
+  MQTT_DISCOVERY,  // Home Assistant discovery, retained by the broker.
+  MQTT_EVENT,      // Recorded events, too large to be kept until replaced.
+  MQTT_CLASS_MAX
+} mqtt_class_t;
+
+typedef struct {
+  uint32_t published;   // Messages handed to the client.
+  uint32_t bytes;       // Payload bytes handed to the client.
+  uint32_t merged;      // State messages merged into an earlier one.
+  uint32_t acked;       // Timed messages acknowledged by the broker.
+  uint32_t rtt_last;    // Round trip of the last acknowledgement (ms).
+  uint32_t rtt_max;     // Longest round trip (ms).
+  uint32_t rtt_total;   // Sum of round trips, for the mean (ms).
+  uint32_t outbox;      // QoS 1 and 2 messages waiting to be acknowledged.
+  uint32_t outbox_max;  // Most messages waiting at once.
+} mqtt_stats_t;
+
+typedef void (*wireless_time_handler_t)(const struct timeval *tv);
+typedef void (*mqtt_connected_handler_t)(void);
+typedef void (*mqtt_message_handler_t)(const char *data, int data_len);
 
 typedef enum { MQTT_SENSOR, MQTT_BINARY_SENSOR, MQTT_MAX } discovery_type_t;
 
@@ -43,14 +86,43 @@ typedef struct {
 
 esp_err_t wireless_start(const char *mqtt_broker);
 
+esp_err_t wireless_stop();
+
+void wireless_set_time_handler(wireless_time_handler_t handler);
+
+esp_err_t wireless_wait_connected(TickType_t timeout);
+
+void mqtt_set_connected_handler(mqtt_connected_handler_t handler);
+
+esp_err_t mqtt_subscribe(const char *topic, int qos,
+                         mqtt_message_handler_t handler);
+
 esp_err_t mqtt_publish(const char *topic, const char *message, int qos,
                        bool retain);
 
-esp_err_t mqtt_publish_json(const char *topic, cJSON *json, int qos,
-                            bool retain);
+esp_err_t mqtt_publish_binary(const char *topic, const void *data, size_t size,
+                              int qos, bool retain);
+
+esp_err_t mqtt_publish_class(mqtt_class_t msg_class, const char *topic,
+                             const void *data, size_t size);
+
+esp_err_t mqtt_flush();
 
-double wireless_get_elevation();
+void mqtt_take_stats(mqtt_stats_t *stats);
+
+esp_err_t mqtt_wait_published(TickType_t timeout);
+
+esp_err_t mqtt_wait_in_flight(mqtt_class_t msg_class, size_t size,
+                              size_t limit, TickType_t timeout);
+
+esp_err_t wireless_get_location(float *latitude, float *longitude);
+
+esp_err_t wireless_get_elevation(float latitude, float longitude,
+                                 double *elevation);
 
 int8_t wireless_get_rssi();
 
-esp_err_t mqtt_publish_discovery(const mqtt_discovery_t *discovery);
\ No newline at end of file
+esp_err_t wireless_get_connect_stats(wireless_connect_stats_t *stats);
+
+esp_err_t mqtt_publish_discovery(const mqtt_discovery_t *discovery,
+                                 bool force);
\ No newline at end of file
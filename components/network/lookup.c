@@ -0,0 +1,50 @@
+#include "lookup.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MIN_ELEVATION -1000  // Lowest elevation that is a real one, the
+                             // elevation service answers -1000000 for points
+                             // it has no data for (m).
+
+static const char *skip_space(const char *p) {
+  while (isspace((unsigned char)*p)) ++p;
+  return p;
+}
+
+static const char *find_value(const char *json, const char *key) {
+  // the value is found after its quoted key at any depth. A key inside a
+  // string value has escaped quotes, so it never matches.
+  const size_t len = strlen(key);
+  for (const char *p = strchr(json, '"'); p != NULL; p = strchr(p + 1, '"')) {
+    if (strncmp(p + 1, key, len) != 0 || p[len + 1] != '"') continue;
+    const char *value = skip_space(p + len + 2);
+    if (*value++ != ':') continue;
+    value = skip_space(value);
+    if (*value == '"') ++value;
+    return value;
+  }
+  return NULL;
+}
+
+esp_err_t lookup_parse_location(const char *json, float *latitude,
+                                float *longitude) {
+  // ipinfo.io has the location as "latitude,longitude"
+  const char *loc = find_value(json, "loc");
+  if (loc == NULL || sscanf(loc, "%f,%f", latitude, longitude) != 2)
+    return ESP_ERR_INVALID_RESPONSE;
+  return ESP_OK;
+}
+
+esp_err_t lookup_parse_elevation(const char *json, double *elevation) {
+  // the elevation point query service nests it in two objects
+  const char *value = find_value(json, "Elevation");
+  if (value == NULL) return ESP_ERR_INVALID_RESPONSE;
+  char *end;
+  const double meters = strtod(value, &end);
+  if (end == value || meters < MIN_ELEVATION) return ESP_ERR_INVALID_RESPONSE;
+  *elevation = meters;
+  return ESP_OK;
+}
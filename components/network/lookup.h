@@ -0,0 +1,9 @@
+#pragma once
+// Reads the one value each lookup in wireless.c needs out of its json
+// response, without parsing the whole response.
+#include "esp_system.h"
+
+esp_err_t lookup_parse_location(const char *json, float *latitude,
+                                float *longitude);
+
+esp_err_t lookup_parse_elevation(const char *json, double *elevation);
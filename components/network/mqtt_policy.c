@@ -0,0 +1,283 @@
+#include "mqtt_policy.h"
+
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#define MAX_TIMED_PUBLISHES 16   // QoS 1 and 2 messages timed at once.
+#define PUBLISH_EXPIRY_MS 30000  // Time the client keeps resending a message
+                                 // before it gives up on it (ms).
+#define STATE_MESSAGE_SIZE 1024  // Space for state merged within a window.
+#define STATE_TOPIC_SIZE 64      // Space for the topic of merged state.
+
+static const char *TAG = "mqtt_policy";
+
+typedef struct {
+  int qos;
+  bool retain;
+} publish_policy_t;
+
+typedef struct {
+  int msg_id;    // Id of the message, or 0 if the slot is free.
+  int64_t sent;  // Time the message was handed to the client (us).
+  uint32_t size;           // Size of the message (bytes).
+  mqtt_class_t msg_class;  // Class of the message, or MQTT_CLASS_MAX.
+} timed_publish_t;
+
+// Readings are superseded by the next report, so they only need to reach the
+// broker once, while backlogged readings would be lost for good. State is
+// merged within a window and discovery is retained for Home Assistant.
+static const publish_policy_t policies[MQTT_CLASS_MAX] = {
+    [MQTT_TELEMETRY] = {.qos = CONFIG_MQTT_TELEMETRY_QOS, .retain = false},
+    [MQTT_BACKLOG] = {.qos = 1, .retain = false},
+    [MQTT_STATE] = {.qos = 0, .retain = false},
+    [MQTT_DISCOVERY] = {.qos = 1, .retain = true},
+    [MQTT_EVENT] = {.qos = 1, .retain = false}};
+
+static timed_publish_t timed_publishes[MAX_TIMED_PUBLISHES];  // The outbox.
+static mqtt_stats_t mqtt_stats;
+static portMUX_TYPE stats_mux = portMUX_INITIALIZER_UNLOCKED;
+static SemaphoreHandle_t state_mutex = NULL;  // Held while merging state.
+static esp_timer_handle_t state_timer = NULL;  // Ends the merge window.
+static char state_topic[STATE_TOPIC_SIZE];
+static char state_message[STATE_MESSAGE_SIZE];  // State waiting to be
+                                                // published, not terminated.
+static size_t state_len = 0;
+
+void mqtt_policy_record_ack(int msg_id) {
+  // the outbox is the timed messages, so an acknowledgement frees a slot
+  const int64_t now = esp_timer_get_time();
+  portENTER_CRITICAL(&stats_mux);
+  for (size_t i = 0; i < MAX_TIMED_PUBLISHES; ++i) {
+    if (timed_publishes[i].msg_id != msg_id) continue;
+    const uint32_t rtt = (now - timed_publishes[i].sent) / 1000;
+    timed_publishes[i].msg_id = 0;
+    ++mqtt_stats.acked;
+    mqtt_stats.rtt_last = rtt;
+    mqtt_stats.rtt_total += rtt;
+    if (rtt > mqtt_stats.rtt_max) mqtt_stats.rtt_max = rtt;
+    break;
+  }
+  portEXIT_CRITICAL(&stats_mux);
+}
+
+static uint32_t count_outbox(int64_t now) {
+  // the caller holds the stats mux. Messages the client has been resending
+  // for too long were dropped from its outbox and will never be acknowledged,
+  // so they age out here too. The broker acknowledges in order, so once the
+  // newest messages are acknowledged any that lost their slot have been too.
+  uint32_t count = 0;
+  for (size_t i = 0; i < MAX_TIMED_PUBLISHES; ++i) {
+    if (timed_publishes[i].msg_id == 0) continue;
+    if (now - timed_publishes[i].sent >= PUBLISH_EXPIRY_MS * 1000LL)
+      timed_publishes[i].msg_id = 0;
+    else
+      ++count;
+  }
+  return count;
+}
+
+static void record_publish(int msg_id, size_t size, int qos,
+                           mqtt_class_t msg_class) {
+  const int64_t now = esp_timer_get_time();
+  portENTER_CRITICAL(&stats_mux);
+  ++mqtt_stats.published;
+  mqtt_stats.bytes += size;
+  if (qos > 0) {
+    // messages the client gave up on are never acknowledged, so the oldest
+    // slot is taken when none are free
+    size_t slot = 0;
+    for (size_t i = 0; i < MAX_TIMED_PUBLISHES; ++i) {
+      if (timed_publishes[i].msg_id == 0) {
+        slot = i;
+        break;
+      }
+      if (timed_publishes[i].sent < timed_publishes[slot].sent) slot = i;
+    }
+    timed_publishes[slot] = (timed_publish_t){
+        .msg_id = msg_id, .sent = now, .size = size, .msg_class = msg_class};
+    const uint32_t outbox = count_outbox(now);
+    if (outbox > mqtt_stats.outbox_max) mqtt_stats.outbox_max = outbox;
+  }
+  portEXIT_CRITICAL(&stats_mux);
+}
+
+static esp_err_t publish(const char *topic, const void *data, size_t size,
+                         int qos, bool retain, mqtt_class_t msg_class,
+                         int *msg_id) {
+  esp_err_t err =
+      wireless_mqtt_publish(topic, data, size, qos, retain, msg_id);
+  if (err) return err;
+  record_publish(*msg_id, size, qos, msg_class);
+  return ESP_OK;
+}
+
+static esp_err_t flush_state() {
+  // the caller holds the state mutex
+  if (state_len == 0) return ESP_OK;
+  const publish_policy_t *policy = &policies[MQTT_STATE];
+  int msg_id;
+  esp_err_t err = publish(state_topic, state_message, state_len, policy->qos,
+                          policy->retain, MQTT_STATE, &msg_id);
+  state_len = 0;
+  return err;
+}
+
+static void state_timer_callback(void *arg) {
+  xSemaphoreTake(state_mutex, portMAX_DELAY);
+  if (flush_state()) ESP_LOGW(TAG, "unable to publish merged state");
+  xSemaphoreGive(state_mutex);
+}
+
+static esp_err_t merge_state(const char *topic, const char *data,
+                             size_t size) {
+  // only json objects can be merged
+  const publish_policy_t *policy = &policies[MQTT_STATE];
+  const bool object = size >= 2 && data[0] == '{' && data[size - 1] == '}';
+  if (!object || state_mutex == NULL || CONFIG_MQTT_STATE_WINDOW_MS == 0 ||
+      strlen(topic) >= sizeof(state_topic) || size > sizeof(state_message)) {
+    int msg_id;
+    return publish(topic, data, size, policy->qos, policy->retain, MQTT_STATE,
+                   &msg_id);
+  }
+
+  xSemaphoreTake(state_mutex, portMAX_DELAY);
+  esp_err_t err = ESP_OK;
+  if (state_len > 0 && (strcmp(topic, state_topic) != 0 ||
+                        state_len + size - 1 > sizeof(state_message)))
+    err = flush_state();
+
+  if (state_len == 0) {
+    // the first state of a window starts it
+    strcpy(state_topic, topic);
+    memcpy(state_message, data, size);
+    state_len = size;
+    esp_timer_stop(state_timer);
+    esp_timer_start_once(state_timer, CONFIG_MQTT_STATE_WINDOW_MS * 1000);
+  } else if (size > 2) {
+    // members of later state follow those already there, and a key that is
+    // written twice keeps its last value for json parsers
+    size_t len = state_len - 1;
+    if (state_len > 2) state_message[len++] = ',';
+    memcpy(state_message + len, data + 1, size - 1);
+    state_len = len + size - 1;
+    portENTER_CRITICAL(&stats_mux);
+    ++mqtt_stats.merged;
+    portEXIT_CRITICAL(&stats_mux);
+  }
+  xSemaphoreGive(state_mutex);
+  return err;
+}
+
+esp_err_t mqtt_policy_init() {
+  state_mutex = xSemaphoreCreateMutex();
+  const esp_timer_create_args_t state_timer_args = {
+      .callback = state_timer_callback, .name = "mqtt_state"};
+  return esp_timer_create(&state_timer_args, &state_timer);
+}
+
+void mqtt_policy_reset() {
+  // nothing sent before a disconnect is waited for, the client may resend it
+  // but the broker's acknowledgement is never counted on
+  portENTER_CRITICAL(&stats_mux);
+  for (size_t i = 0; i < MAX_TIMED_PUBLISHES; ++i)
+    timed_publishes[i].msg_id = 0;
+  portEXIT_CRITICAL(&stats_mux);
+}
+
+esp_err_t mqtt_policy_publish(mqtt_class_t msg_class, const char *topic,
+                              const void *data, size_t size, int *msg_id) {
+  // a single message of a class, never merged
+  if (msg_class < 0 || msg_class >= MQTT_CLASS_MAX || topic == NULL)
+    return ESP_ERR_INVALID_ARG;
+  return publish(topic, data, size, policies[msg_class].qos,
+                 policies[msg_class].retain, msg_class, msg_id);
+}
+
+esp_err_t mqtt_publish(const char *topic, const char *message, int qos,
+                       bool retain) {
+  return mqtt_publish_binary(topic, message,
+                             message != NULL ? strlen(message) : 0, qos,
+                             retain);
+}
+
+esp_err_t mqtt_publish_binary(const char *topic, const void *data, size_t size,
+                              int qos, bool retain) {
+  int msg_id;
+  return publish(topic, data, size, qos, retain, MQTT_CLASS_MAX, &msg_id);
+}
+
+esp_err_t mqtt_publish_class(mqtt_class_t msg_class, const char *topic,
+                             const void *data, size_t size) {
+  if (msg_class < 0 || msg_class >= MQTT_CLASS_MAX || topic == NULL)
+    return ESP_ERR_INVALID_ARG;
+  if (!wireless_mqtt_connected()) return ESP_ERR_INVALID_STATE;
+  if (msg_class == MQTT_STATE) return merge_state(topic, data, size);
+  int msg_id;
+  return mqtt_policy_publish(msg_class, topic, data, size, &msg_id);
+}
+
+esp_err_t mqtt_flush() {
+  if (state_mutex == NULL) return ESP_OK;
+  xSemaphoreTake(state_mutex, portMAX_DELAY);
+  esp_timer_stop(state_timer);
+  esp_err_t err = flush_state();
+  xSemaphoreGive(state_mutex);
+  return err;
+}
+
+void mqtt_take_stats(mqtt_stats_t *stats) {
+  // the outbox is a level, everything else counts from the last take
+  const int64_t now = esp_timer_get_time();
+  portENTER_CRITICAL(&stats_mux);
+  mqtt_stats.outbox = count_outbox(now);
+  *stats = mqtt_stats;
+  mqtt_stats = (mqtt_stats_t){.outbox_max = stats->outbox};
+  portEXIT_CRITICAL(&stats_mux);
+}
+
+esp_err_t mqtt_wait_published(TickType_t timeout) {
+  // merged state would otherwise be left behind
+  mqtt_flush();
+  const TickType_t start = xTaskGetTickCount();
+  while (true) {
+    portENTER_CRITICAL(&stats_mux);
+    const uint32_t outbox = count_outbox(esp_timer_get_time());
+    portEXIT_CRITICAL(&stats_mux);
+    if (outbox == 0) return ESP_OK;
+    if (xTaskGetTickCount() - start >= timeout) return ESP_ERR_TIMEOUT;
+    vTaskDelay(1);
+  }
+}
+
+static size_t get_in_flight(mqtt_class_t msg_class) {
+  const int64_t now = esp_timer_get_time();
+  size_t bytes = 0;
+  portENTER_CRITICAL(&stats_mux);
+  count_outbox(now);
+  for (size_t i = 0; i < MAX_TIMED_PUBLISHES; ++i)
+    if (timed_publishes[i].msg_id != 0 &&
+        timed_publishes[i].msg_class == msg_class)
+      bytes += timed_publishes[i].size;
+  portEXIT_CRITICAL(&stats_mux);
+  return bytes;
+}
+
+esp_err_t mqtt_wait_in_flight(mqtt_class_t msg_class, size_t size,
+                              size_t limit, TickType_t timeout) {
+  // wait until a message of size bytes fits in the limit of the class that
+  // the broker hasn't acknowledged yet, which it always does once everything
+  // before it has been
+  if (msg_class < 0 || msg_class >= MQTT_CLASS_MAX)
+    return ESP_ERR_INVALID_ARG;
+  const TickType_t start = xTaskGetTickCount();
+  while (true) {
+    const size_t in_flight = get_in_flight(msg_class);
+    if (in_flight == 0 || in_flight + size <= limit) return ESP_OK;
+    if (xTaskGetTickCount() - start >= timeout) return ESP_ERR_TIMEOUT;
+    vTaskDelay(1);
+  }
+}
@@ -0,0 +1,21 @@
+#pragma once
+// Between the firmware's publishes and the mqtt client in wireless.c: the QoS
+// and retain flag of each class of message, merged state, and what the broker
+// has yet to acknowledge.
+#include "wireless.h"
+
+esp_err_t mqtt_policy_init();
+
+esp_err_t mqtt_policy_publish(mqtt_class_t msg_class, const char *topic,
+                              const void *data, size_t size, int *msg_id);
+
+void mqtt_policy_record_ack(int msg_id);
+
+void mqtt_policy_reset();
+
+// Implemented by wireless.c.
+bool wireless_mqtt_connected();
+
+esp_err_t wireless_mqtt_publish(const char *topic, const void *data,
+                                size_t size, int qos, bool retain,
+                                int *msg_id);
@@ -19,6 +19,7 @@ static void wifi_handler(void *handler_args, esp_event_base_t base,
     memcpy(wifi_config.sta.ssid, event->ssid, sizeof(wifi_config.sta.ssid));
     memcpy(wifi_config.sta.password, event->password,
            sizeof(wifi_config.sta.password));
+    wifi_config.sta.channel = 0;  // don't keep a cached channel
     wifi_config.sta.bssid_set = event->bssid_set;
     if (wifi_config.sta.bssid_set == true)
       memcpy(wifi_config.sta.bssid, event->bssid,
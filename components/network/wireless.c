@@ -1,42 +1,363 @@
 #include "wireless.h"
 
+#include <stdlib.h>
 #include <string.h>
+#include <sys/time.h>
 
-#include "cJSON.h"
+#include "esp32/rom/crc.h"
+#include "esp_attr.h"
 #include "esp_http_client.h"
 #include "esp_log.h"
+#include "esp_netif_net_stack.h"
 #include "esp_sntp.h"
+#include "esp_timer.h"
 #include "esp_wifi.h"
+#include "freertos/event_groups.h"
+#include "json_writer.h"
+#include "lookup.h"
+#include "lwip/dhcp.h"
 #include "mqtt_client.h"
+#include "mqtt_policy.h"
+#include "nvs.h"
+#include "power.h"
 #include "smartconfig.h"
 
-#define DISCOVERY_PREFIX "homeassistant"
+#define DISCOVERY_MESSAGE_SIZE 768  // Space for a discovery message.
+#define NVS_NAMESPACE "wireless"
+#define NVS_AP_CACHE_KEY "ap_cache"
+#define NVS_DISCOVERY_KEY "discovery"
+#define AP_CACHE_MAGIC 0x57494649  // Marks the access point cache as valid.
+#define DISCOVERY_CACHE_MAGIC 0x44495343  // Marks the discovery cache as
+                                          // loaded.
+#define CONNECT_BUCKET_MS 250  // Upper bound of the first latency bucket (ms).
+#define CONNECTED_BIT BIT(0)     // Set while the station has an address.
+#define MAX_SUBSCRIPTIONS 4      // Number of topics that can be subscribed to.
+#define RESPONSE_SIZE 512        // Space for the response to a lookup.
+#define BROKER_SIZE 128          // Space for the uri of the mqtt broker.
+#define DEFAULT_LEASE_S 3600  // Lease assumed when the server's isn't known,
+                              // shorter than most hand out (s).
+#define MAX_FAST_CONNECT_FAILURES 3  // Failed fast connects in a row after
+                                     // which the access point is forgotten.
 
 static const char *TAG = "wireless";
 
 typedef struct {
-  char *mqtt_broker;
+  char mqtt_broker[BROKER_SIZE];
 } connect_args_t;
 
+typedef struct {
+  const char *topic;
+  int qos;
+  mqtt_message_handler_t handler;
+} subscription_t;
+
+typedef struct {
+  uint32_t magic;
+  uint8_t ssid[32];  // Network the access point was found on.
+  uint8_t bssid[6];
+  uint8_t channel;
+  uint8_t failures;  // Fast connects in a row that failed since the access
+                     // point last answered one.
+  bool lease_valid;  // Whether the lease can be reused. The lease is only
+                     // kept through deep sleep, never in nvs.
+  esp_netif_ip_info_t lease;  // Address from the last dhcp lease.
+  esp_netif_dns_info_t dns;   // Dns server from the last dhcp lease.
+  int64_t lease_obtained;     // System time the lease was obtained (s).
+  uint32_t lease_time;        // Length of the lease (s).
+  uint32_t lease_renew;       // Time after which the server expects the
+                              // lease to be renewed, T1 (s).
+} ap_cache_t;
+
+typedef struct {
+  uint32_t topic;    // Hash of the discovery topic.
+  uint32_t message;  // Hash of the message last published to the topic.
+} discovery_hash_t;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t count;  // Number of hashes in use.
+  discovery_hash_t hashes[MQTT_DISCOVERY_CACHE_SIZE];
+} discovery_cache_t;
+
+typedef struct {
+  int msg_id;        // Id of the message, or 0 if none is waiting.
+  uint32_t message;  // Hash of the message waiting to be acknowledged.
+} pending_discovery_t;
+
 static esp_mqtt_client_handle_t mqtt_client = NULL;
-static TaskHandle_t calling_task = NULL;
+static EventGroupHandle_t wireless_events = NULL;
+static wireless_time_handler_t time_handler = NULL;
+static mqtt_connected_handler_t connected_handler = NULL;
+static subscription_t subscriptions[MAX_SUBSCRIPTIONS];
+static size_t num_subscriptions = 0;
 static bool mqtt_is_connected = false;
+static power_lock_handle_t pm_lock = NULL;  // Held while publishing.
+static esp_netif_t *sta_netif = NULL;
+static bool fast_connecting = false;  // Whether the cached access point is
+                                      // being used instead of a scan.
+static bool lease_in_use = false;     // Whether dhcp was skipped for the
+                                      // cached lease.
+static bool mqtt_was_connected = false;
+static int64_t connect_start = -1;  // Time the connection attempt began (us).
+static connect_args_t connect_args;
+static char response[RESPONSE_SIZE];  // Holds the response to a lookup. Only
+                                      // one lookup runs at a time.
+static pending_discovery_t pending_discovery
+    [MQTT_DISCOVERY_CACHE_SIZE];  // Waiting for the broker, by cache slot.
+static bool discovery_dirty = false;  // Whether hashes changed since the
+                                      // cache was saved.
+static bool discovery_full = false;   // Whether a topic didn't fit the cache.
+
+// The cache and connection statistics survive deep sleep.
+static RTC_DATA_ATTR ap_cache_t ap_cache;
+static RTC_DATA_ATTR discovery_cache_t discovery_cache;
+static RTC_DATA_ATTR wireless_connect_stats_t connect_stats;
+
+static void load_ap_cache() {
+  if (ap_cache.magic == AP_CACHE_MAGIC) return;
+
+  // the lease isn't kept across power cycles, only the access point
+  nvs_handle_t nvs;
+  if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) return;
+  size_t size = sizeof(ap_cache);
+  if (nvs_get_blob(nvs, NVS_AP_CACHE_KEY, &ap_cache, &size) != ESP_OK ||
+      size != sizeof(ap_cache))
+    ap_cache.magic = 0;
+  ap_cache.failures = 0;
+  ap_cache.lease_valid = false;
+  nvs_close(nvs);
+}
+
+static void save_ap_cache(const wifi_ap_record_t *ap_info) {
+  // only write to flash when the access point changes
+  const bool changed = ap_cache.magic != AP_CACHE_MAGIC ||
+                       ap_cache.channel != ap_info->primary ||
+                       memcmp(ap_cache.bssid, ap_info->bssid, 6) != 0 ||
+                       memcmp(ap_cache.ssid, ap_info->ssid, 32) != 0;
+  ap_cache.magic = AP_CACHE_MAGIC;
+  memcpy(ap_cache.ssid, ap_info->ssid, sizeof(ap_cache.ssid));
+  memcpy(ap_cache.bssid, ap_info->bssid, sizeof(ap_cache.bssid));
+  ap_cache.channel = ap_info->primary;
+  if (!changed) return;
+  ap_cache.failures = 0;
+
+  nvs_handle_t nvs;
+  if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) return;
+  ap_cache_t saved = ap_cache;
+  saved.failures = 0;
+  saved.lease_valid = false;
+  if (nvs_set_blob(nvs, NVS_AP_CACHE_KEY, &saved, sizeof(saved)) == ESP_OK)
+    nvs_commit(nvs);
+  nvs_close(nvs);
+}
+
+static void erase_ap_cache() {
+  // a cached access point that can't be reached is forgotten in flash too, or
+  // the next power cycle would try it again
+  ap_cache.magic = 0;
+  nvs_handle_t nvs;
+  if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) return;
+  if (nvs_erase_key(nvs, NVS_AP_CACHE_KEY) == ESP_OK) nvs_commit(nvs);
+  nvs_close(nvs);
+}
+
+static void load_discovery_cache() {
+  if (discovery_cache.magic == DISCOVERY_CACHE_MAGIC) return;
+
+  // a missing or mismatched cache publishes everything
+  bool loaded = false;
+  nvs_handle_t nvs;
+  if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK) {
+    size_t size = sizeof(discovery_cache);
+    loaded = nvs_get_blob(nvs, NVS_DISCOVERY_KEY, &discovery_cache, &size) ==
+                 ESP_OK &&
+             size == sizeof(discovery_cache) &&
+             discovery_cache.count <= MQTT_DISCOVERY_CACHE_SIZE;
+    nvs_close(nvs);
+  }
+  if (!loaded) memset(&discovery_cache, 0, sizeof(discovery_cache));
+  discovery_cache.magic = DISCOVERY_CACHE_MAGIC;
+}
+
+static int find_discovery_hash(uint32_t topic) {
+  for (size_t i = 0; i < discovery_cache.count; ++i)
+    if (discovery_cache.hashes[i].topic == topic) return i;
+  if (discovery_cache.count == MQTT_DISCOVERY_CACHE_SIZE) return -1;
+  const int index = discovery_cache.count++;
+  discovery_cache.hashes[index] = (discovery_hash_t){.topic = topic};
+  pending_discovery[index].msg_id = 0;
+  return index;
+}
+
+static void save_discovery_cache() {
+  nvs_handle_t nvs;
+  if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) return;
+  if (nvs_set_blob(nvs, NVS_DISCOVERY_KEY, &discovery_cache,
+                   sizeof(discovery_cache)) == ESP_OK)
+    nvs_commit(nvs);
+  nvs_close(nvs);
+}
+
+static void commit_discovery(int msg_id) {
+  // a hash is only kept once the broker has the message, and the cache is
+  // saved once no message of the pass is left waiting
+  bool waiting = false;
+  for (size_t i = 0; i < discovery_cache.count; ++i) {
+    pending_discovery_t *pending = &pending_discovery[i];
+    if (pending->msg_id != 0 && pending->msg_id == msg_id) {
+      discovery_cache.hashes[i].message = pending->message;
+      pending->msg_id = 0;
+      discovery_dirty = true;
+    }
+    if (pending->msg_id != 0) waiting = true;
+  }
+  if (!discovery_dirty || waiting) return;
+  discovery_dirty = false;
+  save_discovery_cache();
+}
+
+static bool get_static_ip(esp_netif_ip_info_t *ip_info,
+                          esp_netif_dns_info_t *dns) {
+#ifdef CONFIG_WIFI_STATIC_IP
+  ip_info->ip.addr = esp_ip4addr_aton(CONFIG_WIFI_STATIC_IP_ADDRESS);
+  ip_info->netmask.addr = esp_ip4addr_aton(CONFIG_WIFI_STATIC_IP_NETMASK);
+  ip_info->gw.addr = esp_ip4addr_aton(CONFIG_WIFI_STATIC_IP_GATEWAY);
+  dns->ip.u_addr.ip4.addr = esp_ip4addr_aton(CONFIG_WIFI_STATIC_IP_DNS);
+  return true;
+#else
+  if (!fast_connecting || !ap_cache.lease_valid) return false;
+
+  // past T1 the server expects the lease to be renewed, which only dhcp does.
+  // The system time steps when it is synchronized, which at worst makes the
+  // lease look older than it is.
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  const int64_t age = tv.tv_sec - ap_cache.lease_obtained;
+  if (age < 0 || age >= ap_cache.lease_renew) {
+    ESP_LOGI(TAG, "cached lease is due for renewal, starting dhcp");
+    ap_cache.lease_valid = false;
+    return false;
+  }
+  *ip_info = ap_cache.lease;
+  *dns = ap_cache.dns;
+  lease_in_use = true;
+  return true;
+#endif  // CONFIG_WIFI_STATIC_IP
+}
+
+#ifndef CONFIG_WIFI_STATIC_IP
+static void save_lease(const esp_netif_ip_info_t *ip_info) {
+  // the times of the lease are only kept by lwip. A server that doesn't give
+  // T1 expects renewal at half the lease.
+  const struct netif *netif = esp_netif_get_netif_impl(sta_netif);
+  const struct dhcp *dhcp = netif != NULL ? netif_dhcp_data(netif) : NULL;
+  uint32_t lease_time = DEFAULT_LEASE_S, lease_renew = 0;
+  if (dhcp != NULL && dhcp->offered_t0_lease > 0) {
+    lease_time = dhcp->offered_t0_lease;
+    lease_renew = dhcp->offered_t1_renew;
+  }
+  if (lease_renew == 0 || lease_renew > lease_time)
+    lease_renew = lease_time / 2;
+
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  ap_cache.lease = *ip_info;
+  ap_cache.lease_obtained = tv.tv_sec;
+  ap_cache.lease_time = lease_time;
+  ap_cache.lease_renew = lease_renew;
+  ap_cache.lease_valid = esp_netif_get_dns_info(sta_netif, ESP_NETIF_DNS_MAIN,
+                                                &ap_cache.dns) == ESP_OK;
+}
+#endif  // CONFIG_WIFI_STATIC_IP
+
+static bool is_ap_gone(uint8_t reason) {
+  // the access point isn't there or won't have us, rather than a connection
+  // that failed once
+  return reason == WIFI_REASON_NO_AP_FOUND ||
+         reason == WIFI_REASON_AUTH_FAIL ||
+         reason == WIFI_REASON_AUTH_EXPIRE ||
+         reason == WIFI_REASON_4WAY_HANDSHAKE_TIMEOUT ||
+         reason == WIFI_REASON_HANDSHAKE_TIMEOUT;
+}
+
+static void record_connect_latency() {
+  if (connect_start < 0) return;
+  const uint32_t latency = (esp_timer_get_time() - connect_start) / 1000;
+  connect_start = -1;
+
+  // buckets double in width, the last one holds everything slower
+  int bucket = 0;
+  while (bucket < WIRELESS_CONNECT_BUCKETS - 1 &&
+         latency >= CONNECT_BUCKET_MS << bucket)
+    ++bucket;
+  ++connect_stats.buckets[bucket];
+  connect_stats.last_latency = latency;
+  if (fast_connecting) ++connect_stats.fast_connects;
+  ESP_LOGI(TAG, "connected in %ums", latency);
+}
+
+static void forget_ap() {
+  fast_connecting = false;
+  ap_cache.lease_valid = false;
+
+  // forget the access point without overwriting the credentials in flash
+  wifi_config_t wifi_config = {};
+  esp_wifi_get_config(ESP_IF_WIFI_STA, &wifi_config);
+  wifi_config.sta.bssid_set = false;
+  wifi_config.sta.channel = 0;
+  esp_wifi_set_storage(WIFI_STORAGE_RAM);
+  esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config);
+  esp_wifi_set_storage(WIFI_STORAGE_FLASH);
+
+#ifndef CONFIG_WIFI_STATIC_IP
+  if (lease_in_use) {
+    lease_in_use = false;
+    esp_netif_dhcpc_start(sta_netif);
+  }
+#endif  // CONFIG_WIFI_STATIC_IP
+}
 
 static void sntp_callback(struct timeval *tv) {
   ESP_LOGI(TAG, "sync'd time with ntp server");
-  xTaskNotify(calling_task, 0, eNoAction);
+  if (time_handler != NULL) time_handler(tv);
 }
 
 static esp_err_t mqtt_handler(esp_mqtt_event_handle_t event) {
   if (event->event_id == MQTT_EVENT_CONNECTED) {
     ESP_LOGI(TAG, "mqtt connected");
     mqtt_is_connected = true;
-    // mqtt_publish("online", "Hello world!", 2, false);
+    mqtt_was_connected = true;
+
+    // the broker may have forgotten our subscriptions
+    for (size_t i = 0; i < num_subscriptions; ++i)
+      esp_mqtt_client_subscribe(mqtt_client, subscriptions[i].topic,
+                                subscriptions[i].qos);
+    if (connected_handler != NULL) connected_handler();
   } else if (event->event_id == MQTT_EVENT_DISCONNECTED) {
     ESP_LOGI(TAG, "mqtt disconnected");
     mqtt_is_connected = false;
+    mqtt_policy_reset();
+
+    // the cached lease may have been handed to someone else, so get a new one
+    if (lease_in_use && !mqtt_was_connected) {
+      ESP_LOGW(TAG, "cached lease unusable, starting dhcp");
+      lease_in_use = false;
+      ap_cache.lease_valid = false;
+      esp_netif_dhcpc_start(sta_netif);
+    }
   } else if (event->event_id == MQTT_EVENT_PUBLISHED) {
     ESP_LOGI(TAG, "mqtt published");
+    mqtt_policy_record_ack(event->msg_id);
+    commit_discovery(event->msg_id);
+  } else if (event->event_id == MQTT_EVENT_DATA) {
+    // messages that don't fit in one event aren't expected on our topics
+    if (event->data_len != event->total_data_len) return ESP_OK;
+    for (size_t i = 0; i < num_subscriptions; ++i) {
+      const subscription_t *subscription = &subscriptions[i];
+      if (strlen(subscription->topic) == event->topic_len &&
+          strncmp(subscription->topic, event->topic, event->topic_len) == 0)
+        subscription->handler(event->data, event->data_len);
+    }
   }
   return ESP_OK;
 }
@@ -45,9 +366,38 @@ static void wifi_handler(void *handler_args, esp_event_base_t base,
                          int event_id, void *event_data) {
   if (base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
     esp_wifi_connect();
+  } else if (base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED) {
+    // skip dhcp with a static address or a lease kept through deep sleep
+    esp_netif_ip_info_t ip_info;
+    esp_netif_dns_info_t dns;
+    if (get_static_ip(&ip_info, &dns)) {
+      esp_netif_dhcpc_stop(sta_netif);
+      esp_netif_set_ip_info(sta_netif, &ip_info);
+      esp_netif_set_dns_info(sta_netif, ESP_NETIF_DNS_MAIN, &dns);
+    }
   } else if (base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
     ESP_LOGI(TAG, "wifi disconnected");
     const wifi_event_sta_disconnected_t *wifi_data = event_data;
+    xEventGroupClearBits(wireless_events, CONNECTED_BIT);
+
+    // scan on the next attempt, counting it if the cached access point was
+    // never reached. It is only forgotten for good once it is gone or has
+    // failed a few times in a row, since a single failure is often a busy
+    // channel.
+    if (fast_connecting) {
+      if (connect_start >= 0) {
+        ESP_LOGW(TAG, "cached access point not reached (%d), scanning",
+                 wifi_data->reason);
+        if (is_ap_gone(wifi_data->reason) ||
+            ++ap_cache.failures >= MAX_FAST_CONNECT_FAILURES)
+          erase_ap_cache();
+        ++connect_stats.fallbacks;
+      }
+      forget_ap();
+    }
+
+    // time the reconnect, or keep timing if we never connected
+    if (connect_start < 0) connect_start = esp_timer_get_time();
 
     // if bad password start smart config
     if (wifi_data->reason == WIFI_REASON_AUTH_FAIL)
@@ -59,6 +409,18 @@ static void wifi_handler(void *handler_args, esp_event_base_t base,
     if (mqtt_client != NULL) esp_mqtt_client_stop(mqtt_client);
   } else if (base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
     ESP_LOGI(TAG, "wifi connected");
+    record_connect_latency();
+    xEventGroupSetBits(wireless_events, CONNECTED_BIT);
+
+    // remember the access point and a new lease for the next connection, a
+    // reused lease keeps the time it was obtained
+    if (fast_connecting) ap_cache.failures = 0;
+    wifi_ap_record_t ap_info;
+    if (esp_wifi_sta_get_ap_info(&ap_info) == ESP_OK) save_ap_cache(&ap_info);
+#ifndef CONFIG_WIFI_STATIC_IP
+    const ip_event_got_ip_t *ip_data = event_data;
+    if (!lease_in_use) save_lease(&ip_data->ip_info);
+#endif  // CONFIG_WIFI_STATIC_IP
     if (mqtt_client == NULL) {
       // this is the first time we're connecting
       // get the connect args
@@ -81,22 +443,27 @@ static void wifi_handler(void *handler_args, esp_event_base_t base,
 }
 
 esp_err_t wireless_start(const char *mqtt_broker) {
+  power_lock_create(POWER_LOCK_CPU, "mqtt", &pm_lock);
+  wireless_events = xEventGroupCreate();
+  mqtt_policy_init();
+
   // init network interface and wifi sta
   esp_netif_init();
-  esp_netif_create_default_wifi_sta();
+  sta_netif = esp_netif_create_default_wifi_sta();
 
   // init wifi driver
   wifi_init_config_t wifi_init_config = WIFI_INIT_CONFIG_DEFAULT();
   esp_wifi_init(&wifi_init_config);
 
-  // allocate connect args
-  connect_args_t *connect_args = malloc(sizeof(connect_args_t));
-  connect_args->mqtt_broker = strdup(mqtt_broker);
+  // keep a copy of the connect args
+  if (strlen(mqtt_broker) >= sizeof(connect_args.mqtt_broker))
+    return ESP_ERR_INVALID_ARG;
+  strcpy(connect_args.mqtt_broker, mqtt_broker);
 
   // register wifi event handlers
   esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID, wifi_handler, NULL);
   esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, wifi_handler,
-                             (void *)connect_args);
+                             &connect_args);
 
   // get wifi credentials from nvs
   wifi_config_t wifi_config = {};
@@ -105,35 +472,84 @@ esp_err_t wireless_start(const char *mqtt_broker) {
 
   // check that an ssid was found
   if (strlen((const char *)(wifi_config.sta.ssid)) > 0) {
-    // configure and start wifi
+#ifdef CONFIG_WIFI_FAST_CONNECT
+    // go straight to the last access point instead of scanning for it
+    load_ap_cache();
+    if (ap_cache.magic == AP_CACHE_MAGIC &&
+        memcmp(ap_cache.ssid, wifi_config.sta.ssid, 32) == 0) {
+      wifi_config.sta.bssid_set = true;
+      memcpy(wifi_config.sta.bssid, ap_cache.bssid, 6);
+      wifi_config.sta.channel = ap_cache.channel;
+      fast_connecting = true;
+    }
+#endif  // CONFIG_WIFI_FAST_CONNECT
+
+    // configure and start wifi, keeping the cached access point out of flash
     esp_wifi_set_mode(WIFI_MODE_STA);
+    esp_wifi_set_storage(WIFI_STORAGE_RAM);
     esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config);
+    esp_wifi_set_storage(WIFI_STORAGE_FLASH);
+    connect_start = esp_timer_get_time();
     esp_wifi_start();
   } else
     // start smartconfig
     smartconfig_start();
 
-  // wait for sntp to sync
-  calling_task = xTaskGetCurrentTaskHandle();
-  xTaskNotifyWait(0, 0, 0, portMAX_DELAY);
+  // connecting and synchronizing the time finish in the background
+  return ESP_OK;
+}
+
+void wireless_set_time_handler(wireless_time_handler_t handler) {
+  time_handler = handler;
+}
+
+void mqtt_set_connected_handler(mqtt_connected_handler_t handler) {
+  connected_handler = handler;
+}
+
+esp_err_t mqtt_subscribe(const char *topic, int qos,
+                         mqtt_message_handler_t handler) {
+  if (topic == NULL || handler == NULL) return ESP_ERR_INVALID_ARG;
+  if (num_subscriptions == MAX_SUBSCRIPTIONS) return ESP_ERR_NO_MEM;
+  subscriptions[num_subscriptions++] =
+      (subscription_t){.topic = topic, .qos = qos, .handler = handler};
 
+  // otherwise it is subscribed to when the client connects
+  if (mqtt_is_connected) esp_mqtt_client_subscribe(mqtt_client, topic, qos);
   return ESP_OK;
 }
 
-esp_err_t mqtt_publish(const char *topic, const char *message, int qos,
-                       bool retain) {
-  if (mqtt_client == NULL) return ESP_ERR_INVALID_STATE;
-  const int ret =
-      esp_mqtt_client_publish(mqtt_client, topic, message, 0, qos, retain);
-  return ret == -1 ? ESP_FAIL : ESP_OK;
+esp_err_t wireless_wait_connected(TickType_t timeout) {
+  if (wireless_events == NULL) return ESP_ERR_INVALID_STATE;
+  const EventBits_t bits = xEventGroupWaitBits(wireless_events, CONNECTED_BIT,
+                                               pdFALSE, pdTRUE, timeout);
+  return bits & CONNECTED_BIT ? ESP_OK : ESP_ERR_TIMEOUT;
 }
 
-esp_err_t mqtt_publish_json(const char *topic, cJSON *json, int qos,
-                            bool retain) {
-  char *message = cJSON_PrintUnformatted(json);
-  const esp_err_t err = mqtt_publish(topic, message, qos, retain);
-  free(message);
-  return err;
+bool wireless_mqtt_connected() {
+  return mqtt_client != NULL && mqtt_is_connected;
+}
+
+esp_err_t wireless_mqtt_publish(const char *topic, const void *data,
+                                size_t size, int qos, bool retain,
+                                int *msg_id) {
+  // fail rather than leave messages to the client while offline
+  if (!wireless_mqtt_connected()) return ESP_ERR_INVALID_STATE;
+  power_lock_acquire(pm_lock);
+  *msg_id =
+      esp_mqtt_client_publish(mqtt_client, topic, data, size, qos, retain);
+  power_lock_release(pm_lock);
+  return *msg_id == -1 ? ESP_FAIL : ESP_OK;
+}
+
+esp_err_t wireless_stop() {
+  if (mqtt_client != NULL) esp_mqtt_client_stop(mqtt_client);
+  return esp_wifi_stop();
+}
+
+esp_err_t wireless_get_connect_stats(wireless_connect_stats_t *stats) {
+  *stats = connect_stats;
+  return ESP_OK;
 }
 
 int8_t wireless_get_rssi() {
@@ -142,82 +558,87 @@ int8_t wireless_get_rssi() {
   return ap_info.rssi;
 }
 
-double wireless_get_elevation() {
-  // configure the first http request and client
+static esp_err_t read_response(esp_http_client_handle_t client, int size) {
+  // responses that don't fit are cut short, which the parsing catches
+  if (size > (int)sizeof(response) - 1) size = sizeof(response) - 1;
+  const int read = esp_http_client_read(client, response, size);
+  response[read > 0 ? read : 0] = 0;
+  return read > 0 ? ESP_OK : ESP_ERR_INVALID_RESPONSE;
+}
+
+esp_err_t wireless_get_location(float *latitude, float *longitude) {
+  // look up the location of our public ip address
   esp_http_client_config_t config = {.url = "http://ipinfo.io/json"};
   esp_http_client_handle_t client = esp_http_client_init(&config);
 
-  double elevation = CONFIG_DEFAULT_ELEVATION_METERS;
+  esp_err_t err;
   do {
-    // send the first http request
-    float latitude, longitude;
-    esp_err_t err = esp_http_client_open(client, 0);
-    if (!err) {
-      esp_http_client_fetch_headers(client);
-
-      // read the response into a buffer
-      // response is not chunked, so check headers for content-length
-      const int content_length = esp_http_client_get_content_length(client);
-      cJSON *json = NULL;
-      if (content_length < 1) break;
-
-      char *content = malloc(content_length + 1);
-      esp_http_client_read(client, content, content_length);
-      content[content_length] = 0;
-      json = cJSON_Parse(content);
-      free(content);
-
-      // parse latitude and longitude
-      cJSON *loc = cJSON_GetObjectItem(json, "loc");
-      if (loc == NULL) break;
-      sscanf(loc->valuestring, "%f,%f", &latitude, &longitude);
-      cJSON_Delete(json);
-    }
+    err = esp_http_client_open(client, 0);
+    if (err) break;
+
+    // read the response into a buffer
+    // response is not chunked, so check headers for content-length
+    esp_http_client_fetch_headers(client);
+    const int content_length = esp_http_client_get_content_length(client);
+    err = ESP_ERR_INVALID_RESPONSE;
+    if (content_length < 1) break;
+
+    if (read_response(client, content_length)) break;
+
+    err = lookup_parse_location(response, latitude, longitude);
+  } while (false);
+
+  esp_http_client_close(client);
+  esp_http_client_cleanup(client);
+
+  if (err)
+    ESP_LOGW(TAG, "unable to get location %s", esp_err_to_name(err));
+  else
+    ESP_LOGI(TAG, "got location: %.4f,%.4f", *latitude, *longitude);
+
+  return err;
+}
 
-    // configure the second http request
-    const char *url_format =
-        "https://nationalmap.gov/epqs/pqs.php?"
-        "x=%.6f&y=%.6f&units=Meters&output=json";
-    char url[strlen(url_format) + (11 * 2)];
-    sprintf(url, url_format, longitude, latitude);
-    err = esp_http_client_set_url(client, url);
+esp_err_t wireless_get_elevation(float latitude, float longitude,
+                                 double *elevation) {
+  const char *url_format =
+      "https://nationalmap.gov/epqs/pqs.php?"
+      "x=%.6f&y=%.6f&units=Meters&output=json";
+  char url[strlen(url_format) + (11 * 2)];
+  sprintf(url, url_format, longitude, latitude);
+  esp_http_client_config_t config = {.url = url};
+  esp_http_client_handle_t client = esp_http_client_init(&config);
 
-    // send the second http request
+  esp_err_t err;
+  do {
     err = esp_http_client_open(client, 0);
-    if (!err) {
-      // read the response into a buffer
-      // response is chunked, and esp-idf v4.1 doesn't handle chunks so well,
-      //  so we allocate a buffer around the right size for the response.
-      const int status_code = esp_http_client_get_status_code(client);
-      cJSON *json = NULL;
-      if (status_code != 200) break;
-      const size_t BUFFER_SIZE = 255;
-      char *content = malloc(BUFFER_SIZE);
-      const int read = esp_http_client_read(client, content, BUFFER_SIZE);
-      content[read] = 0;
-      json = cJSON_Parse(content);
-      free(content);
-
-      // parse elevation in meters
-      cJSON *node =
-          cJSON_GetObjectItem(json, "USGS_Elevation_Point_Query_Service");
-      node = cJSON_GetObjectItem(node, "Elevation_Query");
-      node = cJSON_GetObjectItem(node, "Elevation");
-      if (node == NULL) break;
-      elevation = node->valuedouble;
-      cJSON_Delete(json);
-    }
+    if (err) break;
+
+    // read the response into a buffer
+    // response is chunked, and esp-idf v4.1 doesn't handle chunks so well,
+    //  so we read as much as the buffer holds, which fits the response.
+    esp_http_client_fetch_headers(client);
+    const int status_code = esp_http_client_get_status_code(client);
+    err = ESP_ERR_INVALID_RESPONSE;
+    if (status_code != 200) break;
+    if (read_response(client, sizeof(response) - 1)) break;
+
+    err = lookup_parse_elevation(response, elevation);
   } while (false);
 
   esp_http_client_close(client);
   esp_http_client_cleanup(client);
 
-  ESP_LOGI(TAG, "got elevation: %.2fm", elevation);
+  if (err)
+    ESP_LOGW(TAG, "unable to get elevation %s", esp_err_to_name(err));
+  else
+    ESP_LOGI(TAG, "got elevation: %.2fm", *elevation);
 
-  return elevation;
+  return err;
 }
 
-esp_err_t mqtt_publish_discovery(const mqtt_discovery_t *discovery) {
+esp_err_t mqtt_publish_discovery(const mqtt_discovery_t *discovery,
+                                 bool force) {
   if (discovery == NULL) return ESP_OK;
   if (discovery->state_topic == NULL) {
     ESP_LOGE(TAG, "discovery missing required keys");
@@ -241,66 +662,99 @@ esp_err_t mqtt_publish_discovery(const mqtt_discovery_t *discovery) {
   char topic[strlen(fmt) + strlen(type) + strlen(discovery->unique_id)];
   sprintf(topic, fmt, type, discovery->unique_id);
 
-  // start building the discovery json
-  cJSON *json = cJSON_CreateObject();
+  // write the discovery json, discovery is published from the mqtt task so
+  // the buffer is only ever used by one publish at a time
+  static char message[DISCOVERY_MESSAGE_SIZE];
+  json_writer_t json;
+  json_writer_init(&json, message, sizeof(message));
 
   // add required options
-  cJSON_AddStringToObject(json, "state_topic", discovery->state_topic);
+  json_add_string(&json, "state_topic", discovery->state_topic);
 
   // add device information
-  cJSON *device = cJSON_CreateObject();
-  if (discovery->device.name != NULL)
-    cJSON_AddStringToObject(device, "name", discovery->device.name);
-  if (discovery->device.manufacturer != NULL)
-    cJSON_AddStringToObject(device, "manufacturer",
-                            discovery->device.manufacturer);
-  if (discovery->device.model != NULL)
-    cJSON_AddStringToObject(device, "model", discovery->device.model);
-  if (discovery->device.sw_version != NULL)
-    cJSON_AddStringToObject(device, "sw_version", discovery->device.sw_version);
-  if (discovery->device.identifiers != NULL)
-    cJSON_AddStringToObject(device, "identifiers",
-                            discovery->device.identifiers);
-  if (cJSON_GetArraySize(device) > 0)
-    cJSON_AddItemToObject(json, "device", device);
+  const bool has_device =
+      discovery->device.name != NULL ||
+      discovery->device.manufacturer != NULL ||
+      discovery->device.model != NULL ||
+      discovery->device.sw_version != NULL ||
+      discovery->device.identifiers != NULL;
+  if (has_device) {
+    json_begin_object(&json, "device");
+    if (discovery->device.name != NULL)
+      json_add_string(&json, "name", discovery->device.name);
+    if (discovery->device.manufacturer != NULL)
+      json_add_string(&json, "manufacturer", discovery->device.manufacturer);
+    if (discovery->device.model != NULL)
+      json_add_string(&json, "model", discovery->device.model);
+    if (discovery->device.sw_version != NULL)
+      json_add_string(&json, "sw_version", discovery->device.sw_version);
+    if (discovery->device.identifiers != NULL)
+      json_add_string(&json, "identifiers", discovery->device.identifiers);
+    json_end_object(&json);
+  }
 
   // add entity information
   if (discovery->name != NULL)
-    cJSON_AddStringToObject(json, "name", discovery->name);
+    json_add_string(&json, "name", discovery->name);
   if (discovery->unique_id != NULL)
-    cJSON_AddStringToObject(json, "unique_id", discovery->unique_id);
+    json_add_string(&json, "unique_id", discovery->unique_id);
 
   if (discovery->availability_topic != NULL)
-    cJSON_AddStringToObject(json, "availability_topic",
-                            discovery->availability_topic);
+    json_add_string(&json, "availability_topic",
+                    discovery->availability_topic);
   if (discovery->device_class != NULL)
-    cJSON_AddStringToObject(json, "device_class", discovery->device_class);
+    json_add_string(&json, "device_class", discovery->device_class);
   if (discovery->expire_after != 0)
-    cJSON_AddNumberToObject(json, "expire_after", discovery->expire_after);
+    json_add_int(&json, "expire_after", discovery->expire_after);
   if (discovery->force_update == true)
-    cJSON_AddBoolToObject(json, "force_update", discovery->force_update);
+    json_add_bool(&json, "force_update", discovery->force_update);
   if (discovery->value_template != NULL)
-    cJSON_AddStringToObject(json, "value_template", discovery->value_template);
+    json_add_string(&json, "value_template", discovery->value_template);
 
   // add device type dependent options
   if (discovery->type == MQTT_SENSOR) {
     // add sensor options
     if (discovery->sensor.unit_of_measurement != NULL)
-      cJSON_AddStringToObject(json, "unit_of_measurement",
-                              discovery->sensor.unit_of_measurement);
+      json_add_string(&json, "unit_of_measurement",
+                      discovery->sensor.unit_of_measurement);
     if (discovery->sensor.icon != NULL)
-      cJSON_AddStringToObject(json, "icon", discovery->sensor.icon);
+      json_add_string(&json, "icon", discovery->sensor.icon);
   } else if (discovery->type == MQTT_BINARY_SENSOR) {
     // add binary sensor options
     if (discovery->binary_sensor.payload_on != NULL)
-      cJSON_AddStringToObject(json, "payload_on",
-                              discovery->binary_sensor.payload_on);
+      json_add_string(&json, "payload_on",
+                      discovery->binary_sensor.payload_on);
     if (discovery->binary_sensor.payload_off != NULL)
-      cJSON_AddStringToObject(json, "payload_off",
-                              discovery->binary_sensor.payload_off);
+      json_add_string(&json, "payload_off",
+                      discovery->binary_sensor.payload_off);
   }
 
-  esp_err_t err = mqtt_publish_json(topic, json, 2, true);
-  cJSON_Delete(json);
-  return err;
+  esp_err_t err = json_writer_finish(&json);
+  if (err) {
+    ESP_LOGE(TAG, "discovery too large for %s", discovery->unique_id);
+    return err;
+  }
+
+  // the broker retains discovery, so it is only published again when the
+  // message changes. Discovery is published and acknowledged on the mqtt
+  // task, so a whole pass is queued before its first acknowledgement.
+  load_discovery_cache();
+  const uint32_t message_hash = crc32_le(0, (uint8_t *)message, json.len);
+  const int index =
+      find_discovery_hash(crc32_le(0, (uint8_t *)topic, strlen(topic)));
+  if (index < 0 && !discovery_full) {
+    discovery_full = true;
+    ESP_LOGW(TAG, "discovery cache full, %s is published every time",
+             discovery->unique_id);
+  }
+  const bool unchanged =
+      index >= 0 && discovery_cache.hashes[index].message == message_hash;
+  if (!force && unchanged) return ESP_OK;
+  int msg_id;
+  err = mqtt_policy_publish(MQTT_DISCOVERY, topic, message, json.len,
+                            &msg_id);
+  if (err || index < 0 || unchanged) return err;
+  pending_discovery[index] =
+      (pending_discovery_t){.msg_id = msg_id, .message = message_hash};
+  return ESP_OK;
 }
\ No newline at end of file
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "esp_system.h"
+
+#define POWER_MAX_LOCKS 8  // Number of locks that can be created.
+
+typedef enum {
+  POWER_LOCK_CPU,       // Keeps the CPU at its maximum frequency.
+  POWER_LOCK_APB,       // Keeps the APB clock at 80 MHz for peripherals.
+  POWER_LOCK_NO_SLEEP,  // Keeps the chip out of light sleep.
+  POWER_LOCK_MAX
+} power_lock_type_t;
+
+typedef struct power_lock *power_lock_handle_t;
+
+typedef struct {
+  const char *name;       // Name the lock was created with.
+  uint32_t acquisitions;  // Number of times the lock was taken.
+  int64_t held_time;      // Time the lock was held (us).
+} power_lock_stats_t;
+
+esp_err_t power_init();
+
+esp_err_t power_lock_create(power_lock_type_t type, const char *name,
+                            power_lock_handle_t *handle);
+
+esp_err_t power_lock_acquire(power_lock_handle_t handle);
+
+esp_err_t power_lock_release(power_lock_handle_t handle);
+
+size_t power_take_stats(power_lock_stats_t *stats, size_t max,
+                        int64_t *period);
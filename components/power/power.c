@@ -0,0 +1,136 @@
+#include "power.h"
+
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_pm.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+
+#define MIN_FREQ_MHZ CONFIG_ESP32_XTAL_FREQ  // Lowest DFS frequency (MHz).
+
+struct power_lock {
+  const char *name;
+  esp_pm_lock_handle_t pm_lock;  // NULL if power management is disabled.
+  uint32_t depth;                // Number of outstanding acquisitions.
+  uint32_t acquisitions;
+  int64_t held_time;   // Time held since the stats were last taken (us).
+  int64_t held_since;  // Time the lock was first acquired (us).
+};
+
+static const char *TAG = "power";
+
+static const esp_pm_lock_type_t pm_lock_types[POWER_LOCK_MAX] = {
+    [POWER_LOCK_CPU] = ESP_PM_CPU_FREQ_MAX,
+    [POWER_LOCK_APB] = ESP_PM_APB_FREQ_MAX,
+    [POWER_LOCK_NO_SLEEP] = ESP_PM_NO_LIGHT_SLEEP};
+
+static struct power_lock locks[POWER_MAX_LOCKS];
+static size_t num_locks = 0;
+static int64_t stats_since = 0;  // Time the stats were last taken (us).
+static portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+
+esp_err_t power_init() {
+#ifdef CONFIG_PM_ENABLE
+  // let the cpu drop to the crystal frequency and light sleep when idle
+  const esp_pm_config_esp32_t config = {
+      .max_freq_mhz = CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ,
+      .min_freq_mhz = MIN_FREQ_MHZ,
+#ifdef CONFIG_FREERTOS_USE_TICKLESS_IDLE
+      .light_sleep_enable = true
+#endif  // CONFIG_FREERTOS_USE_TICKLESS_IDLE
+  };
+  esp_err_t err = esp_pm_configure(&config);
+  if (err) ESP_LOGE(TAG, "unable to configure power management %x", err);
+  return err;
+#else
+  return ESP_ERR_NOT_SUPPORTED;
+#endif  // CONFIG_PM_ENABLE
+}
+
+esp_err_t power_lock_create(power_lock_type_t type, const char *name,
+                            power_lock_handle_t *handle) {
+  if (type >= POWER_LOCK_MAX || name == NULL) return ESP_ERR_INVALID_ARG;
+
+  // drivers that are started more than once share their lock
+  for (size_t i = 0; i < num_locks; ++i) {
+    if (strcmp(locks[i].name, name) == 0) {
+      *handle = &locks[i];
+      return ESP_OK;
+    }
+  }
+  if (num_locks == POWER_MAX_LOCKS) return ESP_ERR_NO_MEM;
+
+  struct power_lock *lock = &locks[num_locks];
+  memset(lock, 0, sizeof(*lock));
+  lock->name = name;
+#ifdef CONFIG_PM_ENABLE
+  esp_err_t err =
+      esp_pm_lock_create(pm_lock_types[type], 0, name, &lock->pm_lock);
+  if (err) return err;
+#endif  // CONFIG_PM_ENABLE
+
+  // hold times are still tracked without power management
+  ++num_locks;
+  *handle = lock;
+  return ESP_OK;
+}
+
+esp_err_t power_lock_acquire(power_lock_handle_t handle) {
+  if (handle == NULL) return ESP_ERR_INVALID_ARG;
+  if (handle->pm_lock != NULL) {
+    esp_err_t err = esp_pm_lock_acquire(handle->pm_lock);
+    if (err) return err;
+  }
+
+  // only the outermost acquisition starts the clock
+  const int64_t now = esp_timer_get_time();
+  portENTER_CRITICAL(&mux);
+  if (handle->depth++ == 0) handle->held_since = now;
+  ++handle->acquisitions;
+  portEXIT_CRITICAL(&mux);
+  return ESP_OK;
+}
+
+esp_err_t power_lock_release(power_lock_handle_t handle) {
+  if (handle == NULL) return ESP_ERR_INVALID_ARG;
+
+  // the depth is checked under the lock so two releases can't both pass it
+  const int64_t now = esp_timer_get_time();
+  portENTER_CRITICAL(&mux);
+  if (handle->depth == 0) {
+    portEXIT_CRITICAL(&mux);
+    return ESP_ERR_INVALID_STATE;
+  }
+  if (--handle->depth == 0) handle->held_time += now - handle->held_since;
+  portEXIT_CRITICAL(&mux);
+
+  if (handle->pm_lock != NULL) return esp_pm_lock_release(handle->pm_lock);
+  return ESP_OK;
+}
+
+size_t power_take_stats(power_lock_stats_t *stats, size_t max,
+                        int64_t *period) {
+  const int64_t now = esp_timer_get_time();
+  const size_t n = num_locks < max ? num_locks : max;
+
+  portENTER_CRITICAL(&mux);
+  for (size_t i = 0; i < n; ++i) {
+    // count locks that are still held up to now and restart their clock
+    struct power_lock *lock = &locks[i];
+    if (lock->depth > 0) {
+      lock->held_time += now - lock->held_since;
+      lock->held_since = now;
+    }
+    stats[i].name = lock->name;
+    stats[i].acquisitions = lock->acquisitions;
+    stats[i].held_time = lock->held_time;
+    lock->acquisitions = 0;
+    lock->held_time = 0;
+  }
+  portEXIT_CRITICAL(&mux);
+
+  if (period != NULL) *period = now - stats_since;
+  stats_since = now;
+  return n;
+}
@@ -1,6 +1,7 @@
 #include "i2c.h"
 
 #include "driver/i2c.h"
+#include "power.h"
 
 #define WRITE 0
 #define READ 1
@@ -11,6 +12,7 @@
 #define PIN_NUM_SCL 22     // Adafruit Feather 32 Default
 
 static bool started = false;
+static power_lock_handle_t pm_lock = NULL;
 
 static esp_err_t i2c_master_command(char addr, char reg, void *buf, size_t size,
                                     TickType_t timeout,
@@ -40,7 +42,10 @@ static esp_err_t i2c_master_command(char addr, char reg, void *buf, size_t size,
 
   i2c_master_stop(cmd);
 
+  // the bus clock is derived from the apb clock, so hold it for the transfer
+  power_lock_acquire(pm_lock);
   esp_err_t err = i2c_master_cmd_begin(CONFIG_I2C_PORT, cmd, timeout);
+  power_lock_release(pm_lock);
   i2c_cmd_link_delete(cmd);
   return err;
 }
@@ -48,6 +53,8 @@ static esp_err_t i2c_master_command(char addr, char reg, void *buf, size_t size,
 esp_err_t i2c_init() {
   if (started) return ESP_OK;
 
+  power_lock_create(POWER_LOCK_APB, "i2c", &pm_lock);
+
   const i2c_config_t i2c_config = {
       .mode = I2C_MODE_MASTER,  // set to master mode
       .master =
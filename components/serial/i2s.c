@@ -8,24 +8,70 @@
 #define I2S_DATA_IN_PIN_NUM 27
 #define I2S_WORD_SELECT_PIN_NUM 33
 
+#define FRAME_SIZE 4  // Size of a 32-bit frame of the one channel (bytes).
+#define DMA_BUF_MS 8  // Audio held by each dma buffer (ms).
+#define MIN_DMA_BUF_LEN 8      // Shortest dma buffer the driver takes (frames).
+#define MAX_DMA_BUF_LEN 1024   // Longest dma buffer the driver takes (frames).
+#define MIN_DMA_BUF_COUNT 2    // Fewest dma buffers the driver takes.
+#define MAX_DMA_BUF_COUNT 128  // Most dma buffers the driver takes.
+
+static const char *TAG = "i2s";
 static bool started = false;
+static uint32_t sample_rate;
+static int dma_buf_len;
+static int dma_buf_count;
+static QueueHandle_t event_queue = NULL;
 
-esp_err_t i2s_init(void) {
-  if (started) return ESP_OK;
+// The driver keeps filled buffers in a queue that holds all but the one being
+// filled, and overwrites the oldest when the reader falls behind. Every filled
+// buffer is an event and the reader takes a buffer whenever it runs out of the
+// last one, so the buffers waiting are known, and any beyond what the queue
+// holds were lost.
+static uint64_t bytes_read;  // Bytes read since the driver was installed.
+static int32_t waiting;      // Buffers filled and not yet taken.
+static uint32_t lost;        // Buffers lost since the last take.
+static portMUX_TYPE lost_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static void size_ring(const i2s_capture_t *capture, int *len, int *count) {
+  // buffers hold a few ms each, or a block if that is shorter
+  size_t frames = capture->sample_rate / 1000 * DMA_BUF_MS;
+  if (frames > capture->block_size) frames = capture->block_size;
+  if (frames < MIN_DMA_BUF_LEN) frames = MIN_DMA_BUF_LEN;
+  if (frames > MAX_DMA_BUF_LEN) frames = MAX_DMA_BUF_LEN;
+  *len = frames;
+
+  // the buffers waiting must cover the latency, besides the one being filled
+  const size_t latency_frames = capture->sample_rate / 1000 * capture->latency;
+  *count = (latency_frames + frames - 1) / frames + 1;
+  if (*count < MIN_DMA_BUF_COUNT) *count = MIN_DMA_BUF_COUNT;
+  if (*count > MAX_DMA_BUF_COUNT) *count = MAX_DMA_BUF_COUNT;
+}
+
+static esp_err_t install(const i2s_capture_t *capture) {
+  int len, count;
+  size_ring(capture, &len, &count);
 
   // install i2s driver
   const i2s_config_t i2s_config = {
       .mode = I2S_MODE_MASTER | I2S_MODE_RX,
-      .sample_rate = 44100,
+      .sample_rate = capture->sample_rate,
       .bits_per_sample = I2S_BITS_PER_SAMPLE_32BIT,
       .channel_format = I2S_CHANNEL_FMT_ONLY_RIGHT,
       .communication_format = I2S_COMM_FORMAT_I2S | I2S_COMM_FORMAT_I2S_MSB,
       .intr_alloc_flags = ESP_INTR_FLAG_LEVEL1,
-      .dma_buf_count = 8,
-      .dma_buf_len = 64,
+      .dma_buf_count = count,
+      .dma_buf_len = len,
       .use_apll = false};
-  esp_err_t err = i2s_driver_install(CONFIG_I2S_PORT, &i2s_config, 0, NULL);
-  if (err) ESP_LOGE("i2s", "i2s driver install error %x", err);
+
+  // the event queue has room for the buffers filled during a block and
+  // between reads
+  const int queue_size = count + capture->block_size / len + 1;
+  esp_err_t err = i2s_driver_install(CONFIG_I2S_PORT, &i2s_config, queue_size,
+                                     &event_queue);
+  if (err) {
+    ESP_LOGE(TAG, "i2s driver install error %x", err);
+    return err;
+  }
 
   const i2s_pin_config_t pin_config = {.bck_io_num = I2S_BIT_CLOCK_PIN_NUM,
                                        .ws_io_num = I2S_WORD_SELECT_PIN_NUM,
@@ -33,16 +79,84 @@ esp_err_t i2s_init(void) {
                                        .data_in_num = I2S_DATA_IN_PIN_NUM};
   i2s_set_pin(CONFIG_I2S_PORT, &pin_config);
 
-  started = true;
+  sample_rate = capture->sample_rate;
+  dma_buf_len = len;
+  dma_buf_count = count;
+  bytes_read = 0;
+  waiting = 0;
+  ESP_LOGI(TAG, "%d dma buffers of %d frames", count, len);
+  return ESP_OK;
+}
+
+static void count_events() {
+  // buffers filled beyond what the queue holds overwrote older ones
+  i2s_event_t event;
+  while (xQueueReceive(event_queue, &event, 0) == pdTRUE)
+    if (event.type == I2S_EVENT_RX_DONE) ++waiting;
+  const int32_t capacity = dma_buf_count - 1;
+  if (waiting > capacity) {
+    portENTER_CRITICAL(&lost_mux);
+    lost += waiting - capacity;
+    portEXIT_CRITICAL(&lost_mux);
+    waiting = capacity;
+  }
+}
 
+esp_err_t i2s_init(const i2s_capture_t *capture) {
+  if (started) return ESP_OK;
+  esp_err_t err = install(capture);
+  if (err) return err;
+  started = true;
   return ESP_OK;
 }
 
-esp_err_t i2s_deinit(void) { return i2s_driver_uninstall(CONFIG_I2S_PORT); }
+esp_err_t i2s_deinit(void) {
+  started = false;
+  return i2s_driver_uninstall(CONFIG_I2S_PORT);
+}
+
+esp_err_t i2s_bus_start(void) { return i2s_start(CONFIG_I2S_PORT); }
+
+esp_err_t i2s_bus_stop(void) { return i2s_stop(CONFIG_I2S_PORT); }
+
+esp_err_t i2s_bus_set_capture(const i2s_capture_t *capture) {
+  if (!started) return i2s_init(capture);
+  int len, count;
+  size_ring(capture, &len, &count);
+  if (len == dma_buf_len && count == dma_buf_count) {
+    if (capture->sample_rate == sample_rate) return ESP_OK;
+    esp_err_t err =
+        i2s_set_sample_rates(CONFIG_I2S_PORT, capture->sample_rate);
+    if (!err) sample_rate = capture->sample_rate;
+    return err;
+  }
+
+  // the driver allocates the ring when it is installed
+  i2s_driver_uninstall(CONFIG_I2S_PORT);
+  esp_err_t err = install(capture);
+  if (err) started = false;
+  return err;
+}
 
 esp_err_t i2s_bus_read(void *buf, size_t size, TickType_t timeout) {
-  size_t bytes_read;
-  i2s_read(CONFIG_I2S_PORT, buf, size, &bytes_read, timeout);
-  if (size != bytes_read) return ESP_ERR_TIMEOUT;
+  count_events();
+  size_t bytes;
+  i2s_read(CONFIG_I2S_PORT, buf, size, &bytes, timeout);
+
+  // a buffer is taken whenever the reader runs out of the last one
+  const size_t buf_size = dma_buf_len * FRAME_SIZE;
+  const uint64_t taken = (bytes_read + buf_size - 1) / buf_size;
+  bytes_read += bytes;
+  waiting -= (bytes_read + buf_size - 1) / buf_size - taken;
+
+  if (size != bytes) return ESP_ERR_TIMEOUT;
   return ESP_OK;
 }
+
+uint32_t i2s_bus_take_lost(void) {
+  portENTER_CRITICAL(&lost_mux);
+  const uint32_t count = lost;
+  lost = 0;
+  portEXIT_CRITICAL(&lost_mux);
+  return count;
+}
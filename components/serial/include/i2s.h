@@ -3,8 +3,23 @@
 #include "esp_system.h"
 #include "freertos/FreeRTOS.h"
 
-esp_err_t i2s_init(void);
+typedef struct {
+  uint32_t sample_rate;  // Rate of the audio (Hz).
+  size_t block_size;     // Frames the reader reads at a time.
+  uint32_t latency;      // Longest the reader may take between reads without
+                         // losing audio (ms).
+} i2s_capture_t;
+
+esp_err_t i2s_init(const i2s_capture_t *capture);
 
 esp_err_t i2s_deinit(void);
 
-esp_err_t i2s_bus_read(void *buf, size_t size, TickType_t timeout);
\ No newline at end of file
+esp_err_t i2s_bus_start(void);
+
+esp_err_t i2s_bus_stop(void);
+
+esp_err_t i2s_bus_set_capture(const i2s_capture_t *capture);
+
+esp_err_t i2s_bus_read(void *buf, size_t size, TickType_t timeout);
+
+uint32_t i2s_bus_take_lost(void);
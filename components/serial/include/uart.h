@@ -2,6 +2,7 @@
 
 #include "esp_system.h"
 #include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
 
 esp_err_t uart_init();
 
@@ -10,3 +11,16 @@ esp_err_t uart_deinit();
 esp_err_t uart_bus_write(const void *buf, size_t size, TickType_t timeout);
 
 esp_err_t uart_bus_read(void *buf, size_t size, TickType_t timeout);
+
+esp_err_t uart_bus_flush();
+
+esp_err_t uart_bus_hold();
+
+esp_err_t uart_bus_release();
+
+esp_err_t uart_bus_get_available(size_t *size);
+
+// Sets bits in events once size bytes are buffered, which may be right away.
+// Only the latest request is kept.
+esp_err_t uart_bus_notify(size_t size, EventGroupHandle_t events,
+                          EventBits_t bits);
@@ -1,16 +1,55 @@
 #include "uart.h"
 
+#include "arena.h"
 #include "driver/uart.h"
+#include "power.h"
 
 #define CONFIG_UART_PORT 1  // default UART port
 #define PIN_NUM_TX 17       // Adafruit Feather 32 Default
 #define PIN_NUM_RX 16       // Adafruit Feather 32 Default
+#define EVENT_QUEUE_SIZE 10  // Uart events waiting for the event task.
+#define EVENT_TASK_STACK_SIZE 2048  // Size of the event task's stack (bytes).
 
 static bool started = false;
+static power_lock_handle_t pm_lock = NULL;
+static QueueHandle_t event_queue = NULL;
+static portMUX_TYPE notify_mux = portMUX_INITIALIZER_UNLOCKED;
+static struct {
+  size_t size;                // Bytes to wait for.
+  EventGroupHandle_t events;  // Group to notify, or NULL if nothing waits.
+  EventBits_t bits;           // Bits to set once the bytes are buffered.
+} notify;
+
+static void check_notify() {
+  size_t available;
+  if (uart_get_buffered_data_len(CONFIG_UART_PORT, &available)) return;
+  EventGroupHandle_t events = NULL;
+  EventBits_t bits = 0;
+  portENTER_CRITICAL(&notify_mux);
+  if (notify.events != NULL && available >= notify.size) {
+    events = notify.events;
+    bits = notify.bits;
+    notify.events = NULL;
+  }
+  portEXIT_CRITICAL(&notify_mux);
+  if (events != NULL) xEventGroupSetBits(events, bits);
+}
+
+static void event_task(void *arg) {
+  // the driver posts an event once bytes stop arriving or the fifo fills, so
+  // a frame is noticed as soon as it is complete
+  uart_event_t event;
+  while (true) {
+    if (!xQueueReceive(event_queue, &event, portMAX_DELAY)) continue;
+    if (event.type == UART_DATA) check_notify();
+  }
+}
 
 esp_err_t uart_init() {
   if (started) return ESP_OK;
 
+  power_lock_create(POWER_LOCK_APB, "uart", &pm_lock);
+
   // configure the uart port for the pms5003
   const uart_config_t uart_config = {
       .baud_rate = 9600,
@@ -23,9 +62,16 @@ esp_err_t uart_init() {
   uart_param_config(CONFIG_UART_PORT, &uart_config);
   uart_set_pin(CONFIG_UART_PORT, PIN_NUM_TX, PIN_NUM_RX, UART_PIN_NO_CHANGE,
                UART_PIN_NO_CHANGE);
-  esp_err_t err = uart_driver_install(CONFIG_UART_PORT, 255, 0, 10, NULL, 0);
-  if (!err) started = true;
-  return err;
+  esp_err_t err = uart_driver_install(CONFIG_UART_PORT, 255, 0,
+                                      EVENT_QUEUE_SIZE, &event_queue, 0);
+  if (err) return err;
+  if (arena_create_task(event_task, "uart_events", EVENT_TASK_STACK_SIZE,
+                        NULL, 5, tskNO_AFFINITY) == NULL) {
+    uart_driver_delete(CONFIG_UART_PORT);
+    return ESP_ERR_NO_MEM;
+  }
+  started = true;
+  return ESP_OK;
 }
 
 esp_err_t uart_deinit() {
@@ -36,9 +82,12 @@ esp_err_t uart_deinit() {
 esp_err_t uart_bus_write(const void *buf, size_t size, TickType_t timeout) {
   if (size == 0) return ESP_OK;
 
+  // the baud rate is derived from the apb clock, so hold it for the transfer
+  power_lock_acquire(pm_lock);
   const int written = uart_write_bytes(CONFIG_UART_PORT, buf, size);
-
   esp_err_t err = uart_wait_tx_done(CONFIG_UART_PORT, timeout);
+  power_lock_release(pm_lock);
+
   if (written != size)
     return ESP_ERR_TIMEOUT;
   else
@@ -48,13 +97,37 @@ esp_err_t uart_bus_write(const void *buf, size_t size, TickType_t timeout) {
 esp_err_t uart_bus_read(void *buf, size_t size, TickType_t timeout) {
   if (size == 0) return ESP_OK;
 
-  // only read new data
-  uart_flush_input(CONFIG_UART_PORT);
-
+  power_lock_acquire(pm_lock);
   const int read = uart_read_bytes(CONFIG_UART_PORT, buf, size, timeout);
+  power_lock_release(pm_lock);
 
   if (read != size)
     return ESP_ERR_TIMEOUT;
   else
     return ESP_OK;
 }
+
+esp_err_t uart_bus_flush() { return uart_flush_input(CONFIG_UART_PORT); }
+
+esp_err_t uart_bus_hold() { return power_lock_acquire(pm_lock); }
+
+esp_err_t uart_bus_release() { return power_lock_release(pm_lock); }
+
+esp_err_t uart_bus_get_available(size_t *size) {
+  return uart_get_buffered_data_len(CONFIG_UART_PORT, size);
+}
+
+esp_err_t uart_bus_notify(size_t size, EventGroupHandle_t events,
+                          EventBits_t bits) {
+  if (events == NULL) return ESP_ERR_INVALID_ARG;
+  if (!started) return ESP_ERR_INVALID_STATE;
+  portENTER_CRITICAL(&notify_mux);
+  notify.size = size;
+  notify.events = events;
+  notify.bits = bits;
+  portEXIT_CRITICAL(&notify_mux);
+
+  // the bytes may have arrived already
+  check_notify();
+  return ESP_OK;
+}
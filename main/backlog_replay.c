@@ -0,0 +1,63 @@
+#include "backlog_replay.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#include "backlog.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "timestamp.h"
+
+typedef struct {
+  int64_t stamp;   // When the data was measured (us).
+  uint32_t clock;  // Clock the stamp is on, or 0 for the wall clock.
+  char data[];     // The data as it is published.
+} backlog_record_t;
+
+static const char *TAG = "backlog";
+static WORD_ALIGNED_ATTR uint8_t
+    record_buffer[BACKLOG_MAX_SIZE];  // A backlog record.
+
+esp_err_t backlog_replay_keep(const void *data, size_t size, int64_t stamp,
+                              bool timed) {
+  // keep the data with when it was measured. Data that was timed already
+  // holds its time, otherwise the timestamp is kept, which only means
+  // something until power is lost.
+  const size_t header_size = offsetof(backlog_record_t, data);
+  if (size == 0 || size > BACKLOG_MAX_SIZE - header_size)
+    return ESP_ERR_INVALID_SIZE;
+  backlog_record_t *record = (backlog_record_t *)record_buffer;
+  record->clock = timed ? 0 : timestamp_get_clock();
+  record->stamp = stamp;
+  memcpy(record->data, data, size);
+  esp_err_t err = backlog_push(record, header_size + size);
+  if (err) ESP_LOGW(TAG, "unable to backlog data");
+  return err;
+}
+
+esp_err_t backlog_replay(backlog_publish_t publish) {
+  // old data is only useful with its time, so wait until the time is known,
+  // and publish a batch at a time so new data is never held up for long
+  if (!timestamp_is_synced()) return ESP_ERR_INVALID_STATE;
+  backlog_record_t *record = (backlog_record_t *)record_buffer;
+  const size_t header_size = offsetof(backlog_record_t, data);
+  for (int i = 0; i < BACKLOG_BATCH; ++i) {
+    size_t size = BACKLOG_MAX_SIZE;
+    if (backlog_peek(record, &size)) return ESP_OK;
+
+    // data measured before losing power can't be placed in time, so it is
+    // dropped along with anything unreadable. Data that holds its time is
+    // published with a time of 0.
+    time_t time = 0;
+    const bool placed =
+        record->clock == 0 ||
+        (record->clock == timestamp_get_clock() &&
+         timestamp_to_time(record->stamp, &time) == ESP_OK);
+    if (placed && size > header_size) {
+      esp_err_t err = publish(record->data, size - header_size, time);
+      if (err && err != ESP_ERR_INVALID_SIZE) return err;
+    }
+    backlog_pop();
+  }
+  return ESP_OK;
+}
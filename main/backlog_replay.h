@@ -0,0 +1,13 @@
+#pragma once
+#include <time.h>
+
+#include "esp_system.h"
+
+#define BACKLOG_BATCH 32  // Most backlogged readings published per report.
+
+typedef esp_err_t (*backlog_publish_t)(void *data, size_t size, time_t time);
+
+esp_err_t backlog_replay_keep(const void *data, size_t size, int64_t stamp,
+                              bool timed);
+
+esp_err_t backlog_replay(backlog_publish_t publish);
@@ -0,0 +1,90 @@
+#include "battery_history.h"
+
+#include <math.h>
+
+#include "esp_attr.h"
+#include "timestamp.h"
+
+#define MIN_SAMPLES 4   // Samples needed before estimating a rate.
+#define MIN_SPAN 30     // Minutes of history needed before estimating a rate.
+
+// The history is kept in RTC memory so that it survives deep sleep.
+static RTC_DATA_ATTR battery_sample_t history[BATTERY_HISTORY_LENGTH];
+static RTC_DATA_ATTR size_t head = 0;   // Next slot to write.
+static RTC_DATA_ATTR size_t count = 0;  // Number of samples in the history.
+
+// Sliding sums for a least-squares fit of soc and millivolts against time.
+// Times are kept in minutes so the sums stay well inside 64 bits.
+static RTC_DATA_ATTR struct {
+  int64_t t;
+  int64_t tt;
+  int64_t soc;
+  int64_t t_soc;
+  int64_t mv;
+  int64_t t_mv;
+} sums;
+
+static void accumulate(const battery_sample_t *sample, int sign) {
+  const int64_t t = sample->minutes;
+  sums.t += sign * t;
+  sums.tt += sign * t * t;
+  sums.soc += sign * (int64_t)sample->soc;
+  sums.t_soc += sign * t * sample->soc;
+  sums.mv += sign * (int64_t)sample->millivolts;
+  sums.t_mv += sign * t * sample->millivolts;
+}
+
+void battery_history_add(float millivolts, float battery_life) {
+  // timestamps keep running through deep sleep and never jump, unlike
+  // esp_timer and the system time
+  const battery_sample_t sample = {
+      .minutes = timestamp_now() / (60 * 1000000LL),
+      .millivolts = millivolts,
+      .soc = fmaxf(battery_life, 0) * 256};
+
+  // drop the oldest sample from the sums once the history is full
+  if (count == BATTERY_HISTORY_LENGTH)
+    accumulate(&history[head], -1);
+  else
+    ++count;
+
+  history[head] = sample;
+  accumulate(&sample, 1);
+  head = (head + 1) % BATTERY_HISTORY_LENGTH;
+}
+
+size_t battery_history_get(battery_sample_t *samples, size_t max) {
+  // copy out the newest samples in chronological order
+  const size_t n = count < max ? count : max;
+  for (size_t i = 0; i < n; ++i)
+    samples[i] = history[(head + BATTERY_HISTORY_LENGTH - n + i) %
+                         BATTERY_HISTORY_LENGTH];
+  return n;
+}
+
+esp_err_t battery_history_estimate(battery_estimate_t *estimate) {
+  if (count < MIN_SAMPLES) return ESP_ERR_INVALID_STATE;
+  const size_t oldest =
+      (head + BATTERY_HISTORY_LENGTH - count) % BATTERY_HISTORY_LENGTH;
+  const size_t newest = (head + BATTERY_HISTORY_LENGTH - 1) %
+                        BATTERY_HISTORY_LENGTH;
+  if (history[newest].minutes - history[oldest].minutes < MIN_SPAN)
+    return ESP_ERR_INVALID_STATE;
+
+  // slope = (n * sum(ty) - sum(t) * sum(y)) / (n * sum(tt) - sum(t)^2)
+  const int64_t n = count;
+  const int64_t den = n * sums.tt - sums.t * sums.t;
+  if (den <= 0) return ESP_ERR_INVALID_STATE;
+  const int64_t num_soc = n * sums.t_soc - sums.t * sums.soc;
+  const int64_t num_mv = n * sums.t_mv - sums.t * sums.mv;
+
+  estimate->rate = (double)num_soc / den * 60 / 256;  // %/h
+  estimate->millivolt_rate = (double)num_mv / den * 60;  // mV/h
+  if (estimate->rate < 0)
+    estimate->time_to_empty =
+        history[newest].soc / 256.0 / -estimate->rate;  // h
+  else
+    estimate->time_to_empty = INFINITY;
+
+  return ESP_OK;
+}
@@ -0,0 +1,23 @@
+#pragma once
+#include "esp_system.h"
+
+#define BATTERY_HISTORY_LENGTH 64  // Number of samples kept in the history.
+
+typedef struct {
+  uint32_t minutes;     // Timestamp of the sample (minutes).
+  uint16_t millivolts;  // Battery voltage (mV).
+  uint16_t soc;         // Battery life in 1/256ths of a percent.
+} battery_sample_t;
+
+typedef struct {
+  float rate;           // Change in battery life (%/h), negative if draining.
+  float time_to_empty;  // Projected time until the battery is empty (h), or
+                        // INFINITY if the battery isn't draining.
+  float millivolt_rate;  // Change in battery voltage (mV/h).
+} battery_estimate_t;
+
+void battery_history_add(float millivolts, float battery_life);
+
+size_t battery_history_get(battery_sample_t *samples, size_t max);
+
+esp_err_t battery_history_estimate(battery_estimate_t *estimate);
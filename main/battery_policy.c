@@ -0,0 +1,127 @@
+#include "battery_policy.h"
+
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "max17043.h"
+
+#define ECONOMY_THRESHOLD 50   // Battery life below which to economize (%).
+#define LOW_THRESHOLD 25       // Battery life below which to disable PM (%).
+#define CRITICAL_THRESHOLD 10  // Battery life below which to go critical (%).
+                               // Also programmed as the ALRT threshold.
+#define HYSTERESIS 3  // Battery life above a threshold needed to recover (%).
+#define CHARGING_DELTA 1.0  // Rise in battery life that indicates charging (%).
+
+static const char *TAG = "battery";
+
+static const battery_policy_t policies[BATTERY_LEVEL_MAX] = {
+    [BATTERY_NORMAL] = {.report_every = 1,
+                        .pm_every = 1,
+                        .noise_enabled = true,
+                        .noise_continuous = true},
+    [BATTERY_ECONOMY] = {.report_every = 2,
+                         .pm_every = 2,
+                         .noise_enabled = true,
+                         .noise_continuous = false},
+    [BATTERY_LOW] = {.report_every = 3,
+                     .pm_every = 0,
+                     .noise_enabled = true,
+                     .noise_continuous = false},
+    [BATTERY_CRITICAL] = {.report_every = 6,
+                          .pm_every = 0,
+                          .noise_enabled = false,
+                          .noise_continuous = false},
+};
+static const uint8_t thresholds[BATTERY_LEVEL_MAX] = {
+    [BATTERY_NORMAL] = 100,
+    [BATTERY_ECONOMY] = ECONOMY_THRESHOLD,
+    [BATTERY_LOW] = LOW_THRESHOLD,
+    [BATTERY_CRITICAL] = CRITICAL_THRESHOLD,
+};
+
+// The policy state is kept in RTC memory so that it survives deep sleep.
+static RTC_DATA_ATTR volatile battery_level_t level = BATTERY_NORMAL;
+static RTC_DATA_ATTR float last_battery_life = -1;
+static RTC_DATA_ATTR bool charging = false;
+static RTC_DATA_ATTR uint32_t periods = 0, reports = 0;
+static volatile bool alert_pending = false;  // Set by the ALRT interrupt.
+
+static void set_level(battery_level_t new_level) {
+  if (new_level == level) return;
+  ESP_LOGI(TAG, "battery level %d -> %d", level, new_level);
+  level = new_level;
+  periods = 0;  // report right away so the change is visible
+  reports = 0;
+}
+
+static void IRAM_ATTR alert_handler(void *arg) { alert_pending = true; }
+
+static void take_alert() {
+  // the alert is picked up on the report path so that the level is only ever
+  // changed by one task
+  if (!alert_pending) return;
+  alert_pending = false;
+  ESP_LOGW(TAG, "low battery alert");
+
+  // the alert must be cleared in software before it can fire again
+  max17043_clear_alert();
+  set_level(BATTERY_CRITICAL);
+}
+
+esp_err_t battery_policy_start() {
+  // program the alert threshold and clear any stale alert
+  max17043_config_t config;
+  esp_err_t err = max17043_get_config(&config);
+  if (err) return err;
+  config.config.athd = max17043_alert_threshold(CRITICAL_THRESHOLD);
+  config.config.alrt = 0;
+  err = max17043_set_config(&config);
+  if (err) return err;
+  return max17043_set_alert_handler(alert_handler, NULL);
+}
+
+battery_level_t battery_policy_update(float battery_life) {
+  take_alert();
+
+  // track the direction the battery life is moving in whole steps so that
+  // noise in the fuel gauge doesn't toggle the charging state
+  if (last_battery_life < 0) {
+    last_battery_life = battery_life;
+  } else if (battery_life - last_battery_life >= CHARGING_DELTA) {
+    charging = true;
+    last_battery_life = battery_life;
+  } else if (last_battery_life - battery_life >= CHARGING_DELTA) {
+    charging = false;
+    last_battery_life = battery_life;
+  }
+
+  if (charging) {
+    set_level(BATTERY_NORMAL);
+    return level;
+  }
+
+  // drop to the lowest level whose threshold we are below
+  battery_level_t new_level = BATTERY_NORMAL;
+  for (int i = BATTERY_ECONOMY; i < BATTERY_LEVEL_MAX; ++i)
+    if (battery_life < thresholds[i]) new_level = i;
+
+  // only recover once we are clear of the threshold by the hysteresis
+  if (new_level < level && battery_life < thresholds[level] + HYSTERESIS)
+    new_level = level;
+
+  set_level(new_level);
+  return level;
+}
+
+battery_level_t battery_policy_get_level() { return level; }
+
+const battery_policy_t *battery_policy_get() { return &policies[level]; }
+
+bool battery_policy_report_due() {
+  take_alert();
+  return periods++ % policies[level].report_every == 0;
+}
+
+bool battery_policy_pm_due() {
+  const uint8_t pm_every = policies[level].pm_every;
+  return pm_every != 0 && reports++ % pm_every == 0;
+}
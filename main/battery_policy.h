@@ -0,0 +1,28 @@
+#pragma once
+#include "esp_system.h"
+
+typedef enum {
+  BATTERY_NORMAL,    // Report every period with every sensor running.
+  BATTERY_ECONOMY,   // Stretch reports, sample noise only while awake.
+  BATTERY_LOW,       // Stretch reports further, turn off the PMS5003.
+  BATTERY_CRITICAL,  // Report rarely with only the cheapest sensors.
+  BATTERY_LEVEL_MAX
+} battery_level_t;
+
+typedef struct {
+  uint8_t report_every;   // Number of reporting periods between reports.
+  uint8_t pm_every;       // Number of reports between PMS5003 readings, or 0
+                          // to keep the PMS5003 asleep.
+  bool noise_enabled;     // Whether the SPH0645 is sampled at all.
+  bool noise_continuous;  // Whether the SPH0645 samples between reports.
+} battery_policy_t;
+
+esp_err_t battery_policy_start();
+
+battery_level_t battery_policy_update(float battery_life);
+
+battery_level_t battery_policy_get_level();
+const battery_policy_t *battery_policy_get();
+
+bool battery_policy_report_due();
+bool battery_policy_pm_due();
@@ -0,0 +1,64 @@
+#include "deep_sleep.h"
+
+#include "driver/gpio.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_sleep.h"
+#include "esp_timer.h"
+#include "scheduler.h"
+#include "timestamp.h"
+#include "wireless.h"
+
+#define DEEP_SLEEP_MAGIC 0x5ee95ee9  // Marks the RTC state as valid.
+#define BOOT_LEAD_US \
+  (3 * 1000 * 1000)  // Time to boot and reconnect ahead of the next event.
+#define MIN_SLEEP_US \
+  (40 * 1000 * 1000)  // Shorter gaps are cheaper to spend in light sleep.
+#define PUBLISH_TIMEOUT \
+  (5000 / portTICK_PERIOD_MS)  // Time to wait for the broker to acknowledge.
+
+static const char *TAG = "deep_sleep";
+
+static RTC_DATA_ATTR uint32_t magic = 0;
+static RTC_DATA_ATTR int64_t timer_offset;  // Timestamp minus esp_timer time
+                                            // when going to sleep (us).
+static bool warm_boot = false;
+
+static int64_t get_timer_offset() {
+  // timestamps keep running through deep sleep, esp_timer restarts
+  return timestamp_now() - esp_timer_get_time();
+}
+
+void deep_sleep_init() {
+  warm_boot = esp_reset_reason() == ESP_RST_DEEPSLEEP &&
+              magic == DEEP_SLEEP_MAGIC && scheduler_count() > 0;
+  magic = 0;
+  if (!warm_boot) {
+    scheduler_clear();
+    return;
+  }
+
+  // move the retained schedule onto this boot's esp_timer
+  scheduler_shift(timer_offset - get_timer_offset());
+  ESP_LOGI(TAG, "warm boot");
+}
+
+bool deep_sleep_is_warm_boot() { return warm_boot; }
+
+esp_err_t deep_sleep_until(int64_t due) {
+  const int64_t sleep_time = due - esp_timer_get_time() - BOOT_LEAD_US;
+  if (sleep_time < MIN_SLEEP_US) return ESP_ERR_INVALID_STATE;
+
+  // let the broker acknowledge what we sent before dropping the connection
+  if (mqtt_wait_published(PUBLISH_TIMEOUT))
+    ESP_LOGW(TAG, "sleeping with unacknowledged publishes");
+  wireless_stop();
+
+  ESP_LOGI(TAG, "sleeping for %ds", (int)(sleep_time / 1000000));
+  timer_offset = get_timer_offset();
+  magic = DEEP_SLEEP_MAGIC;
+  gpio_deep_sleep_hold_en();  // keep sleeping sensors asleep
+  esp_sleep_enable_timer_wakeup(sleep_time);
+  esp_deep_sleep_start();
+  return ESP_OK;
+}
@@ -0,0 +1,8 @@
+#pragma once
+#include "esp_system.h"
+
+void deep_sleep_init();
+
+bool deep_sleep_is_warm_boot();
+
+esp_err_t deep_sleep_until(int64_t due);
@@ -0,0 +1,210 @@
+#include "elevation.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "nvs.h"
+#include "timestamp.h"
+#include "wireless.h"
+
+#define NVS_NAMESPACE "elevation"
+#define NVS_CACHE_KEY "cache"
+
+#define MAX_AGE_S \
+  (CONFIG_ELEVATION_MAX_AGE_DAYS * 24 * 60 * 60LL)  // Age after which a
+                                                    // looked up elevation is
+                                                    // checked again (s).
+#define LOCATION_TOLERANCE 0.05  // Change in latitude or longitude that counts
+                                 // as having moved (degrees).
+#define TIME_WAIT_S 60  // Time to wait for the time before judging the cache.
+#define REFERENCE_MAX_AGE_US \
+  (15 * 60 * 1000000LL)  // Age after which a reference pressure is stale.
+#define MIN_ESTIMATES 12   // Estimates needed before trusting the average.
+#define MAX_ESTIMATES 288  // Estimates after which the average stops
+                           // weighting new estimates less.
+#define SAVE_EVERY 12      // Estimates between writes to nvs.
+#define LOOKUP_STACK_SIZE 8192  // Stack of the lookup task, which makes https
+                                // requests (bytes).
+
+typedef struct {
+  double elevation;  // Elevation in use (m).
+  float latitude;
+  float longitude;
+  int64_t time;  // Time the elevation was looked up, or 0 if unknown (s).
+  uint8_t source;
+  uint16_t estimates;  // Number of pressure estimates averaged.
+  double estimate;     // Average of the pressure estimates (m).
+} elevation_cache_t;
+
+static const char *TAG = "elevation";
+
+// The cache is kept in RTC memory so nvs is only read on a cold boot.
+static RTC_DATA_ATTR elevation_cache_t cache;
+static RTC_DATA_ATTR bool cache_loaded = false;
+static RTC_DATA_ATTR uint8_t unsaved_estimates = 0;
+static volatile bool updated = false;  // Whether the elevation has changed
+                                       // since it was last taken.
+static bool started = false;
+static double reference = NAN;  // Reference sea level pressure (Pa).
+static int64_t reference_stamp;
+static portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+
+static void load_cache() {
+  cache = (elevation_cache_t){.elevation = CONFIG_DEFAULT_ELEVATION_METERS,
+                              .source = ELEVATION_DEFAULT};
+  nvs_handle_t nvs;
+  if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK) {
+    elevation_cache_t saved;
+    size_t size = sizeof(saved);
+    if (nvs_get_blob(nvs, NVS_CACHE_KEY, &saved, &size) == ESP_OK &&
+        size == sizeof(saved))
+      cache = saved;
+    nvs_close(nvs);
+  }
+  cache_loaded = true;
+}
+
+static void save_cache() {
+  nvs_handle_t nvs;
+  if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) return;
+  if (nvs_set_blob(nvs, NVS_CACHE_KEY, &cache, sizeof(cache)) == ESP_OK)
+    nvs_commit(nvs);
+  nvs_close(nvs);
+}
+
+static bool is_stale() {
+  // a pressure derived elevation only gets better with time
+  if (cache.source == ELEVATION_PRESSURE) return false;
+  if (cache.source == ELEVATION_DEFAULT) return true;
+
+  // a lookup is checked again once it is old or if we never knew its age
+  time_t now;
+  if (timestamp_to_time(timestamp_now(), &now) != ESP_OK) return false;
+  return cache.time == 0 || now - cache.time > MAX_AGE_S;
+}
+
+static void lookup_task(void *arg) {
+  // the lookups need the network and the cache can't be judged without the
+  // time, both of which may take a while
+  wireless_wait_connected(portMAX_DELAY);
+  for (int i = 0; i < TIME_WAIT_S && !timestamp_is_synced(); ++i)
+    vTaskDelay(1000 / portTICK_PERIOD_MS);
+
+  float latitude, longitude;
+  double elevation;
+  do {
+    if (!is_stale()) break;
+    if (wireless_get_location(&latitude, &longitude)) break;
+
+    // only look up the elevation again if we moved
+    const bool moved = cache.source != ELEVATION_LOOKUP ||
+                       fabsf(latitude - cache.latitude) > LOCATION_TOLERANCE ||
+                       fabsf(longitude - cache.longitude) > LOCATION_TOLERANCE;
+    if (moved) {
+      if (wireless_get_elevation(latitude, longitude, &elevation)) break;
+      ESP_LOGI(TAG, "looked up elevation %.1fm", elevation);
+      portENTER_CRITICAL(&mux);
+      cache.elevation = elevation;
+      cache.latitude = latitude;
+      cache.longitude = longitude;
+      cache.source = ELEVATION_LOOKUP;
+      cache.estimates = 0;
+      portEXIT_CRITICAL(&mux);
+      updated = true;
+    }
+    time_t now;
+    if (timestamp_to_time(timestamp_now(), &now)) now = 0;
+    portENTER_CRITICAL(&mux);
+    cache.time = now;
+    portEXIT_CRITICAL(&mux);
+    save_cache();
+  } while (false);
+
+  // the stack goes back to the heap once the lookups are done
+  vTaskDelete(NULL);
+}
+
+#ifdef CONFIG_ELEVATION_FROM_PRESSURE
+static void reference_handler(const char *data, int data_len) {
+  // the reference is published in hPa
+  char buf[16];
+  if (data_len <= 0 || data_len >= sizeof(buf)) return;
+  memcpy(buf, data, data_len);
+  buf[data_len] = 0;
+  char *end;
+  const double hpa = strtod(buf, &end);
+  if (end == buf || hpa <= 0) return;
+
+  portENTER_CRITICAL(&mux);
+  reference = hpa * 100;
+  reference_stamp = timestamp_now();
+  portEXIT_CRITICAL(&mux);
+}
+#endif  // CONFIG_ELEVATION_FROM_PRESSURE
+
+double elevation_start() {
+  if (!cache_loaded) load_cache();
+  if (started) return cache.elevation;
+  started = true;
+
+#ifdef CONFIG_ELEVATION_FROM_PRESSURE
+  mqtt_subscribe(CONFIG_ELEVATION_REFERENCE_TOPIC, 0, reference_handler);
+#endif  // CONFIG_ELEVATION_FROM_PRESSURE
+
+  // a valid cache needs no lookups, and while the time is unknown the task
+  // waits to find out
+  const bool lookup = cache.source != ELEVATION_PRESSURE &&
+                      (!timestamp_is_synced() || is_stale());
+  if (lookup && xTaskCreate(lookup_task, "elevation", LOOKUP_STACK_SIZE, NULL,
+                            1, NULL) != pdPASS)
+    ESP_LOGE(TAG, "unable to start the elevation lookup");
+  return cache.elevation;
+}
+
+bool elevation_take_update(double *elevation) {
+  if (!updated) return false;
+  portENTER_CRITICAL(&mux);
+  updated = false;
+  *elevation = cache.elevation;
+  portEXIT_CRITICAL(&mux);
+  return true;
+}
+
+esp_err_t elevation_get_reference(double *sea_level_pressure) {
+  esp_err_t err = ESP_ERR_INVALID_STATE;
+  const int64_t now = timestamp_now();
+  portENTER_CRITICAL(&mux);
+  if (!isnan(reference) && now - reference_stamp < REFERENCE_MAX_AGE_US) {
+    *sea_level_pressure = reference;
+    err = ESP_OK;
+  }
+  portEXIT_CRITICAL(&mux);
+  return err;
+}
+
+void elevation_add_estimate(double elevation) {
+  // a running mean that turns into an exponential average once it is full
+  portENTER_CRITICAL(&mux);
+  if (cache.estimates < MAX_ESTIMATES) ++cache.estimates;
+  cache.estimate += (elevation - cache.estimate) / cache.estimates;
+
+  // the first estimates are noisy, so keep the previous elevation until then
+  const bool trusted = cache.estimates >= MIN_ESTIMATES;
+  if (trusted) {
+    cache.elevation = cache.estimate;
+    cache.source = ELEVATION_PRESSURE;
+  }
+  portEXIT_CRITICAL(&mux);
+  if (!trusted) return;
+
+  updated = true;
+  if (++unsaved_estimates >= SAVE_EVERY) {
+    save_cache();
+    unsaved_estimates = 0;
+  }
+}
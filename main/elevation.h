@@ -0,0 +1,16 @@
+#pragma once
+#include "esp_system.h"
+
+typedef enum {
+  ELEVATION_DEFAULT,   // CONFIG_DEFAULT_ELEVATION_METERS.
+  ELEVATION_LOOKUP,    // Looked up from the location of our public address.
+  ELEVATION_PRESSURE,  // Averaged from pressure against a reference.
+} elevation_source_t;
+
+double elevation_start();
+
+bool elevation_take_update(double *elevation);
+
+esp_err_t elevation_get_reference(double *sea_level_pressure);
+
+void elevation_add_estimate(double elevation);
@@ -0,0 +1,204 @@
+#include "forecast.h"
+
+#include <math.h>
+
+#include "esp_attr.h"
+#include "timestamp.h"
+
+#define SHORT_WIDTH 10  // Minutes each bucket of the 3 hour history covers.
+#define LONG_WIDTH 60   // Minutes each bucket of the 24 hour history covers.
+#define MIN_SHORT_BUCKETS 6  // Buckets needed before fitting 3 hours.
+#define MIN_LONG_BUCKETS 6   // Buckets needed before fitting 24 hours.
+#define STEADY_HPA 1.6  // Change over 3 hours within which the pressure is
+                        // steady (hPa).
+#define STORM_FALL_3H 6.0    // Fall over 3 hours that means a storm (hPa).
+#define STORM_FALL_24H 24.0  // Fall over 24 hours that means a storm (hPa).
+#define LOW_PRESSURE 1000.0  // Pressure below which a smaller fall means a
+                             // storm (hPa).
+#define LOW_FALL_3H 3.5      // Fall over 3 hours that means a storm when the
+                             // pressure is low (hPa).
+
+typedef struct {
+  uint32_t minutes;  // Middle of the bucket (minutes).
+  int32_t pressure;  // Mean sea level pressure over the bucket (Pa).
+} bucket_t;
+
+// Samples are averaged into buckets, and finished buckets go into a ring with
+// sliding sums for a least-squares fit of pressure against time, so adding a
+// sample costs the same however long the history is. Times are in minutes and
+// pressures in whole pascals so the sums stay exact in 64 bits.
+typedef struct {
+  bucket_t buckets[FORECAST_LONG_BUCKETS];
+  uint16_t length;  // Buckets the ring holds.
+  uint16_t width;   // Minutes each bucket covers.
+  uint16_t head;    // Next slot to write.
+  uint16_t count;   // Number of buckets in the ring.
+  struct {
+    int64_t t;
+    int64_t tt;
+    int64_t p;
+    int64_t tp;
+  } sums;
+  uint32_t open_start;  // Start of the bucket being filled (minutes).
+  double open_sum;      // Sum of the samples in the bucket being filled (Pa).
+  uint32_t open_samples;
+} history_t;
+
+// The histories are kept in RTC memory so that they survive deep sleep.
+static RTC_DATA_ATTR history_t short_history = {
+    .length = FORECAST_SHORT_BUCKETS, .width = SHORT_WIDTH};
+static RTC_DATA_ATTR history_t long_history = {
+    .length = FORECAST_LONG_BUCKETS, .width = LONG_WIDTH};
+static RTC_DATA_ATTR double last_pressure = NAN;  // Last sample added (Pa).
+
+// Negretti and Zambra's forecasts, numbered as in the usual formulas: 1 to 9
+// while falling, 10 to 19 while steady and 20 to 32 while rising.
+static const char *forecasts[32] = {
+    "Settled fine",
+    "Fine weather",
+    "Fine, becoming less settled",
+    "Fairly fine, showery later",
+    "Showery, becoming more unsettled",
+    "Unsettled, rain later",
+    "Rain at times, worse later",
+    "Rain at times, becoming very unsettled",
+    "Very unsettled, rain",
+    "Settled fine",
+    "Fine weather",
+    "Fine, possibly showers",
+    "Fairly fine, showers likely",
+    "Showery, bright intervals",
+    "Changeable, some rain",
+    "Unsettled, rain at times",
+    "Rain at frequent intervals",
+    "Very unsettled, rain",
+    "Stormy, much rain",
+    "Settled fine",
+    "Fine weather",
+    "Becoming fine",
+    "Fairly fine, improving",
+    "Fairly fine, possibly showers early",
+    "Showery early, improving",
+    "Changeable, mending",
+    "Rather unsettled, clearing later",
+    "Unsettled, probably improving",
+    "Unsettled, short fine intervals",
+    "Very unsettled, finer at times",
+    "Stormy, possibly improving",
+    "Stormy, much rain"};
+
+static void accumulate(history_t *history, const bucket_t *bucket, int sign) {
+  const int64_t t = bucket->minutes;
+  history->sums.t += sign * t;
+  history->sums.tt += sign * t * t;
+  history->sums.p += sign * (int64_t)bucket->pressure;
+  history->sums.tp += sign * t * bucket->pressure;
+}
+
+static const bucket_t *get_oldest(const history_t *history) {
+  return &history->buckets[(history->head + history->length - history->count) %
+                           history->length];
+}
+
+static void drop_oldest(history_t *history) {
+  accumulate(history, get_oldest(history), -1);
+  --history->count;
+}
+
+static void close_bucket(history_t *history) {
+  const bucket_t bucket = {
+      .minutes = history->open_start + history->width / 2,
+      .pressure = lround(history->open_sum / history->open_samples)};
+  history->open_sum = 0;
+  history->open_samples = 0;
+
+  // buckets from before a gap in the samples fall out of the window too, so
+  // the fit never spans more than the history
+  const uint32_t span = history->length * history->width;
+  while (history->count > 0 &&
+         bucket.minutes - get_oldest(history)->minutes >= span)
+    drop_oldest(history);
+  if (history->count == history->length) drop_oldest(history);
+
+  history->buckets[history->head] = bucket;
+  accumulate(history, &bucket, 1);
+  history->head = (history->head + 1) % history->length;
+  ++history->count;
+}
+
+static void add_sample(history_t *history, uint32_t minutes, double pressure) {
+  // buckets are aligned to their width, and one is closed by the first sample
+  // after it
+  if (history->open_samples > 0 &&
+      minutes >= history->open_start + history->width)
+    close_bucket(history);
+  if (history->open_samples == 0)
+    history->open_start = minutes - minutes % history->width;
+  history->open_sum += pressure;
+  ++history->open_samples;
+}
+
+static esp_err_t get_change(const history_t *history, uint16_t min_buckets,
+                            float *change) {
+  // slope = (n * sum(tp) - sum(t) * sum(p)) / (n * sum(tt) - sum(t)^2)
+  if (history->count < min_buckets) return ESP_ERR_INVALID_STATE;
+  const int64_t n = history->count;
+  const int64_t den = n * history->sums.tt - history->sums.t * history->sums.t;
+  if (den <= 0) return ESP_ERR_INVALID_STATE;
+  const int64_t num =
+      n * history->sums.tp - history->sums.t * history->sums.p;
+
+  // the change over the whole history, in hPa
+  const uint32_t span = history->length * history->width;
+  *change = (double)num / den * span / 100;
+  return ESP_OK;
+}
+
+static uint8_t get_zambretti(double hpa, float change_3h) {
+  // the formulas give a number for each trend, which is kept within the
+  // numbers of that trend for pressures outside the usual range
+  int code, min, max;
+  if (change_3h <= -STEADY_HPA) {
+    code = lround(127 - 0.12 * hpa);
+    min = 1;
+    max = 9;
+  } else if (change_3h >= STEADY_HPA) {
+    code = lround(185 - 0.16 * hpa);
+    min = 20;
+    max = 32;
+  } else {
+    code = lround(144 - 0.13 * hpa);
+    min = 10;
+    max = 19;
+  }
+  return code < min ? min : code > max ? max : code;
+}
+
+void forecast_add(double sea_level_pressure) {
+  if (isnan(sea_level_pressure)) return;
+
+  // timestamps keep running through deep sleep and never jump, unlike
+  // esp_timer and the system time
+  const uint32_t minutes = timestamp_now() / (60 * 1000000LL);
+  add_sample(&short_history, minutes, sea_level_pressure);
+  add_sample(&long_history, minutes, sea_level_pressure);
+  last_pressure = sea_level_pressure;
+}
+
+esp_err_t forecast_get(forecast_t *forecast) {
+  esp_err_t err =
+      get_change(&short_history, MIN_SHORT_BUCKETS, &forecast->change_3h);
+  if (err) return err;
+  if (get_change(&long_history, MIN_LONG_BUCKETS, &forecast->change_24h))
+    forecast->change_24h = NAN;
+
+  const double hpa = last_pressure / 100;
+  forecast->code = get_zambretti(hpa, forecast->change_3h);
+  forecast->text = forecasts[forecast->code - 1];
+
+  // a fast fall means a storm, and a low pressure takes less of one
+  forecast->storm = forecast->change_3h <= -STORM_FALL_3H ||
+                    forecast->change_24h <= -STORM_FALL_24H ||
+                    (hpa < LOW_PRESSURE && forecast->change_3h <= -LOW_FALL_3H);
+  return ESP_OK;
+}
@@ -0,0 +1,19 @@
+#pragma once
+#include "esp_system.h"
+
+#define FORECAST_SHORT_BUCKETS 18  // Buckets in the 3 hour history.
+#define FORECAST_LONG_BUCKETS 24   // Buckets in the 24 hour history.
+
+typedef struct {
+  float change_3h;   // Fitted change in pressure over 3 hours (hPa).
+  float change_24h;  // Fitted change in pressure over 24 hours (hPa), or NAN
+                     // until there is enough history.
+  uint8_t code;      // Zambretti forecast number, from 1 to 32.
+  const char *text;  // Zambretti forecast.
+  bool storm;        // Whether the pressure is falling fast enough for a
+                     // storm.
+} forecast_t;
+
+void forecast_add(double sea_level_pressure);
+
+esp_err_t forecast_get(forecast_t *forecast);
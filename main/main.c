@@ -1,17 +1,109 @@
-#include <sys/time.h>
+#include <stddef.h>
+#include <string.h>
 
-#include "cJSON.h"
+#include "arena.h"
+#include "backlog.h"
+#include "backlog_replay.h"
+#include "deep_sleep.h"
+#include "esp_attr.h"
 #include "esp_event.h"
+#include "esp_heap_caps.h"
 #include "esp_log.h"
 #include "esp_system.h"
 #include "esp_timer.h"
+#include "json_writer.h"
 #include "nvs_flash.h"
+#include "payload.h"
+#include "power.h"
+#include "scheduler.h"
 #include "sensor_mgmt.h"
+#include "timestamp.h"
 #include "wireless.h"
 
+#define JSON_BOOT_KEY "boot_ms"
+#define JSON_WARM_BOOT_KEY "warm"
+#define JSON_TIME_KEY "time"
+#define JSON_POWER_KEY "pm_lock_ms"
+#define JSON_POWER_PERIOD_KEY "period"
+#define JSON_CONNECT_KEY "connect"
+#define JSON_CONNECT_BUCKETS_KEY "buckets"
+#define JSON_CONNECT_FAST_KEY "fast"
+#define JSON_CONNECT_FALLBACKS_KEY "fallbacks"
+#define JSON_CONNECT_LAST_KEY "last_ms"
+#define JSON_BACKLOG_KEY "backlog"
+#define JSON_BACKLOG_COUNT_KEY "count"
+#define JSON_BACKLOG_DROPPED_KEY "dropped"
+#define JSON_MQTT_KEY "mqtt"
+#define JSON_MQTT_PUBLISHED_KEY "published"
+#define JSON_MQTT_BYTES_KEY "bytes"
+#define JSON_MQTT_MERGED_KEY "merged"
+#define JSON_MQTT_RTT_KEY "rtt_ms"
+#define JSON_MQTT_RTT_LAST_KEY "last"
+#define JSON_MQTT_RTT_MEAN_KEY "mean"
+#define JSON_MQTT_RTT_MAX_KEY "max"
+#define JSON_MQTT_OUTBOX_KEY "outbox"
+#define JSON_MQTT_OUTBOX_MAX_KEY "outbox_max"
+#define JSON_MEMORY_KEY "memory"
+#define JSON_MEMORY_ARENA_KEY "arena"
+#define JSON_MEMORY_LATE_KEY "late"
+#define JSON_MEMORY_STACKS_KEY "stack_free"
+#define JSON_MEMORY_MAIN_KEY "main"
+#define JSON_MEMORY_HEAP_KEY "heap_free"
+#define JSON_MEMORY_HEAP_MIN_KEY "heap_min"
+#define JSON_MEMORY_ALLOCATIONS_KEY "report_allocations"
+
+#define JSON_MESSAGE_SIZE 1024  // Space for a json message.
+
+typedef enum {
+  BOOT_NVS,       // Non-volatile storage is ready.
+  BOOT_SENSORS,   // Sensors have been initialized or resumed.
+  BOOT_WIRELESS,  // Wireless has started connecting.
+  BOOT_SAMPLE,    // The first measurement of this boot has finished.
+  BOOT_TIME,      // The time has been synchronized.
+  BOOT_PUBLISH,   // The first data of this boot has been published.
+  BOOT_STAGE_MAX
+} boot_stage_t;
+
 static const char *TAG = "main";
+static const char *boot_stage_names[BOOT_STAGE_MAX] = {
+    [BOOT_NVS] = "nvs",
+    [BOOT_SENSORS] = "sensors",
+    [BOOT_WIRELESS] = "wireless",
+    [BOOT_SAMPLE] = "sample",
+    [BOOT_TIME] = "time",
+    [BOOT_PUBLISH] = "publish"};
+
+static int64_t boot_times[BOOT_STAGE_MAX];  // Time each stage finished (us).
+static uint32_t connects_reported = 0;  // Connections in the last report.
+static bool warm_boot = false;
+static char message[JSON_MESSAGE_SIZE];  // Json messages are written here,
+                                        // one at a time.
+static payload_t payload;  // The data of the current report as a payload.
+
+// Kept in RTC memory so that they survive deep sleep.
+static RTC_DATA_ATTR bool aligned = false;  // Whether publishes are aligned
+                                            // to the wall clock.
+
+static void schedule();
+static void report();
+
+static void time_synced(const struct timeval *tv) {
+  timestamp_sync(tv);
+  if (boot_times[BOOT_TIME] == 0) boot_times[BOOT_TIME] = esp_timer_get_time();
+}
+
+static void mqtt_connected() {
+  // only discovery that changed since it was last published goes out
+  sensors_publish_discovery(false);
+}
 
-void timer_callback(void *args);
+static void discovery_status(const char *data, int data_len) {
+  // home assistant may have lost discovery when it restarts, so it all goes
+  // out again
+  static const char online[] = "online";
+  if (data_len == sizeof(online) - 1 && memcmp(data, online, data_len) == 0)
+    sensors_publish_discovery(true);
+}
 
 void app_main(void) {
   esp_event_loop_create_default();
@@ -24,54 +116,291 @@ void app_main(void) {
     nvs_flash_erase();
     if (nvs_flash_init() != ESP_OK) esp_restart();
   }
+  boot_times[BOOT_NVS] = esp_timer_get_time();
+  backlog_init();
 
-  // start wireless (blocks) and sensors
+  // scale the cpu frequency and light sleep whenever no lock is held
+  power_init();
+
+  timestamp_init();
+#ifdef USE_DEEP_SLEEP
+  // restore the schedule if we woke from deep sleep
+  deep_sleep_init();
+  warm_boot = deep_sleep_is_warm_boot();
+#endif  // USE_DEEP_SLEEP
+
+  // start sensors right away, the network and time may be a long time coming
+  sensors_start(warm_boot);
+  boot_times[BOOT_SENSORS] = esp_timer_get_time();
+  wireless_set_time_handler(time_synced);
+  mqtt_set_connected_handler(mqtt_connected);
+  mqtt_subscribe(DISCOVERY_STATUS_TOPIC, 1, discovery_status);
   wireless_start(CONFIG_MQTT_BROKER_URI);
-  sensors_start();
+  boot_times[BOOT_WIRELESS] = esp_timer_get_time();
+
+  // everything long-lived has its memory by now
+  arena_seal();
+  if (!warm_boot) {
+    aligned = false;
+    schedule();
+  }
+
+  // sleep until the earliest deadline, run everything that is due, repeat
+  while (true) {
+    // move publishing onto the wall clock once it is known
+    if (!aligned && timestamp_is_synced()) {
+      scheduler_clear();
+      schedule();
+    }
+
+    const int64_t wait = scheduler_next_due() - esp_timer_get_time();
+    if (wait > 0) vTaskDelay(wait / 1000 / portTICK_PERIOD_MS + 1);
+    scheduler_run(esp_timer_get_time());
+    report();
+
+#ifdef USE_DEEP_SLEEP
+    // doesn't return unless the next event is too close to sleep through
+    deep_sleep_until(scheduler_next_due());
+#endif  // USE_DEEP_SLEEP
+  }
+}
+
+static void schedule() {
+  const int64_t period = PUBLISH_PERIOD_MS * 1000LL;
+  const int64_t warmup_time = sensors_get_warmup_time() * 1000LL;
+  const int64_t now = esp_timer_get_time();
+
+  // publish as soon as sensors are warm until the time is known, then align
+  // publishing to the wall clock, leaving time for sensors to warm up
+  int64_t first_publish = now + warmup_time;
+  time_t time;
+  aligned = timestamp_to_time(timestamp_now(), &time) == ESP_OK;
+  if (aligned) {
+    first_publish = now + period - time * 1000000LL % period;
+    if (first_publish - now < warmup_time) first_publish += period;
+  }
+
+#ifdef USE_DEEP_SLEEP
+  sensors_schedule(first_publish, false);  // no sampling while asleep
+#else
+  sensors_schedule(first_publish, true);
+#endif  // USE_DEEP_SLEEP
+}
+
+static esp_err_t publish_json(const char *topic, json_writer_t *json) {
+  esp_err_t err = json_writer_finish(json);
+  if (err) {
+    ESP_LOGW(TAG, "unable to write json for %s", topic);
+    return err;
+  }
+  return mqtt_publish_class(MQTT_STATE, topic, json->buf, json->len);
+}
 
-  // configure and create a periodic timer
-  esp_timer_init();
-  const esp_timer_create_args_t timer_args = {.callback = timer_callback};
-  esp_timer_handle_t main_timer;
-  esp_timer_create(&timer_args, &main_timer);
+static void add_boot_times(json_writer_t *json) {
+  // stages that haven't been reached yet are left out
+  const int64_t first_sample = sensors_get_first_sample_time();
+  if (first_sample >= 0) boot_times[BOOT_SAMPLE] = first_sample;
+  json_begin_object(json, JSON_BOOT_KEY);
+  for (int i = 0; i < BOOT_STAGE_MAX; ++i)
+    if (boot_times[i] > 0)
+      json_add_int(json, boot_stage_names[i], boot_times[i] / 1000);
+  json_add_bool(json, JSON_WARM_BOOT_KEY, warm_boot);
+  json_end_object(json);
+}
+
+static void add_power_stats(json_writer_t *json) {
+  // report how long each lock kept the chip awake since the last report
+  power_lock_stats_t stats[POWER_MAX_LOCKS];
+  int64_t period;
+  const size_t num_stats = power_take_stats(stats, POWER_MAX_LOCKS, &period);
+  json_begin_object(json, JSON_POWER_KEY);
+  for (size_t i = 0; i < num_stats; ++i)
+    json_add_int(json, stats[i].name, stats[i].held_time / 1000);
+  json_add_int(json, JSON_POWER_PERIOD_KEY, period / 1000);
+  json_end_object(json);
+}
+
+static void add_connect_stats(json_writer_t *json) {
+  // only report the latency histogram when there was a new connection
+  wireless_connect_stats_t stats;
+  if (wireless_get_connect_stats(&stats) != ESP_OK) return;
+  uint32_t connects = 0;
+  for (int i = 0; i < WIRELESS_CONNECT_BUCKETS; ++i)
+    connects += stats.buckets[i];
+  if (connects == connects_reported) return;
+  connects_reported = connects;
+
+  json_begin_object(json, JSON_CONNECT_KEY);
+  json_begin_array(json, JSON_CONNECT_BUCKETS_KEY);
+  for (int i = 0; i < WIRELESS_CONNECT_BUCKETS; ++i)
+    json_add_int(json, NULL, stats.buckets[i]);
+  json_end_array(json);
+  json_add_int(json, JSON_CONNECT_FAST_KEY, stats.fast_connects);
+  json_add_int(json, JSON_CONNECT_FALLBACKS_KEY, stats.fallbacks);
+  json_add_int(json, JSON_CONNECT_LAST_KEY, stats.last_latency);
+  json_end_object(json);
+}
+
+static esp_err_t publish_data(const char *message) {
+#ifdef CONFIG_PAYLOAD_BINARY_DATA
+  // the binary payload is a copy for consumers that don't need json
+  mqtt_publish_class(MQTT_TELEMETRY, MQTT_DATA_BINARY_STATE_TOPIC, &payload,
+                     sizeof(payload));
+#endif  // CONFIG_PAYLOAD_BINARY_DATA
+  return mqtt_publish_class(MQTT_TELEMETRY, MQTT_DATA_STATE_TOPIC, message,
+                            strlen(message));
+}
+
+static void backlog_data(const char *message, int64_t stamp, bool timed) {
+#ifdef CONFIG_PAYLOAD_BINARY_BACKLOG
+  backlog_replay_keep(&payload, sizeof(payload), stamp, timed);
+#else
+  if (message != NULL)
+    backlog_replay_keep(message, strlen(message), stamp, timed);
+#endif  // CONFIG_PAYLOAD_BINARY_BACKLOG
+}
+
+static esp_err_t publish_record(void *data, size_t size, time_t time) {
+#ifdef CONFIG_PAYLOAD_BINARY_BACKLOG
+  if (size != sizeof(payload_t)) return ESP_ERR_INVALID_SIZE;
+  if (time != 0) ((payload_t *)data)->time = time;
+  return mqtt_publish_class(MQTT_BACKLOG, MQTT_BACKLOG_STATE_TOPIC, data,
+                            size);
+#else
+  if (size >= sizeof(message)) return ESP_ERR_INVALID_SIZE;
+  memcpy(message, data, size);
+  message[size] = 0;
+
+  // data that was kept before the time was known gets its time now
+  if (time != 0) {
+    json_writer_t json;
+    if (json_writer_reopen(&json, message, sizeof(message)))
+      return ESP_ERR_INVALID_SIZE;
+    json_add_int(&json, JSON_TIME_KEY, time);
+    if (json_writer_finish(&json)) return ESP_ERR_INVALID_SIZE;
+  }
+  return mqtt_publish_class(MQTT_BACKLOG, MQTT_BACKLOG_STATE_TOPIC, message,
+                            strlen(message));
+#endif  // CONFIG_PAYLOAD_BINARY_BACKLOG
+}
 
-  // wait for the wakeup time
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-  time_t ms_to_wakeup =
-      (300 - tv.tv_sec % 300 - 1 - 32) * 1000 + (1000 - (tv.tv_usec / 1000));
-  if (ms_to_wakeup < 10) ms_to_wakeup += 5 * 60 * 1000;
-  vTaskDelay(ms_to_wakeup / portTICK_PERIOD_MS);
+static void add_backlog_stats(json_writer_t *json) {
+  json_begin_object(json, JSON_BACKLOG_KEY);
+  json_add_int(json, JSON_BACKLOG_COUNT_KEY, backlog_count());
+  json_add_int(json, JSON_BACKLOG_DROPPED_KEY, backlog_dropped());
+  json_end_object(json);
+}
+
+static void add_mqtt_stats(json_writer_t *json) {
+  // counts are since the last report, round trips only when there were any
+  mqtt_stats_t stats;
+  mqtt_take_stats(&stats);
+  json_begin_object(json, JSON_MQTT_KEY);
+  json_add_int(json, JSON_MQTT_PUBLISHED_KEY, stats.published);
+  json_add_int(json, JSON_MQTT_BYTES_KEY, stats.bytes);
+  json_add_int(json, JSON_MQTT_MERGED_KEY, stats.merged);
+  if (stats.acked > 0) {
+    json_begin_object(json, JSON_MQTT_RTT_KEY);
+    json_add_int(json, JSON_MQTT_RTT_LAST_KEY, stats.rtt_last);
+    json_add_int(json, JSON_MQTT_RTT_MEAN_KEY, stats.rtt_total / stats.acked);
+    json_add_int(json, JSON_MQTT_RTT_MAX_KEY, stats.rtt_max);
+    json_end_object(json);
+  }
+  json_add_int(json, JSON_MQTT_OUTBOX_KEY, stats.outbox);
+  json_add_int(json, JSON_MQTT_OUTBOX_MAX_KEY, stats.outbox_max);
+  json_end_object(json);
+}
 
-  // start the periodic timer and call the callback
-  esp_timer_start_periodic(main_timer, 5 * 60 * 1000 * 1000);  // 5 minutes
-  timer_callback(NULL);
+static void add_memory_stats(json_writer_t *json) {
+  // what each subsystem carved out of the arena, how close each task came to
+  // the end of its stack, what is left of the heap and, if counted, how often
+  // this report went to it
+  arena_usage_t usage[ARENA_MAX_OWNERS];
+  arena_task_t tasks[ARENA_MAX_TASKS];
+  const size_t num_owners = arena_get_usage(usage, ARENA_MAX_OWNERS);
+  const size_t num_tasks = arena_get_tasks(tasks, ARENA_MAX_TASKS);
+  json_begin_object(json, JSON_MEMORY_KEY);
+  json_begin_object(json, JSON_MEMORY_ARENA_KEY);
+  for (size_t i = 0; i < num_owners; ++i)
+    json_add_int(json, usage[i].owner, usage[i].size);
+  json_end_object(json);
+  json_add_int(json, JSON_MEMORY_LATE_KEY, arena_get_late());
+  json_begin_object(json, JSON_MEMORY_STACKS_KEY);
+  for (size_t i = 0; i < num_tasks; ++i)
+    json_add_int(json, tasks[i].name, tasks[i].stack_free);
+  json_add_int(json, JSON_MEMORY_MAIN_KEY, uxTaskGetStackHighWaterMark(NULL));
+  json_end_object(json);
+  json_add_int(json, JSON_MEMORY_HEAP_KEY,
+               heap_caps_get_free_size(MALLOC_CAP_8BIT));
+  json_add_int(json, JSON_MEMORY_HEAP_MIN_KEY,
+               heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT));
+#ifdef CONFIG_ARENA_COUNT_ALLOCATIONS
+  json_add_int(json, JSON_MEMORY_ALLOCATIONS_KEY, arena_get_allocations());
+#endif
+  json_end_object(json);
 }
 
-void timer_callback(void *args) {
-  TickType_t wake_tick = xTaskGetTickCount();
+static void report() {
+  json_writer_t json;
+  arena_count_allocations();
 
   // wake up sensors and report results
-  cJSON *json = cJSON_CreateObject();
-  sensors_wakeup(json);
-  mqtt_publish_json(MQTT_CONFIG_STATE_TOPIC, json, 2, false);
-  cJSON_Delete(json);
-  ESP_LOGI(TAG, "woke up");
-
-  // wait 32 seconds
-  vTaskDelayUntil(&wake_tick, (32 * 1000) / portTICK_PERIOD_MS);
-
-  // get data and report results
-  json = cJSON_CreateObject();
-  sensors_get_data(json);
-  mqtt_publish_json(MQTT_DATA_STATE_TOPIC, json, 2, false);
-  cJSON_Delete(json);
+  const uint32_t wakeups = sensors_take_wakeups();
+  if (wakeups) {
+    json_writer_init(&json, message, sizeof(message));
+    sensors_wakeup(&json, wakeups);
+    publish_json(MQTT_CONFIG_STATE_TOPIC, &json);
+    ESP_LOGI(TAG, "woke up");
+  }
+
+  const uint32_t publishes = sensors_take_publishes();
+  if (!publishes) return;
+
+  // get data, filling in the binary payload as the json is written
+  json_writer_init(&json, message, sizeof(message));
+  payload_init(&payload, 0);
+  json_writer_set_number_hook(&json, payload_add_hook, &payload);
+  sensors_get_data(&json, publishes);
+
+  // the time is left out until it is known
+  const int64_t stamp = timestamp_now();
+  time_t time;
+  const bool timed = timestamp_to_time(stamp, &time) == ESP_OK;
+  if (timed) {
+    json_add_int(&json, JSON_TIME_KEY, time);
+    payload.time = time;
+  }
+
+  // report results, keeping them for later if we are offline
+  const bool written = json_writer_finish(&json) == ESP_OK;
+  if (!written) ESP_LOGW(TAG, "unable to write data json");
+  if (!written || publish_data(message))
+    backlog_data(written ? message : NULL, stamp, timed);
   ESP_LOGI(TAG, "got data");
 
+  // then catch up on data that couldn't be published before
+  backlog_replay(publish_record);
+  sensors_drain();
+
   // put sensors to sleep and report results
-  json = cJSON_CreateObject();
-  sensors_sleep(json);
-  mqtt_publish_json(MQTT_CONFIG_STATE_TOPIC, json, 2, false);
-  cJSON_Delete(json);
+  json_writer_init(&json, message, sizeof(message));
+  sensors_sleep(&json, publishes);
+  if (boot_times[BOOT_PUBLISH] == 0) {
+    // report how long it took from boot to the first sample and publish
+    boot_times[BOOT_PUBLISH] = esp_timer_get_time();
+    add_boot_times(&json);
+    ESP_LOGI(TAG, "first sample %dms after boot",
+             (int)(boot_times[BOOT_SAMPLE] / 1000));
+  }
+  add_power_stats(&json);
+  add_connect_stats(&json);
+  add_backlog_stats(&json);
+  add_mqtt_stats(&json);
+  publish_json(MQTT_CONFIG_STATE_TOPIC, &json);
+
+  // the memory report has a message of its own, there isn't room left
+  json_writer_init(&json, message, sizeof(message));
+  add_memory_stats(&json);
+  publish_json(MQTT_CONFIG_STATE_TOPIC, &json);
   ESP_LOGI(TAG, "went to sleep");
-}
\ No newline at end of file
+}
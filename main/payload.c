@@ -0,0 +1,50 @@
+#include "payload.h"
+
+#include <math.h>
+#include <string.h>
+
+// The json keys of each field, which must match the sensor adapters.
+static const char *keys[PAYLOAD_FIELD_MAX] = {
+    [PAYLOAD_TEMPERATURE] = "temperature",
+    [PAYLOAD_HUMIDITY] = "humidity",
+    [PAYLOAD_PRESSURE] = "pressure",
+    [PAYLOAD_DEW_POINT] = "dew_point",
+    [PAYLOAD_BATTERY] = "battery",
+    [PAYLOAD_BATTERY_VOLTAGE] = "battery_voltage",
+    [PAYLOAD_BATTERY_RATE] = "battery_rate",
+    [PAYLOAD_BATTERY_TIME_TO_EMPTY] = "battery_time_to_empty",
+    [PAYLOAD_SIGNAL_STRENGTH] = "signal_strength",
+    [PAYLOAD_PM1] = "pm1",
+    [PAYLOAD_PM2_5] = "pm2_5",
+    [PAYLOAD_PM10] = "pm10",
+    [PAYLOAD_AVG_NOISE] = "avg_noise",
+    [PAYLOAD_MIN_NOISE] = "min_noise",
+    [PAYLOAD_MAX_NOISE] = "max_noise",
+    [PAYLOAD_LMAX_NOISE] = "lmax_noise",
+    [PAYLOAD_LMIN_NOISE] = "lmin_noise"};
+
+void payload_init(payload_t *payload, time_t time) {
+  memset(payload, 0, sizeof(*payload));
+  payload->version = PAYLOAD_VERSION;
+  payload->size = sizeof(*payload);
+  payload->time = time;
+}
+
+esp_err_t payload_add(payload_t *payload, const char *key, double value) {
+  for (int i = 0; i < PAYLOAD_FIELD_MAX; ++i) {
+    if (strcmp(keys[i], key) != 0) continue;
+    // values that don't fit are left out rather than wrapped
+    const double hundredths = round(value * 100);
+    if (!isfinite(hundredths) || fabs(hundredths) > INT32_MAX)
+      return ESP_ERR_INVALID_ARG;
+    payload->values[i] = hundredths;
+    payload->fields |= BIT(i);
+    return ESP_OK;
+  }
+  return ESP_ERR_NOT_FOUND;
+}
+
+void payload_add_hook(void *payload, const char *key, double value) {
+  // fields that aren't in the payload are ignored
+  payload_add(payload, key, value);
+}
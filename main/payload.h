@@ -0,0 +1,46 @@
+#pragma once
+#include "esp_system.h"
+
+#define PAYLOAD_VERSION 2  // Bumped whenever the layout of payload_t changes.
+
+typedef enum {
+  PAYLOAD_TEMPERATURE,
+  PAYLOAD_HUMIDITY,
+  PAYLOAD_PRESSURE,
+  PAYLOAD_DEW_POINT,
+  PAYLOAD_BATTERY,
+  PAYLOAD_BATTERY_VOLTAGE,
+  PAYLOAD_BATTERY_RATE,
+  PAYLOAD_BATTERY_TIME_TO_EMPTY,
+  PAYLOAD_SIGNAL_STRENGTH,
+  PAYLOAD_PM1,
+  PAYLOAD_PM2_5,
+  PAYLOAD_PM10,
+  PAYLOAD_AVG_NOISE,
+  PAYLOAD_MIN_NOISE,
+  PAYLOAD_MAX_NOISE,
+  PAYLOAD_LMAX_NOISE,
+  PAYLOAD_LMIN_NOISE,
+  PAYLOAD_FIELD_MAX
+} payload_field_t;
+
+// A compact alternative to the json data. The layout is fixed and
+// little-endian, like the ESP32 itself, so it is sent just as it is in
+// memory.
+typedef struct __attribute__((packed)) {
+  uint8_t version;   // PAYLOAD_VERSION.
+  uint8_t reserved;  // Always zero.
+  uint16_t size;     // Size of the payload (bytes).
+  uint32_t time;     // When the data was measured (s since the epoch), or 0
+                     // if the time isn't known.
+  uint32_t fields;   // Bit mask of the values that are present.
+  int32_t values[PAYLOAD_FIELD_MAX];  // Values in hundredths of the units
+                                      // used in the json, indexed by
+                                      // payload_field_t.
+} payload_t;
+
+void payload_init(payload_t *payload, time_t time);
+
+esp_err_t payload_add(payload_t *payload, const char *key, double value);
+
+void payload_add_hook(void *payload, const char *key, double value);
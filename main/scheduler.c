@@ -0,0 +1,106 @@
+#include "scheduler.h"
+
+#ifdef ESP_PLATFORM
+#include "esp_attr.h"
+#endif  // ESP_PLATFORM
+#ifndef RTC_DATA_ATTR
+#define RTC_DATA_ATTR  // host builds keep the schedule in ordinary memory
+#endif  // RTC_DATA_ATTR
+
+/** A deadline scheduler backed by a binary min-heap ordered by due time.
+ *  Times are plain microsecond counts so that the scheduler can be driven by
+ *  esp_timer_get_time() on the device or by a virtual clock. The heap lives in
+ *  RTC memory so the schedule survives deep sleep; see scheduler_shift().
+ */
+
+typedef struct {
+  int64_t due;     // Time at which the event is due (us).
+  int64_t period;  // Time between repeats (us), or 0 for a one-shot event.
+  uint32_t seq;    // Insertion order, breaks ties between equal due times.
+  scheduler_callback_t callback;
+  void *arg;
+} event_t;
+
+static RTC_DATA_ATTR event_t heap[SCHEDULER_MAX_EVENTS];
+static RTC_DATA_ATTR size_t heap_size = 0;
+static RTC_DATA_ATTR uint32_t next_seq = 0;
+
+static bool before(const event_t *a, const event_t *b) {
+  return a->due < b->due ||
+         (a->due == b->due && (int32_t)(a->seq - b->seq) < 0);
+}
+
+static void swap(size_t a, size_t b) {
+  const event_t tmp = heap[a];
+  heap[a] = heap[b];
+  heap[b] = tmp;
+}
+
+static void sift_up(size_t i) {
+  while (i > 0 && before(&heap[i], &heap[(i - 1) / 2])) {
+    swap(i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+static void sift_down(size_t i) {
+  while (true) {
+    const size_t left = 2 * i + 1, right = left + 1;
+    size_t smallest = i;
+    if (left < heap_size && before(&heap[left], &heap[smallest]))
+      smallest = left;
+    if (right < heap_size && before(&heap[right], &heap[smallest]))
+      smallest = right;
+    if (smallest == i) return;
+    swap(i, smallest);
+    i = smallest;
+  }
+}
+
+static void push(event_t event) {
+  event.seq = next_seq++;
+  heap[heap_size] = event;
+  sift_up(heap_size++);
+}
+
+esp_err_t scheduler_add(int64_t due, int64_t period,
+                        scheduler_callback_t callback, void *arg) {
+  if (callback == NULL || period < 0) return ESP_ERR_INVALID_ARG;
+  if (heap_size == SCHEDULER_MAX_EVENTS) return ESP_ERR_NO_MEM;
+  push((event_t){
+      .due = due, .period = period, .callback = callback, .arg = arg});
+  return ESP_OK;
+}
+
+int64_t scheduler_next_due() { return heap_size ? heap[0].due : INT64_MAX; }
+
+int scheduler_run(int64_t now) {
+  int ran = 0;
+  while (heap_size > 0 && heap[0].due <= now) {
+    // pop the earliest event
+    event_t event = heap[0];
+    heap[0] = heap[--heap_size];
+    sift_down(0);
+
+    event.callback(event.arg, event.due);
+    ++ran;
+
+    if (event.period == 0) continue;
+
+    // reschedule, skipping any periods that were missed entirely
+    event.due += event.period;
+    if (event.due <= now)
+      event.due += ((now - event.due) / event.period + 1) * event.period;
+    push(event);
+  }
+  return ran;
+}
+
+void scheduler_shift(int64_t delta) {
+  // shifting every key by the same amount keeps the heap ordered
+  for (size_t i = 0; i < heap_size; ++i) heap[i].due += delta;
+}
+
+size_t scheduler_count() { return heap_size; }
+
+void scheduler_clear() { heap_size = 0; }
@@ -0,0 +1,19 @@
+#pragma once
+#include "esp_system.h"
+
+#define SCHEDULER_MAX_EVENTS 24  // Maximum number of scheduled events.
+
+typedef void (*scheduler_callback_t)(void *arg, int64_t due);
+
+esp_err_t scheduler_add(int64_t due, int64_t period,
+                        scheduler_callback_t callback, void *arg);
+
+int64_t scheduler_next_due();
+
+int scheduler_run(int64_t now);
+
+void scheduler_shift(int64_t delta);
+
+size_t scheduler_count();
+
+void scheduler_clear();
@@ -0,0 +1,325 @@
+#include <math.h>
+#include <string.h>
+
+#include "bme280.h"
+#include "elevation.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "forecast.h"
+#include "sensor_driver.h"
+
+#define JSON_TEMPERATURE_KEY "temperature"
+#define JSON_HUMIDITY_KEY "humidity"
+#define JSON_PRESSURE_KEY "pressure"
+#define JSON_DEW_POINT_KEY "dew_point"
+#define JSON_TEMPERATURE_MIN_KEY "temperature_min"
+#define JSON_TEMPERATURE_MAX_KEY "temperature_max"
+#define JSON_PRESSURE_MIN_KEY "pressure_min"
+#define JSON_PRESSURE_MAX_KEY "pressure_max"
+#define JSON_PRESSURE_TENDENCY_KEY "pressure_tendency"
+#define JSON_PRESSURE_CHANGE_KEY "pressure_change_3h"
+#define JSON_FORECAST_KEY "forecast"
+#define JSON_FORECAST_CODE_KEY "forecast_code"
+#define JSON_STORM_KEY "storm"
+#define JSON_STORM_ON_VALUE "on"
+#define JSON_STORM_OFF_VALUE "off"
+
+#define MIN_TENDENCY_SAMPLES 3  // Samples needed to fit a pressure tendency.
+#ifdef CONFIG_BME280_NORMAL_MODE
+#define SAMPLE_PERIOD CONFIG_BME280_SAMPLE_MS  // Time between samples (ms).
+#else
+#define SAMPLE_PERIOD (10 * 1000)  // Time between forced samples (ms).
+#endif  // CONFIG_BME280_NORMAL_MODE
+
+static const mqtt_discovery_t discovery[] = {
+    {.type = MQTT_SENSOR,
+     .device = DEFAULT_DEVICE,
+     .device_class = JSON_TEMPERATURE_KEY,
+     .force_update = true,
+     .name = "Temperature",
+     .state_topic = MQTT_DATA_STATE_TOPIC,
+     .unique_id = UNIQUE_ID(JSON_TEMPERATURE_KEY),
+     .sensor =
+         {
+             .unit_of_measurement = TEMPERATURE_SCALE,
+         },
+     .value_template = VALUE_TEMPLATE(JSON_TEMPERATURE_KEY)},
+    {.type = MQTT_SENSOR,
+     .device = DEFAULT_DEVICE,
+     .device_class = JSON_HUMIDITY_KEY,
+     .force_update = true,
+     .name = "Humidity",
+     .state_topic = MQTT_DATA_STATE_TOPIC,
+     .unique_id = UNIQUE_ID(JSON_HUMIDITY_KEY),
+     .sensor =
+         {
+             .unit_of_measurement = HUMIDITY_SCALE,
+         },
+     .value_template = VALUE_TEMPLATE(JSON_HUMIDITY_KEY)},
+    {.type = MQTT_SENSOR,
+     .device = DEFAULT_DEVICE,
+     .device_class = JSON_PRESSURE_KEY,
+     .force_update = true,
+     .name = "Pressure",
+     .state_topic = MQTT_DATA_STATE_TOPIC,
+     .unique_id = UNIQUE_ID(JSON_PRESSURE_KEY),
+     .sensor =
+         {
+             .unit_of_measurement = PRESSURE_SCALE,
+         },
+     .value_template = VALUE_TEMPLATE(JSON_PRESSURE_KEY)},
+    {.type = MQTT_SENSOR,
+     .device = DEFAULT_DEVICE,
+     .force_update = true,
+     .name = "Dew Point",
+     .state_topic = MQTT_DATA_STATE_TOPIC,
+     .unique_id = UNIQUE_ID(JSON_DEW_POINT_KEY),
+     .sensor =
+         {
+             .icon = "mdi:weather-fog",
+             .unit_of_measurement = TEMPERATURE_SCALE,
+         },
+     .value_template = VALUE_TEMPLATE(JSON_DEW_POINT_KEY)},
+    {.type = MQTT_SENSOR,
+     .device = DEFAULT_DEVICE,
+     .name = "Forecast",
+     .state_topic = MQTT_DATA_STATE_TOPIC,
+     .unique_id = UNIQUE_ID(JSON_FORECAST_KEY),
+     .sensor =
+         {
+             .icon = "mdi:crystal-ball",
+         },
+     .value_template = VALUE_TEMPLATE(JSON_FORECAST_KEY)},
+    {.type = MQTT_BINARY_SENSOR,
+     .device = DEFAULT_DEVICE,
+     .name = "Storm Risk",
+     .state_topic = MQTT_DATA_STATE_TOPIC,
+     .unique_id = UNIQUE_ID(JSON_STORM_KEY),
+     .binary_sensor =
+         {
+             .payload_on = JSON_STORM_ON_VALUE,
+             .payload_off = JSON_STORM_OFF_VALUE,
+         },
+     .value_template = VALUE_TEMPLATE(JSON_STORM_KEY)},
+#ifdef CONFIG_BME280_NORMAL_MODE
+    {.type = MQTT_SENSOR,
+     .device = DEFAULT_DEVICE,
+     .force_update = true,
+     .name = "Pressure Tendency",
+     .state_topic = MQTT_DATA_STATE_TOPIC,
+     .unique_id = UNIQUE_ID(JSON_PRESSURE_TENDENCY_KEY),
+     .sensor =
+         {
+             .icon = "mdi:chart-line-variant",
+             .unit_of_measurement = PRESSURE_SCALE "/h",
+         },
+     .value_template = VALUE_TEMPLATE(JSON_PRESSURE_TENDENCY_KEY)},
+#endif  // CONFIG_BME280_NORMAL_MODE
+};
+
+static const char *TAG = "bme280";
+
+typedef struct {
+  double sum;
+  double min;
+  double max;
+} stat_t;
+
+// Everything is updated as samples come in, so a window of any length costs
+// the same. The pressure tendency is a least squares fit of pressure against
+// time, with time in hours from the first sample so the sums keep their
+// precision.
+static struct {
+  stat_t temperature;
+  stat_t humidity;
+  stat_t pressure;
+  stat_t dew_point;
+  uint32_t count;
+  int64_t start;         // Time of the first sample (us).
+  double sum_t;          // Sum of the sample times (h).
+  double sum_tt;         // Sum of the squared sample times (h^2).
+  double sum_tp;         // Sum of the sample times by pressure.
+  double sum_sea_level;  // Sum of the sea level pressures (Pa), the reported
+                         // pressure may be in other units.
+} acc;  // Statistics of the samples taken since the last read.
+
+#ifndef CONFIG_BME280_NORMAL_MODE
+static esp_timer_handle_t ready_timer = NULL;  // Ends a forced conversion.
+static EventGroupHandle_t ready_events;  // Group to notify when it ends.
+static EventBits_t ready_bit;
+#endif  // CONFIG_BME280_NORMAL_MODE
+
+static void add_stat(stat_t *stat, double value, bool first) {
+  stat->sum += value;
+  if (first || value < stat->min) stat->min = value;
+  if (first || value > stat->max) stat->max = value;
+}
+
+static void accumulate(const bme280_data_t *data) {
+  const bool first = acc.count == 0;
+  const int64_t now = esp_timer_get_time();
+  if (first) acc.start = now;
+  add_stat(&acc.temperature, data->temperature, first);
+  add_stat(&acc.humidity, data->humidity, first);
+  add_stat(&acc.pressure, data->pressure, first);
+  add_stat(&acc.dew_point, data->dew_point, first);
+  const double t = (now - acc.start) / 3600e6;
+  acc.sum_t += t;
+  acc.sum_tt += t * t;
+  acc.sum_tp += t * data->pressure;
+  acc.sum_sea_level += data->sea_level_pressure;
+  ++acc.count;
+}
+
+#ifdef CONFIG_BME280_NORMAL_MODE
+static esp_err_t get_tendency(double *tendency) {
+  // the slope of the fit, in pressure per hour
+  const double n = acc.count;
+  const double denominator = n * acc.sum_tt - acc.sum_t * acc.sum_t;
+  if (acc.count < MIN_TENDENCY_SAMPLES || denominator <= 0)
+    return ESP_ERR_INVALID_STATE;
+  *tendency = (n * acc.sum_tp - acc.sum_t * acc.pressure.sum) / denominator;
+  return ESP_OK;
+}
+#endif  // CONFIG_BME280_NORMAL_MODE
+
+static void update_elevation(const bme280_data_t *data) {
+#ifdef CONFIG_ELEVATION_FROM_PRESSURE
+  // compare what we measured against a reference from the same time
+  double sea_level_pressure, estimate;
+  if (data != NULL && elevation_get_reference(&sea_level_pressure) == ESP_OK &&
+      bme280_estimate_elevation(data, sea_level_pressure, &estimate) == ESP_OK)
+    elevation_add_estimate(estimate);
+#endif  // CONFIG_ELEVATION_FROM_PRESSURE
+
+  // applied from here to avoid changing the elevation in the middle of a
+  // compensation
+  double elevation;
+  if (!elevation_take_update(&elevation)) return;
+  ESP_LOGI(TAG, "elevation changed to %.1fm", elevation);
+  bme280_set_elevation(round(elevation));
+}
+
+static esp_err_t init() {
+  esp_err_t err = bme280_reset();
+  if (err) return err;
+#ifdef CONFIG_BME280_NORMAL_MODE
+  const bme280_config_t bme_config =
+      BME280_CONTINUOUS(CONFIG_BME280_STANDBY, CONFIG_BME280_FILTER);
+#else
+  const bme280_config_t bme_config = BME280_WEATHER_MONITORING;
+#endif  // CONFIG_BME280_NORMAL_MODE
+  err = bme280_set_config(&bme_config);
+  if (err) return err;
+
+  // measure with the cached elevation while it is being looked up
+  bme280_set_elevation(round(elevation_start()));
+  return ESP_OK;
+}
+
+static esp_err_t resume() {
+  esp_err_t err = bme280_resume();
+  if (err) return err;
+  bme280_set_elevation(round(elevation_start()));
+  return ESP_OK;
+}
+
+#ifndef CONFIG_BME280_NORMAL_MODE
+static void ready_callback(void *arg) {
+  xEventGroupSetBits(ready_events, ready_bit);
+}
+
+static esp_err_t start_measurement(EventGroupHandle_t events,
+                                   EventBits_t ready) {
+  if (ready_timer == NULL) {
+    const esp_timer_create_args_t ready_timer_args = {
+        .callback = ready_callback, .name = "bme280_ready"};
+    esp_err_t err = esp_timer_create(&ready_timer_args, &ready_timer);
+    if (err) return err;
+  }
+  esp_err_t err = bme280_force_measurement();
+  if (err) return err;
+
+  // the conversion is over within the time the datasheet gives for its
+  // oversampling, so the device isn't polled while it runs
+  ready_events = events;
+  ready_bit = ready;
+  esp_timer_stop(ready_timer);
+  return esp_timer_start_once(ready_timer, bme280_get_measurement_time());
+}
+#endif  // CONFIG_BME280_NORMAL_MODE
+
+static esp_err_t sample() {
+  update_elevation(NULL);
+  esp_err_t err;
+#ifndef CONFIG_BME280_NORMAL_MODE
+  err = bme280_force_measurement();
+  if (err) return err;
+#endif  // CONFIG_BME280_NORMAL_MODE
+  bme280_data_t data;
+  err = bme280_get_data(&data);  // waits for any forced conversion
+  if (err) return err;
+  accumulate(&data);
+  return ESP_OK;
+}
+
+static esp_err_t read(json_writer_t *json) {
+  bme280_data_t data;
+  esp_err_t err = bme280_get_data(&data);
+  if (err) return err;
+  accumulate(&data);
+  update_elevation(&data);
+
+  // report the average of the samples taken since the last read
+  json_add_number(json, JSON_TEMPERATURE_KEY, acc.temperature.sum / acc.count,
+                  DECIMALS);
+  json_add_number(json, JSON_HUMIDITY_KEY, acc.humidity.sum / acc.count,
+                  DECIMALS);
+  json_add_number(json, JSON_PRESSURE_KEY, acc.pressure.sum / acc.count,
+                  DECIMALS);
+  json_add_number(json, JSON_DEW_POINT_KEY, acc.dew_point.sum / acc.count,
+                  DECIMALS);
+#ifdef CONFIG_BME280_NORMAL_MODE
+  // with samples every few seconds the spread and trend mean something
+  json_add_number(json, JSON_TEMPERATURE_MIN_KEY, acc.temperature.min,
+                  DECIMALS);
+  json_add_number(json, JSON_TEMPERATURE_MAX_KEY, acc.temperature.max,
+                  DECIMALS);
+  json_add_number(json, JSON_PRESSURE_MIN_KEY, acc.pressure.min, DECIMALS);
+  json_add_number(json, JSON_PRESSURE_MAX_KEY, acc.pressure.max, DECIMALS);
+  double tendency;
+  if (get_tendency(&tendency) == ESP_OK)
+    json_add_number(json, JSON_PRESSURE_TENDENCY_KEY, tendency, DECIMALS + 1);
+#endif  // CONFIG_BME280_NORMAL_MODE
+  const double sea_level_pressure = acc.sum_sea_level / acc.count;
+  memset(&acc, 0, sizeof(acc));
+
+  // the forecast follows the same window average as the report, and is left
+  // out until there is an hour of history
+  forecast_add(sea_level_pressure);
+  forecast_t forecast;
+  if (forecast_get(&forecast) == ESP_OK) {
+    json_add_number(json, JSON_PRESSURE_CHANGE_KEY, forecast.change_3h,
+                    DECIMALS);
+    json_add_string(json, JSON_FORECAST_KEY, forecast.text);
+    json_add_int(json, JSON_FORECAST_CODE_KEY, forecast.code);
+    const char *storm =
+        forecast.storm ? JSON_STORM_ON_VALUE : JSON_STORM_OFF_VALUE;
+    json_add_string(json, JSON_STORM_KEY, storm);
+  }
+  return ESP_OK;
+}
+
+const sensor_driver_t bme280_sensor_driver = {
+    .name = "bme280",
+    .init = init,
+    .resume = resume,
+#ifndef CONFIG_BME280_NORMAL_MODE
+    .start_measurement = start_measurement,
+#endif  // CONFIG_BME280_NORMAL_MODE
+    .sample = sample,
+    .read = read,
+    .discovery = discovery,
+    .num_discovery = sizeof(discovery) / sizeof(mqtt_discovery_t),
+    .sample_period = SAMPLE_PERIOD,
+    .publish_period = PUBLISH_PERIOD_MS};
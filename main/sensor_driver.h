@@ -0,0 +1,58 @@
+#pragma once
+#include "esp_system.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "json_writer.h"
+#include "sensor_mgmt.h"
+#include "wireless.h"
+
+#define UNIQUE_ID(n) (CLIENT_NAME "_" n)
+#define VALUE_TEMPLATE(a) ("{{ value_json['" a "'] }}")
+
+#define DECIMALS 2  // Decimal places of reported measurements.
+
+#define DEFAULT_DEVICE                                             \
+  {                                                                \
+    .identifiers = MODEL_NAME, .manufacturer = "Mitch Weisbrod", \
+    .model = MODEL_NAME, .name = DEVICE_NAME, .sw_version = ""     \
+  }
+
+typedef struct {
+  const char *name;  // Name of the sensor used in logs.
+  esp_err_t (*init)(void);  // Resets and configures the device. Optional.
+  esp_err_t (*resume)(void);  // Restores the device after deep sleep without
+                              // a full reset. Optional, init() is used if
+                              // missing or if it fails.
+  esp_err_t (*wakeup)(json_writer_t *json);  // Prepares the device ahead of
+                                             // a measurement, e.g. spins up a
+                                             // fan. Optional.
+  esp_err_t (*start_measurement)(
+      EventGroupHandle_t events,
+      EventBits_t ready);  // Starts a conversion without waiting for it, and
+                           // sets ready in events once read() won't block on
+                           // the device. Optional, read() is called right
+                           // away if missing.
+  esp_err_t (*sample)(void);  // Takes an intermediate sample to be folded
+                              // into the next read(). Optional.
+  esp_err_t (*read)(json_writer_t *json);   // Adds the measurement to the
+                                            // json.
+  esp_err_t (*sleep)(json_writer_t *json);  // Puts the device into a low
+                                            // power state after a
+                                            // measurement. Optional.
+  esp_err_t (*drain)(void);  // Publishes what the device kept on its own,
+                             // e.g. recorded events. Optional.
+  const mqtt_discovery_t *discovery;  // Home Assistant discovery descriptors.
+  size_t num_discovery;               // Number of discovery descriptors.
+  uint32_t sample_period;   // Time between calls to sample() (ms).
+  uint32_t warmup_time;     // Time between wakeup() and read() (ms).
+  uint32_t publish_period;  // Time between calls to read() (ms). Must be a
+                            // multiple of PUBLISH_PERIOD_MS.
+} sensor_driver_t;
+
+extern const sensor_driver_t wifi_sensor_driver;
+extern const sensor_driver_t max17043_sensor_driver;
+extern const sensor_driver_t bme280_sensor_driver;
+extern const sensor_driver_t pms5003_sensor_driver;
+extern const sensor_driver_t sph0645_sensor_driver;
+
+esp_err_t sensors_register(const sensor_driver_t *driver);
@@ -0,0 +1,88 @@
+#include <math.h>
+
+#include "battery_history.h"
+#include "battery_policy.h"
+#include "max17043.h"
+#include "sensor_driver.h"
+
+#define JSON_BATTERY_KEY "battery"
+#define JSON_BATTERY_VOLTAGE_KEY "battery_voltage"
+#define JSON_BATTERY_RATE_KEY "battery_rate"
+#define JSON_BATTERY_TIME_TO_EMPTY_KEY "battery_time_to_empty"
+
+static const mqtt_discovery_t discovery[] = {
+    {.type = MQTT_SENSOR,
+     .device = DEFAULT_DEVICE,
+     .device_class = "battery",
+     .name = "Battery Level",
+     .state_topic = MQTT_DATA_STATE_TOPIC,
+     .unique_id = UNIQUE_ID(JSON_BATTERY_KEY),
+     .sensor =
+         {
+             .unit_of_measurement = BATTERY_SCALE,
+         },
+     .value_template = VALUE_TEMPLATE(JSON_BATTERY_KEY)},
+    {.type = MQTT_SENSOR,
+     .device = DEFAULT_DEVICE,
+     .device_class = "voltage",
+     .name = "Battery Voltage",
+     .state_topic = MQTT_DATA_STATE_TOPIC,
+     .unique_id = UNIQUE_ID(JSON_BATTERY_VOLTAGE_KEY),
+     .sensor =
+         {
+             .unit_of_measurement = VOLTAGE_SCALE,
+         },
+     .value_template = VALUE_TEMPLATE(JSON_BATTERY_VOLTAGE_KEY)},
+    {.type = MQTT_SENSOR,
+     .device = DEFAULT_DEVICE,
+     .name = "Battery Rate",
+     .state_topic = MQTT_DATA_STATE_TOPIC,
+     .unique_id = UNIQUE_ID(JSON_BATTERY_RATE_KEY),
+     .sensor =
+         {
+             .icon = "mdi:battery-charging",
+             .unit_of_measurement = BATTERY_RATE_SCALE,
+         },
+     .value_template = VALUE_TEMPLATE(JSON_BATTERY_RATE_KEY)},
+    {.type = MQTT_SENSOR,
+     .device = DEFAULT_DEVICE,
+     .name = "Battery Time to Empty",
+     .state_topic = MQTT_DATA_STATE_TOPIC,
+     .unique_id = UNIQUE_ID(JSON_BATTERY_TIME_TO_EMPTY_KEY),
+     .sensor =
+         {
+             .icon = "mdi:battery-clock",
+             .unit_of_measurement = TIME_TO_EMPTY_SCALE,
+         },
+     .value_template = VALUE_TEMPLATE(JSON_BATTERY_TIME_TO_EMPTY_KEY)},
+};
+
+static esp_err_t init() { return battery_policy_start(); }
+
+static esp_err_t read(json_writer_t *json) {
+  max17043_data_t data;
+  esp_err_t err = max17043_get_data(&data);
+  if (err) return err;
+  json_add_int(json, JSON_BATTERY_KEY, (int)data.battery_life);
+  json_add_number(json, JSON_BATTERY_VOLTAGE_KEY, data.millivolts / 1000.0,
+                  DECIMALS);
+  battery_policy_update(data.battery_life);
+
+  // track the history to estimate how long the battery will last
+  battery_history_add(data.millivolts, data.battery_life);
+  battery_estimate_t estimate;
+  if (battery_history_estimate(&estimate)) return ESP_OK;
+  json_add_number(json, JSON_BATTERY_RATE_KEY, estimate.rate, DECIMALS);
+  if (isfinite(estimate.time_to_empty))
+    json_add_number(json, JSON_BATTERY_TIME_TO_EMPTY_KEY,
+                    estimate.time_to_empty, DECIMALS);
+  return ESP_OK;
+}
+
+const sensor_driver_t max17043_sensor_driver = {
+    .name = "max17043",
+    .init = init,
+    .read = read,
+    .discovery = discovery,
+    .num_discovery = sizeof(discovery) / sizeof(mqtt_discovery_t),
+    .publish_period = 3 * PUBLISH_PERIOD_MS};  // battery changes slowly
@@ -1,340 +1,277 @@
 #include "sensor_mgmt.h"
 
-#include <string.h>
-
-#include "bme280.h"
-#include "cJSON.h"
-#include "max17043.h"
-#include "pms5003.h"
-#include "sph0645.h"
+#include "battery_policy.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/task.h"
+#include "scheduler.h"
+#include "sensor_driver.h"
 #include "wireless.h"
 
-// wifi json keys
-#define JSON_SIGNAL_STRENGTH_KEY "signal_strength"
-// max17043 json keys
-#define JSON_BATTERY_KEY "battery"
-// bme280 json keys
-#define JSON_TEMPERATURE_KEY "temperature"
-#define JSON_HUMIDITY_KEY "humidity"
-#define JSON_PRESSURE_KEY "pressure"
-#define JSON_DEW_POINT_KEY "dew_point"
-// pms5003 json keys
-#define JSON_PM1_KEY "pm1"
-#define JSON_PM2_5_KEY "pm2_5"
-#define JSON_PM10_KEY "pm10"
-#define JSON_FAN_KEY "fan"
-#define JSON_FAN_ON_VALUE "on"
-#define JSON_FAN_OFF_VALUE "off"
-// sph0645 json keys
-#define JSON_AVG_NOISE_KEY "avg_noise"
-#define JSON_MIN_NOISE_KEY "min_noise"
-#define JSON_MAX_NOISE_KEY "max_noise"
-
-#define UNIQUE_ID(n) (CLIENT_NAME "_" n)
-#define VALUE_TEMPLATE(a) ("{{ value_json['" a "'] }}")
-
-#define TRUNCATE(n) (((int64_t)(n * 100)) / 100.0)
-
-#define DEFAULT_DEVICE                                             \
-  {                                                                \
-    .identifiers = MODEL_NAME, .manufacturer = "Mitch Weisbrod", \
-    .model = MODEL_NAME, .name = DEVICE_NAME, .sw_version = ""     \
-  }
+#define MAX_SENSORS 8  // Maximum number of registered sensor drivers.
+#define READY_TIMEOUT_MS 2000  // Time to wait for conversions to finish.
+
+#define JSON_LATENCY_KEY "latency_ms"
+#define JSON_TOTAL_LATENCY_KEY "total"
+#define JSON_MAX_LATENCY_KEY "max"
+
+static const char *TAG = "sensors";
 
-void sensors_start() {
-  esp_err_t err = ESP_OK;
-
-  const mqtt_discovery_t signal_strength = {
-      .type = MQTT_SENSOR,
-      .device = DEFAULT_DEVICE,
-      .device_class = "signal_strength",
-      .name = "Signal Strength",
-      .state_topic = MQTT_DATA_STATE_TOPIC,
-      .unique_id = UNIQUE_ID("signal_strength"),
-      .sensor =
-          {
-              .unit_of_measurement = SIGNAL_STRENGTH_SCALE,
-          },
-      .value_template = VALUE_TEMPLATE(JSON_SIGNAL_STRENGTH_KEY)};
-  mqtt_publish_discovery(&signal_strength);
+static const sensor_driver_t *drivers[MAX_SENSORS];
+static EventGroupHandle_t ready_events = NULL;  // A bit for each sensor whose
+                                                // conversion is done.
+static size_t num_drivers = 0;
+static size_t num_discovery = 0;  // Discovery messages of all the drivers.
 
+typedef struct {
+  int64_t last;  // Latency of the most recent measurement (us).
+  int64_t max;   // Worst latency seen since boot (us).
+} latency_t;
+
+static latency_t latency[MAX_SENSORS];  // Per-sensor measurement latency.
+static latency_t total_latency;         // Latency of the measurement cycle.
+
+static int64_t first_sample_time = -1;  // Time the first measurement of this
+                                        // boot finished (us).
+static uint32_t wakeup_mask = 0;   // Sensors due to be woken up.
+static uint32_t publish_mask = 0;  // Sensors due to be read and published.
+
+static bool report_due(int64_t publish_time) {
 #ifdef USE_MAX17043
-  const mqtt_discovery_t battery = {
-      .type = MQTT_SENSOR,
-      .device = DEFAULT_DEVICE,
-      .device_class = "battery",
-      .name = "Battery Level",
-      .state_topic = MQTT_DATA_STATE_TOPIC,
-      .unique_id = UNIQUE_ID("battery"),
-      .sensor =
-          {
-              .unit_of_measurement = BATTERY_SCALE,
-          },
-      .value_template = VALUE_TEMPLATE(JSON_BATTERY_KEY)};
-  mqtt_publish_discovery(&battery);
+  // decide once per publish time so that wakeups and reads agree
+  static int64_t decided_time = -1;
+  static bool decided = true;
+  if (publish_time != decided_time) {
+    decided_time = publish_time;
+    decided = battery_policy_report_due();
+  }
+  return decided;
+#else
+  return true;
 #endif  // USE_MAX17043
+}
 
-#ifdef USE_BME280
-  do {
-    bme280_reset();
-    const bme280_config_t bme_config = BME280_WEATHER_MONITORING;
-    err = bme280_set_config(&bme_config);
-    if (err) break;
-    const double elevation = wireless_get_elevation();
-    bme280_set_elevation(elevation);
-  } while (false);
-
-  const mqtt_discovery_t bme280_discovery[] = {
-      {.type = MQTT_SENSOR,
-       .device = DEFAULT_DEVICE,
-       .device_class = JSON_TEMPERATURE_KEY,
-       .force_update = true,
-       .name = "Temperature",
-       .state_topic = MQTT_DATA_STATE_TOPIC,
-       .unique_id = UNIQUE_ID(JSON_TEMPERATURE_KEY),
-       .sensor =
-           {
-               .unit_of_measurement = TEMPERATURE_SCALE,
-           },
-       .value_template = VALUE_TEMPLATE(JSON_TEMPERATURE_KEY)},
-      {.type = MQTT_SENSOR,
-       .device = DEFAULT_DEVICE,
-       .device_class = JSON_HUMIDITY_KEY,
-       .force_update = true,
-       .name = "Humidity",
-       .state_topic = MQTT_DATA_STATE_TOPIC,
-       .unique_id = UNIQUE_ID(JSON_HUMIDITY_KEY),
-       .sensor =
-           {
-               .unit_of_measurement = HUMIDITY_SCALE,
-           },
-       .value_template = VALUE_TEMPLATE(JSON_HUMIDITY_KEY)},
-      {.type = MQTT_SENSOR,
-       .device = DEFAULT_DEVICE,
-       .device_class = JSON_PRESSURE_KEY,
-       .force_update = true,
-       //.json_atr
-       //.json_attributes_template = VALUE_TEMPLATE(JSON_ELEVATION_KEY),
-       //.json_attributes_topic = STATE_TOPIC,
-       .name = "Pressure",
-       .state_topic = MQTT_DATA_STATE_TOPIC,
-       .unique_id = UNIQUE_ID(JSON_PRESSURE_KEY),
-       .sensor =
-           {
-               .unit_of_measurement = PRESSURE_SCALE,
-           },
-       .value_template = VALUE_TEMPLATE(JSON_PRESSURE_KEY)},
-      {.type = MQTT_SENSOR,
-       .device = DEFAULT_DEVICE,
-       .force_update = true,
-       .name = "Dew Point",
-       .state_topic = MQTT_DATA_STATE_TOPIC,
-       .unique_id = UNIQUE_ID(JSON_DEW_POINT_KEY),
-       .sensor =
-           {
-               .icon = "mdi:weather-fog",
-               .unit_of_measurement = TEMPERATURE_SCALE,
-           },
-       .value_template = VALUE_TEMPLATE(JSON_DEW_POINT_KEY)},
-  };
-  for (int i = 0; i < sizeof(bme280_discovery) / sizeof(mqtt_discovery_t); ++i)
-    mqtt_publish_discovery(&bme280_discovery[i]);
-
-#endif  // USE BME280
-
-#ifdef USE_PMS5003
-  do {
-    pms5003_reset();
-    const pms5003_config_t pms_config = PMS5003_PASSIVE_ASLEEP;
-    err = pms5003_set_config(&pms_config);
-    if (err) break;
-  } while (false);
-
-  const mqtt_discovery_t pms5003_discovery[] = {
-      {.type = MQTT_SENSOR,
-       .device = DEFAULT_DEVICE,
-       .force_update = true,
-       .name = "PM1",
-       .state_topic = MQTT_DATA_STATE_TOPIC,
-       .unique_id = UNIQUE_ID(JSON_PM1_KEY),
-       .sensor =
-           {
-               .icon = "mdi:smog",
-               .unit_of_measurement = PM_SCALE,
-           },
-       .value_template = VALUE_TEMPLATE(JSON_PM1_KEY)},
-      {.type = MQTT_SENSOR,
-       .device = DEFAULT_DEVICE,
-       .force_update = true,
-       .name = "PM2.5",
-       .state_topic = MQTT_DATA_STATE_TOPIC,
-       .unique_id = UNIQUE_ID(JSON_PM2_5_KEY),
-       .sensor =
-           {
-               .icon = "mdi:smog",
-               .unit_of_measurement = PM_SCALE,
-           },
-       .value_template = VALUE_TEMPLATE(JSON_PM2_5_KEY)},
-      {.type = MQTT_SENSOR,
-       .device = DEFAULT_DEVICE,
-       .force_update = true,
-       .name = "PM10",
-       .state_topic = MQTT_DATA_STATE_TOPIC,
-       .unique_id = UNIQUE_ID(JSON_PM10_KEY),
-       .sensor =
-           {
-               .icon = "mdi:smog",
-               .unit_of_measurement = PM_SCALE,
-           },
-       .value_template = VALUE_TEMPLATE(JSON_PM10_KEY)},
-      {.type = MQTT_BINARY_SENSOR,
-       .device = DEFAULT_DEVICE,
-       .name = "Air Quality Sensor Fan",
-       .state_topic = MQTT_CONFIG_STATE_TOPIC,
-       .unique_id = UNIQUE_ID(JSON_FAN_KEY),
-       .binary_sensor =
-           {
-               .payload_on = JSON_FAN_ON_VALUE,
-               .payload_off = JSON_FAN_OFF_VALUE,
-           },
-       .value_template = VALUE_TEMPLATE(JSON_FAN_KEY)},
-  };
-  for (int i = 0; i < sizeof(pms5003_discovery) / sizeof(mqtt_discovery_t); ++i)
-    mqtt_publish_discovery(&pms5003_discovery[i]);
-#endif  // USE PMS_5003
+static void sample_event(void *arg, int64_t due) {
+  const sensor_driver_t *driver = drivers[(intptr_t)arg];
+  const esp_err_t err = driver->sample();
+  if (!err && first_sample_time < 0) first_sample_time = esp_timer_get_time();
+  if (err && err != ESP_ERR_INVALID_STATE)
+    ESP_LOGW(TAG, "%s sample error %s", driver->name, esp_err_to_name(err));
+}
 
-#ifdef USE_SPH0645
-  do {
-    sph0645_reset();
-    const sph0645_config_t sph_config = SPH0645_DEFAULT_CONFIG;
-    err = sph0645_set_config(&sph_config);
-    if (err) break;
-  } while (false);
-
-  const mqtt_discovery_t sph0645_discovery[] = {
-      {.type = MQTT_SENSOR,
-       .device = DEFAULT_DEVICE,
-       .force_update = true,
-       .name = "Average Noise",
-       .state_topic = MQTT_DATA_STATE_TOPIC,
-       .unique_id = UNIQUE_ID(JSON_AVG_NOISE_KEY),
-       .sensor =
-           {
-               .icon = "mdi:volume-high",
-               .unit_of_measurement = NOISE_SCALE,
-           },
-       .value_template = VALUE_TEMPLATE(JSON_AVG_NOISE_KEY)},
-      {.type = MQTT_SENSOR,
-       .device = DEFAULT_DEVICE,
-       .force_update = true,
-       .name = "Minimum Noise",
-       .state_topic = MQTT_DATA_STATE_TOPIC,
-       .unique_id = UNIQUE_ID(JSON_MIN_NOISE_KEY),
-       .sensor =
-           {
-               .icon = "mdi:volume-minus",
-               .unit_of_measurement = NOISE_SCALE,
-           },
-       .value_template = VALUE_TEMPLATE(JSON_MIN_NOISE_KEY)},
-      {.type = MQTT_SENSOR,
-       .device = DEFAULT_DEVICE,
-       .force_update = true,
-       .name = "Maximum Noise",
-       .state_topic = MQTT_DATA_STATE_TOPIC,
-       .unique_id = UNIQUE_ID(JSON_MAX_NOISE_KEY),
-       .sensor =
-           {
-               .icon = "mdi:volume-plus",
-               .unit_of_measurement = NOISE_SCALE,
-           },
-       .value_template = VALUE_TEMPLATE(JSON_MAX_NOISE_KEY)},
-  };
-  for (int i = 0; i < sizeof(sph0645_discovery) / sizeof(mqtt_discovery_t); ++i)
-    mqtt_publish_discovery(&sph0645_discovery[i]);
-#endif  // USE_SPH0645
+static void wakeup_event(void *arg, int64_t due) {
+  const intptr_t i = (intptr_t)arg;
+  if (report_due(due + drivers[i]->warmup_time * 1000LL))
+    wakeup_mask |= BIT(i);
 }
 
-void sensors_wakeup(cJSON* json) {
-  esp_err_t err = ESP_OK;
-#ifdef USE_PMS5003
-  do {
-    pms5003_config_t pms_config;
-    err = pms5003_get_config(&pms_config);
-    if (err) break;
-    pms_config.sleep = 1;  // wakeup
-    err = pms5003_set_config(&pms_config);
-    if (err) break;
-    cJSON_AddStringToObject(json, JSON_FAN_KEY, JSON_FAN_ON_VALUE);
-  } while (false);
-#endif  // USE_PMS5003
+static void publish_event(void *arg, int64_t due) {
+  if (report_due(due)) publish_mask |= BIT((intptr_t)arg);
 }
 
-void sensors_get_data(cJSON* json) {
-  esp_err_t err = ESP_OK;
+esp_err_t sensors_register(const sensor_driver_t *driver) {
+  if (driver == NULL || driver->read == NULL) return ESP_ERR_INVALID_ARG;
+  if (num_drivers == MAX_SENSORS) return ESP_ERR_NO_MEM;
+  drivers[num_drivers++] = driver;
 
-  // get wifi rssi
-  const int8_t rssi = wireless_get_rssi();
-  cJSON_AddNumberToObject(json, JSON_SIGNAL_STRENGTH_KEY, rssi);
+  // discovery beyond the cache is published on every connect
+  num_discovery += driver->num_discovery;
+  if (num_discovery > MQTT_DISCOVERY_CACHE_SIZE)
+    ESP_LOGW(TAG, "%u discovery messages, only %d are cached",
+             (unsigned)num_discovery, MQTT_DISCOVERY_CACHE_SIZE);
+  return ESP_OK;
+}
 
+void sensors_start(bool warm_boot) {
+  ready_events = xEventGroupCreate();
+  sensors_register(&wifi_sensor_driver);
 #ifdef USE_MAX17043
-  do {
-    max17043_data_t data;
-    err = max17043_get_data(&data);
-    if (err) break;
-    cJSON_AddNumberToObject(json, JSON_BATTERY_KEY, (int)data.battery_life);
-  } while (false);
+  sensors_register(&max17043_sensor_driver);
 #endif  // USE_MAX17043
-
 #ifdef USE_BME280
-  do {
-    err = bme280_force_measurement();
-    if (err) break;
-    bme280_data_t data;
-    err = bme280_get_data(&data);
-    if (err) break;
-    cJSON_AddNumberToObject(json, JSON_TEMPERATURE_KEY,
-                            TRUNCATE(data.temperature));
-    cJSON_AddNumberToObject(json, JSON_HUMIDITY_KEY, TRUNCATE(data.humidity));
-    cJSON_AddNumberToObject(json, JSON_PRESSURE_KEY, TRUNCATE(data.pressure));
-    cJSON_AddNumberToObject(json, JSON_DEW_POINT_KEY, TRUNCATE(data.dew_point));
-  } while (false);
-#endif  // USE BME280
-
+  sensors_register(&bme280_sensor_driver);
+#endif  // USE_BME280
 #ifdef USE_PMS5003
-  do {
-    pms5003_data_t data;
-    err = pms5003_get_data(&data);
-    if (err || !data.checksum_ok) break;
-    cJSON_AddNumberToObject(json, JSON_PM1_KEY, data.concAtm.pm1);
-    cJSON_AddNumberToObject(json, JSON_PM2_5_KEY, data.concAtm.pm2_5);
-    cJSON_AddNumberToObject(json, JSON_PM10_KEY, data.concAtm.pm10);
-  } while (false);
+  sensors_register(&pms5003_sensor_driver);
 #endif  // USE_PMS5003
-
 #ifdef USE_SPH0645
-  do {
-    sph0645_data_t data;
-    err = sph0645_get_data(&data);
-    sph0645_clear_data();
-    if (err) break;
-    cJSON_AddNumberToObject(json, JSON_AVG_NOISE_KEY, TRUNCATE(data.avg));
-    cJSON_AddNumberToObject(json, JSON_MIN_NOISE_KEY, TRUNCATE(data.min));
-    cJSON_AddNumberToObject(json, JSON_MAX_NOISE_KEY, TRUNCATE(data.max));
-  } while (false);
-#endif  // USE_PMS5003
+  sensors_register(&sph0645_sensor_driver);
+#endif  // USE_SPH0645
+  // TODO: register the CO2 sensor, wind vane and rain gauge
+
+  for (int i = 0; i < num_drivers; ++i) {
+    const sensor_driver_t *driver = drivers[i];
+
+    // resume devices that kept their state through deep sleep
+    esp_err_t err = ESP_FAIL;
+    if (warm_boot && driver->resume != NULL) err = driver->resume();
+    if (err && driver->init != NULL) {
+      err = driver->init();
+      if (err)
+        ESP_LOGW(TAG, "%s init error %s", driver->name, esp_err_to_name(err));
+    }
+  }
 }
 
-void sensors_sleep(cJSON* json) {
-  esp_err_t err = ESP_OK;
-#ifdef USE_PMS5003
-  do {
-    pms5003_config_t pms_config;
-    err = pms5003_get_config(&pms_config);
-    if (err) break;
-    pms_config.sleep = 0;  // sleep
-    err = pms5003_set_config(&pms_config);
-    if (err) break;
-    cJSON_AddStringToObject(json, JSON_FAN_KEY, JSON_FAN_OFF_VALUE);
-  } while (false);
-#endif  // USE_PMS5003
-}
\ No newline at end of file
+void sensors_publish_discovery(bool force) {
+  for (int i = 0; i < num_drivers; ++i)
+    for (int j = 0; j < drivers[i]->num_discovery; ++j)
+      mqtt_publish_discovery(&drivers[i]->discovery[j], force);
+}
+
+int64_t sensors_get_first_sample_time() { return first_sample_time; }
+
+uint32_t sensors_get_warmup_time() {
+  uint32_t warmup_time = 0;
+  for (int i = 0; i < num_drivers; ++i)
+    if (drivers[i]->warmup_time > warmup_time)
+      warmup_time = drivers[i]->warmup_time;
+  return warmup_time;
+}
+
+esp_err_t sensors_schedule(int64_t first_publish, bool sampling) {
+  const int64_t now = esp_timer_get_time();
+  for (intptr_t i = 0; i < num_drivers; ++i) {
+    const sensor_driver_t *driver = drivers[i];
+    const int64_t publish_period = driver->publish_period * 1000LL;
+    esp_err_t err = ESP_OK;
+    if (sampling && driver->sample != NULL && driver->sample_period > 0) {
+      // take the first sample right away rather than a period from now
+      const int64_t sample_period = driver->sample_period * 1000LL;
+      err = scheduler_add(now, sample_period, sample_event, (void *)i);
+      if (err) return err;
+    }
+    if (driver->wakeup != NULL) {
+      // added before the publish event so it runs first when there is no
+      // warmup time
+      err = scheduler_add(first_publish - driver->warmup_time * 1000LL,
+                          publish_period, wakeup_event, (void *)i);
+      if (err) return err;
+    }
+    err = scheduler_add(first_publish, publish_period, publish_event,
+                        (void *)i);
+    if (err) return err;
+  }
+  return ESP_OK;
+}
+
+uint32_t sensors_take_wakeups() {
+  const uint32_t mask = wakeup_mask;
+  wakeup_mask = 0;
+  return mask;
+}
+
+uint32_t sensors_take_publishes() {
+  const uint32_t mask = publish_mask;
+  publish_mask = 0;
+  return mask;
+}
+
+void sensors_wakeup(json_writer_t *json, uint32_t sensors) {
+  for (int i = 0; i < num_drivers; ++i) {
+    if (!(sensors & BIT(i)) || drivers[i]->wakeup == NULL) continue;
+    const esp_err_t err = drivers[i]->wakeup(json);
+    if (err)
+      ESP_LOGW(TAG, "%s wakeup error %s", drivers[i]->name,
+               esp_err_to_name(err));
+  }
+}
+
+static void record_latency(int i, int64_t start) {
+  latency[i].last = esp_timer_get_time() - start;
+  if (latency[i].last > latency[i].max) latency[i].max = latency[i].last;
+}
+
+void sensors_get_data(json_writer_t *json, uint32_t sensors) {
+  esp_err_t errs[MAX_SENSORS];
+  EventBits_t pending = 0;  // bit mask of sensors still converting
+
+  // start every conversion up front so that they run at the same time, and
+  // sensors without one are ready right away
+  const int64_t start = esp_timer_get_time();
+  xEventGroupClearBits(ready_events, BIT(MAX_SENSORS) - 1);
+  for (int i = 0; i < num_drivers; ++i) {
+    errs[i] = ESP_OK;
+    if (!(sensors & BIT(i))) continue;
+    if (drivers[i]->start_measurement != NULL)
+      errs[i] = drivers[i]->start_measurement(ready_events, BIT(i));
+    else
+      xEventGroupSetBits(ready_events, BIT(i));
+    if (!errs[i]) pending |= BIT(i);
+  }
+
+  // then collect each result as soon as its sensor signals that it is ready,
+  // so the cycle takes as long as the slowest sensor instead of the sum of
+  // all of them
+  const TickType_t timeout = pdMS_TO_TICKS(READY_TIMEOUT_MS);
+  const TickType_t begin = xTaskGetTickCount();
+  while (pending) {
+    const TickType_t waited = xTaskGetTickCount() - begin;
+    if (waited >= timeout) break;
+    const EventBits_t ready =
+        xEventGroupWaitBits(ready_events, pending, pdTRUE, pdFALSE,
+                            timeout - waited) &
+        pending;
+    for (int i = 0; i < num_drivers; ++i) {
+      if (!(ready & BIT(i))) continue;
+      errs[i] = drivers[i]->read(json);
+      if (!errs[i] && first_sample_time < 0)
+        first_sample_time = esp_timer_get_time();
+      record_latency(i, start);
+      pending &= ~BIT(i);
+    }
+  }
+
+  // a sensor that never got ready isn't read, since its result would be
+  // stale or the read would block on it
+  for (int i = 0; i < num_drivers; ++i) {
+    if (!(pending & BIT(i))) continue;
+    errs[i] = ESP_ERR_TIMEOUT;
+    record_latency(i, start);
+  }
+  total_latency.last = esp_timer_get_time() - start;
+  if (total_latency.last > total_latency.max)
+    total_latency.max = total_latency.last;
+  ESP_LOGI(TAG, "measurement cycle took %dms",
+           (int)(total_latency.last / 1000));
+
+  for (int i = 0; i < num_drivers; ++i) {
+    if (!(sensors & BIT(i))) continue;
+    // sensors that were left asleep report an invalid state
+    if (errs[i] && errs[i] != ESP_ERR_INVALID_STATE)
+      ESP_LOGW(TAG, "%s read error %s", drivers[i]->name,
+               esp_err_to_name(errs[i]));
+  }
+}
+
+void sensors_sleep(json_writer_t *json, uint32_t sensors) {
+  for (int i = 0; i < num_drivers; ++i) {
+    if (!(sensors & BIT(i)) || drivers[i]->sleep == NULL) continue;
+    const esp_err_t err = drivers[i]->sleep(json);
+    if (err)
+      ESP_LOGW(TAG, "%s sleep error %s", drivers[i]->name,
+               esp_err_to_name(err));
+  }
+
+  // report how long the last measurement cycle took
+  json_begin_object(json, JSON_LATENCY_KEY);
+  for (int i = 0; i < num_drivers; ++i)
+    if (sensors & BIT(i))
+      json_add_int(json, drivers[i]->name, latency[i].last / 1000);
+  json_add_int(json, JSON_TOTAL_LATENCY_KEY, total_latency.last / 1000);
+  json_add_int(json, JSON_MAX_LATENCY_KEY, total_latency.max / 1000);
+  json_end_object(json);
+}
+
+void sensors_drain() {
+  // every sensor may have kept something, not only those due to publish
+  for (int i = 0; i < num_drivers; ++i) {
+    if (drivers[i]->drain == NULL) continue;
+    const esp_err_t err = drivers[i]->drain();
+    if (err && err != ESP_ERR_NOT_FOUND)
+      ESP_LOGW(TAG, "%s drain error %s", drivers[i]->name,
+               esp_err_to_name(err));
+  }
+}
@@ -1,6 +1,6 @@
 #pragma once
-#include "cJSON.h"
 #include "esp_system.h"
+#include "json_writer.h"
 
 // which sensors to use and names
 #ifdef CONFIG_OUTSIDE_STATION
@@ -27,6 +27,10 @@
 // TODO: add wind vane and rain gauge
 #endif
 
+#if defined(CONFIG_DEEP_SLEEP) && defined(USE_MAX17043)
+#define USE_DEEP_SLEEP
+#endif
+
 // sensor measurement scales
 #ifdef CONFIG_CELSIUS
 #define TEMPERATURE_SCALE "°C"
@@ -42,17 +46,39 @@
 #endif
 #define SIGNAL_STRENGTH_SCALE "dB"
 #define BATTERY_SCALE "%"
+#define BATTERY_RATE_SCALE "%/h"
+#define VOLTAGE_SCALE "V"
+#define TIME_TO_EMPTY_SCALE "h"
 #define HUMIDITY_SCALE "%"
 #define NOISE_SCALE "dBc"
 #define PM_SCALE "μg/m³"
 
 #define MQTT_DATA_STATE_TOPIC ("weather-station/" CLIENT_NAME "/data")
+#define MQTT_DATA_BINARY_STATE_TOPIC \
+  ("weather-station/" CLIENT_NAME "/data/binary")
 #define MQTT_CONFIG_STATE_TOPIC ("weather-station/" CLIENT_NAME "/config")
+#define MQTT_BACKLOG_STATE_TOPIC ("weather-station/" CLIENT_NAME "/backlog")
+#define MQTT_EVENT_STATE_TOPIC ("weather-station/" CLIENT_NAME "/event")
+#define MQTT_EVENT_AUDIO_TOPIC ("weather-station/" CLIENT_NAME "/event/audio")
+
+#define PUBLISH_PERIOD_MS (5 * 60 * 1000)  // Base time between publishes.
+
+void sensors_start(bool warm_boot);
+
+void sensors_publish_discovery(bool force);
+
+int64_t sensors_get_first_sample_time();
+
+uint32_t sensors_get_warmup_time();
+esp_err_t sensors_schedule(int64_t first_publish, bool sampling);
+
+uint32_t sensors_take_wakeups();
+uint32_t sensors_take_publishes();
 
-void sensors_start();
+void sensors_wakeup(json_writer_t *json, uint32_t sensors);
 
-void sensors_wakeup(cJSON *json);
+void sensors_get_data(json_writer_t *json, uint32_t sensors);
 
-void sensors_get_data(cJSON *json);
+void sensors_sleep(json_writer_t *json, uint32_t sensors);
 
-void sensors_sleep(cJSON *json);
\ No newline at end of file
+void sensors_drain();
\ No newline at end of file
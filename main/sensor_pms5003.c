@@ -0,0 +1,122 @@
+#include "battery_policy.h"
+#include "pms5003.h"
+#include "sensor_driver.h"
+
+#define JSON_PM1_KEY "pm1"
+#define JSON_PM2_5_KEY "pm2_5"
+#define JSON_PM10_KEY "pm10"
+#define JSON_FAN_KEY "fan"
+#define JSON_FAN_ON_VALUE "on"
+#define JSON_FAN_OFF_VALUE "off"
+
+static const mqtt_discovery_t discovery[] = {
+    {.type = MQTT_SENSOR,
+     .device = DEFAULT_DEVICE,
+     .force_update = true,
+     .name = "PM1",
+     .state_topic = MQTT_DATA_STATE_TOPIC,
+     .unique_id = UNIQUE_ID(JSON_PM1_KEY),
+     .sensor =
+         {
+             .icon = "mdi:smog",
+             .unit_of_measurement = PM_SCALE,
+         },
+     .value_template = VALUE_TEMPLATE(JSON_PM1_KEY)},
+    {.type = MQTT_SENSOR,
+     .device = DEFAULT_DEVICE,
+     .force_update = true,
+     .name = "PM2.5",
+     .state_topic = MQTT_DATA_STATE_TOPIC,
+     .unique_id = UNIQUE_ID(JSON_PM2_5_KEY),
+     .sensor =
+         {
+             .icon = "mdi:smog",
+             .unit_of_measurement = PM_SCALE,
+         },
+     .value_template = VALUE_TEMPLATE(JSON_PM2_5_KEY)},
+    {.type = MQTT_SENSOR,
+     .device = DEFAULT_DEVICE,
+     .force_update = true,
+     .name = "PM10",
+     .state_topic = MQTT_DATA_STATE_TOPIC,
+     .unique_id = UNIQUE_ID(JSON_PM10_KEY),
+     .sensor =
+         {
+             .icon = "mdi:smog",
+             .unit_of_measurement = PM_SCALE,
+         },
+     .value_template = VALUE_TEMPLATE(JSON_PM10_KEY)},
+    {.type = MQTT_BINARY_SENSOR,
+     .device = DEFAULT_DEVICE,
+     .name = "Air Quality Sensor Fan",
+     .state_topic = MQTT_CONFIG_STATE_TOPIC,
+     .unique_id = UNIQUE_ID(JSON_FAN_KEY),
+     .binary_sensor =
+         {
+             .payload_on = JSON_FAN_ON_VALUE,
+             .payload_off = JSON_FAN_OFF_VALUE,
+         },
+     .value_template = VALUE_TEMPLATE(JSON_FAN_KEY)},
+};
+
+static esp_err_t set_sleep(uint8_t sleep) {
+  pms5003_config_t pms_config;
+  esp_err_t err = pms5003_get_config(&pms_config);
+  if (err) return err;
+  pms_config.sleep = sleep;
+  return pms5003_set_config(&pms_config);
+}
+
+static esp_err_t init() {
+  esp_err_t err = pms5003_reset();
+  if (err) return err;
+  const pms5003_config_t pms_config = PMS5003_PASSIVE_ASLEEP;
+  return pms5003_set_config(&pms_config);
+}
+
+static esp_err_t wakeup(json_writer_t *json) {
+#ifdef USE_MAX17043
+  if (!battery_policy_pm_due()) return ESP_OK;
+#endif  // USE_MAX17043
+  esp_err_t err = set_sleep(PMS5003_WAKEUP);
+  if (err) return err;
+  json_add_string(json, JSON_FAN_KEY, JSON_FAN_ON_VALUE);
+  return ESP_OK;
+}
+
+static esp_err_t start_measurement(EventGroupHandle_t events,
+                                   EventBits_t ready) {
+  esp_err_t err = pms5003_request_data();
+  if (err) return err;
+  return pms5003_notify_ready(events, ready);
+}
+
+static esp_err_t read(json_writer_t *json) {
+  pms5003_data_t data;
+  esp_err_t err = pms5003_read_data(&data);
+  if (err) return err;
+  if (!data.checksum_ok) return ESP_ERR_INVALID_CRC;
+  json_add_int(json, JSON_PM1_KEY, data.concAtm.pm1);
+  json_add_int(json, JSON_PM2_5_KEY, data.concAtm.pm2_5);
+  json_add_int(json, JSON_PM10_KEY, data.concAtm.pm10);
+  return ESP_OK;
+}
+
+static esp_err_t sleep(json_writer_t *json) {
+  esp_err_t err = set_sleep(PMS5003_SLEEP);
+  if (err) return err;
+  json_add_string(json, JSON_FAN_KEY, JSON_FAN_OFF_VALUE);
+  return ESP_OK;
+}
+
+const sensor_driver_t pms5003_sensor_driver = {
+    .name = "pms5003",
+    .init = init,
+    .wakeup = wakeup,
+    .start_measurement = start_measurement,
+    .read = read,
+    .sleep = sleep,
+    .discovery = discovery,
+    .num_discovery = sizeof(discovery) / sizeof(mqtt_discovery_t),
+    .warmup_time = 32 * 1000,  // let the fan settle the airflow
+    .publish_period = PUBLISH_PERIOD_MS};
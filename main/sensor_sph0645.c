@@ -0,0 +1,281 @@
+#include <stddef.h>
+#include <time.h>
+
+#include "battery_policy.h"
+#include "esp_timer.h"
+#include "sensor_driver.h"
+#include "sph0645.h"
+#include "timestamp.h"
+
+#define JSON_AVG_NOISE_KEY "avg_noise"
+#define JSON_MIN_NOISE_KEY "min_noise"
+#define JSON_MAX_NOISE_KEY "max_noise"
+#define JSON_LMAX_NOISE_KEY "lmax_noise"
+#define JSON_LMIN_NOISE_KEY "lmin_noise"
+#define JSON_TONES_KEY "tones"
+#define JSON_TONE_FREQUENCY_KEY "frequency"
+#define JSON_TONE_LEVEL_KEY "level"
+#define JSON_TONE_PROMINENCE_KEY "prominence"
+#define JSON_DSP_KEY "mic_dsp"
+#define JSON_DSP_BLOCKS_KEY "blocks"
+#define JSON_DSP_CYCLES_MEAN_KEY "cycles_mean"
+#define JSON_DSP_CYCLES_MAX_KEY "cycles_max"
+#define JSON_DSP_LOAD_MAX_KEY "load_max"
+#define JSON_DSP_LOST_BUFFERS_KEY "lost_buffers"
+#define JSON_DSP_STACK_FREE_KEY "stack_free"
+
+#define JSON_EVENT_ID_KEY "id"
+#define JSON_EVENT_TIME_KEY "time"
+#define JSON_EVENT_PEAK_KEY "peak"
+#define JSON_EVENT_DURATION_KEY "duration_ms"
+#define JSON_EVENT_PRE_TRIGGER_KEY "pre_trigger_ms"
+#define JSON_EVENT_SAMPLE_RATE_KEY "sample_rate"
+#define JSON_EVENT_FORMAT_KEY "format"
+#define JSON_EVENT_SIZE_KEY "size"
+
+#define EVENT_CHUNK_SIZE 4096  // Audio published per message (bytes).
+#define EVENT_CHUNKS 16        // Most audio messages published per report.
+#define EVENT_JSON_SIZE 256    // Size of the json describing an event.
+#define EVENT_ACK_TIMEOUT_MS 2000  // Time to wait for the broker to take
+                                   // earlier audio (ms).
+
+typedef struct {
+  uint32_t id;      // Id of the event the audio is from.
+  uint32_t offset;  // Offset of the audio in the event (bytes).
+  uint8_t audio[EVENT_CHUNK_SIZE];
+} event_chunk_t;
+
+// An event is described once and its audio is then published in chunks, up
+// to a limit per report so a long event doesn't hold up the others. Chunks
+// wait for the broker, so the client's outbox holds little of the audio.
+static event_chunk_t chunk;
+static bool event_described = false;
+static uint32_t event_id;
+static size_t event_offset;  // Audio of the event published so far (bytes).
+
+static const mqtt_discovery_t discovery[] = {
+    {.type = MQTT_SENSOR,
+     .device = DEFAULT_DEVICE,
+     .force_update = true,
+     .name = "Average Noise",
+     .state_topic = MQTT_DATA_STATE_TOPIC,
+     .unique_id = UNIQUE_ID(JSON_AVG_NOISE_KEY),
+     .sensor =
+         {
+             .icon = "mdi:volume-high",
+             .unit_of_measurement = NOISE_SCALE,
+         },
+     .value_template = VALUE_TEMPLATE(JSON_AVG_NOISE_KEY)},
+    {.type = MQTT_SENSOR,
+     .device = DEFAULT_DEVICE,
+     .force_update = true,
+     .name = "Minimum Noise",
+     .state_topic = MQTT_DATA_STATE_TOPIC,
+     .unique_id = UNIQUE_ID(JSON_MIN_NOISE_KEY),
+     .sensor =
+         {
+             .icon = "mdi:volume-minus",
+             .unit_of_measurement = NOISE_SCALE,
+         },
+     .value_template = VALUE_TEMPLATE(JSON_MIN_NOISE_KEY)},
+    {.type = MQTT_SENSOR,
+     .device = DEFAULT_DEVICE,
+     .force_update = true,
+     .name = "Maximum Noise",
+     .state_topic = MQTT_DATA_STATE_TOPIC,
+     .unique_id = UNIQUE_ID(JSON_MAX_NOISE_KEY),
+     .sensor =
+         {
+             .icon = "mdi:volume-plus",
+             .unit_of_measurement = NOISE_SCALE,
+         },
+     .value_template = VALUE_TEMPLATE(JSON_MAX_NOISE_KEY)},
+    {.type = MQTT_SENSOR,
+     .device = DEFAULT_DEVICE,
+     .force_update = true,
+     .name = "Noise Lmax",
+     .state_topic = MQTT_DATA_STATE_TOPIC,
+     .unique_id = UNIQUE_ID(JSON_LMAX_NOISE_KEY),
+     .sensor =
+         {
+             .icon = "mdi:volume-high",
+             .unit_of_measurement = NOISE_SCALE,
+         },
+     .value_template = VALUE_TEMPLATE(JSON_LMAX_NOISE_KEY)},
+    {.type = MQTT_SENSOR,
+     .device = DEFAULT_DEVICE,
+     .force_update = true,
+     .name = "Noise Lmin",
+     .state_topic = MQTT_DATA_STATE_TOPIC,
+     .unique_id = UNIQUE_ID(JSON_LMIN_NOISE_KEY),
+     .sensor =
+         {
+             .icon = "mdi:volume-low",
+             .unit_of_measurement = NOISE_SCALE,
+         },
+     .value_template = VALUE_TEMPLATE(JSON_LMIN_NOISE_KEY)},
+};
+
+static esp_err_t init() {
+  esp_err_t err = sph0645_reset();
+  if (err) return err;
+  sph0645_config_t sph_config = SPH0645_DEFAULT_CONFIG;
+  sph_config.sample_rate = CONFIG_MIC_SAMPLE_RATE;
+  sph_config.event_threshold = CONFIG_MIC_EVENT_THRESHOLD;
+  sph_config.event_pre_trigger = CONFIG_MIC_EVENT_PRE_MS;
+  sph_config.event_post_trigger = CONFIG_MIC_EVENT_POST_MS;
+  sph_config.spectrum_bins = CONFIG_MIC_SPECTRUM_BINS;
+  sph_config.dma_latency = CONFIG_MIC_DMA_LATENCY_MS;
+  return sph0645_set_config(&sph_config);
+}
+
+static esp_err_t wakeup(json_writer_t *json) {
+#ifdef USE_MAX17043
+  // only sample noise during the wakeup window when saving power
+  const battery_policy_t *policy = battery_policy_get();
+  if (policy->noise_enabled && !policy->noise_continuous) {
+    sph0645_clear_data();
+    return sph0645_resume();
+  }
+#endif  // USE_MAX17043
+  return ESP_OK;
+}
+
+static esp_err_t read(json_writer_t *json) {
+  sph0645_data_t data;
+  esp_err_t err = sph0645_get_data(&data);
+  sph0645_clear_data();
+  if (err) return err;
+  if (data.samples == 0) return ESP_ERR_INVALID_STATE;
+  json_add_number(json, JSON_AVG_NOISE_KEY, data.avg, DECIMALS);
+  json_add_number(json, JSON_MIN_NOISE_KEY, data.min, DECIMALS);
+  json_add_number(json, JSON_MAX_NOISE_KEY, data.max, DECIMALS);
+  json_add_number(json, JSON_LMAX_NOISE_KEY, data.lmax, DECIMALS);
+  json_add_number(json, JSON_LMIN_NOISE_KEY, data.lmin, DECIMALS);
+
+  // the loudest peaks of the spectrum, which stand out when tonal
+  if (data.num_peaks > 0) {
+    json_begin_array(json, JSON_TONES_KEY);
+    for (int i = 0; i < data.num_peaks; ++i) {
+      json_begin_object(json, NULL);
+      json_add_number(json, JSON_TONE_FREQUENCY_KEY, data.peaks[i].frequency,
+                      0);
+      json_add_number(json, JSON_TONE_LEVEL_KEY, data.peaks[i].level,
+                      DECIMALS);
+      json_add_number(json, JSON_TONE_PROMINENCE_KEY,
+                      data.peaks[i].prominence, DECIMALS);
+      json_end_object(json);
+    }
+    json_end_array(json);
+  }
+  return ESP_OK;
+}
+
+static void add_dsp_stats(json_writer_t *json) {
+  // the worst block shows how close the mic came to falling behind, and lost
+  // buffers show when it did, and the free stack how close the mic task came
+  // to overflowing
+  sph0645_dsp_stats_t stats;
+  sph0645_take_dsp_stats(&stats);
+  if (stats.blocks == 0 || stats.budget == 0) return;
+  json_begin_object(json, JSON_DSP_KEY);
+  json_add_int(json, JSON_DSP_BLOCKS_KEY, stats.blocks);
+  json_add_int(json, JSON_DSP_CYCLES_MEAN_KEY,
+               stats.cycles_total / stats.blocks);
+  json_add_int(json, JSON_DSP_CYCLES_MAX_KEY, stats.cycles_max);
+  json_add_number(json, JSON_DSP_LOAD_MAX_KEY,
+                  100.0 * stats.cycles_max / stats.budget, DECIMALS);
+  json_add_int(json, JSON_DSP_LOST_BUFFERS_KEY, stats.lost_buffers);
+  json_add_int(json, JSON_DSP_STACK_FREE_KEY, stats.stack_free);
+  json_end_object(json);
+}
+
+static esp_err_t sleep(json_writer_t *json) {
+  add_dsp_stats(json);
+#ifdef USE_MAX17043
+  // suspend the mic between reports unless the battery allows it to run
+  const battery_policy_t *policy = battery_policy_get();
+  if (policy->noise_continuous)
+    return sph0645_resume();
+  else
+    return sph0645_suspend();
+#endif  // USE_MAX17043
+  return ESP_OK;
+}
+
+static esp_err_t describe_event(const sph0645_event_t *event) {
+  char buf[EVENT_JSON_SIZE];
+  json_writer_t json;
+  json_writer_init(&json, buf, sizeof(buf));
+  json_add_int(&json, JSON_EVENT_ID_KEY, event->id);
+
+  // the event was timed on esp_timer, which only counts since boot
+  const int64_t stamp = timestamp_now() - (esp_timer_get_time() - event->time);
+  time_t time;
+  if (timestamp_to_time(stamp, &time) == ESP_OK)
+    json_add_int(&json, JSON_EVENT_TIME_KEY, time);
+  json_add_number(&json, JSON_EVENT_PEAK_KEY, event->peak, DECIMALS);
+  json_add_int(&json, JSON_EVENT_DURATION_KEY, event->duration);
+  json_add_int(&json, JSON_EVENT_PRE_TRIGGER_KEY, event->pre_trigger);
+  json_add_int(&json, JSON_EVENT_SAMPLE_RATE_KEY, event->sample_rate);
+  json_add_string(&json, JSON_EVENT_FORMAT_KEY,
+                  event->format == SPH0645_EVENT_FORMAT_ULAW ? "ulaw"
+                                                              : "pcm24");
+  json_add_int(&json, JSON_EVENT_SIZE_KEY, event->size);
+  esp_err_t err = json_writer_finish(&json);
+  if (err) return err;
+  return mqtt_publish_class(MQTT_EVENT, MQTT_EVENT_STATE_TOPIC, buf,
+                            json.len);
+}
+
+static esp_err_t drain() {
+  sph0645_event_t event;
+  esp_err_t err = sph0645_get_event(&event);
+  if (err) return err;
+
+  if (!event_described || event.id != event_id) {
+    err = describe_event(&event);
+    if (err) return err;
+    event_described = true;
+    event_id = event.id;
+    event_offset = 0;
+  }
+
+  // a chunk that fails is published again next time
+  for (int i = 0; i < EVENT_CHUNKS && event_offset < event.size; ++i) {
+    const size_t left = event.size - event_offset;
+    const size_t size = left < EVENT_CHUNK_SIZE ? left : EVENT_CHUNK_SIZE;
+    const size_t message_size = offsetof(event_chunk_t, audio) + size;
+    err = mqtt_wait_in_flight(MQTT_EVENT, message_size,
+                              CONFIG_MIC_EVENT_IN_FLIGHT,
+                              pdMS_TO_TICKS(EVENT_ACK_TIMEOUT_MS));
+    if (err) return err;
+    chunk.id = event.id;
+    chunk.offset = event_offset;
+    err = sph0645_read_event(event_offset, chunk.audio, size);
+    if (err) return err;
+    err = mqtt_publish_class(MQTT_EVENT, MQTT_EVENT_AUDIO_TOPIC, &chunk,
+                             message_size);
+    if (err) return err;
+    event_offset += size;
+  }
+
+  // recording starts again once the whole event is out
+  if (event_offset == event.size) {
+    sph0645_release_event();
+    event_described = false;
+  }
+  return ESP_OK;
+}
+
+const sensor_driver_t sph0645_sensor_driver = {
+    .name = "sph0645",
+    .init = init,
+    .wakeup = wakeup,
+    .read = read,
+    .sleep = sleep,
+    .drain = drain,
+    .discovery = discovery,
+    .num_discovery = sizeof(discovery) / sizeof(mqtt_discovery_t),
+    .warmup_time = 32 * 1000,  // sampling window when saving power
+    .publish_period = PUBLISH_PERIOD_MS};
@@ -0,0 +1,32 @@
+#include "sensor_driver.h"
+#include "wireless.h"
+
+#define JSON_SIGNAL_STRENGTH_KEY "signal_strength"
+
+static const mqtt_discovery_t discovery[] = {
+    {.type = MQTT_SENSOR,
+     .device = DEFAULT_DEVICE,
+     .device_class = "signal_strength",
+     .name = "Signal Strength",
+     .state_topic = MQTT_DATA_STATE_TOPIC,
+     .unique_id = UNIQUE_ID(JSON_SIGNAL_STRENGTH_KEY),
+     .sensor =
+         {
+             .unit_of_measurement = SIGNAL_STRENGTH_SCALE,
+         },
+     .value_template = VALUE_TEMPLATE(JSON_SIGNAL_STRENGTH_KEY)},
+};
+
+static esp_err_t read(json_writer_t *json) {
+  const int8_t rssi = wireless_get_rssi();
+  if (rssi == 0) return ESP_ERR_INVALID_STATE;  // not connected yet
+  json_add_int(json, JSON_SIGNAL_STRENGTH_KEY, rssi);
+  return ESP_OK;
+}
+
+const sensor_driver_t wifi_sensor_driver = {
+    .name = "wifi",
+    .read = read,
+    .discovery = discovery,
+    .num_discovery = sizeof(discovery) / sizeof(mqtt_discovery_t),
+    .publish_period = PUBLISH_PERIOD_MS};
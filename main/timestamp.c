@@ -0,0 +1,56 @@
+#include "timestamp.h"
+
+#include "esp_attr.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+
+// Timestamps count microseconds on a clock that never jumps. Until the time
+// is synchronized it is the system time, which starts at zero on power up and
+// keeps running through deep sleep. Once synchronized the system time steps
+// to the wall clock, so the step is kept as an offset instead.
+static RTC_DATA_ATTR bool synced = false;
+static RTC_DATA_ATTR int64_t sync_offset = 0;  // Wall time minus timestamp
+                                               // time (us).
+static RTC_DATA_ATTR uint32_t clock_id = 0;  // Identifies the clock, which
+                                             // restarts on power up.
+static int64_t timer_offset;  // System time minus esp_timer time (us).
+static portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+
+void timestamp_init() {
+  // esp_timer restarts on every boot, the system time doesn't
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  timer_offset = tv.tv_sec * 1000000LL + tv.tv_usec - esp_timer_get_time();
+  while (clock_id == 0) clock_id = esp_random();
+}
+
+int64_t timestamp_now() {
+  portENTER_CRITICAL(&mux);
+  const int64_t now = esp_timer_get_time() + timer_offset - sync_offset;
+  portEXIT_CRITICAL(&mux);
+  return now;
+}
+
+void timestamp_sync(const struct timeval *tv) {
+  // the system time has already been stepped to tv
+  const int64_t wall = tv->tv_sec * 1000000LL + tv->tv_usec;
+  portENTER_CRITICAL(&mux);
+  const int64_t timer = esp_timer_get_time();
+  const int64_t now = timer + timer_offset - sync_offset;
+  sync_offset = wall - now;
+  timer_offset = wall - timer;
+  synced = true;
+  portEXIT_CRITICAL(&mux);
+}
+
+bool timestamp_is_synced() { return synced; }
+
+uint32_t timestamp_get_clock() { return clock_id; }
+
+esp_err_t timestamp_to_time(int64_t stamp, time_t *time) {
+  if (!synced) return ESP_ERR_INVALID_STATE;
+  portENTER_CRITICAL(&mux);
+  *time = (stamp + sync_offset) / 1000000;
+  portEXIT_CRITICAL(&mux);
+  return ESP_OK;
+}
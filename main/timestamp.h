@@ -0,0 +1,16 @@
+#pragma once
+#include <sys/time.h>
+
+#include "esp_system.h"
+
+void timestamp_init();
+
+int64_t timestamp_now();
+
+void timestamp_sync(const struct timeval *tv);
+
+bool timestamp_is_synced();
+
+uint32_t timestamp_get_clock();
+
+esp_err_t timestamp_to_time(int64_t stamp, time_t *time);
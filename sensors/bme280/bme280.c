@@ -1,8 +1,13 @@
 #include "bme280.h"
 
 #include <math.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <string.h>
 
+#include "esp32/rom/crc.h"
+#include "esp_attr.h"
+#include "esp_log.h"
 #include "i2c.h"
 #include "nvs.h"
 #include "nvs_flash.h"
@@ -17,19 +22,42 @@
 #define REG_DATA_START 0xf7
 #define REG_TRIM_T1_TO_H1 0x88
 #define REG_TRIM_H2_TO_H6 0xe1
+#define TRIM_T1_TO_H1_SIZE 26  // Size of the first block of trimming
+                               // parameters (bytes).
+#define TRIM_T1_TO_P9_SIZE 24  // Part of the first block laid out as it is
+                               // in dig_t (bytes).
+#define TRIM_H1_OFFSET 25      // Offset of h1 in the first block.
+#define TRIM_H2_TO_H6_SIZE 7   // Size of the second block (bytes).
 
 #define MEASURING_BIT 8
 #define IM_UPDATE_BIT 1
 
 #define DEFAULT_WAIT_TIME 100 / portTICK_PERIOD_MS
 
+#define NVS_NAMESPACE "bme280"
+#define NVS_DIG_KEY_FORMAT "dig_%02x"  // Trimming parameters of a chip id.
+#define DIG_CACHE_VERSION 1  // Version of the cached trimming parameters.
+
+#define MEASURE_BASE_US 1250  // Time of a measurement besides its readings,
+                              // from section 9.1 of the datasheet (us).
+#define MEASURE_SAMPLE_US 2300  // Time of each oversampled reading (us).
+#define MEASURE_SETUP_US 575    // Time to set up pressure or humidity (us).
+
 #define MAX(a, b) (a > b ? a : b)
 
-static double
+// Device state is kept in RTC memory so that it survives deep sleep, where the
+// BME280 stays powered and keeps its configuration.
+static RTC_DATA_ATTR double
     elevation;  // The elevation of the weather station (meters). Used to
                 // compensate pressure at current elevation from sea level.
-
-static struct {
+static RTC_DATA_ATTR bool dig_valid = false;  // Whether dig has been read.
+static RTC_DATA_ATTR bool normal_mode = false;  // Whether the device measures
+                                                // on its own.
+static RTC_DATA_ATTR uint32_t measurement_time = 0;  // Longest a forced
+                                                     // measurement takes with
+                                                     // the config (us).
+
+typedef struct {
   uint16_t t1;
   int16_t t2;
   int16_t t3;
@@ -50,7 +78,26 @@ static struct {
   int16_t h4;
   int16_t h5;
   int8_t h6;
-} dig;  // Trimming parameters.
+} dig_t;
+
+typedef struct {
+  uint8_t chip_id;
+  uint8_t version;
+  dig_t dig;
+  uint32_t crc;  // CRC-32 of everything before it.
+} dig_cache_t;
+
+static const char *TAG = "bme280";
+static RTC_DATA_ATTR dig_t dig;  // Trimming parameters.
+
+static double scale_height(double celsius) {
+  // height over which pressure falls by a factor of e (meters)
+  const double M = 0.02897,  // molar mass of Eath's air (kg/mol)
+      g = 9.807665,          // gravitational constant (m/s^2)
+      R = 8.3145,            // universal gas constant (J/mol*K)
+      K = celsius + 273.15;  // temperature in Kelvin
+  return (R * K) / (M * g);
+}
 
 static int32_t calculate_t_fine(const int32_t adc_T) {
   // This mess of code taken straight from the datasheet. Best not to mess with
@@ -120,18 +167,98 @@ static uint32_t compensate_humidity(const int32_t t_fine, const int32_t adc_H) {
   return H;
 }
 
+static uint32_t oversampling(uint8_t osrs) {
+  // settings past 16x are 16x too
+  if (osrs == 0) return 0;
+  return 1 << ((osrs > 5 ? 5 : osrs) - 1);
+}
+
+static uint32_t get_measurement_time(const bme280_config_t *config) {
+  // the maximum, where skipped readings take no time
+  const uint32_t t = oversampling(config->ctrl_meas.osrs_t),
+                 p = oversampling(config->ctrl_meas.osrs_p),
+                 h = oversampling(config->ctrl_hum.osrs_h);
+  uint32_t time = MEASURE_BASE_US + t * MEASURE_SAMPLE_US;
+  if (p) time += p * MEASURE_SAMPLE_US + MEASURE_SETUP_US;
+  if (h) time += h * MEASURE_SAMPLE_US + MEASURE_SETUP_US;
+  return time;
+}
+
 static esp_err_t wait_for_device(uint8_t bit_to_wait_for) {
-  for (uint8_t bit = 1; bit & bit_to_wait_for;) {
+  for (uint8_t bit = bit_to_wait_for; bit & bit_to_wait_for;) {
     // Wait for the device to be ready by reading the status register
     esp_err_t err =
-        i2c_bus_read(I2C_ADDRESS, REG_RESET, &bit, 1, DEFAULT_WAIT_TIME);
+        i2c_bus_read(I2C_ADDRESS, REG_STATUS, &bit, 1, DEFAULT_WAIT_TIME);
     if (err) return err;
   }
   return ESP_OK;
 }
 
+static esp_err_t read_dig(const uint8_t *first, dig_t *out) {
+  // read the second block of trimming parameters and unpack both, h4 and h5
+  // share a byte and their top bytes are signed
+  uint8_t buf[TRIM_H2_TO_H6_SIZE];
+  esp_err_t err = i2c_bus_read(I2C_ADDRESS, REG_TRIM_H2_TO_H6, buf,
+                               sizeof(buf), DEFAULT_WAIT_TIME);
+  if (err) return err;
+  memset(out, 0, sizeof(*out));
+  memcpy(out, first, TRIM_T1_TO_P9_SIZE);
+  out->h1 = first[TRIM_H1_OFFSET];
+  out->h2 = buf[1] << 8 | buf[0];
+  out->h3 = buf[2];
+  out->h4 = (int8_t)buf[3] * 16 | (buf[4] & 0x0f);
+  out->h5 = (int8_t)buf[5] * 16 | buf[4] >> 4;
+  out->h6 = buf[6];
+  return ESP_OK;
+}
+
+static void get_dig_key(uint8_t chip_id, char *key) {
+  sprintf(key, NVS_DIG_KEY_FORMAT, chip_id);
+}
+
+static esp_err_t load_dig(uint8_t chip_id, dig_t *out) {
+  char key[8];
+  get_dig_key(chip_id, key);
+  nvs_handle_t nvs;
+  esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs);
+  if (err) return err;
+  dig_cache_t cache;
+  size_t size = sizeof(cache);
+  err = nvs_get_blob(nvs, key, &cache, &size);
+  nvs_close(nvs);
+  if (err) return err;
+
+  // a cache from another chip id, an older version or one that was
+  // corrupted is ignored
+  if (size != sizeof(cache) || cache.chip_id != chip_id ||
+      cache.version != DIG_CACHE_VERSION ||
+      cache.crc != crc32_le(0, (uint8_t *)&cache, offsetof(dig_cache_t, crc)))
+    return ESP_ERR_INVALID_CRC;
+  *out = cache.dig;
+  return ESP_OK;
+}
+
+static void save_dig(uint8_t chip_id, const dig_t *in) {
+  char key[8];
+  get_dig_key(chip_id, key);
+  dig_cache_t cache;
+  memset(&cache, 0, sizeof(cache));
+  cache.chip_id = chip_id;
+  cache.version = DIG_CACHE_VERSION;
+  cache.dig = *in;
+  cache.crc = crc32_le(0, (uint8_t *)&cache, offsetof(dig_cache_t, crc));
+
+  nvs_handle_t nvs;
+  if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) return;
+  if (nvs_set_blob(nvs, key, &cache, sizeof(cache)) == ESP_OK) nvs_commit(nvs);
+  nvs_close(nvs);
+}
+
 esp_err_t bme280_reset() {
   i2c_init();
+  dig_valid = false;
+  normal_mode = false;
+  measurement_time = MEASURE_BASE_US;
 
   const uint8_t soft_reset_word =
       0xb6;  // The soft reset word which resets the device using the complete
@@ -143,22 +270,36 @@ esp_err_t bme280_reset() {
   err = wait_for_device(IM_UPDATE_BIT);
   if (err) return err;
 
-  // read the trimming parameters and copy them to memory
-  char buf[32];
-  err =
-      i2c_bus_read(I2C_ADDRESS, REG_TRIM_T1_TO_H1, buf, 25, DEFAULT_WAIT_TIME);
+  // the trimming parameters never change, so they are cached in nvs. Every
+  // chip has the same id, so the first block, whose temperature and pressure
+  // trimming differs from chip to chip, is read every time to make sure the
+  // cache is for this one, and the rest only when it isn't.
+  uint8_t chip_id;
+  err = bme280_get_chip_id(&chip_id);
   if (err) return err;
-  err = i2c_bus_read(I2C_ADDRESS, REG_TRIM_H2_TO_H6, buf + 25, 7,
+  uint8_t first[TRIM_T1_TO_H1_SIZE];
+  err = i2c_bus_read(I2C_ADDRESS, REG_TRIM_T1_TO_H1, first, sizeof(first),
                      DEFAULT_WAIT_TIME);
   if (err) return err;
-  memcpy(&dig, buf, 25);
-  dig.h2 = buf[26] << 8 | buf[25];
-  dig.h3 = buf[27];
-  dig.h4 = buf[28] << 4 | (buf[29] & 0x0f);
-  dig.h5 = buf[30] << 4 | buf[29] >> 4;
-  dig.h6 = buf[31];
+  const bool cached = load_dig(chip_id, &dig) == ESP_OK;
+  if (cached && memcmp(&dig, first, TRIM_T1_TO_P9_SIZE) == 0) {
+    dig_valid = true;
+    return ESP_OK;
+  }
+
+  if (cached) ESP_LOGW(TAG, "cached trimming parameters are for another chip");
+  err = read_dig(first, &dig);
+  if (err) return err;
+  save_dig(chip_id, &dig);
+  dig_valid = true;
 
-  return err;
+  return ESP_OK;
+}
+
+esp_err_t bme280_resume() {
+  // the device kept its trimming parameters and config through deep sleep
+  if (!dig_valid) return ESP_ERR_INVALID_STATE;
+  return i2c_init();
 }
 
 esp_err_t bme280_set_config(const bme280_config_t *config) {
@@ -177,7 +318,10 @@ esp_err_t bme280_set_config(const bme280_config_t *config) {
   if (err) return err;
   err = i2c_bus_write(I2C_ADDRESS, REG_CTRL_MEAS, &(config->ctrl_meas.val), 1,
                       DEFAULT_WAIT_TIME);
-  return err;
+  if (err) return err;
+  normal_mode = config->ctrl_meas.mode == BME280_NORMAL_MODE;
+  measurement_time = get_measurement_time(config);
+  return ESP_OK;
 }
 
 esp_err_t bme280_get_config(bme280_config_t *config) {
@@ -208,13 +352,29 @@ esp_err_t bme280_force_measurement() {
   return err;
 }
 
-esp_err_t bme280_get_data(bme280_data_t *data) {
-  esp_err_t err = wait_for_device(MEASURING_BIT);
+uint32_t bme280_get_measurement_time() { return measurement_time; }
+
+esp_err_t bme280_is_measuring(bool *measuring) {
+  uint8_t status;
+  esp_err_t err =
+      i2c_bus_read(I2C_ADDRESS, REG_STATUS, &status, 1, DEFAULT_WAIT_TIME);
   if (err) return err;
+  *measuring = status & MEASURING_BIT;
+  return ESP_OK;
+}
+
+esp_err_t bme280_get_data(bme280_data_t *data) {
+  // in normal mode the data registers are shadowed while a conversion runs,
+  // so the last result can be read without waiting
+  if (!normal_mode) {
+    esp_err_t err = wait_for_device(MEASURING_BIT);
+    if (err) return err;
+  }
 
   // get uncompensated data from the device
   uint8_t buf[8];
-  err = i2c_bus_read(I2C_ADDRESS, REG_DATA_START, buf, 8, DEFAULT_WAIT_TIME);
+  esp_err_t err =
+      i2c_bus_read(I2C_ADDRESS, REG_DATA_START, buf, 8, DEFAULT_WAIT_TIME);
   if (err) return err;
 
   // swap the endianness and align
@@ -241,27 +401,29 @@ esp_err_t bme280_get_data(bme280_data_t *data) {
     data->temperature = NAN;
     data->humidity = NAN;
     data->pressure = NAN;
+    data->station_pressure = NAN;
+    data->sea_level_pressure = NAN;
     return ESP_ERR_INVALID_STATE;
   }
 
   // get pressure value
   if (adc_P != 0x80000) {
     // compensate for pressure at current_elevation
-    const uint32_t pressure_sea_level =
-        compensate_pressure(t_fine, adc_P) / 256;
-    const double M = 0.02897,  // molar mass of Eath's air (kg/mol)
-        g = 9.807665,          // gravitational constant (m/s^2)
-        R = 8.3145,            // universal gas constant (J/mol*K)
-        K = celsius + 273.15;  // temperature in Kelvin
-    data->pressure =
-        pressure_sea_level * exp((M * g) / (R * K) * elevation);  // default Pa
+    const uint32_t station_pressure = compensate_pressure(t_fine, adc_P) / 256;
+    data->station_pressure = station_pressure;
+    data->sea_level_pressure =
+        station_pressure * exp(elevation / scale_height(celsius));
+    data->pressure = data->sea_level_pressure;  // default Pa
 #ifdef CONFIG_IN_HG
     data->pressure /= 3386.0;  // convert to inHg
 #elif defined(CONFIG_MM_HG)
     data->pressure /= 133.0;                         // convert to mmHg
 #endif
-  } else
+  } else {
     data->pressure = NAN;
+    data->station_pressure = NAN;
+    data->sea_level_pressure = NAN;
+  }
 
   // get humidity value
   if (adc_H != 0x800)
@@ -286,9 +448,31 @@ esp_err_t bme280_get_data(bme280_data_t *data) {
 }
 
 esp_err_t bme280_get_chip_id(uint8_t *chip_id) {
-  return i2c_bus_write(I2C_ADDRESS, REG_CHIP_ID, chip_id, 1, DEFAULT_WAIT_TIME);
+  return i2c_bus_read(I2C_ADDRESS, REG_CHIP_ID, chip_id, 1, DEFAULT_WAIT_TIME);
 }
 
 double bme280_get_elevation() { return elevation; }
 
-void bme280_set_elevation(int32_t meters) { elevation = meters; }
\ No newline at end of file
+void bme280_set_elevation(int32_t meters) { elevation = meters; }
+
+esp_err_t bme280_estimate_elevation(const bme280_data_t *data,
+                                    double sea_level_pressure,
+                                    double *elevation) {
+  if (isnan(data->station_pressure) || isnan(data->temperature) ||
+      sea_level_pressure <= 0)
+    return ESP_ERR_INVALID_ARG;
+
+  // undo the temperature conversion from bme280_get_data()
+#ifdef CONFIG_CELSIUS
+  const double celsius = data->temperature;
+#elif defined(CONFIG_FAHRENHEIT)
+  const double celsius = (data->temperature - 32) * 5.0 / 9.0;
+#elif defined(CONFIG_KELVIN)
+  const double celsius = data->temperature - 273.15;
+#endif
+
+  // invert the sea level correction from bme280_get_data()
+  *elevation = scale_height(celsius) *
+               log(sea_level_pressure / data->station_pressure);
+  return ESP_OK;
+}
\ No newline at end of file
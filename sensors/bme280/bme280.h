@@ -32,10 +32,20 @@
 #define BME280_WEATHER_MONITORING                      \
   {.config = {.spi3w_en = 0, .t_sb = 0, .filter = 0},  \
    .ctrl_meas = {.mode = 1, .osrs_p = 1, .osrs_t = 1}, \
-   .ctrl_hum = {.osrs_h = 1}};
+   .ctrl_hum = {.osrs_h = 1}}
+
+// Measures continuously with the given standby and IIR filter, oversampled
+// for the lowest noise the datasheet recommends for indoor navigation.
+#define BME280_CONTINUOUS(standby, iir)                          \
+  {.config = {.spi3w_en = 0, .t_sb = (standby), .filter = (iir)}, \
+   .ctrl_meas = {.mode = 3, .osrs_p = 5, .osrs_t = 2},           \
+   .ctrl_hum = {.osrs_h = 1}}
 
 typedef struct {
   double pressure;
+  double station_pressure;  // Pressure at the sensor before it is corrected
+                            // to sea level (Pa).
+  double sea_level_pressure;  // Pressure corrected to sea level (Pa).
   float temperature;
   float humidity;
   double dew_point;
@@ -76,15 +86,22 @@ typedef struct {
 } bme280_config_t;
 
 esp_err_t bme280_reset();
+esp_err_t bme280_resume();
 
 esp_err_t bme280_set_config(const bme280_config_t *config);
 esp_err_t bme280_get_config(bme280_config_t *config);
 
 esp_err_t bme280_force_measurement();
+uint32_t bme280_get_measurement_time();  // Longest a forced measurement
+                                         // takes (us).
+esp_err_t bme280_is_measuring(bool *measuring);
 
 esp_err_t bme280_get_data(bme280_data_t *data);
 
 esp_err_t bme280_get_chip_id(uint8_t *chip_id);
 
 double bme280_get_elevation();
-void bme280_set_elevation(int32_t meters);
\ No newline at end of file
+void bme280_set_elevation(int32_t meters);
+esp_err_t bme280_estimate_elevation(const bme280_data_t *data,
+                                    double sea_level_pressure,
+                                    double *elevation);
\ No newline at end of file
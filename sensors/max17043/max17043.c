@@ -2,6 +2,7 @@
 
 #include <math.h>
 
+#include "driver/gpio.h"
 #include "esp32/rom/ets_sys.h"
 #include "i2c.h"
 
@@ -17,6 +18,9 @@
 #define CONFIG_REG 0x0c
 #define COMMAND_REG 0xfe
 
+#define PIN_NUM_ALRT \
+  CONFIG_MAX17043_ALERT_PIN  // ALRT is open-drain and pulled low on an alert
+
 #define DEFAULT_WAIT_TIME 100 / portTICK_PERIOD_MS
 
 esp_err_t max17043_reset() {
@@ -38,7 +42,7 @@ esp_err_t max17043_get_config(max17043_config_t *config) {
   esp_err_t err =
       i2c_bus_read(DEVICE_ADDRESS, CONFIG_REG, buf, 2, DEFAULT_WAIT_TIME);
   if (err) return err;
-  config->config.val = buf[0] << 8 | buf[1];
+  config->config.val = buf[1] << 8 | buf[0];  // same byte order as written
 
   err = i2c_bus_read(DEVICE_ADDRESS, MODE_REG, buf, 2, DEFAULT_WAIT_TIME);
   if (err) return err;
@@ -60,6 +64,30 @@ esp_err_t max17043_get_data(max17043_data_t *data) {
 
 uint8_t max17043_alert_threshold(uint8_t percentage) { return 32 - percentage; }
 
+esp_err_t max17043_set_alert_handler(max17043_alert_handler_t handler,
+                                     void *arg) {
+  if (handler == NULL) return gpio_isr_handler_remove(PIN_NUM_ALRT);
+
+  // configure the alert pin as an input with a pullup
+  gpio_reset_pin(PIN_NUM_ALRT);
+  gpio_set_direction(PIN_NUM_ALRT, GPIO_MODE_INPUT);
+  gpio_set_pull_mode(PIN_NUM_ALRT, GPIO_PULLUP_ONLY);
+  gpio_set_intr_type(PIN_NUM_ALRT, GPIO_INTR_NEGEDGE);
+
+  // the isr service may already be installed by another driver
+  esp_err_t err = gpio_install_isr_service(0);
+  if (err && err != ESP_ERR_INVALID_STATE) return err;
+  return gpio_isr_handler_add(PIN_NUM_ALRT, handler, arg);
+}
+
+esp_err_t max17043_clear_alert() {
+  max17043_config_t config;
+  esp_err_t err = max17043_get_config(&config);
+  if (err) return err;
+  config.config.alrt = 0;  // re-arms the alert pin
+  return max17043_set_config(&config);
+}
+
 esp_err_t max17043_get_version(uint16_t *version) {
   uint8_t buf[2];
   esp_err_t err =
@@ -56,6 +56,8 @@ typedef struct {
                   // values are reserved.
 } max17043_config_t;
 
+typedef void (*max17043_alert_handler_t)(void *arg);  // Called from an ISR.
+
 esp_err_t max17043_reset();
 
 esp_err_t max17043_set_config(const max17043_config_t *config);
@@ -65,4 +67,8 @@ esp_err_t max17043_get_data(max17043_data_t *data);
 
 uint8_t max17043_alert_threshold(uint8_t percentage);
 
+esp_err_t max17043_set_alert_handler(max17043_alert_handler_t handler,
+                                     void *arg);
+esp_err_t max17043_clear_alert();
+
 esp_err_t max17043_get_version(uint16_t *version);
\ No newline at end of file
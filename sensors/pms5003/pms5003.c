@@ -12,6 +12,8 @@
 
 static uint8_t pms5003_mode;
 static int64_t fan_on_tick = -1;
+static bool uart_held = false;  // Whether the uart is kept from light sleep
+                                // while waiting for a frame.
 
 esp_err_t pms5003_reset() {
   uart_init();
@@ -66,25 +68,51 @@ esp_err_t pms5003_set_config(const pms5003_config_t *config) {
   return ESP_OK;
 }
 
-esp_err_t pms5003_get_data(pms5003_data_t *data) {
+static void release_uart() {
+  if (!uart_held) return;
+  uart_bus_release();
+  uart_held = false;
+}
+
+esp_err_t pms5003_request_data() {
   if (fan_on_tick < 0)
     return ESP_ERR_INVALID_STATE;  // pms5003 is sleeping, so it won't respond
                                    // to uart commands
 
-  data->checksum_ok = false;  // assume data is bad
-  data->fan_on_time = (esp_timer_get_time() - fan_on_tick) / 1000;
+  // only read new data
+  esp_err_t err = uart_bus_flush();
+  if (err) return err;
+
+  // bytes that arrive during light sleep are lost, so stay awake until the
+  // frame has been read
+  if (!uart_held && uart_bus_hold() == ESP_OK) uart_held = true;
 
-  // allocate a buffer and read the data in
-  uint8_t buffer[32];
   if (pms5003_mode == PMS5003_PASSIVE) {
     // request data from the device
     const uint8_t cmd[] = {0x42, 0x4d, 0xe2, 0x00, 0x00, 0x01, 0x71};
-    esp_err_t err = uart_bus_write(cmd, sizeof(cmd), DEFAULT_WAIT_TIME);
-    if (err) return err;
+    err = uart_bus_write(cmd, sizeof(cmd), DEFAULT_WAIT_TIME);
   }
 
+  // no frame is coming to release the uart
+  if (err) release_uart();
+  return err;
+}
+
+esp_err_t pms5003_notify_ready(EventGroupHandle_t events, EventBits_t bits) {
+  // a whole frame can be read without blocking
+  return uart_bus_notify(PMS5003_FRAME_SIZE, events, bits);
+}
+
+esp_err_t pms5003_read_data(pms5003_data_t *data) {
+  if (fan_on_tick < 0) return ESP_ERR_INVALID_STATE;
+
+  data->checksum_ok = false;  // assume data is bad
+  data->fan_on_time = (esp_timer_get_time() - fan_on_tick) / 1000;
+
   // read the data from the device
-  esp_err_t err = uart_bus_read(buffer, 32, DEFAULT_WAIT_TIME);
+  uint8_t buffer[PMS5003_FRAME_SIZE];
+  esp_err_t err = uart_bus_read(buffer, sizeof(buffer), DEFAULT_WAIT_TIME);
+  release_uart();
   if (err) return err;
 
   // copy data over, swap endianness
@@ -99,4 +127,10 @@ esp_err_t pms5003_get_data(pms5003_data_t *data) {
   if (checksum == (buffer[30] << 8 | buffer[31])) data->checksum_ok = true;
 
   return ESP_OK;
-}
\ No newline at end of file
+}
+
+esp_err_t pms5003_get_data(pms5003_data_t *data) {
+  esp_err_t err = pms5003_request_data();
+  if (err) return err;
+  return pms5003_read_data(data);
+}
@@ -1,11 +1,14 @@
 #pragma once
 
 #include "esp_system.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
 
 #define PMS5003_WAKEUP 1  // PMS5003 wakeup.
 #define PMS5003_SLEEP 0   // PMS5003 sleep.
 #define PMS5003_ACTIVE 1  // PMS5003 active mode.
 #define PMS5003_PASSIVE 0 // PMS5003 passive mode.
+#define PMS5003_FRAME_SIZE 32 // Size of a PMS5003 data frame in bytes.
 
 typedef struct
 {
@@ -62,6 +65,10 @@ esp_err_t pms5003_reset();
 esp_err_t pms5003_get_config(pms5003_config_t *config);
 esp_err_t pms5003_set_config(const pms5003_config_t *config);
 
+esp_err_t pms5003_request_data();
+esp_err_t pms5003_notify_ready(EventGroupHandle_t events, EventBits_t bits);
+esp_err_t pms5003_read_data(pms5003_data_t *data);
+
 esp_err_t pms5003_get_data(pms5003_data_t *data);
 
 esp_err_t pms5003_get_power(uint32_t *level);
@@ -0,0 +1,15 @@
+#pragma once
+
+#include "esp_attr.h"
+#include "sdkconfig.h"
+
+// The filters that run on every sample can be kept in iram, where they don't
+// compete with wifi for the flash cache and take the same time on every
+// block. The rest of the block path is cheap enough to run from flash.
+#ifdef CONFIG_MIC_DSP_IN_IRAM
+#define DSP_ATTR IRAM_ATTR
+#define DSP_SECTION(name) ".pushsection .iram1." name ", \"ax\"\n"
+#else
+#define DSP_ATTR
+#define DSP_SECTION(name) ".pushsection .text." name ", \"ax\"\n"
+#endif  // CONFIG_MIC_DSP_IN_IRAM
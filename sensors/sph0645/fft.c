@@ -0,0 +1,100 @@
+#include "fft.h"
+
+#include <math.h>
+
+// The twiddle factors are stepped with a recurrence instead of being looked
+// up, which costs a couple of multiplies per butterfly group but needs no
+// table, and keeps everything in single precision for the FPU.
+
+static void rotate(float *wr, float *wi, float wpr, float wpi) {
+  // multiply w by 1 + wp, which keeps more precision than multiplying by
+  // the rotation itself
+  const float t = *wr;
+  *wr += t * wpr - *wi * wpi;
+  *wi += *wi * wpr + t * wpi;
+}
+
+static void fft_complex(float *data, size_t n) {
+  // reorder the n complex values into bit reversed order
+  for (size_t i = 0, j = 0; i < n; ++i) {
+    if (i < j) {
+      float t = data[2 * i];
+      data[2 * i] = data[2 * j];
+      data[2 * j] = t;
+      t = data[2 * i + 1];
+      data[2 * i + 1] = data[2 * j + 1];
+      data[2 * j + 1] = t;
+    }
+    size_t m = n >> 1;
+    while (m >= 1 && j >= m) {
+      j -= m;
+      m >>= 1;
+    }
+    j += m;
+  }
+
+  // then combine transforms of twice the length each pass
+  for (size_t len = 1; len < n; len <<= 1) {
+    const float theta = M_PI / len;
+    const float s = sinf(0.5f * theta);
+    const float wpr = -2 * s * s, wpi = sinf(theta);
+    float wr = 1, wi = 0;
+    for (size_t m = 0; m < len; ++m) {
+      for (size_t i = 2 * m; i < 2 * n; i += 4 * len) {
+        const size_t k = i + 2 * len;
+        const float tr = wr * data[k] - wi * data[k + 1];
+        const float ti = wr * data[k + 1] + wi * data[k];
+        data[k] = data[i] - tr;
+        data[k + 1] = data[i + 1] - ti;
+        data[i] += tr;
+        data[i + 1] += ti;
+      }
+      rotate(&wr, &wi, wpr, wpi);
+    }
+  }
+}
+
+float fft_window_hann(float *data, size_t n) {
+  // returns the sum of the squared window, which scales the power spectrum
+  const float theta = 2 * M_PI / n;
+  const float s = sinf(0.5f * theta);
+  const float wpr = -2 * s * s, wpi = sinf(theta);
+  float wr = 1, wi = 0, sum_sqr = 0;
+  for (size_t i = 0; i < n; ++i) {
+    const float w = 0.5f - 0.5f * wr;
+    data[i] *= w;
+    sum_sqr += w * w;
+    rotate(&wr, &wi, wpr, wpi);
+  }
+  return sum_sqr;
+}
+
+void fft_real(float *data, size_t n) {
+  // n real values are transformed as n / 2 complex values, then untangled
+  // into the first half of the spectrum. The result is packed in place with
+  // the real dc and nyquist terms first, then the real and imaginary parts of
+  // each bin. Its sign convention is the conjugate of the usual one, which
+  // makes no difference to the power.
+  const size_t half = n / 2;
+  fft_complex(data, half);
+
+  const float theta = M_PI / half;
+  const float s = sinf(0.5f * theta);
+  const float wpr = -2 * s * s, wpi = sinf(theta);
+  float wr = 1 + wpr, wi = wpi;
+  for (size_t k = 1; k < n / 4; ++k) {
+    const size_t i = 2 * k, j = n - 2 * k;
+    const float h1r = 0.5f * (data[i] + data[j]);
+    const float h1i = 0.5f * (data[i + 1] - data[j + 1]);
+    const float h2r = 0.5f * (data[i + 1] + data[j + 1]);
+    const float h2i = -0.5f * (data[i] - data[j]);
+    data[i] = h1r + wr * h2r - wi * h2i;
+    data[i + 1] = h1i + wr * h2i + wi * h2r;
+    data[j] = h1r - wr * h2r + wi * h2i;
+    data[j + 1] = -h1i + wr * h2i + wi * h2r;
+    rotate(&wr, &wi, wpr, wpi);
+  }
+  const float dc = data[0];
+  data[0] = dc + data[1];
+  data[1] = dc - data[1];
+}
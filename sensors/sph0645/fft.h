@@ -0,0 +1,7 @@
+#pragma once
+
+#include "esp_system.h"
+
+float fft_window_hann(float *data, size_t n);
+
+void fft_real(float *data, size_t n);
@@ -1,5 +1,19 @@
 #include "sos_iir_filter.h"
 
+#include <math.h>
+
+#include "dsp_attr.h"
+
+#define MAX_SOS 3  // Most second-order sections in a filter.
+#define REFERENCE_FREQUENCY 1000.0  // Weightings are 0 dB here (Hz).
+#define EQUALIZER_SAMPLE_RATE 48000.0  // Rate the equalizer was designed at.
+
+// Poles of the IEC 61672 frequency weightings (Hz).
+#define WEIGHTING_F1 20.598997
+#define WEIGHTING_F2 107.65265
+#define WEIGHTING_F3 737.86223
+#define WEIGHTING_F4 12194.217
+
 typedef struct {
   float b1;
   float b2;
@@ -13,16 +27,26 @@ typedef struct {
 } SOS_Delay_State;
 
 typedef struct {
-  const int num_sos;
-  const float gain;
-  SOS_Coefficients *sos;
-  SOS_Delay_State *w;
+  int num_sos;
+  float gain;
+  SOS_Coefficients sos[MAX_SOS];
+  SOS_Delay_State w[MAX_SOS];
 } SOS_IIR_Filter;
 
-static SOS_Delay_State *mic_w = NULL, *c_weighting_w = NULL;
+typedef struct {
+  double b[3];  // Numerator in powers of z^-1.
+  double a[3];  // Denominator in powers of z^-1.
+} biquad_t;
+
+static SOS_IIR_Filter mic_filter, a_filter, c_filter;
 
 extern int sos_filter_f32(float *input, float *output, int len,
                           const SOS_Coefficients *coeffs, SOS_Delay_State *w);
+extern float sos_filter_sum_sqr_f32(float *input, float *output, int len,
+                                    const SOS_Coefficients *coeffs,
+                                    SOS_Delay_State *w, float gain);
+
+#ifdef __XTENSA__
 __asm__(
     //
     // ESP32 implementation of IIR Second-Order Section filter
@@ -35,7 +59,7 @@ __asm__(
     // float* a6 = w;
     // float  a7 = gain;
     //
-    ".text                    \n"
+    DSP_SECTION("sos_filter_f32")
     ".align  4                \n"
     ".global sos_filter_f32   \n"
     ".type   sos_filter_f32,@function\n"
@@ -61,11 +85,9 @@ __asm__(
     "  ssi     f4, a6, 0      \n"  // w[0] = f4;
     "  ssi     f5, a6, 4      \n"  // w[1] = f5;
     "  movi.n   a2, 0         \n"  // return 0;
-    "  retw.n                 \n");
+    "  retw.n                 \n"
+    ".popsection              \n");
 
-extern float sos_filter_sum_sqr_f32(float *input, float *output, int len,
-                                    const SOS_Coefficients *coeffs,
-                                    SOS_Delay_State *w, float gain);
 __asm__(
     //
     // ESP32 implementation of IIR Second-Order section filter with applied
@@ -79,7 +101,7 @@ __asm__(
     // float* a6 = w;
     // float  a7 = gain;
     //
-    ".text                    \n"
+    DSP_SECTION("sos_filter_sum_sqr_f32")
     ".align  4                \n"
     ".global sos_filter_sum_sqr_f32 \n"
     ".type   sos_filter_sum_sqr_f32,@function \n"
@@ -110,96 +132,187 @@ __asm__(
     "  ssi     f5, a6, 4      \n"  // w[1] = f5;
     "  rfr     a2, f10        \n"  // return sum_sqr;
     "  retw.n                 \n"  //
-);
+    ".popsection              \n");
+#else
+// The same filters in C for other targets, such as the host tests.
+int sos_filter_f32(float *input, float *output, int len,
+                   const SOS_Coefficients *coeffs, SOS_Delay_State *w) {
+  float w0 = w->w0, w1 = w->w1;
+  for (int i = 0; i < len; ++i) {
+    const float x = input[i] + coeffs->a1 * w0 + coeffs->a2 * w1;
+    output[i] = x + coeffs->b1 * w0 + coeffs->b2 * w1;
+    w1 = w0;
+    w0 = x;
+  }
+  w->w0 = w0;
+  w->w1 = w1;
+  return 0;
+}
+
+float sos_filter_sum_sqr_f32(float *input, float *output, int len,
+                             const SOS_Coefficients *coeffs,
+                             SOS_Delay_State *w, float gain) {
+  float w0 = w->w0, w1 = w->w1, sum_sqr = 0;
+  for (int i = 0; i < len; ++i) {
+    const float x = input[i] + coeffs->a1 * w0 + coeffs->a2 * w1;
+    const float y = (x + coeffs->b1 * w0 + coeffs->b2 * w1) * gain;
+    output[i] = y;
+    sum_sqr += y * y;
+    w1 = w0;
+    w0 = x;
+  }
+  w->w0 = w0;
+  w->w1 = w1;
+  return sum_sqr;
+}
+#endif  // __XTENSA__
 
 static inline float filter(float *input, float *output, size_t len,
-                           const int num_sos, const float gain,
-                           const SOS_Coefficients *sos, SOS_Delay_State *w) {
+                           SOS_IIR_Filter *f) {
   float *source = input;
 
   // Apply all but last Second-Order-Section
-  for (int i = 0; i < (num_sos - 1); i++) {
-    sos_filter_f32(source, output, len, &sos[i], &w[i]);
+  for (int i = 0; i < (f->num_sos - 1); i++) {
+    sos_filter_f32(source, output, len, &f->sos[i], &f->w[i]);
     source = output;
   }
 
   // Apply last SOS with gain and return the sum of squares of all samples
-  return sos_filter_sum_sqr_f32(source, output, len, &sos[num_sos - 1],
-                                &w[num_sos - 1], gain);
+  return sos_filter_sum_sqr_f32(source, output, len, &f->sos[f->num_sos - 1],
+                                &f->w[f->num_sos - 1], f->gain);
+}
+
+static biquad_t high_pass(double k, double frequency) {
+  // s / (s + w) by the bilinear transform s = k (1 - z^-1) / (1 + z^-1)
+  const double w = 2 * M_PI * frequency;
+  return (biquad_t){.b = {k, -k, 0}, .a = {k + w, w - k, 0}};
+}
+
+static biquad_t low_pass(double k, double frequency) {
+  // 1 / (s + w) by the bilinear transform
+  const double w = 2 * M_PI * frequency;
+  return (biquad_t){.b = {1, 1, 0}, .a = {k + w, w - k, 0}};
+}
+
+static biquad_t low_pass_matched(double sample_rate, double frequency) {
+  // 1 / (s + w) with its pole matched and its dc gain kept. The bilinear
+  // transform pulls the curve down near nyquist when the pole is close to it,
+  // and a matched pole errs the other way.
+  const double w = 2 * M_PI * frequency;
+  const double p = exp(-w / sample_rate);
+  return (biquad_t){.b = {(1 - p) / w, 0, 0}, .a = {1, -p, 0}};
 }
 
-float equalize(float *input, float *output, size_t len) {
-  // Knowles SPH0645LM4H-B, rev. B
+static biquad_t cascade(biquad_t x, biquad_t y) {
+  // multiply two first-order sections into one second-order section
+  return (biquad_t){.b = {x.b[0] * y.b[0], x.b[0] * y.b[1] + x.b[1] * y.b[0],
+                          x.b[1] * y.b[1]},
+                    .a = {x.a[0] * y.a[0], x.a[0] * y.a[1] + x.a[1] * y.a[0],
+                          x.a[1] * y.a[1]}};
+}
+
+static void rebilinear_poly(const double *p, double r, double *q) {
+  // back to the analog prototype and forward again at a rate r times the
+  // original, see resample()
+  const double s2 = p[0] - p[1] + p[2];
+  const double s1 = 2 * (p[0] - p[2]);
+  const double s0 = p[0] + p[1] + p[2];
+  q[0] = s2 * r * r + s1 * r + s0;
+  q[1] = 2 * (s0 - s2 * r * r);
+  q[2] = s2 * r * r - s1 * r + s0;
+}
+
+static biquad_t resample(biquad_t x, double from_rate, double to_rate) {
+  // a section designed at one rate is moved to another by undoing its
+  // bilinear transform and transforming again
+  biquad_t y;
+  rebilinear_poly(x.b, to_rate / from_rate, y.b);
+  rebilinear_poly(x.a, to_rate / from_rate, y.a);
+  return y;
+}
+
+static double poly_magnitude(const double *p, double omega) {
+  const double re = p[0] + p[1] * cos(omega) + p[2] * cos(2 * omega);
+  const double im = p[1] * sin(omega) + p[2] * sin(2 * omega);
+  return sqrt(re * re + im * im);
+}
+
+static double magnitude(biquad_t x, double omega) {
+  return poly_magnitude(x.b, omega) / poly_magnitude(x.a, omega);
+}
+
+static void set_filter(SOS_IIR_Filter *f, const biquad_t *sections,
+                       int num_sos, double gain) {
+  // sections are stored with b0 and a0 of one and the denominator negated,
+  // which is what the assembly filters expect
+  f->num_sos = num_sos;
+  for (int i = 0; i < num_sos; ++i) {
+    const biquad_t *x = &sections[i];
+    gain *= x->b[0] / x->a[0];
+    f->sos[i] = (SOS_Coefficients){.b1 = x->b[1] / x->b[0],
+                                   .b2 = x->b[2] / x->b[0],
+                                   .a1 = -x->a[1] / x->a[0],
+                                   .a2 = -x->a[2] / x->a[0]};
+    f->w[i] = (SOS_Delay_State){0};
+  }
+  f->gain = gain;
+}
+
+static void set_weighting(SOS_IIR_Filter *f, const biquad_t *sections,
+                          int num_sos, double sample_rate) {
+  // weightings are normalized to 0 dB at the reference frequency
+  const double omega = 2 * M_PI * REFERENCE_FREQUENCY / sample_rate;
+  double response = 1;
+  for (int i = 0; i < num_sos; ++i) response *= magnitude(sections[i], omega);
+  set_filter(f, sections, num_sos, 1 / response);
+}
+
+esp_err_t sos_iir_design(uint32_t sample_rate) {
+  if (sample_rate < 2 * REFERENCE_FREQUENCY) return ESP_ERR_INVALID_ARG;
+  const double fs = sample_rate, k = 2 * fs;
+
+  // Knowles SPH0645LM4H-B, rev. B, designed at 48kHz
   // https://cdn-shop.adafruit.com/product-files/3421/i2S+Datasheet.PDF
   // B ~= [1.001234, -1.991352, 0.990149]
   // A ~= [1.0, -1.993853, 0.993863]
   // With additional DC blocking component
-  const float gain = 1.00123377961525;
-  const SOS_Coefficients sos[] = {
-      {-1.0, 0.0, +0.9992, 0},  // DC blocker, a1 = -0.9992
-      {-1.988897663539382, +0.988928479008099, +1.993853376183491,
-       -0.993862821429572}};
-  const int num_sos = sizeof(sos) / sizeof(SOS_Coefficients);
-
-  if (mic_w == NULL) {
-    // lazy initialization
-    mic_w = calloc(num_sos, sizeof(SOS_Delay_State));
-  }
-  return filter(input, output, len, num_sos, gain, sos, mic_w);
-}
-
-float weight_dBC(float *input, float *output, size_t len) {
-  // C-weighting IIR Filter, Fs = 48KHz
-  // Designed by invfreqz curve-fitting, see:
-  // https://github.com/ikostoski/esp32-i2s-slm/blob/master/math/c_weighting.m
-  // B = [-0.49164716933714026, 0.14844753846498662, 0.74117815661529129,
-  // -0.03281878334039314, -0.29709276192593875, -0.06442545322197900,
-  // -0.00364152725482682] A = [1.0, -1.0325358998928318, -0.9524000181023488,
-  // 0.8936404694728326   0.2256286147169398  -0.1499917107550188,
-  // 0.0156718181681081]
-  const float gain = -0.491647169337140;
-  const SOS_Coefficients sos[] = {{+1.4604385758204708, +0.5275070373815286,
-                                   +1.9946144559930252, -0.9946217070140883},
-                                  {+0.2376222404939509, +0.0140411206016894,
-                                   -1.3396585608422749, -0.4421457807694559},
-                                  {-2.0000000000000000, +1.0000000000000000,
-                                   +0.3775800047420818, -0.0356365756680430}};
-  const int num_sos = sizeof(sos) / sizeof(SOS_Coefficients);
-
-  if (c_weighting_w == NULL) {
-    // lazy initialization
-    c_weighting_w = calloc(num_sos, sizeof(SOS_Delay_State));
-  }
+  const double equalizer_gain = 1.00123377961525;
+  const biquad_t equalizer[] = {
+      {.b = {1.0, -1.0, 0}, .a = {1.0, -0.9992, 0}},  // DC blocker
+      {.b = {1.0, -1.988897663539382, +0.988928479008099},
+       .a = {1.0, -1.993853376183491, +0.993862821429572}}};
+  biquad_t sections[MAX_SOS];
+  for (int i = 0; i < 2; ++i)
+    sections[i] = resample(equalizer[i], EQUALIZER_SAMPLE_RATE, fs);
+  set_filter(&mic_filter, sections, 2, equalizer_gain);
 
-  return filter(input, output, len, num_sos, gain, sos, c_weighting_w);
-}
-
-float weight_dBA(float *input, float *output, size_t len) {
-  // A-weighting IIR Filter, Fs = 48KHz
-  // (By Dr. Matt L., Source: https://dsp.stackexchange.com/a/36122)
-  // B = [0.169994948147430, 0.280415310498794, -1.120574766348363,
-  // 0.131562559965936, 0.974153561246036, -0.282740857326553,
-  // -0.152810756202003] A = [1.0, -2.12979364760736134,
-  // 0.42996125885751674, 1.62132698199721426, -0.96669962900852902,
-  // 0.00121015844426781, 0.04400300696788968]
-  const float gain = 0.169994948147430;
-  const SOS_Coefficients sos[] = {{-2.00026996133106, +1.00027056142719,
-                                   -1.060868438509278, -0.163987445885926},
-                                  {+4.35912384203144, +3.09120265783884,
-                                   +1.208419926363593, -0.273166998428332},
-                                  {-0.70930303489759, -0.29071868393580,
-                                   +1.982242159753048, -0.982298594928989}};
-  const int num_sos = sizeof(sos) / sizeof(SOS_Coefficients);
-
-  if (c_weighting_w == NULL) {
-    // lazy initialization
-    c_weighting_w = calloc(num_sos, sizeof(SOS_Delay_State));
-  }
+  // C-weighting is s^2 / ((s + w1)^2 (s + w4)^2) and A-weighting adds
+  // s^2 / ((s + w2) (s + w3)), with one of the w4 poles matched to keep the
+  // curve inside the IEC 61672 class 1 tolerances up to about fs / 3. The w1
+  // poles go in sections of their own, as a double pole that close to dc
+  // loses the 70dB of A-weighting at 10Hz to rounding in single precision.
+  sections[0] = cascade(high_pass(k, WEIGHTING_F1), low_pass(k, WEIGHTING_F4));
+  sections[1] = cascade(high_pass(k, WEIGHTING_F1),
+                        low_pass_matched(fs, WEIGHTING_F4));
+  set_weighting(&c_filter, sections, 2, fs);
+  sections[2] = cascade(high_pass(k, WEIGHTING_F2), high_pass(k, WEIGHTING_F3));
+  set_weighting(&a_filter, sections, 3, fs);
+  return ESP_OK;
+}
+
+DSP_ATTR float equalize(float *input, float *output, size_t len) {
+  return filter(input, output, len, &mic_filter);
+}
+
+DSP_ATTR float weight_dBC(float *input, float *output, size_t len) {
+  return filter(input, output, len, &c_filter);
+}
 
-  return filter(input, output, len, num_sos, gain, sos, c_weighting_w);
+DSP_ATTR float weight_dBA(float *input, float *output, size_t len) {
+  return filter(input, output, len, &a_filter);
 }
 
-float weight_none(float *input, float *output, size_t len) {
+DSP_ATTR float weight_none(float *input, float *output, size_t len) {
   float sum_sqr = 0;
   float s;
   for (int i = 0; i < len; i++) {
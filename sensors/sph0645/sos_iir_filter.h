@@ -2,6 +2,8 @@
 
 #include "esp_system.h"
 
+esp_err_t sos_iir_design(uint32_t sample_rate);
+
 float equalize(float *input, float *output, size_t len);
 
 float weight_dBC(float *input, float *output, size_t len);
@@ -0,0 +1,187 @@
+#include "sound_event.h"
+
+#include <string.h>
+
+#include "arena.h"
+#include "esp_log.h"
+
+#define FRAME_SHIFT 8   // Shift from an i2s frame to a 24-bit sample.
+#define ULAW_BIAS 0x84  // Added to a magnitude before finding its segment.
+#define ULAW_CLIP 32635  // Largest magnitude mu-law can encode.
+
+typedef enum {
+  EVENT_DISABLED,   // There is no buffer and events aren't detected.
+  EVENT_LISTENING,  // Recording and waiting for a trigger.
+  EVENT_RECORDING,  // Recording what follows a trigger.
+  EVENT_FROZEN      // Holding an event until it is released.
+} event_state_t;
+
+static const char *TAG = "sound_event";
+
+// The ring holds exactly the audio kept before and after a trigger, so once
+// everything after a trigger is recorded the whole ring is the event, and
+// recording stops until it has been read out and released. Only the mic task
+// writes while recording and only readers touch a frozen event. The buffer
+// comes from the arena and is kept for any later ring that fits in it.
+static struct {
+  uint8_t *buf;
+  size_t capacity;  // Size of the buffer (bytes).
+  uint8_t format;
+  size_t sample_size;  // Size of a sample in the ring (bytes).
+  size_t length;       // Samples the ring holds.
+  size_t post;         // Samples kept after a trigger.
+  size_t head;         // Next sample to write.
+  size_t count;        // Samples written, up to the length.
+  size_t remaining;    // Samples still to record after a trigger.
+  size_t start;        // First sample of a frozen event.
+  uint32_t sample_rate;
+  float peak;  // Highest level since the trigger.
+  bool above;  // Whether the level has stayed above the threshold since the
+               // trigger.
+  volatile event_state_t state;
+  sph0645_event_t event;
+} ring;
+static uint32_t next_id = 0;
+
+static uint8_t ulaw_encode(int32_t sample) {
+  // g.711 mu-law of the top 16 of the 24 bits
+  int32_t pcm = sample >> 8;
+  const uint8_t sign = pcm < 0 ? 0x80 : 0;
+  if (pcm < 0) pcm = -pcm;
+  if (pcm > ULAW_CLIP) pcm = ULAW_CLIP;
+  pcm += ULAW_BIAS;
+  const int exponent = 31 - __builtin_clz(pcm) - 7;
+  const int mantissa = (pcm >> (exponent + 3)) & 0x0f;
+  return ~(sign | exponent << 4 | mantissa);
+}
+
+esp_err_t sound_event_alloc(uint32_t sample_rate, uint32_t pre_trigger,
+                            uint32_t post_trigger) {
+  sound_event_disable();
+  const size_t pre = sample_rate / 1000 * pre_trigger;
+  const size_t post = sample_rate / 1000 * post_trigger;
+  if (post == 0) return ESP_ERR_INVALID_ARG;
+
+  // raw samples are kept when there is psram, otherwise they are compressed
+  // to fit in dram
+  if (ring.buf == NULL || (pre + post) * ring.sample_size > ring.capacity) {
+    uint8_t *buf = arena_alloc("sound_event", (pre + post) * 3,
+                               MALLOC_CAP_SPIRAM);
+    ring.format = SPH0645_EVENT_FORMAT_PCM24;
+    ring.sample_size = 3;
+    if (buf == NULL) {
+      buf = arena_alloc("sound_event", pre + post, MALLOC_CAP_8BIT);
+      ring.format = SPH0645_EVENT_FORMAT_ULAW;
+      ring.sample_size = 1;
+    }
+    if (buf == NULL) {
+      ring.buf = NULL;
+      ring.capacity = 0;
+      return ESP_ERR_NO_MEM;
+    }
+    ring.buf = buf;
+    ring.capacity = (pre + post) * ring.sample_size;
+    ESP_LOGI(TAG, "%u byte event buffer", (unsigned)ring.capacity);
+  }
+
+  ring.length = pre + post;
+  ring.post = post;
+  ring.head = 0;
+  ring.count = 0;
+  ring.sample_rate = sample_rate;
+  ring.state = EVENT_LISTENING;
+  return ESP_OK;
+}
+
+void sound_event_disable() { ring.state = EVENT_DISABLED; }
+
+void sound_event_record(const int32_t *frames, size_t len) {
+  if (ring.state != EVENT_LISTENING && ring.state != EVENT_RECORDING) return;
+  if (ring.state == EVENT_RECORDING && len > ring.remaining)
+    len = ring.remaining;
+
+  if (ring.format == SPH0645_EVENT_FORMAT_ULAW) {
+    for (size_t i = 0; i < len; ++i) {
+      ring.buf[ring.head] = ulaw_encode(frames[i] >> FRAME_SHIFT);
+      if (++ring.head == ring.length) ring.head = 0;
+    }
+  } else {
+    for (size_t i = 0; i < len; ++i) {
+      // little-endian, like the rest of our payloads
+      const int32_t sample = frames[i] >> FRAME_SHIFT;
+      uint8_t *dst = &ring.buf[ring.head * 3];
+      dst[0] = sample;
+      dst[1] = sample >> 8;
+      dst[2] = sample >> 16;
+      if (++ring.head == ring.length) ring.head = 0;
+    }
+  }
+
+  ring.count = ring.count + len < ring.length ? ring.count + len : ring.length;
+  if (ring.state == EVENT_RECORDING) ring.remaining -= len;
+}
+
+bool sound_event_is_listening() { return ring.state == EVENT_LISTENING; }
+
+bool sound_event_is_recording() { return ring.state == EVENT_RECORDING; }
+
+void sound_event_trigger(int64_t time, size_t recorded, float level) {
+  // recorded is how much of the audio after the trigger is already in the
+  // ring
+  if (ring.state != EVENT_LISTENING) return;
+  ring.remaining = recorded < ring.post ? ring.post - recorded : 0;
+  ring.peak = level;
+  ring.above = true;
+  ring.event = (sph0645_event_t){.id = next_id++, .time = time};
+  ring.state = EVENT_RECORDING;
+}
+
+void sound_event_update(float level, bool above, uint32_t elapsed) {
+  if (ring.state != EVENT_RECORDING) return;
+  if (level > ring.peak) ring.peak = level;
+  if (ring.above && above)
+    ring.event.duration += elapsed;
+  else
+    ring.above = false;
+}
+
+void sound_event_finish() {
+  if (ring.state != EVENT_RECORDING || ring.remaining > 0) return;
+
+  // a ring that wasn't full yet when triggered holds less from before it
+  const size_t per_ms = ring.sample_rate / 1000;
+  ring.start = (ring.head + ring.length - ring.count) % ring.length;
+  ring.event.pre_trigger = (ring.count - ring.post) / per_ms;
+  ring.event.sample_rate = ring.sample_rate;
+  ring.event.format = ring.format;
+  ring.event.size = ring.count * ring.sample_size;
+  ring.state = EVENT_FROZEN;
+}
+
+esp_err_t sound_event_get(sph0645_event_t *event, float *peak_level) {
+  if (ring.state != EVENT_FROZEN) return ESP_ERR_NOT_FOUND;
+  *event = ring.event;
+  *peak_level = ring.peak;
+  return ESP_OK;
+}
+
+esp_err_t sound_event_read(size_t offset, void *buf, size_t size) {
+  if (ring.state != EVENT_FROZEN) return ESP_ERR_INVALID_STATE;
+  if (offset > ring.event.size || size > ring.event.size - offset)
+    return ESP_ERR_INVALID_SIZE;
+
+  // the event may wrap around the end of the ring
+  const size_t ring_size = ring.length * ring.sample_size;
+  const size_t first = (ring.start * ring.sample_size + offset) % ring_size;
+  const size_t len = size < ring_size - first ? size : ring_size - first;
+  memcpy(buf, ring.buf + first, len);
+  memcpy((uint8_t *)buf + len, ring.buf, size - len);
+  return ESP_OK;
+}
+
+void sound_event_release() {
+  // what is left in the ring is from before the event, with a gap since
+  if (ring.state != EVENT_FROZEN) return;
+  ring.count = 0;
+  ring.state = EVENT_LISTENING;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "esp_system.h"
+#include "sph0645.h"
+
+esp_err_t sound_event_alloc(uint32_t sample_rate, uint32_t pre_trigger,
+                            uint32_t post_trigger);
+void sound_event_disable();
+
+void sound_event_record(const int32_t *frames, size_t len);
+
+bool sound_event_is_listening();
+bool sound_event_is_recording();
+void sound_event_trigger(int64_t time, size_t recorded, float level);
+void sound_event_update(float level, bool above, uint32_t elapsed);
+void sound_event_finish();
+
+esp_err_t sound_event_get(sph0645_event_t *event, float *peak_level);
+esp_err_t sound_event_read(size_t offset, void *buf, size_t size);
+void sound_event_release();
@@ -0,0 +1,128 @@
+#include "spectrum.h"
+
+#include <math.h>
+#include <string.h>
+
+#include "arena.h"
+#include "fft.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#define NEAR_BINS 3  // Bins on each side of a peak that belong to its tone.
+#define FAR_BINS 8   // Bins on each side beyond the tone that the peak's
+                     // prominence is judged against.
+
+// The power of each bin is summed over every transform since the last clear,
+// scaled so that the bins of a tone add up to its mean square. The buffer
+// comes from the arena and is reused by every spectrum that fits in it.
+static float *power = NULL;
+static size_t capacity = 0;  // Bins the buffer holds.
+static size_t num_bins = 0;
+static uint32_t transforms = 0;  // Transforms summed into the power.
+
+esp_err_t spectrum_alloc(size_t bins) {
+  spectrum_disable();
+  if (bins > capacity) {
+    float *buf =
+        arena_alloc("spectrum", bins * sizeof(float), MALLOC_CAP_8BIT);
+    if (buf == NULL) return ESP_ERR_NO_MEM;
+    power = buf;
+    capacity = bins;
+  }
+  memset(power, 0, bins * sizeof(float));
+  transforms = 0;
+  num_bins = bins;
+  return ESP_OK;
+}
+
+void spectrum_disable() {
+  vTaskSuspendAll();  // enter critical section, interrupts enabled
+  num_bins = 0;
+  xTaskResumeAll();  // exit critical section
+}
+
+void spectrum_add(float *samples, size_t len) {
+  // each transform is done in place, so the samples are used up
+  if (num_bins == 0) return;
+  const size_t n = num_bins * 2;
+  for (float *data = samples; data + n <= samples + len; data += n) {
+    const float scale = 2 / (n * fft_window_hann(data, n));
+    fft_real(data, n);
+
+    vTaskSuspendAll();  // enter critical section, interrupts enabled
+    power[0] += data[0] * data[0] * scale / 2;
+    for (size_t k = 1; k < num_bins; ++k)
+      power[k] += (data[2 * k] * data[2 * k] +
+                   data[2 * k + 1] * data[2 * k + 1]) *
+                  scale;
+    ++transforms;
+    xTaskResumeAll();  // exit critical section
+  }
+}
+
+void spectrum_clear() {
+  vTaskSuspendAll();  // enter critical section, interrupts enabled
+  for (size_t k = 0; k < num_bins; ++k) power[k] = 0;
+  transforms = 0;
+  xTaskResumeAll();  // exit critical section
+}
+
+static void add_peak(sph0645_peak_t *peaks, size_t *num_peaks,
+                     size_t max_peaks, size_t k, float bin_width) {
+  // the tone spreads over the window's main lobe, so its level is the sum of
+  // the bins around the peak
+  const float level = (power[k - 1] + power[k] + power[k + 1]) / transforms;
+
+  // keep the loudest peaks sorted, loudest first
+  size_t i = *num_peaks;
+  if (i == max_peaks) {
+    if (level <= peaks[i - 1].level) return;
+    --i;
+  } else {
+    ++*num_peaks;
+  }
+  for (; i > 0 && peaks[i - 1].level < level; --i) peaks[i] = peaks[i - 1];
+
+  // the frequency is refined by fitting a parabola to the log of the bins
+  const float a = logf(power[k - 1]), b = logf(power[k]),
+              c = logf(power[k + 1]);
+  float offset = 0.5f * (a - c) / (a - 2 * b + c);
+  if (!isfinite(offset)) offset = 0;
+
+  // prominence compares the peak with the bins just beyond its tone
+  float around = 0;
+  size_t count = 0;
+  for (size_t d = NEAR_BINS + 1; d <= NEAR_BINS + FAR_BINS; ++d) {
+    if (k > d) {
+      around += power[k - d];
+      ++count;
+    }
+    if (k + d < num_bins) {
+      around += power[k + d];
+      ++count;
+    }
+  }
+  around /= count;
+
+  peaks[i] = (sph0645_peak_t){
+      .frequency = (k + offset) * bin_width,
+      .level = level,
+      .prominence = around > 0 ? 10 * log10f(power[k] / around) : INFINITY};
+}
+
+size_t spectrum_get_peaks(sph0645_peak_t *peaks, size_t max_peaks,
+                          uint32_t sample_rate) {
+  // peaks are local maxima, leaving out the dc bin, with their level as a
+  // mean square
+  size_t num_peaks = 0;
+  vTaskSuspendAll();  // enter critical section, interrupts enabled
+  if (num_bins > 0 && transforms > 0 && max_peaks > 0) {
+    const float bin_width = (float)sample_rate / (num_bins * 2);
+    for (size_t k = 2; k + 1 < num_bins; ++k)
+      if (power[k] > power[k - 1] && power[k] >= power[k + 1] &&
+          power[k] > 0)
+        add_peak(peaks, &num_peaks, max_peaks, k, bin_width);
+  }
+  xTaskResumeAll();  // exit critical section
+  return num_peaks;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include "esp_system.h"
+#include "sph0645.h"
+
+esp_err_t spectrum_alloc(size_t bins);
+void spectrum_disable();
+
+void spectrum_add(float *samples, size_t len);
+void spectrum_clear();
+
+size_t spectrum_get_peaks(sph0645_peak_t *peaks, size_t max_peaks,
+                          uint32_t sample_rate);
@@ -3,13 +3,30 @@
 #include <math.h>
 #include <string.h>
 
+#include "arena.h"
+#include "esp_log.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 #include "freertos/task.h"
 #include "i2s.h"
+#include "power.h"
 #include "sos_iir_filter.h"
-
-#define SAMPLE_RATE 48000  // Hz, fixed to design of IIR filters
-#define SAMPLE_BITS 32     // Number of bits received in the i2s frame.
+#include "sound_event.h"
+#include "spectrum.h"
+#include "time_weighting.h"
+#include "xtensa/core-macros.h"
+
+#define SAMPLE_BITS 32  // Number of bits received in the i2s frame.
+#define MIC_TASK_STACK_SIZE \
+  4096  // Size of the mic task's stack (bytes). The dsp stats report how
+        // much of it has never been used.
+#define MIC_TASK_STACK_MARGIN 512  // Least stack left free before a warning
+                                   // is logged (bytes).
+#define MIC_TASK_CORE \
+  (portNUM_PROCESSORS - 1)  // Core the mic task runs on, away from wifi when
+                            // there are two. Also keeps the cycle count on
+                            // one core.
 
 #define MIC_SENSITIVITY \
   -26  // dBFS value expected at MIC_REF_DB (value from datasheet)
@@ -22,10 +39,15 @@
   24  // Valid number of bits in i2s frame. Must be less than or equal to
       // SAMPLE_BITS.
 #define MIC_POWER_UP_TIME 50  // Power-up time of the microphone (ms).
+#define PARK_MARGIN_MS 100    // Time allowed beyond a block for the mic task
+                              // to park (ms).
+#define SUB_BLOCK_MS 1   // Step of the time weighting (ms).
 #define MIC_OFFSET_DB \
   3.0103  // Default offset (sine-wave RMS vs. dBFS). Modify this value for
           // linear calibration.
 
+static const char *TAG = "sph0645";
+
 #define MIN(a, b) ((a < b) ? a : b)
 #define MAX(a, b) ((a > b) ? a : b)
 
@@ -35,15 +57,68 @@ static sph0645_data_t task_data;  // Holds the currently collected data. Average
                                   // is calculated lazily.
 static sph0645_config_t task_config;  // Holds the current config data.
 static float *samples = NULL;
+static size_t samples_capacity = 0;  // Samples the buffer holds.
+static power_lock_handle_t pm_lock = NULL;  // Held while processing a block.
+static bool filters_designed = false;
+static sph0645_dsp_stats_t dsp_stats;
+static portMUX_TYPE stats_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// The mic task lives in the arena, so instead of being deleted and created
+// again it is parked between blocks while its config and buffers change, and
+// restarts from the top with the new config when unparked.
+static volatile bool park_requested = false;
+static volatile bool restart_requested = false;
+static volatile bool suspended = false;
+static bool task_parked = false;
+static SemaphoreHandle_t parked = NULL;  // Given by the mic task once parked.
+static StaticSemaphore_t parked_buffer;
+
+static double get_mic_ref_ampl() {
+  // Microphone i2s output at 94dB SPL.
+  return pow10(MIC_SENSITIVITY / 20.0) * ((1 << (MIC_BITS - 1)) - 1);
+}
 
-static void mic_reader_task(void *arg) {
+static double level_to_db(double mean_sqr) {
+  const double ref = get_mic_ref_ampl();
+  return MIC_OFFSET_DB + MIC_REF_DB + 10 * log10(mean_sqr / (ref * ref));
+}
+
+static double db_to_level(double db) {
+  const double rms =
+      get_mic_ref_ampl() * pow10((db - MIC_OFFSET_DB - MIC_REF_DB) / 20);
+  return rms * rms;
+}
+
+static i2s_capture_t get_capture(const sph0645_config_t *config) {
+  return (i2s_capture_t){
+      .sample_rate = config->sample_rate,
+      .block_size = config->sample_rate / 1000 * config->sample_length,
+      .latency = config->dma_latency};
+}
+
+static void end_block(uint32_t start_cycles) {
+  // the cycles include any time the task was held up, which is what a block
+  // has to fit in
+  const uint32_t cycles = XTHAL_GET_CCOUNT() - start_cycles;
+  portENTER_CRITICAL(&stats_mux);
+  ++dsp_stats.blocks;
+  dsp_stats.cycles_last = cycles;
+  dsp_stats.cycles_max = MAX(dsp_stats.cycles_max, cycles);
+  dsp_stats.cycles_total += cycles;
+  portEXIT_CRITICAL(&stats_mux);
+  power_lock_release(pm_lock);
+}
+
+static void read_blocks() {
+  const uint32_t sample_rate = task_config.sample_rate;
   const size_t num_samples =
-      SAMPLE_RATE / 1000 *
+      sample_rate / 1000 *
       task_config.sample_length;  // Number of samples needed for the configured
                                   // sample length.
-  const double mic_ref_ampl =
-      pow10(MIC_SENSITIVITY / 20.0) *
-      ((1 << (MIC_BITS - 1)) - 1);  // Microphone i2s output at 94dB SPL.
+  const size_t sub_block_samples = sample_rate / 1000 * SUB_BLOCK_MS;
+  const TickType_t read_timeout =
+      num_samples * 2000 / sample_rate / portTICK_PERIOD_MS + 1;
+  const double mic_ref_ampl = get_mic_ref_ampl();
   float (*weighing)(float *, float *, size_t);
   if (task_config.weighting == SPH0645_WEIGHTING_C)
     weighing = weight_dBC;
@@ -51,32 +126,91 @@ static void mic_reader_task(void *arg) {
     weighing = weight_dBA;
   else
     weighing = weight_none;
+  time_weighting_t time_weighting;
+  time_weighting_init(&time_weighting, task_config.time_weighting,
+                      SUB_BLOCK_MS);
+  const float event_level = task_config.event_threshold > 0
+                                ? db_to_level(task_config.event_threshold)
+                                : INFINITY;
 
   uint64_t acc_samples = 0;
+  float level = 0;  // Time weighted mean square.
   double acc_sum_sqr = 0;
   bool delay_state_uninitialized = true;
 
   sph0645_clear_data();
+  portENTER_CRITICAL(&stats_mux);
+  dsp_stats.budget = (uint64_t)num_samples *
+                     CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ * 1000000 / sample_rate;
+  portEXIT_CRITICAL(&stats_mux);
 
   while (true) {
-    // Block and wait for microphone values from i2s
-    i2s_bus_read(samples, num_samples * sizeof(int32_t), portMAX_DELAY);
+    // park between blocks when asked to, and start over if the config changed
+    if (park_requested) {
+      xSemaphoreGive(parked);
+      while (park_requested) ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+      if (restart_requested) {
+        restart_requested = false;
+        return;
+      }
+    }
 
-    // Convert integer microphone values to floats
+    // Block and wait for microphone values from i2s, a read that times out
+    // comes back around to check for a park
+    if (i2s_bus_read(samples, num_samples * sizeof(int32_t), read_timeout))
+      continue;
+    power_lock_acquire(pm_lock);
+    const uint32_t start_cycles = XTHAL_GET_CCOUNT();
+    const int64_t block_start =
+        esp_timer_get_time() - num_samples * 1000000LL / sample_rate;
+
+    // Keep the raw samples in case an event is found in them
     int32_t *int_samples = (int32_t *)samples;
+    sound_event_record(int_samples, num_samples);
+
+    // Convert integer microphone values to floats
     for (int i = 0; i < num_samples; i++)
       samples[i] = int_samples[i] >> (SAMPLE_BITS - MIC_BITS);
 
-    // Apply equalization and get C-weighted sum of squares
+    // Apply equalization
     const float sum_sqr_z = equalize(samples, samples, num_samples);
-    const float sum_sqr_c = weighing(samples, samples, num_samples);
 
-    // Discard first round of data because of uninitialized delay state
+    // Get the weighted sum of squares a sub-block at a time, stepping the
+    // time weighting with the mean square of each
+    float sum_sqr_c = 0;
+    float level_max = level, level_min = level;
+    for (size_t i = 0; i < num_samples; i += sub_block_samples) {
+      const float sub_sum_sqr =
+          weighing(samples + i, samples + i, sub_block_samples);
+      const float mean_sqr = sub_sum_sqr / sub_block_samples;
+      level = time_weighting_step(&time_weighting, level, mean_sqr);
+      level_max = MAX(level_max, level);
+      level_min = MIN(level_min, level);
+      sum_sqr_c += sub_sum_sqr;
+
+      // events start when the time weighted level crosses the threshold
+      if (level > event_level && !delay_state_uninitialized &&
+          sound_event_is_listening())
+        sound_event_trigger(block_start + i * 1000000LL / sample_rate,
+                            num_samples - i, level);
+      else if (sound_event_is_recording())
+        sound_event_update(level, level > event_level, SUB_BLOCK_MS);
+    }
+    sound_event_finish();
+
+    // Discard first round of data because of uninitialized delay state,
+    // starting the time weighting where the level is now
     if (delay_state_uninitialized) {
       delay_state_uninitialized = false;
+      level = sum_sqr_c / num_samples;
+      end_block(start_cycles);
       continue;
     }
 
+    // The weighted samples aren't needed anymore, so the spectrum is taken
+    // from them in place
+    spectrum_add(samples, num_samples);
+
     // Calculate dB values relative to mic_ref_ampl and adjust for microphone
     // reference
     const double rms_z = sqrt((double)sum_sqr_z / num_samples);
@@ -85,17 +219,34 @@ static void mic_reader_task(void *arg) {
 
     // In case of acoustic overload or below noise floor measurement, report
     // infinty
-    if (dBz > MIC_OVERLOAD_DB)
+    const bool overload = dBz > MIC_OVERLOAD_DB;
+    const bool below_floor = isnan(dBz) || (dBz < MIC_NOISE_DB);
+    if (overload)
       acc_sum_sqr = INFINITY;
-    else if (isnan(dBz) || (dBz < MIC_NOISE_DB))
+    else if (below_floor)
       acc_sum_sqr = NAN;
 
+    // Track the time weighted extremes, which are only meaningful above the
+    // noise floor
+    if (!below_floor) {
+      const double lmax =
+          overload ? INFINITY
+                   : MIC_OFFSET_DB + MIC_REF_DB +
+                         20 * log10(sqrt(level_max) / mic_ref_ampl);
+      const double lmin = MIC_OFFSET_DB + MIC_REF_DB +
+                          20 * log10(sqrt(level_min) / mic_ref_ampl);
+      vTaskSuspendAll();  // enter critical section, interrupts enabled
+      task_data.lmax = MAX(task_data.lmax, lmax);
+      task_data.lmin = MIN(task_data.lmin, lmin);
+      xTaskResumeAll();  // exit critical section
+    }
+
     // Accumulate the C-weighted sum of squares
     acc_sum_sqr += sum_sqr_c;
     acc_samples += num_samples;
 
     // When we gather enough samples, calculate the RMS C-weighted value
-    if (acc_samples >= SAMPLE_RATE * task_config.sample_period / 1000.0) {
+    if (acc_samples >= sample_rate * task_config.sample_period / 1000.0) {
       vTaskSuspendAll();  // enter critical section, interrupts enabled
 
       const double rms_c = sqrt(acc_sum_sqr / acc_samples);
@@ -114,56 +265,166 @@ static void mic_reader_task(void *arg) {
       acc_sum_sqr = 0;
       acc_samples = 0;
     }
+
+    end_block(start_cycles);
   }
 }
 
+static void mic_reader_task(void *arg) {
+  while (true) read_blocks();
+}
+
+static esp_err_t park_task() {
+  // the task finishes the block it is on, and with it releases its pm lock,
+  // before it parks
+  if (task_parked) return ESP_OK;
+  xSemaphoreTake(parked, 0);  // a park that timed out may have been given late
+  park_requested = true;
+  const uint32_t timeout_ms = task_config.sample_length * 2 + PARK_MARGIN_MS;
+  if (!xSemaphoreTake(parked, timeout_ms / portTICK_PERIOD_MS + 1)) {
+    // withdraw the request so the task can't park with no one to unpark it
+    park_requested = false;
+    xTaskNotifyGive(mic_reader_task_handle);
+    return ESP_ERR_TIMEOUT;
+  }
+  task_parked = true;
+  return ESP_OK;
+}
+
+static void unpark_task() {
+  if (!task_parked) return;
+  task_parked = false;
+  park_requested = false;
+  xTaskNotifyGive(mic_reader_task_handle);
+}
+
+static esp_err_t start_task() {
+  if (parked == NULL) parked = xSemaphoreCreateBinaryStatic(&parked_buffer);
+  mic_reader_task_handle =
+      arena_create_task(mic_reader_task, "i2s_mic_reader", MIC_TASK_STACK_SIZE,
+                        NULL, 4, MIC_TASK_CORE);
+  return mic_reader_task_handle != NULL ? ESP_OK : ESP_ERR_NO_MEM;
+}
+
+static esp_err_t apply_config(const sph0645_config_t *config) {
+  // the buffers only grow, and whatever they outgrow stays in the arena
+  const size_t num_samples =
+      config->sample_rate / 1000 * config->sample_length;
+  if (num_samples > samples_capacity) {
+    float *buf =
+        arena_alloc("sph0645", num_samples * sizeof(float), MALLOC_CAP_8BIT);
+    if (buf == NULL) return ESP_ERR_NO_MEM;
+    samples = buf;
+    samples_capacity = num_samples;
+  }
+
+  // the event buffer is only needed when events are detected
+  sound_event_disable();
+  if (config->event_threshold > 0) {
+    esp_err_t err = sound_event_alloc(config->sample_rate,
+                                      config->event_pre_trigger,
+                                      config->event_post_trigger);
+    if (err) return err;
+  }
+
+  // and the spectrum only when one is taken
+  spectrum_disable();
+  if (config->spectrum_bins != 0) {
+    esp_err_t err = spectrum_alloc(config->spectrum_bins);
+    if (err) return err;
+  }
+
+  // the i2s dma buffers follow the block and the latency, and the clock and
+  // the filters follow the sample rate
+  const i2s_capture_t capture = get_capture(config);
+  esp_err_t err = i2s_bus_set_capture(&capture);
+  if (err) return err;
+  if (config->sample_rate != task_config.sample_rate || !filters_designed) {
+    err = sos_iir_design(config->sample_rate);
+    if (err) return err;
+    filters_designed = true;
+  }
+
+  // Copy argument to task_config
+  memcpy(&task_config, config, sizeof(task_config));
+  return ESP_OK;
+}
+
 esp_err_t sph0645_reset() {
-  i2s_init();
+  // the capture is set again when a config is set
+  if (task_config.sample_rate == 0) {
+    const sph0645_config_t default_config = SPH0645_DEFAULT_CONFIG;
+    task_config = default_config;
+  }
+
+  // Park the task if it is currently running
+  if (mic_reader_task_handle != NULL) {
+    esp_err_t err = park_task();
+    if (err) return err;
+  }
+  const i2s_capture_t capture = get_capture(&task_config);
+  i2s_init(&capture);
+  power_lock_create(POWER_LOCK_CPU, "sph0645", &pm_lock);
 
   if (samples == NULL) {
     // Discard data to allow for mic startup
-    const size_t num_samples = SAMPLE_RATE / 1000 * MIC_POWER_UP_TIME;
+    const size_t num_samples =
+        task_config.sample_rate / 1000 * MIC_POWER_UP_TIME;
     for (int i = 0; i < num_samples; ++i) {
       int32_t discard;
       esp_err_t err = i2s_bus_read(&discard, sizeof(discard), 1);
       if (err) return err;
     }
-  } else {
-    // Delete the task if it is currently running
-    if (mic_reader_task_handle != NULL) vTaskDelete(mic_reader_task_handle);
-
-    // Create the reader task
-    xTaskCreate(mic_reader_task, "i2s_mic_reader", 2048, NULL, 4,
-                &mic_reader_task_handle);
+  } else if (mic_reader_task_handle != NULL) {
+    // Restart the reader task
+    restart_requested = true;
+    if (!suspended) unpark_task();
   }
 
   return ESP_OK;
 }
 
 esp_err_t sph0645_set_config(const sph0645_config_t *config) {
-  if (config->sample_length == 0 || config->sample_period == 0)
+  if (config->sample_length == 0 || config->sample_period == 0 ||
+      config->time_weighting > SPH0645_TIME_WEIGHTING_IMPULSE)
     return ESP_ERR_INVALID_ARG;
 
-  // Suspend the currently running mic task
-  if (mic_reader_task_handle != NULL) vTaskSuspend(mic_reader_task_handle);
+  // a whole block is recorded before it is checked for an event, so the
+  // audio kept after an event must hold at least a block
+  if (config->event_threshold > 0 &&
+      config->event_post_trigger < config->sample_length)
+    return ESP_ERR_INVALID_ARG;
 
-  // Check to see if we can malloc a large enough block of memory for samples
-  const size_t num_samples = SAMPLE_RATE / 1000 * config->sample_length;
-  float *tmp_samples = realloc(samples, num_samples * sizeof(float));
-  if (tmp_samples == NULL) {
-    if (mic_reader_task_handle != NULL) vTaskResume(mic_reader_task_handle);
-    return ESP_ERR_NO_MEM;
-  }
-  samples = tmp_samples;
+  // the mic needs a bit clock of at least 1MHz and the filters are designed
+  // for whole kHz rates
+  if (config->sample_rate < SPH0645_MIN_SAMPLE_RATE ||
+      config->sample_rate > SPH0645_MAX_SAMPLE_RATE ||
+      config->sample_rate % 1000 != 0)
+    return ESP_ERR_INVALID_ARG;
 
-  // Copy argument to task_config
-  memcpy(&task_config, config, sizeof(task_config));
+  // each transform takes twice as many samples as it has bins
+  const uint32_t bins = config->spectrum_bins;
+  if (bins != 0 &&
+      (bins < SPH0645_MIN_SPECTRUM_BINS || bins > SPH0645_MAX_SPECTRUM_BINS ||
+       (bins & (bins - 1)) != 0 ||
+       bins * 2 > config->sample_rate / 1000 * config->sample_length))
+    return ESP_ERR_INVALID_ARG;
 
-  // Restart the task automatically if it was running
-  if (mic_reader_task_handle != NULL) vTaskDelete(mic_reader_task_handle);
-  xTaskCreate(mic_reader_task, "i2s_mic_reader", 2048, NULL, 4,
-              &mic_reader_task_handle);
+  // Park the mic task while its buffers and config change
+  if (mic_reader_task_handle != NULL) {
+    esp_err_t err = park_task();
+    if (err) return err;
+  }
+  esp_err_t err = apply_config(config);
+  if (err) {
+    if (mic_reader_task_handle != NULL && !suspended) unpark_task();
+    return err;
+  }
 
+  // Restart the task with the new config, or start it the first time
+  if (mic_reader_task_handle == NULL) return start_task();
+  restart_requested = true;
+  if (!suspended) unpark_task();
   return ESP_OK;
 }
 
@@ -172,6 +433,30 @@ esp_err_t sph0645_get_config(sph0645_config_t *config) {
   return ESP_OK;
 }
 
+esp_err_t sph0645_suspend() {
+  if (mic_reader_task_handle == NULL) return ESP_ERR_INVALID_STATE;
+  if (suspended) return ESP_OK;
+
+  // i2s is only stopped once the task is parked between blocks, so it is never
+  // left waiting on a read or holding its pm lock
+  esp_err_t err = park_task();
+  if (err) return err;
+  suspended = true;
+
+  // the i2s driver keeps the chip awake while it is running
+  return i2s_bus_stop();
+}
+
+esp_err_t sph0645_resume() {
+  if (mic_reader_task_handle == NULL) return ESP_ERR_INVALID_STATE;
+  if (!suspended) return ESP_OK;
+  esp_err_t err = i2s_bus_start();
+  if (err) return err;
+  suspended = false;
+  unpark_task();
+  return ESP_OK;
+}
+
 esp_err_t sph0645_get_data(sph0645_data_t *data) {
   if (mic_reader_task_handle == NULL) return ESP_ERR_INVALID_STATE;
 
@@ -185,6 +470,12 @@ esp_err_t sph0645_get_data(sph0645_data_t *data) {
   // calculate the average lazily
   data->avg /= data->samples;
 
+  // the spectrum keeps its own critical section
+  data->num_peaks = spectrum_get_peaks(data->peaks, SPH0645_SPECTRUM_PEAKS,
+                                       task_config.sample_rate);
+  for (int i = 0; i < data->num_peaks; ++i)
+    data->peaks[i].level = level_to_db(data->peaks[i].level);
+
   return ESP_OK;
 }
 
@@ -196,6 +487,40 @@ void sph0645_clear_data() {
   task_data.samples = 0;
   task_data.max = -INFINITY;
   task_data.min = INFINITY;
+  task_data.lmax = -INFINITY;
+  task_data.lmin = INFINITY;
 
   xTaskResumeAll();  // exit critical section
-}
\ No newline at end of file
+
+  spectrum_clear();
+}
+
+void sph0645_take_dsp_stats(sph0645_dsp_stats_t *stats) {
+  // the budget and last block are levels, everything else counts from the
+  // last take
+  portENTER_CRITICAL(&stats_mux);
+  *stats = dsp_stats;
+  dsp_stats = (sph0645_dsp_stats_t){.cycles_last = dsp_stats.cycles_last,
+                                    .budget = dsp_stats.budget};
+  portEXIT_CRITICAL(&stats_mux);
+  stats->lost_buffers = i2s_bus_take_lost();
+  if (mic_reader_task_handle == NULL) return;
+  stats->stack_free = uxTaskGetStackHighWaterMark(mic_reader_task_handle);
+  if (stats->stack_free < MIC_TASK_STACK_MARGIN)
+    ESP_LOGW(TAG, "Mic task has only %u bytes of stack left.",
+             stats->stack_free);
+}
+
+esp_err_t sph0645_get_event(sph0645_event_t *event) {
+  float peak_level;
+  esp_err_t err = sound_event_get(event, &peak_level);
+  if (err) return err;
+  event->peak = level_to_db(peak_level);
+  return ESP_OK;
+}
+
+esp_err_t sph0645_read_event(size_t offset, void *buf, size_t size) {
+  return sound_event_read(offset, buf, size);
+}
+
+void sph0645_release_event() { sound_event_release(); }
\ No newline at end of file
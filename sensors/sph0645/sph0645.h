@@ -6,24 +6,89 @@
 #define SPH0645_WEIGHTING_C BIT(1)
 #define SPH0645_WEIGHTING_A BIT(2)
 
+#define SPH0645_TIME_WEIGHTING_FAST 0     // 125ms time constant.
+#define SPH0645_TIME_WEIGHTING_SLOW 1     // 1s time constant.
+#define SPH0645_TIME_WEIGHTING_IMPULSE 2  // 35ms rising and 1.5s falling.
+
+#define SPH0645_EVENT_FORMAT_PCM24 0  // Signed 24-bit little-endian samples.
+#define SPH0645_EVENT_FORMAT_ULAW 1   // G.711 mu-law of the top 16 bits.
+
+#define SPH0645_SPECTRUM_PEAKS 4  // Most spectral peaks in the data.
+
+typedef struct {
+  float frequency;   // Interpolated frequency of the peak (Hz).
+  float level;       // Level of the tone at the peak (dB).
+  float prominence;  // How far the peak stands above the spectrum around
+                     // it (dB).
+} sph0645_peak_t;
+
 typedef struct {
   float avg;
   float min;
   float max;
+  float lmax;  // Highest time weighted level (dB).
+  float lmin;  // Lowest time weighted level (dB).
   uint64_t samples;
+  sph0645_peak_t peaks[SPH0645_SPECTRUM_PEAKS];  // Loudest peaks of the
+                                                 // spectrum, loudest first.
+  uint8_t num_peaks;
 } sph0645_data_t;
 
 typedef struct {
+  uint32_t id;           // Counts up with every event.
+  int64_t time;          // When the level crossed the threshold, on the
+                         // esp_timer clock (us).
+  float peak;            // Highest time weighted level of the event (dB).
+  uint32_t duration;     // Time the level stayed above the threshold, up to
+                         // the end of the recording (ms).
+  uint32_t pre_trigger;  // Audio recorded before the trigger (ms).
+  uint32_t sample_rate;  // Rate of the recorded audio (Hz).
+  uint8_t format;        // Format of the recorded audio.
+  size_t size;           // Size of the recorded audio (bytes).
+} sph0645_event_t;
+
+typedef struct {
+  uint32_t blocks;        // Blocks processed.
+  uint32_t cycles_last;   // CPU cycles spent on the last block.
+  uint32_t cycles_max;    // Most CPU cycles spent on a block.
+  uint64_t cycles_total;  // CPU cycles spent on every block.
+  uint32_t budget;  // CPU cycles at full speed in the time a block takes to
+                    // arrive.
+  uint32_t lost_buffers;  // I2S buffers overwritten before they were read.
+  uint32_t stack_free;    // Least stack the mic task has had free (bytes).
+} sph0645_dsp_stats_t;
+
+#define SPH0645_MIN_SAMPLE_RATE 16000  // Slowest rate the mic clocks at (Hz).
+#define SPH0645_MAX_SAMPLE_RATE 48000  // Fastest rate the filters are good for.
+#define SPH0645_MIN_SPECTRUM_BINS 64    // Fewest bins of a spectrum.
+#define SPH0645_MAX_SPECTRUM_BINS 1024  // Most bins of a spectrum.
+
+typedef struct {
+  uint32_t sample_rate;  // Rate at which audio is sampled (Hz).
   uint32_t
       sample_length;  // Length of time in which audio samples are taken (ms).
   uint32_t sample_period;  // Period in which audio values are calculated (ms).
   uint8_t weighting;       // Decibel weighting of the collected waveform.
+  uint8_t time_weighting;  // Time weighting of the levels in lmax and lmin.
+  float event_threshold;   // Time weighted level that starts an event (dB),
+                           // or 0 to not detect events.
+  uint32_t event_pre_trigger;   // Audio kept from before an event (ms).
+  uint32_t event_post_trigger;  // Audio kept from after an event starts
+                                // (ms). At least sample_length.
+  uint32_t spectrum_bins;  // Bins of the spectrum, a power of two that fits
+                           // twice in a sample, or 0 for no spectrum.
+  uint32_t dma_latency;  // Longest the task may fall behind the mic, while
+                         // processing a block or held up, without losing
+                         // audio (ms). Sizes the I2S DMA buffers.
 } sph0645_config_t;
 
-#define SPH0645_DEFAULT_CONFIG                   \
-  {                                              \
-    .sample_length = 125, .sample_period = 1000, \
-    .weighting = SPH0645_WEIGHTING_C             \
+#define SPH0645_DEFAULT_CONFIG                                         \
+  {                                                                    \
+    .sample_rate = 48000, .sample_length = 125, .sample_period = 1000, \
+    .weighting = SPH0645_WEIGHTING_C,                                  \
+    .time_weighting = SPH0645_TIME_WEIGHTING_FAST,                     \
+    .event_threshold = 0, .event_pre_trigger = 500,                    \
+    .event_post_trigger = 1000, .spectrum_bins = 0, .dma_latency = 50  \
   }
 
 esp_err_t sph0645_reset();
@@ -31,6 +96,17 @@ esp_err_t sph0645_reset();
 esp_err_t sph0645_set_config(const sph0645_config_t *config);
 esp_err_t sph0645_get_config(sph0645_config_t *config);
 
+esp_err_t sph0645_suspend();
+esp_err_t sph0645_resume();
+
 esp_err_t sph0645_get_data(sph0645_data_t *data);
 
-void sph0645_clear_data();
\ No newline at end of file
+void sph0645_clear_data();
+
+void sph0645_take_dsp_stats(sph0645_dsp_stats_t *stats);
+
+esp_err_t sph0645_get_event(sph0645_event_t *event);
+
+esp_err_t sph0645_read_event(size_t offset, void *buf, size_t size);
+
+void sph0645_release_event();
\ No newline at end of file
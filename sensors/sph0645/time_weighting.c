@@ -0,0 +1,31 @@
+#include "time_weighting.h"
+
+#include <math.h>
+
+#include "sph0645.h"
+
+#define FAST_TAU 0.125   // Time constant of fast time weighting (s).
+#define SLOW_TAU 1.0     // Time constant of slow time weighting (s).
+#define IMPULSE_RISE_TAU 0.035  // Time constant of rising impulse levels (s).
+#define IMPULSE_FALL_TAU 1.5    // Time constant of falling impulse levels (s).
+
+void time_weighting_init(time_weighting_t *weighting, uint8_t time_weighting,
+                         uint32_t step_ms) {
+  // smoothing factors of an exponential average stepped every step_ms, which
+  // decays exactly as the analog time constant does at each step
+  float rise_tau = FAST_TAU, fall_tau = FAST_TAU;
+  if (time_weighting == SPH0645_TIME_WEIGHTING_SLOW) {
+    rise_tau = fall_tau = SLOW_TAU;
+  } else if (time_weighting == SPH0645_TIME_WEIGHTING_IMPULSE) {
+    rise_tau = IMPULSE_RISE_TAU;
+    fall_tau = IMPULSE_FALL_TAU;
+  }
+  weighting->rise = 1 - expf(-(float)step_ms / 1000 / rise_tau);
+  weighting->fall = 1 - expf(-(float)step_ms / 1000 / fall_tau);
+}
+
+float time_weighting_step(const time_weighting_t *weighting, float level,
+                          float mean_sqr) {
+  const float factor = mean_sqr > level ? weighting->rise : weighting->fall;
+  return level + (mean_sqr - level) * factor;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "esp_system.h"
+
+typedef struct {
+  float rise;  // Smoothing factor while the level rises.
+  float fall;  // Smoothing factor while the level falls.
+} time_weighting_t;
+
+void time_weighting_init(time_weighting_t *weighting, uint8_t time_weighting,
+                         uint32_t step_ms);
+
+float time_weighting_step(const time_weighting_t *weighting, float level,
+                          float mean_sqr);
@@ -0,0 +1,49 @@
+#include "alloc.h"
+
+#include <malloc.h>
+#include <string.h>
+
+// Wrapped with -Wl,--wrap so that every allocation in the test goes through
+// here first.
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+static alloc_stats_t stats;
+
+static void count(void *ptr, size_t size, size_t old_size) {
+  if (ptr == NULL) return;
+  ++stats.allocations;
+  stats.bytes += size;
+  stats.in_use += (ptrdiff_t)malloc_usable_size(ptr) - (ptrdiff_t)old_size;
+  if (stats.in_use > stats.peak) stats.peak = stats.in_use;
+}
+
+void *__wrap_malloc(size_t size) {
+  void *ptr = __real_malloc(size);
+  count(ptr, size, 0);
+  return ptr;
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+  void *ptr = __real_calloc(n, size);
+  count(ptr, n * size, 0);
+  return ptr;
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+  const size_t old_size = ptr != NULL ? malloc_usable_size(ptr) : 0;
+  void *new_ptr = __real_realloc(ptr, size);
+  count(new_ptr, size, old_size);
+  return new_ptr;
+}
+
+void __wrap_free(void *ptr) {
+  if (ptr != NULL) stats.in_use -= (ptrdiff_t)malloc_usable_size(ptr);
+  __real_free(ptr);
+}
+
+void alloc_reset() { memset(&stats, 0, sizeof(stats)); }
+
+void alloc_get_stats(alloc_stats_t *out) { *out = stats; }
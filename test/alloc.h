@@ -0,0 +1,14 @@
+#pragma once
+// Counts heap allocations in tests linked with WRAP_ALLOC.
+#include <stddef.h>
+
+typedef struct {
+  size_t allocations;  // Calls to malloc, calloc and realloc.
+  size_t bytes;        // Bytes asked for by them.
+  ptrdiff_t in_use;    // Bytes allocated less bytes freed since the reset.
+  ptrdiff_t peak;      // Most of in_use at once.
+} alloc_stats_t;
+
+void alloc_reset();
+
+void alloc_get_stats(alloc_stats_t *stats);
@@ -0,0 +1,7 @@
+#pragma once
+// Memory placement means nothing on the host, and RTC memory is just memory.
+#define IRAM_ATTR
+#define DRAM_ATTR
+#define RTC_DATA_ATTR
+#define RTC_NOINIT_ATTR
+#define WORD_ALIGNED_ATTR __attribute__((aligned(4)))
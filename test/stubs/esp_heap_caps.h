@@ -0,0 +1,12 @@
+#pragma once
+// The parts of esp_heap_caps.h the tests compile against.
+#include <stddef.h>
+#include <stdint.h>
+
+#define MALLOC_CAP_32BIT BIT(1)
+#define MALLOC_CAP_8BIT BIT(2)
+#define MALLOC_CAP_DMA BIT(3)
+#define MALLOC_CAP_SPIRAM BIT(10)
+#define MALLOC_CAP_INTERNAL BIT(11)
+
+void *heap_caps_malloc(size_t size, uint32_t caps);
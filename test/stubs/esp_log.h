@@ -0,0 +1,15 @@
+#pragma once
+// Logs are checked for their format but not printed.
+#include <stdio.h>
+
+#define ESP_LOG_QUIET(tag, fmt, ...)         \
+  do {                                       \
+    (void)(tag);                             \
+    if (0) printf(fmt "\n", ##__VA_ARGS__); \
+  } while (0)
+
+#define ESP_LOGE(tag, fmt, ...) ESP_LOG_QUIET(tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) ESP_LOG_QUIET(tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...) ESP_LOG_QUIET(tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGD(tag, fmt, ...) ESP_LOG_QUIET(tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGV(tag, fmt, ...) ESP_LOG_QUIET(tag, fmt, ##__VA_ARGS__)
@@ -0,0 +1,22 @@
+#pragma once
+// The parts of task.h the tests compile against.
+#include "freertos/FreeRTOS.h"
+
+typedef void *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task);
+TickType_t xTaskGetTickCount(void);
+void vTaskDelay(TickType_t ticks);
+BaseType_t xTaskCreate(TaskFunction_t task, const char *name,
+                       uint32_t stack_size, void *arg, UBaseType_t priority,
+                       TaskHandle_t *handle);
+void vTaskDelete(TaskHandle_t task);
+TaskHandle_t xTaskCreateStaticPinnedToCore(TaskFunction_t task,
+                                           const char *name,
+                                           uint32_t stack_size, void *arg,
+                                           UBaseType_t priority,
+                                           StackType_t *stack,
+                                           StaticTask_t *buffer,
+                                           BaseType_t core);
@@ -0,0 +1,5 @@
+#pragma once
+// The parts of nvs_flash.h the tests compile against.
+#include "nvs.h"
+
+esp_err_t nvs_flash_init(void);
@@ -0,0 +1,8 @@
+#pragma once
+// The options of the default outside station in sdkconfig. Tests that need
+// others define them on the command line.
+#define CONFIG_OUTSIDE_STATION 1
+#define CONFIG_CELSIUS 1
+#define CONFIG_MM_HG 1
+#define CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ 80
+#define CONFIG_MAX17043_ALERT_PIN 32
@@ -0,0 +1,40 @@
+#pragma once
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+// Checks count their failures and carry on, so one run shows every failure.
+static int failures = 0;
+
+#define CHECK(cond)                                                  \
+  do {                                                               \
+    if (!(cond)) {                                                   \
+      printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      ++failures;                                                    \
+    }                                                                \
+  } while (0)
+
+#define CHECK_NEAR(a, b, tol)                                             \
+  do {                                                                    \
+    const double a_ = (a), b_ = (b);                                      \
+    if (!(fabs(a_ - b_) <= (tol))) {                                      \
+      printf("%s:%d: check failed: %s = %g, expected %g +/- %g\n",        \
+             __FILE__, __LINE__, #a, a_, b_, (double)(tol));              \
+      ++failures;                                                         \
+    }                                                                     \
+  } while (0)
+
+#define CHECK_STR(a, b)                                                  \
+  do {                                                                   \
+    const char *a_ = (a), *b_ = (b);                                     \
+    if (strcmp(a_, b_) != 0) {                                           \
+      printf("%s:%d: check failed: %s = \"%s\", expected \"%s\"\n",      \
+             __FILE__, __LINE__, #a, a_, b_);                            \
+      ++failures;                                                        \
+    }                                                                    \
+  } while (0)
+
+static inline int test_result(const char *name) {
+  printf("%s: %s\n", name, failures ? "FAILED" : "passed");
+  return failures != 0;
+}
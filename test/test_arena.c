@@ -0,0 +1,135 @@
+// Carves memory out of the arena on a stubbed heap and checks what is counted
+// per owner, that owners past the table share its last entry, memory carved
+// out after sealing, and that a task's stack and control block come out of
+// one allocation that is never half made.
+#include <stdlib.h>
+
+#include "arena.h"
+#include "test.h"
+
+static bool heap_full;       // Whether the heap refuses allocations.
+static int heap_allocations;
+static StackType_t *created_stack;  // Stack of the last task created.
+static StaticTask_t *created_buffer;
+static int tasks_created;
+
+void *heap_caps_malloc(size_t size, uint32_t caps) {
+  if (heap_full) return NULL;
+  ++heap_allocations;
+  return malloc(size);
+}
+
+TaskHandle_t xTaskCreateStaticPinnedToCore(TaskFunction_t task,
+                                           const char *name,
+                                           uint32_t stack_size, void *arg,
+                                           UBaseType_t priority,
+                                           StackType_t *stack,
+                                           StaticTask_t *buffer,
+                                           BaseType_t core) {
+  created_stack = stack;
+  created_buffer = buffer;
+  ++tasks_created;
+  return buffer;
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task) {
+  CHECK(task != NULL);
+  return 100;
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle() { return NULL; }
+
+static void task(void *arg) {}
+
+static size_t get_size(const char *owner) {
+  arena_usage_t usage[ARENA_MAX_OWNERS];
+  const size_t count = arena_get_usage(usage, ARENA_MAX_OWNERS);
+  for (size_t i = 0; i < count; ++i)
+    if (strcmp(usage[i].owner, owner) == 0) return usage[i].size;
+  return 0;
+}
+
+static void test_owners() {
+  // the table fills up to its last entry with named owners, then the rest
+  // are counted together, and none of them go without memory
+  static const char *owners[] = {"wifi",  "mqtt",    "i2s",   "fft",
+                                 "event", "backlog", "json",  "uart",
+                                 "sntp",  "http",    "ota",   "co2",
+                                 "wind",  "rain"};
+  for (size_t i = 0; i < sizeof(owners) / sizeof(owners[0]); ++i) {
+    void *buf = arena_alloc(owners[i], 100 + i, MALLOC_CAP_8BIT);
+    CHECK(buf != NULL);
+    free(buf);
+  }
+  arena_usage_t usage[ARENA_MAX_OWNERS];
+  CHECK(arena_get_usage(usage, ARENA_MAX_OWNERS) == ARENA_MAX_OWNERS);
+  for (size_t i = 0; i < ARENA_MAX_OWNERS - 1; ++i) {
+    CHECK_STR(usage[i].owner, owners[i]);
+    CHECK(usage[i].size == 100 + i);
+  }
+  CHECK_STR(usage[ARENA_MAX_OWNERS - 1].owner, "other");
+  CHECK(get_size("other") == 111 + 112 + 113);
+
+  // named owners keep counting for themselves
+  free(arena_alloc("wifi", 50, MALLOC_CAP_8BIT));
+  CHECK(get_size("wifi") == 150);
+
+  // and nothing is counted when the heap is out of memory
+  heap_full = true;
+  CHECK(arena_alloc("wifi", 50, MALLOC_CAP_8BIT) == NULL);
+  CHECK(arena_alloc("wind", 50, MALLOC_CAP_8BIT) == NULL);
+  heap_full = false;
+  CHECK(get_size("wifi") == 150);
+  CHECK(get_size("other") == 336);
+}
+
+static void test_tasks() {
+  // one allocation holds the control block and then the aligned stack, all
+  // counted for the task
+  const size_t before = get_size("other");
+  heap_allocations = 0;
+  CHECK(arena_create_task(task, "mic", 4096, NULL, 4, 0) != NULL);
+  CHECK(heap_allocations == 1);
+  CHECK((void *)created_stack > (void *)created_buffer);
+  CHECK((uint8_t *)created_stack - (uint8_t *)created_buffer <
+        sizeof(StaticTask_t) + 16);
+  CHECK((uintptr_t)created_stack % 16 == 0);
+  const size_t size = get_size("other") - before;  // the table is full
+  CHECK(size >= 4096 + sizeof(StaticTask_t));
+
+  // a task that doesn't fit leaves nothing behind, and isn't reported
+  heap_full = true;
+  tasks_created = 0;
+  CHECK(arena_create_task(task, "lost", 4096, NULL, 4, 0) == NULL);
+  CHECK(tasks_created == 0);
+  heap_full = false;
+  arena_task_t tasks[ARENA_MAX_TASKS];
+  CHECK(arena_get_tasks(tasks, ARENA_MAX_TASKS) == 1);
+  CHECK_STR(tasks[0].name, "mic");
+  CHECK(tasks[0].stack_size == 4096 && tasks[0].stack_free == 100);
+
+  // until the table of tasks is full, the slot of the failed task included
+  int created = 1;
+  while (arena_create_task(task, "worker", 2048, NULL, 1, 0) != NULL)
+    ++created;
+  CHECK(created == ARENA_MAX_TASKS - 1);
+  CHECK(arena_get_tasks(tasks, ARENA_MAX_TASKS) == ARENA_MAX_TASKS - 1);
+}
+
+static void test_seal() {
+  // memory carved out after sealing still comes, but is counted as late
+  CHECK(arena_get_late() == 0);
+  arena_seal();
+  void *buf = arena_alloc("i2s", 256, MALLOC_CAP_8BIT);
+  CHECK(buf != NULL);
+  free(buf);
+  CHECK(arena_get_late() == 256);
+  CHECK(get_size("i2s") == 102 + 256);
+}
+
+int main() {
+  test_owners();
+  test_tasks();
+  test_seal();
+  return test_result("arena");
+}
@@ -0,0 +1,386 @@
+// Runs the backlog ring on a fake NOR flash partition, where writes can only
+// clear bits and erases are by sector, and replays it to a stand-in broker
+// that drops and restores the connection.
+#include <string.h>
+
+#include "backlog.h"
+#include "backlog_replay.h"
+#include "esp_partition.h"
+#include "test.h"
+#include "timestamp.h"
+
+#define SECTOR_SIZE 4096
+#define NUM_SECTORS 4
+#define REPORT_US (10 * 60 * 1000000LL)  // Time between reports (us).
+#define WALL_START 1600000000  // Wall time when the time is synced (s).
+
+static uint8_t flash[NUM_SECTORS * SECTOR_SIZE];
+static const esp_partition_t fake_partition = {
+    .type = ESP_PARTITION_TYPE_DATA, .subtype = 0x40, .size = sizeof(flash)};
+static esp_reset_reason_t reset_reason = ESP_RST_POWERON;
+static int writes_left = -1;  // Writes before power is lost, or -1.
+static int erases = 0;
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type,
+                                                esp_partition_subtype_t subtype,
+                                                const char *label) {
+  return type == fake_partition.type && subtype == fake_partition.subtype
+             ? &fake_partition
+             : NULL;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *partition,
+                             size_t src_offset, void *dst, size_t size) {
+  if (src_offset + size > sizeof(flash)) return ESP_ERR_INVALID_SIZE;
+  memcpy(dst, flash + src_offset, size);
+  return ESP_OK;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t *partition,
+                              size_t dst_offset, const void *src,
+                              size_t size) {
+  if (dst_offset + size > sizeof(flash)) return ESP_ERR_INVALID_SIZE;
+
+  // once power is lost nothing more reaches the flash
+  if (writes_left == 0) return ESP_OK;
+  if (writes_left > 0) --writes_left;
+  for (size_t i = 0; i < size; ++i)
+    flash[dst_offset + i] &= ((const uint8_t *)src)[i];
+  return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *partition,
+                                    size_t offset, size_t size) {
+  if (offset % SECTOR_SIZE || size % SECTOR_SIZE ||
+      offset + size > sizeof(flash))
+    return ESP_ERR_INVALID_ARG;
+  if (writes_left == 0) return ESP_OK;
+  memset(flash + offset, 0xff, size);
+  ++erases;
+  return ESP_OK;
+}
+
+esp_reset_reason_t esp_reset_reason() { return reset_reason; }
+
+// The clock starts over on every power up, and the wall time is the
+// timestamp plus an offset once it is synced.
+static int64_t now = 0;
+static uint32_t clock_id = 1;
+static bool synced = false;
+static int64_t sync_offset = 0;
+
+int64_t timestamp_now() { return now; }
+bool timestamp_is_synced() { return synced; }
+uint32_t timestamp_get_clock() { return clock_id; }
+
+esp_err_t timestamp_to_time(int64_t stamp, time_t *time) {
+  if (!synced) return ESP_ERR_INVALID_STATE;
+  *time = (stamp + sync_offset) / 1000000;
+  return ESP_OK;
+}
+
+static void sync_time() {
+  synced = true;
+  sync_offset = WALL_START * 1000000LL - now;
+}
+
+static void power_up(esp_reset_reason_t reason) {
+  // the backlog only trusts what it kept in RTC memory after deep sleep
+  reset_reason = reason;
+  CHECK(backlog_init() == ESP_OK);
+}
+
+static void erase_flash() {
+  memset(flash, 0xff, sizeof(flash));
+  power_up(ESP_RST_POWERON);
+}
+
+static size_t fill(uint8_t *buf, uint32_t n) {
+  // a record of n, with a size that varies from record to record
+  const size_t size = 1 + n * 37 % 300;
+  for (size_t i = 0; i < size; ++i) buf[i] = n + i * 7;
+  memcpy(buf, &n, size < sizeof(n) ? size : sizeof(n));
+  return size;
+}
+
+static bool check_record(uint32_t n) {
+  // the oldest record holds n
+  uint8_t expected[BACKLOG_MAX_SIZE], buf[BACKLOG_MAX_SIZE];
+  const size_t expected_size = fill(expected, n);
+  size_t size = sizeof(buf);
+  if (backlog_peek(buf, &size) != ESP_OK) return false;
+  return size == expected_size && memcmp(buf, expected, size) == 0;
+}
+
+static void test_round_trip() {
+  erase_flash();
+  CHECK(backlog_count() == 0);
+  uint8_t buf[BACKLOG_MAX_SIZE];
+  size_t size = sizeof(buf);
+  CHECK(backlog_peek(buf, &size) == ESP_ERR_NOT_FOUND);
+  CHECK(backlog_pop() == ESP_ERR_NOT_FOUND);
+  CHECK(backlog_push(buf, 0) == ESP_ERR_INVALID_SIZE);
+  CHECK(backlog_push(buf, BACKLOG_MAX_SIZE + 1) == ESP_ERR_INVALID_SIZE);
+
+  // records come back as they went in, including the largest
+  memset(buf, 0xa5, sizeof(buf));
+  CHECK(backlog_push(buf, BACKLOG_MAX_SIZE) == ESP_OK);
+  for (uint32_t n = 0; n < 20; ++n) {
+    const size_t size = fill(buf, n);
+    CHECK(backlog_push(buf, size) == ESP_OK);
+  }
+  CHECK(backlog_count() == 21);
+  uint8_t out[BACKLOG_MAX_SIZE];
+  size = BACKLOG_MAX_SIZE - 1;
+  CHECK(backlog_peek(out, &size) == ESP_ERR_INVALID_SIZE);
+  size = sizeof(out);
+  CHECK(backlog_peek(out, &size) == ESP_OK);
+  CHECK(size == BACKLOG_MAX_SIZE && out[0] == 0xa5 && out[size - 1] == 0xa5);
+  CHECK(backlog_pop() == ESP_OK);
+  for (uint32_t n = 0; n < 10; ++n) {
+    CHECK(check_record(n));
+    CHECK(backlog_pop() == ESP_OK);
+  }
+
+  // a scan after a reset finds the same records, and deep sleep keeps them
+  power_up(ESP_RST_POWERON);
+  CHECK(backlog_count() == 10);
+  CHECK(check_record(10));
+  power_up(ESP_RST_DEEPSLEEP);
+  CHECK(backlog_count() == 10);
+  CHECK(check_record(10));
+
+  // a record whose data was corrupted is dropped
+  const uint32_t dropped = backlog_dropped();
+  for (size_t i = 16; i < sizeof(flash) - 4; i += 4) {
+    // a record's data follows its 16 byte header, and starts with its number
+    uint32_t word;
+    memcpy(&word, flash + i, sizeof(word));
+    if (word == 10 && flash[i - 16] == 0x4c && flash[i - 15] == 0x42) {
+      flash[i] &= ~0x02;  // bits can only be cleared
+      break;
+    }
+  }
+  CHECK(check_record(11));
+  CHECK(backlog_dropped() == dropped + 1);
+  CHECK(backlog_count() == 9);
+}
+
+static void test_wrap() {
+  // records keep coming back in order while the ring wraps many times
+  erase_flash();
+  uint8_t buf[BACKLOG_MAX_SIZE];
+  uint32_t pushed = 0, popped = 0;
+  erases = 0;
+  while (erases < 5 * NUM_SECTORS) {
+    for (int i = 0; i < 2; ++i) {
+      const size_t size = fill(buf, pushed++);
+      CHECK(backlog_push(buf, size) == ESP_OK);
+    }
+    for (int i = pushed - popped < 40 ? 1 : 3; i > 0; --i) {
+      CHECK(check_record(popped++));
+      CHECK(backlog_pop() == ESP_OK);
+    }
+    CHECK(backlog_count() == pushed - popped);
+
+    // a scan halfway through a wrap finds the same tail
+    if (pushed % 90 == 0) {
+      power_up(ESP_RST_POWERON);
+      CHECK(backlog_count() == pushed - popped);
+    }
+  }
+  while (popped < pushed) {
+    CHECK(check_record(popped++));
+    CHECK(backlog_pop() == ESP_OK);
+  }
+  CHECK(backlog_count() == 0);
+  CHECK(backlog_dropped() == 0);
+}
+
+static void test_full() {
+  // a full ring drops its oldest sector to make room, and what is left is
+  // the newest records in order
+  erase_flash();
+  uint8_t buf[BACKLOG_MAX_SIZE];
+  uint32_t pushed = 0;
+  while (backlog_dropped() == 0) {
+    const size_t size = fill(buf, pushed++);
+    CHECK(backlog_push(buf, size) == ESP_OK);
+  }
+  for (int i = 0; i < 200; ++i) {
+    const size_t size = fill(buf, pushed++);
+    CHECK(backlog_push(buf, size) == ESP_OK);
+  }
+  const uint32_t kept = backlog_count();
+  CHECK(kept > 0);
+  CHECK(kept + backlog_dropped() == pushed);
+
+  // a rescan agrees
+  power_up(ESP_RST_POWERON);
+  CHECK(backlog_count() == kept);
+  for (uint32_t n = pushed - kept; n < pushed; ++n) {
+    CHECK(check_record(n));
+    CHECK(backlog_pop() == ESP_OK);
+  }
+  CHECK(backlog_count() == 0);
+}
+
+static void test_torn_write() {
+  // power lost partway through a push leaves the records before it, and the
+  // backlog carries on after the torn one
+  erase_flash();
+  uint8_t buf[BACKLOG_MAX_SIZE];
+  for (uint32_t n = 0; n < 5; ++n) {
+    const size_t size = fill(buf, n);
+    CHECK(backlog_push(buf, size) == ESP_OK);
+  }
+  writes_left = 2;  // the header and data, but not the magic
+  const size_t size = fill(buf, 5);
+  backlog_push(buf, size);
+  writes_left = -1;
+  power_up(ESP_RST_POWERON);
+  CHECK(backlog_count() == 5);
+  for (uint32_t n = 6; n < 8; ++n) {
+    const size_t size = fill(buf, n);
+    CHECK(backlog_push(buf, size) == ESP_OK);
+  }
+  static const uint32_t expected[] = {0, 1, 2, 3, 4, 6, 7};
+  for (int i = 0; i < 7; ++i) {
+    CHECK(check_record(expected[i]));
+    CHECK(backlog_pop() == ESP_OK);
+  }
+}
+
+// The stand-in broker takes messages while it is connected, and can drop the
+// connection after a number of them.
+static bool connected = true;
+static int publishes_left = -1;  // Messages before the connection drops.
+static int batch_published = 0;
+static bool replaying = false;
+static struct {
+  int n;
+  time_t time;
+  bool replayed;
+} received[1000];
+static int num_received = 0;
+
+static esp_err_t broker_publish(const char *message, time_t time) {
+  if (publishes_left == 0) connected = false;
+  if (!connected) return ESP_FAIL;
+  if (publishes_left > 0) --publishes_left;
+  int n;
+  long message_time = 0;
+  if (sscanf(message, "{\"n\":%d,\"time\":%ld}", &n, &message_time) < 1)
+    return ESP_ERR_INVALID_SIZE;
+  received[num_received].n = n;
+  received[num_received].time = message_time ? message_time : time;
+  received[num_received].replayed = replaying;
+  ++num_received;
+  return ESP_OK;
+}
+
+static esp_err_t publish_record(void *data, size_t size, time_t time) {
+  // records are replayed with the time they were measured
+  char message[64];
+  if (size >= sizeof(message)) return ESP_ERR_INVALID_SIZE;
+  memcpy(message, data, size);
+  message[size] = 0;
+  ++batch_published;
+  replaying = true;
+  esp_err_t err = broker_publish(message, time);
+  replaying = false;
+  return err;
+}
+
+static void report(int n) {
+  // publish a reading, keeping it if the broker can't be reached, then catch
+  // up on the backlog
+  char message[64];
+  time_t time;
+  const bool timed = timestamp_to_time(now, &time) == ESP_OK;
+  if (timed)
+    snprintf(message, sizeof(message), "{\"n\":%d,\"time\":%ld}", n,
+             (long)time);
+  else
+    snprintf(message, sizeof(message), "{\"n\":%d}", n);
+  if (broker_publish(message, 0))
+    CHECK(backlog_replay_keep(message, strlen(message), now, timed) ==
+          ESP_OK);
+  batch_published = 0;
+  backlog_replay(publish_record);
+  CHECK(batch_published <= BACKLOG_BATCH);
+}
+
+static void test_replay() {
+  erase_flash();
+  now = 0;
+
+  // offline and without the time from the start, then the time is synced
+  // while still offline. The connection comes back, drops partway through
+  // catching up, comes back, and is lost again for a while.
+  const int reports = 300;
+  for (int n = 0; n < reports; ++n) {
+    now += REPORT_US;
+    if (n == 124) {
+      CHECK(!connected);
+      publishes_left = -1;
+    }
+    connected = n >= 150 || (n >= 120 && n < 140);
+    if (n == 30) {
+      CHECK(backlog_count() == 30);  // nothing is replayed without the time
+      sync_time();
+    }
+    if (n == 122) publishes_left = 10;
+    report(n);
+  }
+  CHECK(backlog_count() == 0);
+
+  // every reading arrives exactly once, with the time it was measured
+  static bool seen[300];
+  for (int i = 0; i < num_received; ++i) {
+    const int n = received[i].n;
+    CHECK(n >= 0 && n < reports && !seen[n]);
+    seen[n] = true;
+    const time_t measured =
+        WALL_START + (n + 1 - 31) * REPORT_US / 1000000;
+    CHECK(received[i].time == measured);
+  }
+  for (int n = 0; n < reports; ++n) CHECK(seen[n]);
+  CHECK(num_received == reports);
+
+  // the backlog goes out oldest first
+  int last = -1;
+  for (int i = 0; i < num_received; ++i) {
+    if (!received[i].replayed) continue;
+    CHECK(received[i].n > last);
+    last = received[i].n;
+  }
+
+  // readings kept before power was lost can't be placed in time and are
+  // dropped instead of replayed
+  num_received = 0;
+  connected = false;
+  synced = false;
+  for (int n = 0; n < 3; ++n) {
+    now += REPORT_US;
+    report(n);
+  }
+  CHECK(backlog_count() == 3);
+  now = 0;
+  ++clock_id;
+  power_up(ESP_RST_POWERON);
+  connected = true;
+  sync_time();
+  CHECK(backlog_replay(publish_record) == ESP_OK);
+  CHECK(num_received == 0);
+  CHECK(backlog_count() == 0);
+}
+
+int main() {
+  test_round_trip();
+  test_wrap();
+  test_full();
+  test_torn_write();
+  test_replay();
+  return test_result("backlog");
+}
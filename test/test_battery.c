@@ -0,0 +1,179 @@
+// Discharges a simulated battery through the battery policy and history, with
+// the cost of each period taken from the policy in force, and checks the
+// levels, the alert, the recovery on charging and the projected runtime.
+#include "battery_history.h"
+#include "battery_policy.h"
+#include "max17043.h"
+#include "test.h"
+#include "timestamp.h"
+
+#define CAPACITY_MAH 2000.0  // Capacity of the simulated battery (mAh).
+#define PERIOD_MIN 10        // Minutes between publish times.
+#define SLEEP_MA 2.0         // Current between reports (mA).
+#define REPORT_MAH (120.0 * 0.5 / 60)  // Charge used by a report (mAh).
+#define PM_MAH (80.0 * 0.5 / 60)       // Charge used by the PMS5003 (mAh).
+#define MIC_MA 3.0  // Current of continuous noise sampling (mA).
+#define GAUGE_NOISE 0.4  // Noise in the battery life from the fuel gauge (%).
+
+static int64_t now = 0;
+static max17043_alert_handler_t alert_handler = NULL;
+static int alerts_cleared = 0;
+
+int64_t timestamp_now() { return now; }
+
+esp_err_t max17043_get_config(max17043_config_t *config) {
+  *config = (max17043_config_t)MAX17043_DEFAULT_CONFIG;
+  return ESP_OK;
+}
+
+esp_err_t max17043_set_config(const max17043_config_t *config) {
+  return ESP_OK;
+}
+
+uint8_t max17043_alert_threshold(uint8_t percentage) { return 32 - percentage; }
+
+esp_err_t max17043_set_alert_handler(max17043_alert_handler_t handler,
+                                     void *arg) {
+  alert_handler = handler;
+  return ESP_OK;
+}
+
+esp_err_t max17043_clear_alert() {
+  ++alerts_cleared;
+  return ESP_OK;
+}
+
+static double period_cost(const battery_policy_t *policy, bool report,
+                          bool pm) {
+  // charge used over one period (mAh)
+  double mah = SLEEP_MA * PERIOD_MIN / 60;
+  if (policy->noise_continuous) mah += MIC_MA * PERIOD_MIN / 60;
+  if (report) mah += REPORT_MAH;
+  if (pm) mah += PM_MAH;
+  return mah;
+}
+
+static double average_ma(const battery_policy_t *policy) {
+  // average current of a policy kept for good (mA)
+  const double reports = 1.0 / policy->report_every;
+  const double pms = policy->pm_every ? reports / policy->pm_every : 0;
+  return (period_cost(policy, false, false) + reports * REPORT_MAH +
+          pms * PM_MAH) * 60 / PERIOD_MIN;
+}
+
+static double gauge(double mah, int period) {
+  // battery life as the fuel gauge reads it, with a repeatable wobble
+  const double noise = GAUGE_NOISE * sin(period * 2.1);
+  return mah / CAPACITY_MAH * 100 + noise;
+}
+
+int main() {
+  CHECK(battery_policy_start() == ESP_OK);
+  CHECK(alert_handler != NULL);
+  CHECK(battery_policy_get_level() == BATTERY_NORMAL);
+
+  // discharge until empty, reading the gauge on every report
+  battery_policy_t policies[BATTERY_LEVEL_MAX];
+  bool seen[BATTERY_LEVEL_MAX] = {false};
+  int level_changes = 0;
+  bool changed = false;
+  double mah = CAPACITY_MAH;
+  battery_level_t level = BATTERY_NORMAL;
+  int period = 0;
+  bool alerted = false;
+  int estimates = 0;
+  for (; mah > 0; ++period) {
+    now += PERIOD_MIN * 60 * 1000000LL;
+
+    // the gauge raises its alert as it crosses 12%, before the report path
+    // has seen the battery life fall below the critical threshold
+    if (!alerted && mah / CAPACITY_MAH * 100 < 12) {
+      alerted = true;
+      CHECK(battery_policy_get_level() == BATTERY_LOW);
+      alert_handler(NULL);
+      CHECK(alerts_cleared == 0);  // nothing changes until the report path
+      CHECK(battery_policy_get_level() == BATTERY_LOW);
+    }
+
+    // the first report after a change goes out right away
+    const bool report = battery_policy_report_due();
+    if (changed) CHECK(report);
+    changed = false;
+    bool pm = false;
+    if (report) {
+      const double life = gauge(mah, period);
+      const battery_level_t before = battery_policy_get_level();
+      const battery_level_t new_level = battery_policy_update(life);
+      CHECK(new_level >= level);  // noise never steps the level back up
+      if (new_level != level) ++level_changes;
+      changed = new_level != before;
+      level = new_level;
+      battery_history_add(3300 + 9 * life, life);
+      pm = battery_policy_pm_due();
+      if (!seen[level]) {
+        seen[level] = true;
+        policies[level] = *battery_policy_get();
+        // the levels follow the thresholds, less the gauge noise
+        if (level == BATTERY_ECONOMY) CHECK_NEAR(life, 50, 1 + GAUGE_NOISE);
+        if (level == BATTERY_LOW) CHECK_NEAR(life, 25, 1 + GAUGE_NOISE);
+      }
+    }
+    if (alerted) CHECK(battery_policy_get_level() == BATTERY_CRITICAL);
+    mah -= period_cost(battery_policy_get(), report, pm);
+
+    // once it spans a few hours, the history projects how long is left from
+    // the recent drain through the noise of the gauge
+    battery_estimate_t estimate;
+    if (report && period >= 36 && mah > CAPACITY_MAH * 0.6 &&
+        battery_history_estimate(&estimate) == ESP_OK) {
+      const double rate = -average_ma(battery_policy_get()) /
+                          CAPACITY_MAH * 100;  // %/h
+      CHECK_NEAR(estimate.rate, rate, fabs(rate) * 0.1);
+      CHECK_NEAR(estimate.time_to_empty, mah / CAPACITY_MAH * 100 / -rate,
+                 mah / CAPACITY_MAH * 100 / -rate * 0.1);
+      ++estimates;
+    }
+  }
+  for (int i = 0; i < BATTERY_LEVEL_MAX; ++i) CHECK(seen[i]);
+  CHECK(level_changes == BATTERY_LEVEL_MAX - 1);
+  CHECK(estimates > 0);
+  CHECK(alerts_cleared == 1);
+
+  // reports and the PMS5003 are stretched as the battery runs down
+  for (int i = BATTERY_ECONOMY; i < BATTERY_LEVEL_MAX; ++i) {
+    CHECK(policies[i].report_every >= policies[i - 1].report_every);
+    CHECK(average_ma(&policies[i]) < average_ma(&policies[i - 1]));
+  }
+
+  // stepping down lasts well beyond staying at the normal level from full
+  const double hours = period * PERIOD_MIN / 60.0;
+  static const char *names[BATTERY_LEVEL_MAX] = {"normal", "economy", "low",
+                                                 "critical"};
+  printf("projected runtime from %.0f mAh:\n", CAPACITY_MAH);
+  for (int i = 0; i < BATTERY_LEVEL_MAX; ++i) {
+    const double fixed = CAPACITY_MAH / average_ma(&policies[i]);
+    printf("  %-8s %6.1f h at %5.2f mA\n", names[i], fixed,
+           average_ma(&policies[i]));
+    if (i == BATTERY_NORMAL) CHECK(hours > fixed * 1.2);
+  }
+  printf("  adaptive %6.1f h\n", hours);
+
+  // charging puts the level straight back to normal, and the history turns
+  // to a rise with no time to empty
+  mah = 0;
+  for (int i = 0; i < 24; ++i, ++period) {
+    now += PERIOD_MIN * 60 * 1000000LL;
+    mah += CAPACITY_MAH * 0.02;
+    const double life = gauge(mah, period);
+    level = battery_policy_update(life);
+    battery_history_add(3300 + 9 * life, life);
+    if (i >= 1) CHECK(level == BATTERY_NORMAL);
+  }
+  CHECK(battery_policy_get()->noise_continuous);
+  battery_estimate_t estimate;
+  CHECK(battery_history_estimate(&estimate) == ESP_OK);
+  CHECK(estimate.rate > 0);
+  CHECK(isinf(estimate.time_to_empty));
+
+  return test_result("battery");
+}
@@ -0,0 +1,480 @@
+// Starts the bme280 driver against chips on a mocked bus, counting the i2c
+// transactions of each start, and checks that the trimming parameters cached
+// in nvs are only used while they belong to the chip on the bus. Every chip
+// reports the same id, so a swapped sensor has to be found by its trimming.
+// Then simulates a day of reports from a chip with the pressure noise of the
+// datasheet, sampled in forced mode and in normal mode as sensor_bme280.c
+// does, and compares their variance and i2c traffic.
+#include <math.h>
+
+#include "bme280.h"
+#include "esp32/rom/crc.h"
+#include "i2c.h"
+#include "nvs.h"
+#include "test.h"
+
+#define I2C_ADDRESS 0x76
+#define REG_TRIM_T1_TO_P9 0x88
+#define REG_TRIM_H1 0xa1
+#define REG_CHIP_ID 0xd0
+#define REG_RESET 0xe0
+#define REG_TRIM_H2_TO_H6 0xe1
+#define REG_CTRL_HUM 0xf2
+#define REG_STATUS 0xf3
+#define REG_CTRL_MEAS 0xf4
+#define REG_CONFIG 0xf5
+#define REG_DATA_START 0xf7
+#define CHIP_ID 0x60
+#define RESET_WORD 0xb6
+#define MEASURING_BIT 8
+#define CACHE_VERSION_OFFSET 1  // Offset of the version in the nvs blob.
+#define MAX_BLOB 128
+
+#define I2C_HZ 100000     // Clock of the i2c bus.
+#define ADC_P 0x655ac     // Pressure reading of the datasheet example.
+#define REPORT_S 300      // Time between reports, PUBLISH_PERIOD_MS (s).
+#define FORCED_SAMPLE_S 10  // Time between samples in forced mode (s).
+#define NORMAL_SAMPLE_S 2   // CONFIG_BME280_SAMPLE_MS by default (s).
+#define SIM_REPORTS 288   // A day of reports.
+#define FALL_PA_PER_S (-100.0 / 3 / 3600)  // A barometer falling 1hPa in 3h.
+
+typedef struct {
+  uint16_t t1;
+  int16_t t2, t3;
+  uint16_t p1;
+  int16_t p2, p3, p4, p5, p6, p7, p8, p9;
+  uint8_t h1;
+  int16_t h2;
+  uint8_t h3;
+  int16_t h4, h5;
+  int8_t h6;
+} trim_t;
+
+// The example of the bmp280 datasheet, with humidity trimming of a real chip
+// except for a negative h5.
+static const trim_t datasheet = {27504, 26435, -1000, 36477, -10685, 3024,
+                                 2855,  140,   -7,    15500, -14600, 6000,
+                                 75,    362,   0,     313,   -20,    30};
+// Another chip, the same but for a slightly different temperature trimming.
+static const trim_t other = {27510, 26435, -1000, 36477, -10685, 3024,
+                             2855,  140,   -7,    15500, -14600, 6000,
+                             75,    362,   0,     313,   -20,    30};
+
+// RMS pressure noise of the datasheet for each oversampling setting (Pa).
+static const double pressure_noise[] = {0, 3.3, 2.6, 2.1, 1.6, 1.3};
+// Standby of each t_sb setting (s).
+static const double standby[] = {0.0005, 0.0625, 0.125, 0.25,
+                                 0.5,    1,      0.01,  0.02};
+
+static uint8_t regs[256];  // Registers of the chip on the bus.
+static int transactions = 0;
+static bool bus_fails = false;
+
+// The chip converts in the background of the register map, on a pressure
+// that falls steadily from that of the datasheet example.
+static struct {
+  double time;          // Time on the bus (s).
+  double bus_time;      // Time the bus has been busy (s).
+  uint8_t mode;         // Mode of the conversions.
+  double next;          // End of the running conversion (s).
+  double measure;       // Time a conversion takes (s).
+  double standby;       // Time between conversions in normal mode (s).
+  double noise;         // RMS noise of a conversion (Pa).
+  int coefficient;      // Of the IIR filter, 1 when it is off.
+  int resolution;       // Bits of the pressure reading.
+  bool primed;          // Whether the filter holds a conversion.
+  double filtered;      // Output of the IIR filter (Pa).
+  double p0;            // Pressure at the start, read at ADC_P (Pa).
+  double pa_per_count;  // Pressure of one count of the reading (Pa).
+} chip;
+
+static struct {
+  char key[16];
+  uint8_t blob[MAX_BLOB];
+  size_t size;
+} nvs_store;
+static int nvs_writes = 0;
+
+esp_err_t i2c_init() { return ESP_OK; }
+
+static double gaussian() {
+  // box-muller, from a seeded rand() so every run is the same
+  const double u = (rand() + 1.0) / (RAND_MAX + 2.0);
+  const double v = (rand() + 1.0) / (RAND_MAX + 2.0);
+  return sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+static double true_pressure(double time) {
+  return chip.p0 + FALL_PA_PER_S * time;
+}
+
+static void put_pressure_count(int32_t count) {
+  regs[REG_DATA_START] = count >> 12;
+  regs[REG_DATA_START + 1] = count >> 4;
+  regs[REG_DATA_START + 2] = (count & 0x0f) << 4;
+}
+
+static void convert() {
+  // a conversion ends, goes through the filter, and is read out at the
+  // resolution of the settings
+  const double sample = true_pressure(chip.next) + chip.noise * gaussian();
+  chip.filtered = chip.primed ? chip.filtered + (sample - chip.filtered) /
+                                                    chip.coefficient
+                              : sample;
+  chip.primed = true;
+  const int32_t count =
+      lround(ADC_P + (chip.filtered - chip.p0) / chip.pa_per_count);
+  put_pressure_count(count & ~((1 << (20 - chip.resolution)) - 1));
+  if (chip.mode == BME280_NORMAL_MODE) {
+    chip.next += chip.measure + chip.standby;
+  } else {
+    chip.mode = BME280_SLEEP_MODE;
+    regs[REG_CTRL_MEAS] &= ~0x03;
+  }
+}
+
+static void advance(double seconds) {
+  // runs the conversions that end in the time
+  chip.time += seconds;
+  while (chip.mode != BME280_SLEEP_MODE && chip.next <= chip.time) convert();
+  const bool measuring = chip.mode != BME280_SLEEP_MODE &&
+                         chip.time >= chip.next - chip.measure;
+  regs[REG_STATUS] = measuring ? MEASURING_BIT : 0;
+}
+
+static int oversampling(int setting) {
+  return setting ? 1 << (setting - 1) : 0;
+}
+
+static void start_conversions() {
+  // the typical measurement time of the datasheet for the settings
+  bme280_config_t config;
+  config.config.val = regs[REG_CONFIG];
+  config.ctrl_meas.val = regs[REG_CTRL_MEAS];
+  config.ctrl_hum.val = regs[REG_CTRL_HUM];
+  const int osrs_t = oversampling(config.ctrl_meas.osrs_t);
+  const int osrs_p = oversampling(config.ctrl_meas.osrs_p);
+  const int osrs_h = oversampling(config.ctrl_hum.osrs_h);
+  chip.measure = (1 + 2 * osrs_t + (osrs_p ? 2 * osrs_p + 0.5 : 0) +
+                  (osrs_h ? 2 * osrs_h + 0.5 : 0)) /
+                 1000;
+  chip.standby = standby[config.config.t_sb];
+  chip.noise = pressure_noise[config.ctrl_meas.osrs_p];
+  chip.coefficient = config.config.filter ? 1 << config.config.filter : 1;
+  chip.resolution =
+      config.config.filter ? 20 : 15 + config.ctrl_meas.osrs_p;
+  chip.mode = config.ctrl_meas.mode == 2 ? BME280_FORCED_MODE
+                                         : config.ctrl_meas.mode;
+  chip.next = chip.time + chip.measure;
+}
+
+static void write_reg(uint8_t reg, uint8_t value) {
+  if (reg == REG_RESET) {
+    if (value != RESET_WORD) return;
+    regs[REG_CTRL_HUM] = regs[REG_CTRL_MEAS] = regs[REG_CONFIG] = 0;
+    chip.mode = BME280_SLEEP_MODE;
+    chip.primed = false;
+    return;
+  }
+  regs[reg] = value;
+  if (reg == REG_CTRL_MEAS) start_conversions();
+}
+
+esp_err_t i2c_bus_read(char addr, char reg, void *buf, size_t size,
+                       TickType_t timeout) {
+  // address, register, address again, then the data, 9 bits a byte
+  ++transactions;
+  const double time = (3 + size) * 9.0 / I2C_HZ;
+  chip.bus_time += time;
+  advance(time);
+  if (bus_fails || addr != I2C_ADDRESS) return ESP_FAIL;
+  memcpy(buf, regs + (uint8_t)reg, size);
+  return ESP_OK;
+}
+
+esp_err_t i2c_bus_write(char addr, char reg, const void *buf, size_t size,
+                        TickType_t timeout) {
+  ++transactions;
+  const double time = (2 + size) * 9.0 / I2C_HZ;
+  chip.bus_time += time;
+  advance(time);
+  if (bus_fails || addr != I2C_ADDRESS) return ESP_FAIL;
+  for (size_t i = 0; i < size; ++i)
+    write_reg((uint8_t)reg + i, ((const uint8_t *)buf)[i]);
+  return ESP_OK;
+}
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t open_mode,
+                   nvs_handle_t *out_handle) {
+  *out_handle = 1;
+  return ESP_OK;
+}
+
+void nvs_close(nvs_handle_t handle) {}
+
+esp_err_t nvs_commit(nvs_handle_t handle) { return ESP_OK; }
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out_value,
+                       size_t *length) {
+  if (nvs_store.size == 0 || strcmp(key, nvs_store.key) != 0)
+    return ESP_ERR_NVS_NOT_FOUND;
+  memcpy(out_value, nvs_store.blob,
+         *length < nvs_store.size ? *length : nvs_store.size);
+  *length = nvs_store.size;
+  return ESP_OK;
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value,
+                       size_t length) {
+  if (length > MAX_BLOB) return ESP_ERR_INVALID_SIZE;
+  ++nvs_writes;
+  snprintf(nvs_store.key, sizeof(nvs_store.key), "%s", key);
+  memcpy(nvs_store.blob, value, length);
+  nvs_store.size = length;
+  return ESP_OK;
+}
+
+static void put_le16(uint8_t *p, uint16_t value) {
+  p[0] = value;
+  p[1] = value >> 8;
+}
+
+static void insert_chip(const trim_t *trim) {
+  // the register map of the datasheet, with the reserved byte before h1 set
+  // so that reading it instead of h1 shows, asleep
+  memset(regs, 0, sizeof(regs));
+  chip.mode = BME280_SLEEP_MODE;
+  chip.primed = false;
+  regs[REG_CHIP_ID] = CHIP_ID;
+  const int16_t first[] = {trim->t1, trim->t2, trim->t3, trim->p1,
+                           trim->p2, trim->p3, trim->p4, trim->p5,
+                           trim->p6, trim->p7, trim->p8, trim->p9};
+  for (size_t i = 0; i < 12; ++i)
+    put_le16(regs + REG_TRIM_T1_TO_P9 + 2 * i, first[i]);
+  regs[REG_TRIM_H1 - 1] = 0xff;
+  regs[REG_TRIM_H1] = trim->h1;
+  uint8_t *h = regs + REG_TRIM_H2_TO_H6;
+  put_le16(h, trim->h2);
+  h[2] = trim->h3;
+  h[3] = trim->h4 >> 4;
+  h[4] = (trim->h4 & 0x0f) | (trim->h5 & 0x0f) << 4;
+  h[5] = trim->h5 >> 4;
+  h[6] = trim->h6;
+
+  // a reading of 25.08 C and 100653 Pa with the datasheet trimming
+  const uint8_t data[] = {0x65, 0x5a, 0xc0, 0x7e, 0xed, 0x00, 0x6a, 0x00};
+  memcpy(regs + REG_DATA_START, data, sizeof(data));
+}
+
+static double expected_humidity(const trim_t *trim) {
+  // the floating point compensation of the bme280 datasheet
+  const double adc_T = 0x7eed0, adc_H = 0x6a00;
+  const double var1 = (adc_T / 16384 - trim->t1 / 1024.0) * trim->t2;
+  const double var2 = (adc_T / 131072 - trim->t1 / 8192.0) *
+                      (adc_T / 131072 - trim->t1 / 8192.0) * trim->t3;
+  double h = var1 + var2 - 76800;
+  h = (adc_H - (trim->h4 * 64.0 + trim->h5 / 16384.0 * h)) *
+      (trim->h2 / 65536.0 *
+       (1 + trim->h6 / 67108864.0 * h * (1 + trim->h3 / 67108864.0 * h)));
+  h *= 1 - trim->h1 * h / 524288;
+  return h < 0 ? 0 : h > 100 ? 100 : h;
+}
+
+static int start() {
+  // transactions of a cold start
+  transactions = 0;
+  CHECK(bme280_reset() == ESP_OK);
+  return transactions;
+}
+
+static double temperature() {
+  bme280_data_t data;
+  CHECK(bme280_get_data(&data) == ESP_OK);
+  return data.temperature;
+}
+
+static void test_first_start() {
+  // without a cache the reset, the status, the id and both blocks of
+  // trimming are read, and the trimming is saved
+  insert_chip(&datasheet);
+  CHECK(start() == 5);
+  CHECK(nvs_writes == 1);
+
+  bme280_data_t data;
+  CHECK(bme280_get_data(&data) == ESP_OK);
+  CHECK_NEAR(data.temperature, 25.08, 1e-4);
+  CHECK(data.station_pressure == 100653);
+  CHECK_NEAR(data.humidity, expected_humidity(&datasheet), 0.05);
+}
+
+static void test_cached_start() {
+  // the same chip again skips the second block and leaves nvs alone, and
+  // waking from deep sleep reads nothing
+  insert_chip(&datasheet);
+  CHECK(start() == 4);
+  CHECK(nvs_writes == 1);
+  bme280_data_t data;
+  CHECK(bme280_get_data(&data) == ESP_OK);
+  CHECK_NEAR(data.humidity, expected_humidity(&datasheet), 0.05);
+
+  transactions = 0;
+  CHECK(bme280_resume() == ESP_OK);
+  CHECK(transactions == 0);
+}
+
+static void test_swapped_chip() {
+  // a chip with the same id but other trimming is noticed on every start,
+  // not now and then
+  for (int i = 0; i < 8; ++i) {
+    const trim_t *trim = i % 2 ? &datasheet : &other;
+    insert_chip(trim);
+    const int writes = nvs_writes;
+    CHECK(start() == 5);
+    CHECK(nvs_writes == writes + 1);
+    if (trim == &datasheet)
+      CHECK_NEAR(temperature(), 25.08, 1e-4);
+    else
+      CHECK(temperature() < 25.07);
+  }
+  insert_chip(&datasheet);
+  CHECK(start() == 4);
+  CHECK_NEAR(temperature(), 25.08, 1e-4);
+}
+
+static void test_bad_cache() {
+  // a cache that was corrupted or is from an older version is read again
+  insert_chip(&datasheet);
+  nvs_store.blob[nvs_store.size - 1] ^= 1;
+  CHECK(start() == 5);
+  CHECK(start() == 4);
+
+  nvs_store.blob[CACHE_VERSION_OFFSET] = 0;
+  const size_t crc_offset = nvs_store.size - sizeof(uint32_t);
+  const uint32_t crc = crc32_le(0, nvs_store.blob, crc_offset);
+  memcpy(nvs_store.blob + crc_offset, &crc, sizeof(crc));
+  CHECK(start() == 5);
+  CHECK(start() == 4);
+
+  // and a start that fails leaves nothing to resume
+  bus_fails = true;
+  CHECK(bme280_reset() != ESP_OK);
+  bus_fails = false;
+  CHECK(bme280_resume() == ESP_ERR_INVALID_STATE);
+}
+
+typedef struct {
+  const char *name;
+  double sample_s;  // Time between samples (s).
+  bme280_config_t config;
+} sampling_t;
+
+typedef struct {
+  double i2c;        // Transactions a report.
+  double bus_ms;     // Time the bus is busy a report (ms).
+  double sample_sd;  // Standard deviation of a sample from the truth (Pa).
+  double report_sd;  // Standard deviation of a report from the truth (Pa).
+  double bias;       // Mean difference of a report from the truth (Pa).
+} result_t;
+
+static void calibrate() {
+  // the pressure of a count of the reading, through the driver
+  insert_chip(&datasheet);
+  CHECK(bme280_reset() == ESP_OK);
+  bme280_data_t data;
+  put_pressure_count(ADC_P);
+  CHECK(bme280_get_data(&data) == ESP_OK);
+  chip.p0 = data.station_pressure;
+  put_pressure_count(ADC_P + 4096);
+  CHECK(bme280_get_data(&data) == ESP_OK);
+  chip.pa_per_count = (data.station_pressure - chip.p0) / 4096;
+}
+
+static double take(bool forced, bool report) {
+  // the calls sensor_bme280.c makes for a sample, or for a report, which
+  // waits out the longest measurement time on a timer before reading
+  if (forced) {
+    CHECK(bme280_force_measurement() == ESP_OK);
+    if (report) advance(bme280_get_measurement_time() / 1e6);
+  }
+  bme280_data_t data;
+  CHECK(bme280_get_data(&data) == ESP_OK);
+  return data.station_pressure - true_pressure(chip.time);
+}
+
+static result_t simulate(const sampling_t *mode) {
+  // a report averages the samples since the last one and itself
+  srand(1);
+  chip.time = 0;
+  insert_chip(&datasheet);
+  CHECK(bme280_reset() == ESP_OK);
+  CHECK(bme280_set_config(&mode->config) == ESP_OK);
+  const bool forced = mode->config.ctrl_meas.mode == BME280_FORCED_MODE;
+  CHECK(bme280_get_measurement_time() >= chip.measure * 1e6);
+  const int samples = REPORT_S / mode->sample_s;
+  double sample_sum = 0, sample_sqr = 0, report_sum = 0, report_sqr = 0;
+  transactions = 0;
+  chip.bus_time = 0;
+  for (int r = 0; r < SIM_REPORTS; ++r) {
+    double sum = 0;
+    for (int i = 1; i <= samples; ++i) {
+      advance(r * REPORT_S + i * mode->sample_s - chip.time);
+      const double error = take(forced, i == samples);
+      sum += error;
+      sample_sum += error;
+      sample_sqr += error * error;
+    }
+    report_sum += sum / samples;
+    report_sqr += (sum / samples) * (sum / samples);
+  }
+  const double n = (double)SIM_REPORTS * samples;
+  const double bias = report_sum / SIM_REPORTS;
+  return (result_t){
+      .i2c = (double)transactions / SIM_REPORTS,
+      .bus_ms = chip.bus_time / SIM_REPORTS * 1000,
+      .sample_sd = sqrt(sample_sqr / n - pow(sample_sum / n, 2)),
+      .report_sd = sqrt(report_sqr / SIM_REPORTS - bias * bias),
+      .bias = bias};
+}
+
+static void test_modes() {
+  // forced mode as it runs by default, and normal mode with the default
+  // standby, filter and sample time
+  static const sampling_t modes[] = {
+      {"forced", FORCED_SAMPLE_S, BME280_WEATHER_MONITORING},
+      {"normal", NORMAL_SAMPLE_S,
+       BME280_CONTINUOUS(BME280_STANDBY_1000_MS, BME280_FILTER_16)},
+  };
+  calibrate();
+  result_t results[2];
+  printf("%-8s %7s %10s %10s %10s %10s %8s\n", "mode", "samples",
+         "i2c/report", "bus ms", "sample sd", "report sd", "bias");
+  for (int i = 0; i < 2; ++i) {
+    results[i] = simulate(&modes[i]);
+    printf("%-8s %7d %10.0f %10.1f %8.2fPa %8.3fPa %6.2fPa\n", modes[i].name,
+           (int)(REPORT_S / modes[i].sample_s), results[i].i2c,
+           results[i].bus_ms, results[i].sample_sd, results[i].report_sd,
+           results[i].bias);
+  }
+
+  // normal mode reads only the data, once a sample, and the filter and
+  // oversampling leave its reports far less noisy
+  const result_t forced = results[0], normal = results[1];
+  CHECK(normal.i2c == REPORT_S / NORMAL_SAMPLE_S);
+  CHECK(forced.i2c > 4 * REPORT_S / FORCED_SAMPLE_S);
+  CHECK(normal.sample_sd < forced.sample_sd / 4);
+  CHECK(normal.report_sd < forced.report_sd / 2);
+
+  // both are off by less than the step of a forced reading, the 16 bits of
+  // which cut off 4 of the 20
+  const double step = 16 * fabs(chip.pa_per_count);
+  CHECK(fabs(normal.bias) < step && fabs(forced.bias) < step);
+}
+
+int main() {
+  test_first_start();
+  test_cached_start();
+  test_swapped_chip();
+  test_bad_cache();
+  test_modes();
+  return test_result("bme280");
+}
@@ -0,0 +1,355 @@
+// Cold boots the elevation cache against a stubbed clock, nvs and network,
+// counting the https lookups of each boot: a valid cache makes none, a stale
+// one or a move beyond the tolerance looks up again, and failed lookups leave
+// the cache as it was. Then parses real responses of both services, with the
+// keys nested, quoted, escaped or missing. Each boot runs in a child process,
+// since elevation.c only starts once per process.
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "elevation.h"
+#include "freertos/task.h"
+#include "lookup.h"
+#include "nvs.h"
+#include "test.h"
+#include "timestamp.h"
+#include "wireless.h"
+
+#define DAY_S (24 * 60 * 60)
+#define START_S 1600000000  // Time of the first boot.
+
+// The cache as elevation.c keeps it in nvs.
+typedef struct {
+  double elevation;
+  float latitude;
+  float longitude;
+  int64_t time;
+  uint8_t source;
+  uint16_t estimates;
+  double estimate;
+} elevation_cache_t;
+
+// What ipinfo.io answers, pretty printed, with a location to fill in.
+static const char *location_format =
+    "{\n"
+    "  \"ip\": \"203.0.113.7\",\n"
+    "  \"city\": \"Mountain View\",\n"
+    "  \"region\": \"California\",\n"
+    "  \"country\": \"US\",\n"
+    "  \"loc\": \"%.4f,%.4f\",\n"
+    "  \"org\": \"AS15169 Google LLC\",\n"
+    "  \"postal\": \"94043\",\n"
+    "  \"timezone\": \"America/Los_Angeles\"\n"
+    "}";
+
+// And for an address it can't place.
+static const char *bogon_response =
+    "{\n"
+    "  \"ip\": \"192.168.1.2\",\n"
+    "  \"bogon\": true\n"
+    "}";
+
+// What the elevation point query service answers, with an elevation to fill
+// in, which it nests under a key that starts with the same name.
+static const char *elevation_format =
+    "{\"USGS_Elevation_Point_Query_Service\":{\"Elevation_Query\":"
+    "{\"x\":-122.0838,\"y\":37.386,\"Data_Source\":\"3DEP 1\\/3 "
+    "arc-second\",\"Elevation\":%s,\"Units\":\"Meters\"}}}";
+
+static struct {
+  bool valid;
+  elevation_cache_t cache;
+  int writes;
+} nvs;                   // The stored cache.
+static time_t wall;      // Time once it is synced (s).
+static bool synced;      // Whether the time is synced.
+static int sync_delays;  // Delays of the lookup task after which the time
+                         // syncs, or 0 if it doesn't.
+static bool create_fails;
+static char location[512];   // Next response of the location lookup.
+static char elevation[512];  // Next response of the elevation lookup.
+
+typedef struct {
+  double start;         // Elevation elevation_start returned (m).
+  bool task;            // Whether the lookup task was started.
+  bool deleted;         // Whether it deleted itself.
+  int location_calls;   // Location lookups.
+  int elevation_calls;  // Elevation lookups.
+  bool updated;         // Whether an update was taken after the task.
+  double update;        // The update (m).
+} boot_t;
+
+static boot_t boot_state;
+static TaskFunction_t lookup_task;
+static int delays;
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t open_mode,
+                   nvs_handle_t *out_handle) {
+  CHECK_STR(name, "elevation");
+  *out_handle = 1;
+  return ESP_OK;
+}
+
+void nvs_close(nvs_handle_t handle) {}
+
+esp_err_t nvs_commit(nvs_handle_t handle) { return ESP_OK; }
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out_value,
+                       size_t *length) {
+  if (!nvs.valid || strcmp(key, "cache") != 0) return ESP_ERR_NVS_NOT_FOUND;
+  if (*length >= sizeof(nvs.cache))
+    memcpy(out_value, &nvs.cache, sizeof(nvs.cache));
+  *length = sizeof(nvs.cache);
+  return ESP_OK;
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value,
+                       size_t length) {
+  CHECK_STR(key, "cache");
+  CHECK(length == sizeof(nvs.cache));
+  memcpy(&nvs.cache, value, sizeof(nvs.cache));
+  nvs.valid = true;
+  ++nvs.writes;
+  return ESP_OK;
+}
+
+int64_t timestamp_now() { return synced ? wall * 1000000LL : 0; }
+
+bool timestamp_is_synced() { return synced; }
+
+esp_err_t timestamp_to_time(int64_t stamp, time_t *time) {
+  if (!synced) return ESP_ERR_INVALID_STATE;
+  *time = stamp / 1000000;
+  return ESP_OK;
+}
+
+esp_err_t wireless_wait_connected(TickType_t timeout) { return ESP_OK; }
+
+esp_err_t wireless_get_location(float *latitude, float *longitude) {
+  ++boot_state.location_calls;
+  return lookup_parse_location(location, latitude, longitude);
+}
+
+esp_err_t wireless_get_elevation(float latitude, float longitude,
+                                 double *elevation_m) {
+  ++boot_state.elevation_calls;
+  return lookup_parse_elevation(elevation, elevation_m);
+}
+
+BaseType_t xTaskCreate(TaskFunction_t task, const char *name,
+                       uint32_t stack_size, void *arg, UBaseType_t priority,
+                       TaskHandle_t *handle) {
+  if (create_fails) return pdFAIL;
+  boot_state.task = true;
+  lookup_task = task;
+  return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task) {
+  CHECK(task == NULL);
+  boot_state.deleted = true;
+}
+
+void vTaskDelay(TickType_t ticks) {
+  if (sync_delays > 0 && ++delays >= sync_delays) synced = true;
+}
+
+static void set_location(double latitude, double longitude) {
+  snprintf(location, sizeof(location), location_format, latitude, longitude);
+}
+
+static void set_elevation(const char *meters) {
+  snprintf(elevation, sizeof(elevation), elevation_format, meters);
+}
+
+static boot_t boot() {
+  // a cold boot that runs the lookup task to its end, if it was started
+  int fds[2];
+  CHECK(pipe(fds) == 0);
+  const pid_t pid = fork();
+  if (pid == 0) {
+    failures = 0;  // the parent counts those it already has
+    boot_state.start = elevation_start();
+    if (lookup_task != NULL) lookup_task(NULL);
+    boot_state.updated = elevation_take_update(&boot_state.update);
+    write(fds[1], &boot_state, sizeof(boot_state));
+    write(fds[1], &nvs, sizeof(nvs));
+    _exit(failures);
+  }
+  boot_t state = {0};
+  CHECK(read(fds[0], &state, sizeof(state)) == sizeof(state));
+  CHECK(read(fds[0], &nvs, sizeof(nvs)) == sizeof(nvs));
+  int status;
+  waitpid(pid, &status, 0);
+  CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  close(fds[0]);
+  close(fds[1]);
+  return state;
+}
+
+static void test_lookups() {
+  // the first boot has nothing but the default, so both lookups run
+  synced = true;
+  wall = START_S;
+  set_location(37.3860, -122.0838);
+  set_elevation("32.39");
+  boot_t state = boot();
+  CHECK(state.start == CONFIG_DEFAULT_ELEVATION_METERS);
+  CHECK(state.task && state.deleted);
+  CHECK(state.location_calls == 1 && state.elevation_calls == 1);
+  CHECK(state.updated);
+  CHECK_NEAR(state.update, 32.39, 1e-9);
+  CHECK(nvs.writes == 1 && nvs.cache.source == ELEVATION_LOOKUP);
+  CHECK(nvs.cache.time == START_S);
+
+  // a valid cache starts no task at all
+  wall += DAY_S;
+  state = boot();
+  CHECK_NEAR(state.start, 32.39, 1e-9);
+  CHECK(!state.task);
+  CHECK(state.location_calls == 0 && state.elevation_calls == 0);
+  CHECK(nvs.writes == 1);
+
+  // nor once the time the task waits for shows it is valid
+  synced = false;
+  sync_delays = 3;
+  state = boot();
+  CHECK(state.task && state.deleted);
+  CHECK(state.location_calls == 0 && state.elevation_calls == 0);
+  CHECK(nvs.writes == 1);
+  sync_delays = 0;
+  synced = true;
+
+  // a stale cache checks the location, and only the time changes while it
+  // is within the tolerance
+  wall += CONFIG_ELEVATION_MAX_AGE_DAYS * DAY_S;
+  set_location(37.4056, -122.0775);
+  state = boot();
+  CHECK(state.location_calls == 1 && state.elevation_calls == 0);
+  CHECK(!state.updated);
+  CHECK(nvs.writes == 2 && nvs.cache.time == wall);
+  CHECK_NEAR(nvs.cache.elevation, 32.39, 1e-9);
+
+  // a move beyond it looks up the elevation again
+  wall += CONFIG_ELEVATION_MAX_AGE_DAYS * DAY_S + 1;
+  set_location(37.4416, -122.1430);
+  set_elevation("7.82");
+  state = boot();
+  CHECK(state.location_calls == 1 && state.elevation_calls == 1);
+  CHECK(state.updated);
+  CHECK_NEAR(state.update, 7.82, 1e-9);
+  CHECK(nvs.writes == 3);
+  CHECK_NEAR(nvs.cache.latitude, 37.4416, 1e-4);
+
+  // as does one of a single coordinate
+  wall += CONFIG_ELEVATION_MAX_AGE_DAYS * DAY_S + 1;
+  set_location(37.4416, -122.0830);
+  state = boot();
+  CHECK(state.location_calls == 1 && state.elevation_calls == 1);
+  CHECK(nvs.writes == 4);
+
+  // a cache of unknown age is checked as soon as the time is known
+  nvs.cache.time = 0;
+  state = boot();
+  CHECK(state.task && state.location_calls == 1);
+  CHECK(nvs.writes == 5 && nvs.cache.time == wall);
+}
+
+static void test_failed_lookups() {
+  // failed lookups leave the cache stale, so the next boot tries again
+  synced = true;
+  wall = START_S;
+  nvs.valid = false;
+  nvs.writes = 0;
+  strcpy(location, bogon_response);
+  boot_t state = boot();
+  CHECK(state.location_calls == 1 && state.elevation_calls == 0);
+  CHECK(!state.updated && nvs.writes == 0);
+
+  set_location(48.8534, 2.3488);
+  set_elevation("-1000000");
+  state = boot();
+  CHECK(state.location_calls == 1 && state.elevation_calls == 1);
+  CHECK(!state.updated && nvs.writes == 0);
+  CHECK(state.start == CONFIG_DEFAULT_ELEVATION_METERS);
+
+  // an elevation derived from pressure is never looked up, even before the
+  // time is known
+  synced = false;
+  nvs.cache = (elevation_cache_t){
+      .elevation = 41, .source = ELEVATION_PRESSURE, .estimates = 12};
+  nvs.valid = true;
+  state = boot();
+  CHECK(state.start == 41);
+  CHECK(!state.task);
+
+  // and a task that can't be started makes no lookups
+  synced = true;
+  nvs.valid = false;
+  create_fails = true;
+  state = boot();
+  CHECK(state.start == CONFIG_DEFAULT_ELEVATION_METERS);
+  CHECK(!state.task && state.location_calls == 0);
+  create_fails = false;
+}
+
+static void test_parse() {
+  float latitude, longitude;
+  double meters;
+  set_location(37.3860, -122.0838);
+  CHECK(lookup_parse_location(location, &latitude, &longitude) == ESP_OK);
+  CHECK_NEAR(latitude, 37.386, 1e-4);
+  CHECK_NEAR(longitude, -122.0838, 1e-4);
+
+  // keys that only start with the key, and the key escaped inside a value,
+  // are skipped
+  const char *tricky =
+      "{\"locale\": \"1,2\", \"org\": \"AS1 \\\"loc\\\": \\\"3,4\\\"\", "
+      "\"loc\" : \"-33.8688,151.2093\"}";
+  CHECK(lookup_parse_location(tricky, &latitude, &longitude) == ESP_OK);
+  CHECK_NEAR(latitude, -33.8688, 1e-4);
+  CHECK_NEAR(longitude, 151.2093, 1e-4);
+
+  // missing or empty values and other pages are errors
+  CHECK(lookup_parse_location(bogon_response, &latitude, &longitude) ==
+        ESP_ERR_INVALID_RESPONSE);
+  CHECK(lookup_parse_location("{\"loc\": null}", &latitude, &longitude) ==
+        ESP_ERR_INVALID_RESPONSE);
+  CHECK(lookup_parse_location("{\"loc\": \"\"}", &latitude, &longitude) ==
+        ESP_ERR_INVALID_RESPONSE);
+  CHECK(lookup_parse_location("<html><body>Too Many Requests</body></html>",
+                              &latitude, &longitude) ==
+        ESP_ERR_INVALID_RESPONSE);
+
+  // the elevation is found past the object named like it
+  set_elevation("32.39");
+  CHECK(lookup_parse_elevation(elevation, &meters) == ESP_OK);
+  CHECK_NEAR(meters, 32.39, 1e-9);
+  set_elevation("-86.3");  // Badwater Basin
+  CHECK(lookup_parse_elevation(elevation, &meters) == ESP_OK);
+  CHECK_NEAR(meters, -86.3, 1e-9);
+  CHECK(lookup_parse_elevation("{\"Elevation\": \"7.82\"}", &meters) ==
+        ESP_OK);
+  CHECK_NEAR(meters, 7.82, 1e-9);
+
+  // points without data, invalid queries and cut off responses are errors
+  set_elevation("-1000000");
+  CHECK(lookup_parse_elevation(elevation, &meters) ==
+        ESP_ERR_INVALID_RESPONSE);
+  CHECK(lookup_parse_elevation(
+            "{\"USGS_Elevation_Point_Query_Service\":{\"Elevation_Query\":"
+            "\"Invalid or missing input parameters.\"}}",
+            &meters) == ESP_ERR_INVALID_RESPONSE);
+  CHECK(lookup_parse_elevation("{\"x\":-122.0838,\"Elevation\":", &meters) ==
+        ESP_ERR_INVALID_RESPONSE);
+  CHECK(lookup_parse_elevation("{\"Elevation\": null}", &meters) ==
+        ESP_ERR_INVALID_RESPONSE);
+}
+
+int main() {
+  test_lookups();
+  test_failed_lookups();
+  test_parse();
+  return test_result("elevation");
+}
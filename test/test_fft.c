@@ -0,0 +1,146 @@
+// Compares the real fft the spectrum uses against a direct dft in double
+// precision for every size the spectrum can take, checks the packing of its
+// output and the hann window, and times a transform of each size.
+#include <time.h>
+
+#include "fft.h"
+#include "test.h"
+
+#define MIN_N 4        // Smallest transform checked.
+#define MAX_N 2048     // Largest transform, twice the most spectrum bins.
+#define MAX_ERROR 1e-4  // Worst error relative to the largest bin.
+#define BENCH_SAMPLES (1 << 22)  // Samples transformed at each size.
+
+static float data[MAX_N];
+static double input[MAX_N], dft_re[MAX_N / 2 + 1], dft_im[MAX_N / 2 + 1];
+
+static void dft(size_t n) {
+  // the first half of the spectrum, with the sign convention of fft_real()
+  for (size_t k = 0; k <= n / 2; ++k) {
+    double re = 0, im = 0;
+    for (size_t i = 0; i < n; ++i) {
+      const double theta = 2 * M_PI * (double)((i * k) % n) / n;
+      re += input[i] * cos(theta);
+      im += input[i] * sin(theta);
+    }
+    dft_re[k] = re;
+    dft_im[k] = im;
+  }
+}
+
+static void fill(size_t n, unsigned seed) {
+  // noise with a couple of tones on top, one between bins
+  srand(seed);
+  for (size_t i = 0; i < n; ++i) {
+    input[i] = (double)rand() / RAND_MAX - 0.5 + sin(2 * M_PI * 3 * i / n) +
+               0.25 * cos(2 * M_PI * 10.5 * i / n);
+    data[i] = input[i];
+  }
+}
+
+static double transform_error(size_t n) {
+  // the worst difference in any real or imaginary part, relative to the
+  // largest bin, with dc and nyquist packed together at the start
+  fft_real(data, n);
+  dft(n);
+  double largest = 0;
+  for (size_t k = 0; k <= n / 2; ++k)
+    largest = fmax(largest, hypot(dft_re[k], dft_im[k]));
+  double worst = fmax(fabs(data[0] - dft_re[0]),
+                      fabs(data[1] - dft_re[n / 2]));
+  for (size_t k = 1; k < n / 2; ++k) {
+    worst = fmax(worst, fabs(data[2 * k] - dft_re[k]));
+    worst = fmax(worst, fabs(data[2 * k + 1] - dft_im[k]));
+  }
+  return worst / largest;
+}
+
+static void test_transform() {
+  printf("%-6s %12s\n", "n", "worst error");
+  for (size_t n = MIN_N; n <= MAX_N; n *= 2) {
+    double worst = 0;
+    for (unsigned seed = 1; seed <= 3; ++seed) {
+      fill(n, seed);
+      worst = fmax(worst, transform_error(n));
+    }
+    printf("%-6zu %12.2e\n", n, worst);
+    CHECK(worst < MAX_ERROR);
+  }
+
+  // a cosine on a bin is all real, a sine all imaginary, and both are half
+  // the length high
+  const size_t n = 256;
+  for (size_t i = 0; i < n; ++i)
+    data[i] = cos(2 * M_PI * 5 * i / n) + sin(2 * M_PI * 9 * i / n);
+  fft_real(data, n);
+  CHECK_NEAR(data[2 * 5], n / 2, 1e-3);
+  CHECK_NEAR(data[2 * 5 + 1], 0, 1e-3);
+  CHECK_NEAR(data[2 * 9], 0, 1e-3);
+  CHECK_NEAR(data[2 * 9 + 1], n / 2, 1e-3);
+  CHECK_NEAR(data[0], 0, 1e-3);
+  CHECK_NEAR(data[1], 0, 1e-3);
+
+  // and a constant and an alternating signal land on dc and nyquist
+  for (size_t i = 0; i < n; ++i) data[i] = 2 + (i % 2 ? -1 : 1);
+  fft_real(data, n);
+  CHECK_NEAR(data[0], 2 * n, 1e-3);
+  CHECK_NEAR(data[1], n, 1e-3);
+}
+
+static void test_window() {
+  // the periodic hann window, whose squares sum to 3/8 of its length
+  for (size_t n = MIN_N; n <= MAX_N; n *= 2) {
+    for (size_t i = 0; i < n; ++i) data[i] = 1;
+    CHECK_NEAR(fft_window_hann(data, n), 0.375 * n, 1e-4 * n);
+    double worst = 0;
+    for (size_t i = 0; i < n; ++i) {
+      const double hann = 0.5 - 0.5 * cos(2 * M_PI * i / n);
+      worst = fmax(worst, fabs(data[i] - hann));
+    }
+    CHECK(worst < 1e-5);
+  }
+}
+
+static double seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  return 0;
+#endif
+}
+
+static void bench() {
+  // each transform windows and transforms a fresh block, as spectrum_add()
+  // does, so the cost per sample grows with log n
+  printf("%-6s %8s %10s %15s\n", "n", "bins", "us", "cycles/sample");
+  for (size_t n = 128; n <= MAX_N; n *= 2) {
+    const size_t transforms = BENCH_SAMPLES / n;
+    volatile float sink = 0;
+    fill(n, 1);
+    const double start = seconds();
+    const uint64_t start_cycles = cycles();
+    for (size_t t = 0; t < transforms; ++t) {
+      for (size_t i = 0; i < n; ++i) data[i] = input[i];
+      sink += fft_window_hann(data, n);
+      fft_real(data, n);
+      sink += data[2];
+    }
+    const double time = (seconds() - start) / transforms;
+    const double per_sample =
+        (double)(cycles() - start_cycles) / BENCH_SAMPLES;
+    printf("%-6zu %8zu %10.2f %15.1f\n", n, n / 2, time * 1e6, per_sample);
+  }
+}
+
+int main() {
+  test_transform();
+  test_window();
+  bench();
+  return test_result("fft");
+}
@@ -0,0 +1,232 @@
+// Replays pressure traces through the forecast a report at a time against a
+// stubbed clock: how samples fill buckets and gaps empty them, the fitted 3
+// and 24 hour changes, the Zambretti numbers kept within their trend, the
+// storm rules, and a deep low passing over a day.
+#include "forecast.h"
+#include "test.h"
+#include "timestamp.h"
+
+#define DAY_MINUTES (24 * 60)
+#define START_MINUTES (1000 * DAY_MINUTES)  // Clock at the start, far from
+                                            // zero so the fit sums are large.
+#define REPORT_MINUTES 5  // Time between samples, PUBLISH_PERIOD_MS.
+#define RESTART_MINUTES (2 * DAY_MINUTES)  // Gap that empties both histories.
+
+// Hourly readings of a deep low passing, as a barograph draws one (hPa).
+static const double storm_trace[] = {
+    1012.0, 1011.8, 1011.5, 1011.0, 1010.2, 1009.0, 1007.5, 1005.6, 1003.4,
+    1001.0, 998.5,  996.2,  994.4,  993.3,  993.0,  993.6,  995.0,  997.0,
+    999.3,  1001.5, 1003.4, 1005.0, 1006.3, 1007.2, 1007.8};
+#define STORM_HOURS (sizeof(storm_trace) / sizeof(storm_trace[0]) - 1)
+
+static uint32_t now = START_MINUTES;  // Stubbed clock (minutes).
+static double level;                  // Pressure of the next sample (hPa).
+
+int64_t timestamp_now() { return now * 60LL * 1000000; }
+
+static void run(double rate, int minutes) {
+  // a sample every report for the time, the pressure moving at the rate
+  // (hPa/h)
+  for (int m = 0; m < minutes; m += REPORT_MINUTES) {
+    forecast_add(level * 100);
+    level += rate * REPORT_MINUTES / 60;
+    now += REPORT_MINUTES;
+  }
+}
+
+static void gap(double rate, int minutes) {
+  // no samples for the time, while the pressure keeps moving
+  level += rate * minutes / 60;
+  now += minutes;
+}
+
+static void restart(double hpa) {
+  // far enough on that nothing from before is in either history once the
+  // first new bucket closes, and at the start of a day so that the first
+  // buckets are whole
+  now += RESTART_MINUTES - now % DAY_MINUTES;
+  level = hpa;
+}
+
+static forecast_t get() {
+  forecast_t forecast;
+  CHECK(forecast_get(&forecast) == ESP_OK);
+  return forecast;
+}
+
+static void test_buckets() {
+  // samples are averaged into 10 minute buckets, so noise that alternates
+  // within one is gone, and a bucket only counts once the first sample after
+  // it closes it
+  forecast_t forecast;
+  CHECK(forecast_get(&forecast) == ESP_ERR_INVALID_STATE);
+  restart(1013);
+  for (int i = 0; i < 12; ++i) {
+    CHECK(forecast_get(&forecast) == ESP_ERR_INVALID_STATE);
+    forecast_add((level + (i % 2 ? -0.5 : 0.5)) * 100);
+    now += REPORT_MINUTES;
+  }
+  CHECK(forecast_get(&forecast) == ESP_ERR_INVALID_STATE);  // 5 buckets
+  run(0, REPORT_MINUTES);
+  forecast = get();
+  CHECK(forecast.change_3h == 0);
+  CHECK(isnan(forecast.change_24h));
+  CHECK(forecast.code == 12);
+  CHECK_STR(forecast.text, "Fine, possibly showers");
+  CHECK(!forecast.storm);
+
+  // the 24 hour change needs 6 hourly buckets
+  run(0, 5 * 60 - REPORT_MINUTES);
+  CHECK(isnan(get().change_24h));
+  run(0, REPORT_MINUTES);
+  CHECK(get().change_24h == 0);
+}
+
+static void test_trends() {
+  // steady trends are fitted exactly, however many times the rings wrap,
+  // and the 24 hour change is taken from the trend before a day is in
+  restart(975);
+  run(1, 7 * 60);
+  forecast_t forecast = get();
+  CHECK_NEAR(forecast.change_3h, 3, 0.01);
+  CHECK_NEAR(forecast.change_24h, 24, 0.01);
+  run(1, 18 * 60);
+  forecast = get();
+  CHECK_NEAR(forecast.change_3h, 3, 0.01);
+  CHECK_NEAR(forecast.change_24h, 24, 0.01);
+  CHECK(forecast.code == 25);
+  CHECK_STR(forecast.text, "Showery early, improving");
+
+  // a slow fall is still steady over 3 hours, and no storm over 24
+  restart(1022.5);
+  run(-0.5, 25 * 60);
+  forecast = get();
+  CHECK_NEAR(forecast.change_3h, -1.5, 0.01);
+  CHECK_NEAR(forecast.change_24h, -12, 0.01);
+  CHECK(forecast.code == 13);
+  CHECK(!forecast.storm);
+}
+
+static void test_gaps() {
+  // the fit spans a gap shorter than the history without being thrown off
+  restart(1015);
+  run(-0.8, 4 * 60);
+  CHECK_NEAR(get().change_3h, -2.4, 0.01);
+  gap(-0.8, 60);
+  run(-0.8, 3 * 60);
+  CHECK_NEAR(get().change_3h, -2.4, 0.01);
+  CHECK_NEAR(get().change_24h, -19.2, 0.01);
+
+  // a gap longer than 3 hours drops everything from before it out of the
+  // short history once the first new bucket closes, and it takes an hour
+  // of buckets again
+  gap(-0.8, 4 * 60);
+  run(-0.8, 2 * REPORT_MINUTES);
+  get();  // the forecast from before the gap until then
+  run(-0.8, REPORT_MINUTES);
+  forecast_t forecast;
+  CHECK(forecast_get(&forecast) == ESP_ERR_INVALID_STATE);
+  run(-0.8, 60 - 3 * REPORT_MINUTES);
+  CHECK(forecast_get(&forecast) == ESP_ERR_INVALID_STATE);
+  run(-0.8, REPORT_MINUTES);
+  forecast = get();
+  CHECK_NEAR(forecast.change_3h, -2.4, 0.01);
+
+  // while the long history keeps the buckets from before it
+  CHECK_NEAR(forecast.change_24h, -19.2, 0.01);
+}
+
+static void check_code(double hpa, double rate, uint8_t code,
+                       const char *text) {
+  // two hours at a pressure, moving at a rate (hPa/h)
+  restart(hpa - rate * 2);
+  run(rate, 2 * 60);
+  const forecast_t forecast = get();
+  CHECK(forecast.code == code);
+  CHECK_STR(forecast.text, text);
+}
+
+static void test_zambretti() {
+  // the numbers of the formulas within the usual range
+  check_code(1013, 0, 12, "Fine, possibly showers");
+  check_code(1000, 1, 25, "Showery early, improving");
+  check_code(1000, -0.8, 7, "Rain at times, worse later");
+
+  // and kept within those of their trend beyond it
+  check_code(1070, 0, 10, "Settled fine");
+  check_code(940, 0, 19, "Stormy, much rain");
+  check_code(1060, 0.8, 20, "Settled fine");
+  check_code(950, 0.8, 32, "Stormy, much rain");
+  check_code(1060, -0.8, 1, "Settled fine");
+  check_code(900, -0.8, 9, "Very unsettled, rain");
+}
+
+static void test_storm() {
+  // a fall of 6 hPa over 3 hours, after a steady day
+  restart(1020);
+  run(0, 21 * 60);
+  CHECK(!get().storm);
+  run(-2.2, 3 * 60);
+  forecast_t forecast = get();
+  CHECK(forecast.change_3h <= -6);
+  CHECK(forecast.change_24h > -24);
+  CHECK(forecast.storm);
+
+  // or of 24 hPa over 24 hours, fitted from a steady fall
+  restart(1040);
+  run(-1.1, 8 * 60);
+  forecast = get();
+  CHECK(forecast.change_3h > -3.5 && forecast.change_24h <= -24);
+  CHECK(forecast.storm);
+
+  // or of 3.5 hPa over 3 hours below 1000 hPa, but not above it
+  restart(1001);
+  run(0, 21 * 60);
+  run(-1.25, 3 * 60);
+  forecast = get();
+  CHECK(forecast.change_3h <= -3.5 && forecast.change_3h > -6);
+  CHECK(forecast.storm);
+  restart(1021);
+  run(0, 21 * 60);
+  run(-1.25, 3 * 60);
+  CHECK(!get().storm);
+}
+
+static void test_storm_trace() {
+  // the low is steady at first, a storm while it deepens fastest, and
+  // clearing by the end
+  restart(storm_trace[0]);
+  int storm_hours = 0;
+  for (size_t hour = 0; hour < STORM_HOURS; ++hour) {
+    run(storm_trace[hour + 1] - storm_trace[hour], 60);
+    forecast_t forecast;
+    if (forecast_get(&forecast) != ESP_OK) {
+      CHECK(hour == 0);  // the first hour is short a bucket
+      continue;
+    }
+    if (hour == 3) {
+      CHECK(forecast.code >= 10 && forecast.code <= 19);
+      CHECK(!forecast.storm);
+    }
+    if (hour == 9) {
+      CHECK(forecast.change_3h <= -6);
+      CHECK(forecast.code >= 1 && forecast.code <= 9);
+    }
+    if (forecast.storm) ++storm_hours;
+  }
+  CHECK(storm_hours > 0);
+  const forecast_t forecast = get();
+  CHECK(forecast.change_3h >= 1.6);
+  CHECK(forecast.code >= 20 && forecast.code <= 32);
+  CHECK(!forecast.storm);
+}
+
+int main() {
+  test_buckets();
+  test_trends();
+  test_gaps();
+  test_zambretti();
+  test_storm();
+  test_storm_trace();
+  return test_result("forecast");
+}
@@ -0,0 +1,250 @@
+// Writes json into fixed buffers and checks the escaping, the fixed point
+// numbers, nesting and its errors, running out of buffer and reopening, and
+// that none of it touches the heap.
+#include <stdint.h>
+
+#include "alloc.h"
+#include "json_writer.h"
+#include "test.h"
+
+#define BENCH_MESSAGES 100000
+
+static char buf[256];
+
+static const char *number(double value, int decimals) {
+  // a number as the only member, with the braces and key stripped off
+  static char out[64];
+  json_writer_t json;
+  json_writer_init(&json, buf, sizeof(buf));
+  json_add_number(&json, "n", value, decimals);
+  CHECK(json_writer_finish(&json) == ESP_OK);
+  snprintf(out, sizeof(out), "%.*s", (int)strlen(buf) - 6, buf + 5);
+  return out;
+}
+
+static void test_escaping() {
+  // quotes, backslashes and control characters are escaped, in keys too, and
+  // utf-8 is passed through
+  json_writer_t json;
+  json_writer_init(&json, buf, sizeof(buf));
+  json_add_string(&json, "a\"b", "q\"\\\n\x01\x1f\xc2\xb0" "C");
+  json_add_string(&json, "none", NULL);
+  json_add_string(&json, NULL, "");
+  json_add_bool(&json, "t", true);
+  json_add_bool(&json, "f", false);
+  CHECK(json_writer_finish(&json) == ESP_OK);
+  CHECK_STR(buf,
+            "{\"a\\\"b\":\"q\\\"\\\\\\u000a\\u0001\\u001f\xc2\xb0" "C\","
+            "\"none\":null,\"\":\"\",\"t\":true,\"f\":false}");
+}
+
+static void test_numbers() {
+  // fixed point to the decimals asked for, without trailing zeros
+  CHECK_STR(number(21.37, 2), "21.37");
+  CHECK_STR(number(1.5, 2), "1.5");
+  CHECK_STR(number(2, 2), "2");
+  CHECK_STR(number(1.05, 2), "1.05");
+  CHECK_STR(number(0.001, 3), "0.001");
+  CHECK_STR(number(123.000001, 6), "123.000001");
+  CHECK_STR(number(3.14159265, 10), "3.141593");  // at most 6 decimals
+  CHECK_STR(number(2.7, -1), "3");
+
+  // halves round away from zero, and so do negatives
+  CHECK_STR(number(0.125, 2), "0.13");
+  CHECK_STR(number(0.0625, 3), "0.063");
+  CHECK_STR(number(2.5, 0), "3");
+  CHECK_STR(number(-2.5, 0), "-3");
+  CHECK_STR(number(-0.42, 2), "-0.42");
+  CHECK_STR(number(-10.996, 2), "-11");
+
+  // a negative that rounds to zero has no sign
+  CHECK_STR(number(-0.004, 2), "0");
+  CHECK_STR(number(-0.0, 2), "0");
+
+  // json has no infinity or nan, and what doesn't fit in 64 bits is left out
+  CHECK_STR(number(NAN, 2), "null");
+  CHECK_STR(number(INFINITY, 2), "null");
+  CHECK_STR(number(-INFINITY, 0), "null");
+  CHECK_STR(number(1e18, 0), "null");
+  CHECK_STR(number(1e12, 6), "null");
+  CHECK_STR(number(999999999999.999, 3), "999999999999.999");
+
+  // integers are written whole
+  json_writer_t json;
+  json_writer_init(&json, buf, sizeof(buf));
+  json_add_int(&json, "min", INT64_MIN);
+  json_add_int(&json, "max", INT64_MAX);
+  json_add_int(&json, "zero", 0);
+  CHECK(json_writer_finish(&json) == ESP_OK);
+  CHECK_STR(buf, "{\"min\":-9223372036854775808,"
+                 "\"max\":9223372036854775807,\"zero\":0}");
+}
+
+static void test_nesting() {
+  // arrays take no keys, and members are separated at every depth
+  json_writer_t json;
+  json_writer_init(&json, buf, sizeof(buf));
+  json_begin_array(&json, "a");
+  json_add_int(&json, "ignored", 1);
+  json_begin_object(&json, NULL);
+  json_begin_array(&json, "b");
+  json_end_array(&json);
+  json_add_number(&json, "c", -1.25, 1);
+  json_end_object(&json);
+  json_begin_array(&json, NULL);
+  json_add_bool(&json, NULL, true);
+  json_add_string(&json, NULL, "x");
+  json_end_array(&json);
+  json_end_array(&json);
+  json_begin_object(&json, "d");
+  json_end_object(&json);
+  json_add_int(&json, "e", 2);
+  CHECK(json_writer_finish(&json) == ESP_OK);
+  CHECK_STR(buf, "{\"a\":[1,{\"b\":[],\"c\":-1.3},[true,\"x\"]],\"d\":{},"
+                 "\"e\":2}");
+
+  // nesting stops at the deepest level, counting the top level object
+  json_writer_init(&json, buf, sizeof(buf));
+  for (int i = 1; i < JSON_WRITER_MAX_DEPTH; ++i) json_begin_array(&json, "");
+  CHECK(json.err == ESP_OK);
+  json_begin_object(&json, NULL);
+  CHECK(json.err == ESP_ERR_INVALID_STATE);
+  CHECK(json_writer_finish(&json) == ESP_ERR_INVALID_STATE);
+
+  // closing the wrong kind, closing the top level or leaving one open
+  json_writer_init(&json, buf, sizeof(buf));
+  json_begin_array(&json, "a");
+  json_end_object(&json);
+  CHECK(json_writer_finish(&json) == ESP_ERR_INVALID_STATE);
+  json_writer_init(&json, buf, sizeof(buf));
+  json_end_object(&json);
+  CHECK(json_writer_finish(&json) == ESP_ERR_INVALID_STATE);
+  json_writer_init(&json, buf, sizeof(buf));
+  json_begin_object(&json, "a");
+  CHECK(json_writer_finish(&json) == ESP_ERR_INVALID_STATE);
+
+  // nothing can be added once finished
+  json_writer_init(&json, buf, sizeof(buf));
+  CHECK(json_writer_finish(&json) == ESP_OK);
+  CHECK_STR(buf, "{}");
+  json_add_int(&json, "late", 1);
+  CHECK(json.err == ESP_ERR_INVALID_STATE);
+}
+
+static void test_overflow() {
+  // a message that just fits leaves room for the null
+  json_writer_t json;
+  char small[8];
+  json_writer_init(&json, small, sizeof(small));
+  json_add_int(&json, "a", 1);
+  CHECK(json_writer_finish(&json) == ESP_OK);
+  CHECK_STR(small, "{\"a\":1}");
+
+  // one more byte runs out, and what was written is still terminated
+  json_writer_init(&json, small, sizeof(small) - 1);
+  json_add_int(&json, "a", 1);
+  CHECK(json_writer_finish(&json) == ESP_ERR_NO_MEM);
+  CHECK_STR(small, "{\"a\":1");
+
+  // the first error is the one kept, and the buffer isn't overrun
+  memset(buf, 'x', sizeof(buf));
+  json_writer_init(&json, buf, 16);
+  json_add_string(&json, "long", "far more than sixteen bytes");
+  json_end_array(&json);
+  CHECK(json_writer_finish(&json) == ESP_ERR_NO_MEM);
+  CHECK(strlen(buf) == 15);
+  CHECK(buf[16] == 'x');
+
+  // and no buffer at all is an error, not a crash
+  json_writer_init(&json, NULL, 0);
+  json_add_int(&json, "a", 1);
+  CHECK(json_writer_finish(&json) == ESP_ERR_NO_MEM);
+}
+
+static void test_reopen() {
+  // a finished object can be continued, with a separator only if needed
+  json_writer_t json;
+  json_writer_init(&json, buf, sizeof(buf));
+  json_add_int(&json, "a", 1);
+  CHECK(json_writer_finish(&json) == ESP_OK);
+  CHECK(json_writer_reopen(&json, buf, sizeof(buf)) == ESP_OK);
+  json_add_int(&json, "b", 2);
+  CHECK(json_writer_finish(&json) == ESP_OK);
+  CHECK_STR(buf, "{\"a\":1,\"b\":2}");
+
+  strcpy(buf, "{}");
+  CHECK(json_writer_reopen(&json, buf, sizeof(buf)) == ESP_OK);
+  json_add_int(&json, "b", 2);
+  CHECK(json_writer_finish(&json) == ESP_OK);
+  CHECK_STR(buf, "{\"b\":2}");
+
+  // only a whole, terminated object is taken
+  strcpy(buf, "[1]");
+  CHECK(json_writer_reopen(&json, buf, sizeof(buf)) == ESP_ERR_INVALID_ARG);
+  strcpy(buf, "{\"a\":1");
+  CHECK(json_writer_reopen(&json, buf, sizeof(buf)) == ESP_ERR_INVALID_ARG);
+  strcpy(buf, "{}");
+  CHECK(json_writer_reopen(&json, buf, 2) == ESP_ERR_INVALID_ARG);
+}
+
+static void count_number(void *arg, const char *key, double value) {
+  ++*(int *)arg;
+}
+
+static void test_hook() {
+  // only named numbers at the top level are passed to the hook
+  json_writer_t json;
+  int numbers = 0;
+  json_writer_init(&json, buf, sizeof(buf));
+  json_writer_set_number_hook(&json, count_number, &numbers);
+  json_add_number(&json, "a", 1, 0);
+  json_add_int(&json, "b", 2);
+  json_add_string(&json, "c", "3");
+  json_begin_array(&json, "d");
+  json_add_number(&json, NULL, 4, 0);
+  json_end_array(&json);
+  json_begin_object(&json, "e");
+  json_add_int(&json, "f", 5);
+  json_end_object(&json);
+  CHECK(json_writer_finish(&json) == ESP_OK);
+  CHECK(numbers == 2);
+}
+
+static void bench() {
+  // a state message of the size reports send, written over and over, never
+  // touches the heap, so its high-water mark stays at nothing
+  alloc_stats_t stats;
+  alloc_reset();
+  void *volatile block = malloc(16);
+  free(block);
+  alloc_get_stats(&stats);
+  CHECK(stats.allocations == 1 && stats.in_use == 0);
+
+  alloc_reset();
+  for (int i = 0; i < BENCH_MESSAGES; ++i) {
+    json_writer_t json;
+    json_writer_init(&json, buf, sizeof(buf));
+    json_begin_object(&json, "mqtt");
+    json_add_int(&json, "published", i);
+    json_add_number(&json, "rtt", i / 7.0, 2);
+    json_end_object(&json);
+    json_add_string(&json, "forecast", "Fairly fine, showery later");
+    json_writer_finish(&json);
+  }
+  alloc_get_stats(&stats);
+  CHECK(stats.allocations == 0);
+  CHECK(stats.peak == 0);
+  printf("%d messages: %zu allocations, %td bytes peak\n", BENCH_MESSAGES,
+         stats.allocations, stats.peak);
+}
+
+int main() {
+  test_escaping();
+  test_numbers();
+  test_nesting();
+  test_overflow();
+  test_reopen();
+  test_hook();
+  bench();
+  return test_result("json_writer");
+}
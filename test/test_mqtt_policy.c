@@ -0,0 +1,327 @@
+// Publishes through the mqtt policy layer to a stand-in broker on a virtual
+// clock: the QoS and retain flag of each class of message, state merged
+// within its window, and the packets and bytes of one reporting cycle on the
+// wire, with the counts the report carries about them, and an outbox that
+// empties again when the broker goes away.
+#include "esp_timer.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "mqtt_policy.h"
+#include "test.h"
+
+#define RTT_MS 30         // Time the broker takes to acknowledge (ms).
+#define MAX_PACKETS 64    // Packets the broker keeps.
+#define PUBACK_BYTES 4    // Size of an acknowledgement on the wire.
+#define STATE_SIZE 1020   // State that fits the merge buffer on its own.
+#define DATA_TOPIC "weather-station/test/data"
+#define CONFIG_TOPIC "weather-station/test/config"
+#define BACKLOG_TOPIC "weather-station/test/backlog"
+#define EVENT_TOPIC "weather-station/test/event"
+#define DISCOVERY_TOPIC "homeassistant/sensor/test/config"
+
+typedef struct {
+  char topic[64];
+  char data[1100];
+  size_t size;
+  int qos;
+  bool retain;
+  int msg_id;
+  int64_t ack_time;  // Time the broker acknowledges it, or -1 (us).
+} packet_t;
+
+static int64_t now = 0;  // Virtual clock (us).
+static bool connected = true;
+static bool acking = true;  // Whether the broker acknowledges messages.
+static packet_t packets[MAX_PACKETS];
+static size_t num_packets = 0;
+static int next_msg_id = 1;
+static esp_timer_cb_t timer_callback = NULL;
+static int64_t timer_due = -1;  // Time the merge window ends, or -1 (us).
+
+static void advance(int64_t us) {
+  // moves the clock on, acknowledging messages and ending the merge window
+  // as their times come
+  const int64_t end = now + us;
+  while (true) {
+    int64_t next = end;
+    if (timer_due >= 0 && timer_due < next) next = timer_due;
+    for (size_t i = 0; i < num_packets; ++i)
+      if (packets[i].ack_time >= 0 && packets[i].ack_time < next)
+        next = packets[i].ack_time;
+    now = next;
+    for (size_t i = 0; i < num_packets; ++i) {
+      if (packets[i].ack_time < 0 || packets[i].ack_time > now) continue;
+      packets[i].ack_time = -1;
+      mqtt_policy_record_ack(packets[i].msg_id);
+    }
+    if (timer_due >= 0 && timer_due <= now) {
+      timer_due = -1;
+      timer_callback(NULL);
+    }
+    if (now == end) return;
+  }
+}
+
+bool wireless_mqtt_connected() { return connected; }
+
+esp_err_t wireless_mqtt_publish(const char *topic, const void *data,
+                                size_t size, int qos, bool retain,
+                                int *msg_id) {
+  if (!connected) return ESP_ERR_INVALID_STATE;
+  if (num_packets == MAX_PACKETS) return ESP_FAIL;
+  packet_t *packet = &packets[num_packets++];
+  snprintf(packet->topic, sizeof(packet->topic), "%s", topic);
+  memcpy(packet->data, data, size);
+  packet->data[size] = 0;
+  packet->size = size;
+  packet->qos = qos;
+  packet->retain = retain;
+  packet->msg_id = qos > 0 ? next_msg_id++ : 0;
+  packet->ack_time = qos > 0 && acking ? now + RTT_MS * 1000 : -1;
+  *msg_id = packet->msg_id;
+  return ESP_OK;
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args,
+                           esp_timer_handle_t *timer) {
+  timer_callback = args->callback;
+  *timer = &timer_callback;
+  return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout) {
+  timer_due = now + timeout;
+  return ESP_OK;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer) {
+  timer_due = -1;
+  return ESP_OK;
+}
+
+int64_t esp_timer_get_time() { return now; }
+
+TickType_t xTaskGetTickCount() { return now / 1000 / portTICK_PERIOD_MS; }
+
+void vTaskDelay(TickType_t ticks) {
+  advance(ticks * portTICK_PERIOD_MS * 1000LL);
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex() { return &next_msg_id; }
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t timeout) {
+  return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore) { return pdTRUE; }
+
+static size_t wire_size(const packet_t *packet) {
+  // fixed header, remaining length, topic, packet id and payload
+  size_t remaining = 2 + strlen(packet->topic) + packet->size;
+  if (packet->qos > 0) remaining += 2;
+  size_t size = 1 + remaining;
+  for (size_t left = remaining; left >= 128; left /= 128) ++size;
+  return size + 1;
+}
+
+static esp_err_t publish_str(mqtt_class_t msg_class, const char *topic,
+                             const char *message) {
+  return mqtt_publish_class(msg_class, topic, message, strlen(message));
+}
+
+static void clear_packets() {
+  // once everything sent has been acknowledged
+  advance(RTT_MS * 1000);
+  num_packets = 0;
+  mqtt_stats_t stats;
+  mqtt_take_stats(&stats);
+}
+
+static void test_classes() {
+  // readings go at the configured QoS, backlogged readings and events are
+  // always acknowledged, state isn't, and discovery is kept by the broker
+  static const struct {
+    mqtt_class_t msg_class;
+    const char *topic;
+    int qos;
+    bool retain;
+  } classes[] = {{MQTT_TELEMETRY, DATA_TOPIC, CONFIG_MQTT_TELEMETRY_QOS, false},
+                 {MQTT_BACKLOG, BACKLOG_TOPIC, 1, false},
+                 {MQTT_STATE, CONFIG_TOPIC, 0, false},
+                 {MQTT_DISCOVERY, DISCOVERY_TOPIC, 1, true},
+                 {MQTT_EVENT, EVENT_TOPIC, 1, false}};
+  for (size_t i = 0; i < sizeof(classes) / sizeof(classes[0]); ++i) {
+    clear_packets();
+    CHECK(publish_str(classes[i].msg_class, classes[i].topic, "{\"a\":1}") ==
+          ESP_OK);
+    CHECK(mqtt_flush() == ESP_OK);
+    CHECK(num_packets == 1);
+    CHECK_STR(packets[0].topic, classes[i].topic);
+    CHECK(packets[0].qos == classes[i].qos);
+    CHECK(packets[0].retain == classes[i].retain);
+  }
+  CHECK(mqtt_wait_published(pdMS_TO_TICKS(1000)) == ESP_OK);
+
+  // nothing is left to the client while offline, and unknown classes are
+  // refused
+  clear_packets();
+  connected = false;
+  CHECK(publish_str(MQTT_TELEMETRY, DATA_TOPIC, "{}") ==
+        ESP_ERR_INVALID_STATE);
+  CHECK(publish_str(MQTT_STATE, CONFIG_TOPIC, "{}") == ESP_ERR_INVALID_STATE);
+  connected = true;
+  CHECK(publish_str(MQTT_CLASS_MAX, DATA_TOPIC, "{}") == ESP_ERR_INVALID_ARG);
+  CHECK(mqtt_flush() == ESP_OK);
+  CHECK(num_packets == 0);
+}
+
+static void test_merge() {
+  // state to one topic within the window goes out as one object when the
+  // window ends
+  clear_packets();
+  CHECK(publish_str(MQTT_STATE, CONFIG_TOPIC, "{\"a\":1}") == ESP_OK);
+  advance((CONFIG_MQTT_STATE_WINDOW_MS - 100) * 1000LL);
+  CHECK(publish_str(MQTT_STATE, CONFIG_TOPIC, "{}") == ESP_OK);
+  CHECK(publish_str(MQTT_STATE, CONFIG_TOPIC, "{\"b\":[2],\"a\":3}") ==
+        ESP_OK);
+  CHECK(num_packets == 0);
+  advance(100 * 1000LL);
+  CHECK(num_packets == 1);
+  CHECK_STR(packets[0].data, "{\"a\":1,\"b\":[2],\"a\":3}");
+  mqtt_stats_t stats;
+  mqtt_take_stats(&stats);
+  CHECK(stats.published == 1 && stats.merged == 1);
+
+  // another topic ends the window early, as does state that wouldn't fit
+  clear_packets();
+  CHECK(publish_str(MQTT_STATE, CONFIG_TOPIC, "{\"a\":1}") == ESP_OK);
+  CHECK(publish_str(MQTT_STATE, EVENT_TOPIC, "{\"b\":2}") == ESP_OK);
+  CHECK(num_packets == 1);
+  static char large[STATE_SIZE + 1];
+  memset(large, ' ', sizeof(large) - 1);
+  large[0] = '{';
+  large[sizeof(large) - 2] = '}';
+  CHECK(publish_str(MQTT_STATE, EVENT_TOPIC, large) == ESP_OK);
+  CHECK(num_packets == 2);
+  CHECK_STR(packets[1].data, "{\"b\":2}");
+  CHECK(mqtt_flush() == ESP_OK);
+  CHECK(num_packets == 3 && packets[2].size == sizeof(large) - 1);
+
+  // and anything but an object goes out on its own at once
+  CHECK(publish_str(MQTT_STATE, CONFIG_TOPIC, "online") == ESP_OK);
+  CHECK(num_packets == 4);
+  advance(CONFIG_MQTT_STATE_WINDOW_MS * 1000LL);
+  CHECK(num_packets == 4);
+}
+
+static void test_cycle() {
+  // the messages of a report as main.c publishes them, then the wait for the
+  // broker before deep sleep
+  clear_packets();
+  const int64_t start = now;
+  publish_str(MQTT_STATE, CONFIG_TOPIC, "{\"pms5003\":{\"fan\":true}}");
+  publish_str(MQTT_TELEMETRY, DATA_TOPIC,
+              "{\"temperature\":21.3,\"humidity\":48.2,\"pressure\":763.1,"
+              "\"pm2_5\":4,\"pm10\":7,\"battery\":87.5,\"time\":1600000600}");
+  for (int i = 0; i < 3; ++i)
+    publish_str(MQTT_BACKLOG, BACKLOG_TOPIC,
+                "{\"temperature\":21.1,\"humidity\":48.9,\"pressure\":763.0,"
+                "\"time\":1600000000}");
+  publish_str(MQTT_STATE, CONFIG_TOPIC,
+              "{\"pms5003\":{\"fan\":false},\"pm_lock_ms\":{\"mqtt\":12,"
+              "\"period\":600000},\"mqtt\":{\"published\":5,\"bytes\":420}}");
+  publish_str(MQTT_STATE, CONFIG_TOPIC,
+              "{\"memory\":{\"heap_free\":123456,\"heap_min\":98765}}");
+  CHECK(mqtt_wait_published(pdMS_TO_TICKS(5000)) == ESP_OK);
+  CHECK(now - start <= (RTT_MS + portTICK_PERIOD_MS) * 1000);
+
+  // state is merged into one unacknowledged message, and each reading has
+  // an acknowledgement of its own
+  size_t publishes[MQTT_CLASS_MAX] = {0}, bytes[MQTT_CLASS_MAX] = {0};
+  size_t payload = 0, acks = 0;
+  for (size_t i = 0; i < num_packets; ++i) {
+    const packet_t *packet = &packets[i];
+    const mqtt_class_t msg_class =
+        strcmp(packet->topic, DATA_TOPIC) == 0      ? MQTT_TELEMETRY
+        : strcmp(packet->topic, BACKLOG_TOPIC) == 0 ? MQTT_BACKLOG
+                                                    : MQTT_STATE;
+    ++publishes[msg_class];
+    bytes[msg_class] += wire_size(packet);
+    if (packet->qos > 0) {
+      bytes[msg_class] += PUBACK_BYTES;
+      ++acks;
+    }
+    payload += packet->size;
+  }
+  printf("%-10s %8s %8s\n", "class", "packets", "bytes");
+  static const char *names[] = {"telemetry", "backlog", "state"};
+  size_t total_packets = acks, total_bytes = 0;
+  for (int c = MQTT_TELEMETRY; c <= MQTT_STATE; ++c) {
+    printf("%-10s %8zu %8zu\n", names[c], publishes[c], bytes[c]);
+    total_packets += publishes[c];
+    total_bytes += bytes[c];
+  }
+  printf("%-10s %8zu %8zu\n", "cycle", total_packets, total_bytes);
+  CHECK(publishes[MQTT_TELEMETRY] == 1 && publishes[MQTT_BACKLOG] == 3 &&
+        publishes[MQTT_STATE] == 1);
+  CHECK(acks == 4);
+  CHECK(total_packets == 9);
+  CHECK(bytes[MQTT_TELEMETRY] == 141);
+  CHECK(bytes[MQTT_BACKLOG] == 327);
+  CHECK(bytes[MQTT_STATE] == 203);
+
+  // which the report counts by payload, with the outbox empty again
+  mqtt_stats_t stats;
+  mqtt_take_stats(&stats);
+  CHECK(stats.published == 5);
+  CHECK(stats.bytes == payload);
+  CHECK(stats.merged == 2);
+  CHECK(stats.acked == 4);
+  CHECK(stats.rtt_last == RTT_MS && stats.rtt_max == RTT_MS);
+  CHECK(stats.outbox == 0 && stats.outbox_max == 4);
+}
+
+static void test_outbox() {
+  // a broker that goes away leaves nothing to wait for once the client is
+  // disconnected, so deep sleep isn't put off on every report after it
+  clear_packets();
+  acking = false;
+  for (int i = 0; i < 3; ++i)
+    CHECK(publish_str(MQTT_BACKLOG, BACKLOG_TOPIC, "{}") == ESP_OK);
+  mqtt_stats_t stats;
+  mqtt_take_stats(&stats);
+  CHECK(stats.outbox == 3 && stats.outbox_max == 3);
+  mqtt_policy_reset();
+  const int64_t start = now;
+  CHECK(mqtt_wait_published(pdMS_TO_TICKS(5000)) == ESP_OK);
+  CHECK(now == start);
+  mqtt_take_stats(&stats);
+  CHECK(stats.outbox == 0);
+
+  // and messages the client gave up on age out while it stays connected
+  CHECK(publish_str(MQTT_BACKLOG, BACKLOG_TOPIC, "{}") == ESP_OK);
+  CHECK(mqtt_wait_published(pdMS_TO_TICKS(5000)) == ESP_ERR_TIMEOUT);
+  CHECK(mqtt_wait_published(pdMS_TO_TICKS(30000)) == ESP_OK);
+  mqtt_take_stats(&stats);
+  CHECK(stats.outbox == 0 && stats.acked == 0);
+  acking = true;
+
+  // more messages than are timed are still all waited for, as the broker
+  // acknowledges them in order
+  clear_packets();
+  for (int i = 0; i < 20; ++i)
+    CHECK(publish_str(MQTT_BACKLOG, BACKLOG_TOPIC, "{}") == ESP_OK);
+  CHECK(mqtt_wait_published(pdMS_TO_TICKS(5000)) == ESP_OK);
+  mqtt_take_stats(&stats);
+  CHECK(stats.outbox == 0 && stats.outbox_max == 16);
+  CHECK(stats.acked == 16);
+}
+
+int main() {
+  CHECK(mqtt_policy_init() == ESP_OK);
+  test_classes();
+  test_merge();
+  test_cycle();
+  test_outbox();
+  return test_result("mqtt_policy");
+}
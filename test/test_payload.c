@@ -0,0 +1,204 @@
+// Round trips the binary payload through its wire format, including the
+// bounds of its fields, and compares it with the json it is filled in from:
+// bytes on the wire, heap allocations and time to encode.
+#include <string.h>
+#include <time.h>
+
+#include "alloc.h"
+#include "json_writer.h"
+#include "payload.h"
+#include "test.h"
+
+#define DECIMALS 2  // Decimals the sensor adapters write.
+#define BENCH_REPORTS 100000
+
+static const struct {
+  const char *key;
+  payload_field_t field;
+  double value;
+} report[] = {
+    {"temperature", PAYLOAD_TEMPERATURE, 21.37},
+    {"humidity", PAYLOAD_HUMIDITY, 48.2},
+    {"pressure", PAYLOAD_PRESSURE, 755.93},
+    {"dew_point", PAYLOAD_DEW_POINT, 9.91},
+    {"battery", PAYLOAD_BATTERY, 87},
+    {"battery_voltage", PAYLOAD_BATTERY_VOLTAGE, 4.07},
+    {"battery_rate", PAYLOAD_BATTERY_RATE, -0.42},
+    {"battery_time_to_empty", PAYLOAD_BATTERY_TIME_TO_EMPTY, 207.14},
+    {"signal_strength", PAYLOAD_SIGNAL_STRENGTH, -67},
+    {"pm1", PAYLOAD_PM1, 3},
+    {"pm2_5", PAYLOAD_PM2_5, 5},
+    {"pm10", PAYLOAD_PM10, 8},
+    {"avg_noise", PAYLOAD_AVG_NOISE, 41.58},
+    {"min_noise", PAYLOAD_MIN_NOISE, 35.02},
+    {"max_noise", PAYLOAD_MAX_NOISE, 63.7},
+    {"lmax_noise", PAYLOAD_LMAX_NOISE, 71.31},
+    {"lmin_noise", PAYLOAD_LMIN_NOISE, 33.9},
+};
+#define REPORT_FIELDS (sizeof(report) / sizeof(report[0]))
+
+static uint32_t get_le(const uint8_t *p, int bytes) {
+  uint32_t value = 0;
+  for (int i = bytes - 1; i >= 0; --i) value = value << 8 | p[i];
+  return value;
+}
+
+static void decode(const uint8_t *wire, payload_t *out) {
+  // decode the wire format byte by byte, as a receiver on any host would
+  memset(out, 0, sizeof(*out));
+  out->version = wire[0];
+  out->reserved = wire[1];
+  out->size = get_le(wire + 2, 2);
+  out->time = get_le(wire + 4, 4);
+  out->fields = get_le(wire + 8, 4);
+  for (int i = 0; i < PAYLOAD_FIELD_MAX; ++i)
+    out->values[i] = (int32_t)get_le(wire + 12 + 4 * i, 4);
+}
+
+static size_t write_report(char *buf, size_t size, payload_t *payload) {
+  // the data json of a report, filling in the payload as it is written
+  json_writer_t json;
+  json_writer_init(&json, buf, size);
+  if (payload != NULL) {
+    payload_init(payload, 0);
+    json_writer_set_number_hook(&json, payload_add_hook, payload);
+  }
+  for (size_t i = 0; i < REPORT_FIELDS; ++i)
+    json_add_number(&json, report[i].key, report[i].value, DECIMALS);
+  json_add_string(&json, "forecast", "Fairly fine, showery later");
+  json_add_int(&json, "time", 1600000000);
+  if (payload != NULL) payload->time = 1600000000;
+  CHECK(json_writer_finish(&json) == ESP_OK);
+  return strlen(buf);
+}
+
+static void test_layout() {
+  // the layout is part of the wire format
+  CHECK(sizeof(payload_t) == 12 + 4 * PAYLOAD_FIELD_MAX);
+  CHECK(offsetof(payload_t, time) == 4);
+  CHECK(offsetof(payload_t, fields) == 8);
+  CHECK(offsetof(payload_t, values) == 12);
+  CHECK(PAYLOAD_FIELD_MAX <= 32);  // one bit each in fields
+}
+
+static void test_round_trip() {
+  char buf[1024];
+  payload_t payload, decoded;
+  write_report(buf, sizeof(buf), &payload);
+  decode((const uint8_t *)&payload, &decoded);
+  CHECK(decoded.version == PAYLOAD_VERSION);
+  CHECK(decoded.reserved == 0);
+  CHECK(decoded.size == sizeof(payload_t));
+  CHECK(decoded.time == 1600000000);
+
+  // every field of the report is present and matches the json to the
+  // hundredth, and strings and the time aren't fields
+  CHECK(decoded.fields == BIT(PAYLOAD_FIELD_MAX) - 1);
+  for (size_t i = 0; i < REPORT_FIELDS; ++i) {
+    const int32_t value = decoded.values[report[i].field];
+    char key[40];
+    snprintf(key, sizeof(key), "\"%s\":", report[i].key);
+    const char *in_json = strstr(buf, key);
+    CHECK(in_json != NULL);
+    if (in_json != NULL)
+      CHECK_NEAR(value / 100.0, atof(in_json + strlen(key)), 1e-9);
+  }
+
+  // only top level numbers go in, and fields that aren't sent are clear
+  json_writer_t json;
+  payload_init(&payload, 0);
+  json_writer_init(&json, buf, sizeof(buf));
+  json_writer_set_number_hook(&json, payload_add_hook, &payload);
+  json_begin_object(&json, "nested");
+  json_add_number(&json, "temperature", 5, DECIMALS);
+  json_end_object(&json);
+  json_add_number(&json, "humidity", 50, DECIMALS);
+  json_add_number(&json, "unknown", 1, DECIMALS);
+  CHECK(json_writer_finish(&json) == ESP_OK);
+  decode((const uint8_t *)&payload, &decoded);
+  CHECK(decoded.fields == BIT(PAYLOAD_HUMIDITY));
+  CHECK(decoded.values[PAYLOAD_TEMPERATURE] == 0);
+  CHECK(decoded.values[PAYLOAD_HUMIDITY] == 5000);
+}
+
+static void test_bounds() {
+  // values round to the nearest hundredth, and the largest that fit in an
+  // int32 come through, while anything beyond is left out instead of wrapped
+  payload_t payload, decoded;
+  payload_init(&payload, 0);
+  CHECK(payload_add(&payload, "pressure", 21474836.47) == ESP_OK);
+  CHECK(payload_add(&payload, "dew_point", -21474836.47) == ESP_OK);
+  CHECK(payload_add(&payload, "pm1", 0.005) == ESP_OK);
+  CHECK(payload_add(&payload, "pm10", -0.004) == ESP_OK);
+  CHECK(payload_add(&payload, "temperature", 21474836.48) ==
+        ESP_ERR_INVALID_ARG);
+  CHECK(payload_add(&payload, "humidity", -21474836.48) ==
+        ESP_ERR_INVALID_ARG);
+  CHECK(payload_add(&payload, "battery", NAN) == ESP_ERR_INVALID_ARG);
+  CHECK(payload_add(&payload, "battery_time_to_empty", INFINITY) ==
+        ESP_ERR_INVALID_ARG);
+  CHECK(payload_add(&payload, "nothing", 1) == ESP_ERR_NOT_FOUND);
+  decode((const uint8_t *)&payload, &decoded);
+  CHECK(decoded.values[PAYLOAD_PRESSURE] == INT32_MAX);
+  CHECK(decoded.values[PAYLOAD_DEW_POINT] == -INT32_MAX);
+  CHECK(decoded.values[PAYLOAD_PM1] == 1);
+  CHECK(decoded.values[PAYLOAD_PM10] == 0);
+  CHECK(decoded.fields == (BIT(PAYLOAD_PRESSURE) | BIT(PAYLOAD_DEW_POINT) |
+                           BIT(PAYLOAD_PM1) | BIT(PAYLOAD_PM10)));
+}
+
+static double seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench() {
+  // the payload is filled in while the json is written, so its cost is the
+  // difference between writing the json with and without it
+  static char buf[1024];
+  payload_t payload;
+  alloc_stats_t stats;
+  size_t json_bytes = 0;
+
+  // the counts only mean something if allocations are seen at all
+  alloc_reset();
+  void *volatile block = malloc(16);
+  free(block);
+  alloc_get_stats(&stats);
+  CHECK(stats.allocations == 1 && stats.in_use == 0);
+
+  alloc_reset();
+  double start = seconds();
+  for (int i = 0; i < BENCH_REPORTS; ++i)
+    json_bytes = write_report(buf, sizeof(buf), NULL);
+  const double json_time = (seconds() - start) / BENCH_REPORTS;
+  alloc_get_stats(&stats);
+  const size_t json_allocations = stats.allocations;
+
+  alloc_reset();
+  start = seconds();
+  for (int i = 0; i < BENCH_REPORTS; ++i)
+    write_report(buf, sizeof(buf), &payload);
+  const double both_time = (seconds() - start) / BENCH_REPORTS;
+  alloc_get_stats(&stats);
+  const size_t both_allocations = stats.allocations;
+
+  CHECK(json_allocations == 0);
+  CHECK(both_allocations == 0);
+  CHECK(sizeof(payload) < json_bytes / 2);
+  printf("%-8s %6s %12s %10s\n", "encoding", "bytes", "allocations",
+         "us/report");
+  printf("%-8s %6zu %12zu %10.2f\n", "json", json_bytes, json_allocations,
+         json_time * 1e6);
+  printf("%-8s %6zu %12zu %10.2f\n", "binary", sizeof(payload),
+         both_allocations, (both_time - json_time) * 1e6);
+}
+
+int main() {
+  test_layout();
+  test_round_trip();
+  test_bounds();
+  bench();
+  return test_result("payload");
+}
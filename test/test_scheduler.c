@@ -0,0 +1,452 @@
+// Drives the scheduler with a virtual clock and checks the heap order, ties,
+// a full queue, periodic events and scheduler_shift. Then runs the outside
+// station's sensor table through sensor_mgmt.c and a loop like the one in
+// main.c for an hour, checking that every sensor is called at its deadline
+// and how much of the hour the cpu is left idle, and that a sensor that never
+// signals it is ready isn't read.
+#include "freertos/event_groups.h"
+#include "freertos/task.h"
+#include "scheduler.h"
+#include "sensor_driver.h"
+#include "test.h"
+
+#define MAX_RUNS 256
+
+#define HOUR_US (60 * 60 * 1000000LL)
+#define BOOT_US 800000  // Clock when the sensors are scheduled (us).
+#define DRIVER_CALL_US 2000  // Cpu time of a driver call, an i2c or uart
+                             // exchange (us).
+#define PUBLISH_US 150000  // Cpu time of writing and publishing a message
+                           // (us).
+#define BME280_CONVERSION_US 10000  // Forced conversion at 1x oversampling.
+#define PMS5003_FRAME_US 40000  // Time for a requested frame to arrive (us).
+#define MAX_LATENESS_US 100000  // Time a call may follow its deadline, a tick
+                                // of the loop's sleep and the conversions of
+                                // a measurement cycle (us).
+#define MIN_IDLE 99.5  // Share of the hour the cpu must be idle (%).
+
+static struct {
+  intptr_t arg;
+  int64_t due;
+} runs[MAX_RUNS];
+static int num_runs = 0;
+
+static void record(void *arg, int64_t due) {
+  if (num_runs < MAX_RUNS)
+    runs[num_runs++] = (typeof(runs[0])){.arg = (intptr_t)arg, .due = due};
+}
+
+static void add_another(void *arg, int64_t due) {
+  record(arg, due);
+  scheduler_add(due, 0, record, (void *)((intptr_t)arg + 1));
+}
+
+static void reset() {
+  scheduler_clear();
+  num_runs = 0;
+}
+
+static void test_order() {
+  // events come out by due time whatever order they went in
+  reset();
+  uint32_t seed = 1;
+  for (int i = 0; i < SCHEDULER_MAX_EVENTS; ++i) {
+    seed = seed * 1664525 + 1013904223;
+    CHECK(scheduler_add(seed >> 12, 0, record, (void *)(intptr_t)i) == ESP_OK);
+  }
+  CHECK(scheduler_count() == SCHEDULER_MAX_EVENTS);
+  int64_t next = scheduler_next_due();
+  CHECK(scheduler_run(INT64_MAX) == SCHEDULER_MAX_EVENTS);
+  CHECK(num_runs == SCHEDULER_MAX_EVENTS);
+  CHECK(runs[0].due == next);
+  for (int i = 1; i < num_runs; ++i) CHECK(runs[i].due >= runs[i - 1].due);
+  CHECK(scheduler_count() == 0);
+  CHECK(scheduler_next_due() == INT64_MAX);
+
+  // nothing runs before it is due
+  reset();
+  scheduler_add(1000, 0, record, NULL);
+  CHECK(scheduler_run(999) == 0);
+  CHECK(scheduler_run(1000) == 1);
+}
+
+static void test_ties() {
+  // events due at the same time run in the order they were added
+  reset();
+  for (int i = 0; i < 8; ++i)
+    scheduler_add(i % 2 ? 500 : 100, 0, record, (void *)(intptr_t)i);
+  scheduler_run(INT64_MAX);
+  static const int expected[] = {0, 2, 4, 6, 1, 3, 5, 7};
+  for (int i = 0; i < 8; ++i) CHECK(runs[i].arg == expected[i]);
+
+  // a repeating event goes behind events already waiting at its next time
+  reset();
+  scheduler_add(0, 10, record, (void *)1);
+  scheduler_add(10, 0, record, (void *)2);
+  scheduler_run(0);
+  scheduler_run(10);
+  CHECK(num_runs == 3);
+  CHECK(runs[1].arg == 2 && runs[2].arg == 1);
+  CHECK(runs[2].due == 10);
+
+  // an event added by a callback runs in the same pass if it is due
+  reset();
+  scheduler_add(50, 0, add_another, (void *)10);
+  CHECK(scheduler_run(50) == 2);
+  CHECK(runs[1].arg == 11 && runs[1].due == 50);
+}
+
+static void test_full() {
+  reset();
+  CHECK(scheduler_add(0, 0, NULL, NULL) == ESP_ERR_INVALID_ARG);
+  CHECK(scheduler_add(0, -1, record, NULL) == ESP_ERR_INVALID_ARG);
+
+  // fill the queue with one repeating event and the rest one-shots
+  CHECK(scheduler_add(0, 100, record, (void *)0) == ESP_OK);
+  for (int i = 1; i < SCHEDULER_MAX_EVENTS; ++i)
+    CHECK(scheduler_add(1000 + i, 0, record, (void *)(intptr_t)i) == ESP_OK);
+  CHECK(scheduler_add(0, 0, record, NULL) == ESP_ERR_NO_MEM);
+  CHECK(scheduler_count() == SCHEDULER_MAX_EVENTS);
+
+  // a repeating event is put back even when the queue is full
+  CHECK(scheduler_run(0) == 1);
+  CHECK(scheduler_count() == SCHEDULER_MAX_EVENTS);
+  CHECK(scheduler_next_due() == 100);
+
+  // the first one-shot runs with one repeat, the other repeats before now
+  // being missed, and makes room for another event
+  CHECK(scheduler_run(1001) == 2);
+  CHECK(scheduler_next_due() == 1002);
+  CHECK(scheduler_count() == SCHEDULER_MAX_EVENTS - 1);
+  CHECK(scheduler_add(5000, 0, record, NULL) == ESP_OK);
+  CHECK(scheduler_add(5000, 0, record, NULL) == ESP_ERR_NO_MEM);
+  scheduler_run(1100);
+  CHECK(runs[num_runs - 1].arg == 0 && runs[num_runs - 1].due == 1100);
+}
+
+static void test_period() {
+  // a late run skips the periods that were missed entirely, including one
+  // due just as it runs
+  reset();
+  scheduler_add(0, 100, record, NULL);
+  CHECK(scheduler_run(350) == 1);
+  CHECK(runs[0].due == 0);
+  CHECK(scheduler_next_due() == 400);
+  CHECK(scheduler_run(500) == 1);
+  CHECK(scheduler_next_due() == 600);
+
+  // and a run just on time keeps the grid
+  CHECK(scheduler_run(600) == 1);
+  CHECK(runs[2].due == 600);
+  CHECK(scheduler_next_due() == 700);
+}
+
+static void test_shift() {
+  // after deep sleep the clock restarts, and shifting the schedule by the
+  // change keeps the order and the gaps
+  reset();
+  scheduler_add(10000, 1000, record, (void *)1);
+  scheduler_add(10500, 0, record, (void *)2);
+  scheduler_add(9000, 0, record, (void *)3);
+  scheduler_shift(-9000);
+  CHECK(scheduler_next_due() == 0);
+  CHECK(scheduler_run(1500) == 3);
+  CHECK(runs[0].arg == 3 && runs[0].due == 0);
+  CHECK(runs[1].arg == 1 && runs[1].due == 1000);
+  CHECK(runs[2].arg == 2 && runs[2].due == 1500);
+  CHECK(scheduler_next_due() == 2000);
+
+  // forwards too
+  scheduler_shift(1000000);
+  CHECK(scheduler_run(1001999) == 0);
+  CHECK(scheduler_run(1002000) == 1);
+  CHECK(runs[3].due == 1002000);
+}
+
+// The sensors in the order sensors_start registers them.
+enum { WIFI, BATTERY, BME280, PMS5003, SPH0645, NUM_SENSORS };
+static const char *names[NUM_SENSORS] = {"wifi", "battery", "bme280",
+                                         "pms5003", "sph0645"};
+
+typedef struct {
+  int64_t next;    // Time the next call is due (us).
+  int64_t period;  // Time between calls (us).
+  int calls;
+  int64_t worst;  // Latest a call followed its deadline (us).
+} deadline_t;
+
+static int64_t now;   // Virtual clock (us).
+static int64_t busy;  // Time the cpu spent working (us).
+static deadline_t samples;
+static deadline_t wakeups[NUM_SENSORS];
+static deadline_t reads[NUM_SENSORS];
+static int64_t ready[NUM_SENSORS];  // Time each conversion finishes (us), or
+                                    // -1 if none is running.
+static EventBits_t ready_bits;  // The event group the sensors signal.
+static bool frame_lost;         // Whether the pms5003 never sends its frame.
+static char message[1024];
+
+int64_t esp_timer_get_time() { return now; }
+
+void vTaskDelay(TickType_t ticks) {
+  now += ticks * portTICK_PERIOD_MS * 1000LL;
+}
+
+TickType_t xTaskGetTickCount() { return now / 1000 / portTICK_PERIOD_MS; }
+
+EventGroupHandle_t xEventGroupCreate() { return &ready_bits; }
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits) {
+  return ready_bits |= bits;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t group, EventBits_t bits) {
+  const EventBits_t before = ready_bits;
+  ready_bits &= ~bits;
+  return before;
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t group, EventBits_t bits,
+                                BaseType_t clear, BaseType_t all,
+                                TickType_t timeout) {
+  // the conversions end while the task waits, the first to end wakes it
+  CHECK(!all);
+  const int64_t deadline = now + timeout * portTICK_PERIOD_MS * 1000LL;
+  if (!(ready_bits & bits)) {
+    int first = -1;
+    for (int i = 0; i < NUM_SENSORS; ++i)
+      if (ready[i] >= 0 && (first < 0 || ready[i] < ready[first])) first = i;
+    if (first < 0 || ready[first] > deadline) {
+      now = deadline;
+      return ready_bits;
+    }
+    if (ready[first] > now) now = ready[first];
+    ready_bits |= BIT(first);
+    ready[first] = -1;
+  }
+  const EventBits_t set = ready_bits;
+  if (clear) ready_bits &= ~bits;
+  return set;
+}
+
+const char *esp_err_to_name(esp_err_t err) { return "error"; }
+
+bool battery_policy_report_due() { return true; }
+
+esp_err_t mqtt_publish_discovery(const mqtt_discovery_t *discovery,
+                                 bool force) {
+  return ESP_OK;
+}
+
+static void work(int64_t time) {
+  now += time;
+  busy += time;
+}
+
+static void call(deadline_t *deadline) {
+  // the cpu time of the call is spent after the deadline is checked
+  const int64_t late = now - deadline->next;
+  CHECK(late >= 0);
+  if (late > deadline->worst) deadline->worst = late;
+  deadline->next += deadline->period;
+  ++deadline->calls;
+  work(DRIVER_CALL_US);
+}
+
+static esp_err_t read_wifi(json_writer_t *json) {
+  call(&reads[WIFI]);
+  return ESP_OK;
+}
+
+static esp_err_t read_battery(json_writer_t *json) {
+  call(&reads[BATTERY]);
+  return ESP_OK;
+}
+
+static esp_err_t start_bme280(EventGroupHandle_t events, EventBits_t bit) {
+  CHECK(bit == BIT(BME280));
+  work(DRIVER_CALL_US);
+  ready[BME280] = now + BME280_CONVERSION_US;
+  return ESP_OK;
+}
+
+static esp_err_t sample_bme280() {
+  call(&samples);
+  return ESP_OK;
+}
+
+static esp_err_t read_bme280(json_writer_t *json) {
+  CHECK(ready[BME280] < 0);  // only once it signalled
+  call(&reads[BME280]);
+  return ESP_OK;
+}
+
+static esp_err_t wakeup_pms5003(json_writer_t *json) {
+  call(&wakeups[PMS5003]);
+  return ESP_OK;
+}
+
+static esp_err_t start_pms5003(EventGroupHandle_t events, EventBits_t bit) {
+  CHECK(bit == BIT(PMS5003));
+  work(DRIVER_CALL_US);
+  ready[PMS5003] = frame_lost ? INT64_MAX : now + PMS5003_FRAME_US;
+  return ESP_OK;
+}
+
+static esp_err_t read_pms5003(json_writer_t *json) {
+  CHECK(ready[PMS5003] < 0);
+  call(&reads[PMS5003]);
+  return ESP_OK;
+}
+
+static esp_err_t wakeup_sph0645(json_writer_t *json) {
+  call(&wakeups[SPH0645]);
+  return ESP_OK;
+}
+
+static esp_err_t read_sph0645(json_writer_t *json) {
+  call(&reads[SPH0645]);
+  return ESP_OK;
+}
+
+static esp_err_t sleep_sensor(json_writer_t *json) {
+  work(DRIVER_CALL_US);
+  return ESP_OK;
+}
+
+// The periods and warmup times of the drivers in sensor_*.c, with the
+// bme280 in forced mode.
+const sensor_driver_t wifi_sensor_driver = {
+    .name = "wifi", .read = read_wifi, .publish_period = PUBLISH_PERIOD_MS};
+const sensor_driver_t max17043_sensor_driver = {
+    .name = "max17043",
+    .read = read_battery,
+    .publish_period = 3 * PUBLISH_PERIOD_MS};
+const sensor_driver_t bme280_sensor_driver = {
+    .name = "bme280",
+    .start_measurement = start_bme280,
+    .sample = sample_bme280,
+    .read = read_bme280,
+    .sample_period = 10 * 1000,
+    .publish_period = PUBLISH_PERIOD_MS};
+const sensor_driver_t pms5003_sensor_driver = {
+    .name = "pms5003",
+    .wakeup = wakeup_pms5003,
+    .start_measurement = start_pms5003,
+    .read = read_pms5003,
+    .sleep = sleep_sensor,
+    .warmup_time = 32 * 1000,
+    .publish_period = PUBLISH_PERIOD_MS};
+const sensor_driver_t sph0645_sensor_driver = {
+    .name = "sph0645",
+    .wakeup = wakeup_sph0645,
+    .read = read_sph0645,
+    .sleep = sleep_sensor,
+    .warmup_time = 32 * 1000,
+    .publish_period = PUBLISH_PERIOD_MS};
+
+static void report() {
+  // as main.c does, with the cpu time of its messages
+  json_writer_t json;
+  const uint32_t woken = sensors_take_wakeups();
+  if (woken) {
+    json_writer_init(&json, message, sizeof(message));
+    sensors_wakeup(&json, woken);
+    work(PUBLISH_US);
+  }
+
+  const uint32_t publishes = sensors_take_publishes();
+  if (!publishes) return;
+  json_writer_init(&json, message, sizeof(message));
+  sensors_get_data(&json, publishes);
+  work(PUBLISH_US);
+  sensors_drain();
+  json_writer_init(&json, message, sizeof(message));
+  sensors_sleep(&json, publishes);
+  work(PUBLISH_US);
+}
+
+static void test_sensor_table() {
+  // before the time is known the first publish waits out the longest warmup,
+  // and the sensors that need it are woken up at boot
+  scheduler_clear();
+  now = BOOT_US;
+  sensors_start(false);
+  const int64_t warmup = sensors_get_warmup_time() * 1000LL;
+  const int64_t first_publish = now + warmup;
+  CHECK(warmup == 32 * 1000000LL);
+  CHECK(sensors_schedule(first_publish, true) == ESP_OK);
+
+  const int64_t period = PUBLISH_PERIOD_MS * 1000LL;
+  samples = (deadline_t){.next = now, .period = 10 * 1000000LL};
+  for (int i = 0; i < NUM_SENSORS; ++i) {
+    wakeups[i] = (deadline_t){.next = first_publish - warmup, .period = period};
+    reads[i] = (deadline_t){.next = first_publish, .period = period};
+  }
+  reads[BATTERY].period = 3 * period;
+  for (int i = 0; i < NUM_SENSORS; ++i) ready[i] = -1;
+
+  // the loop of main.c: sleep until the earliest deadline and run what's due
+  const int64_t end = now + HOUR_US;
+  int passes = 0;
+  while (scheduler_next_due() < end) {
+    const int64_t wait = scheduler_next_due() - now;
+    if (wait > 0) vTaskDelay(wait / 1000 / portTICK_PERIOD_MS + 1);
+    scheduler_run(now);
+    report();
+    ++passes;
+  }
+  const double idle = 100.0 * (end - BOOT_US - busy) / (end - BOOT_US);
+
+  printf("sensor     calls   worst ms\n");
+  printf("%-8s %7d %10.1f\n", "sample", samples.calls, samples.worst / 1e3);
+  for (int i = 0; i < NUM_SENSORS; ++i)
+    if (reads[i].calls)
+      printf("%-8s %7d %10.1f\n", names[i], reads[i].calls,
+             reads[i].worst / 1e3);
+  printf("%d passes, %.2f%% idle\n", passes, idle);
+
+  // every 10 s, every 5 minutes after the warmup, and every 15 for the
+  // battery, each call within a tick and a measurement cycle of its deadline
+  CHECK(samples.calls == 360);
+  CHECK(samples.worst <= MAX_LATENESS_US);
+  for (int i = 0; i < NUM_SENSORS; ++i) {
+    CHECK(reads[i].calls == (i == BATTERY ? 4 : 12));
+    CHECK(reads[i].worst <= MAX_LATENESS_US);
+  }
+
+  // and the fan and microphone are woken up the warmup before each read
+  CHECK(wakeups[PMS5003].calls == 12 && wakeups[SPH0645].calls == 12);
+  CHECK(wakeups[PMS5003].worst <= MAX_LATENESS_US);
+  CHECK(wakeups[WIFI].calls == 0 && wakeups[BME280].calls == 0);
+  CHECK(idle >= MIN_IDLE);
+}
+
+static void test_lost_frame() {
+  // a frame that never arrives holds up the cycle until the timeout, and the
+  // sensor isn't read while the other sensors are
+  const int bme280_reads = reads[BME280].calls;
+  const int pms5003_reads = reads[PMS5003].calls;
+  reads[BME280].next = now;
+  frame_lost = true;
+  const int64_t start = now;
+  json_writer_t json;
+  json_writer_init(&json, message, sizeof(message));
+  sensors_get_data(&json, BIT(BME280) | BIT(PMS5003));
+  CHECK(reads[BME280].calls == bme280_reads + 1);
+  CHECK(reads[PMS5003].calls == pms5003_reads);
+  CHECK(now - start >= 2000000 && now - start < 2000000 + MAX_LATENESS_US);
+  frame_lost = false;
+  ready[PMS5003] = -1;
+}
+
+int main() {
+  test_order();
+  test_ties();
+  test_full();
+  test_period();
+  test_shift();
+  test_sensor_table();
+  test_lost_frame();
+  return test_result("scheduler");
+}
@@ -0,0 +1,213 @@
+// Feeds a counting signal through the sound event ring a millisecond at a
+// time, as the microphone task does, and checks what a trigger captures:
+// the audio from before and after it, its timing and duration, reads that
+// wrap around the ring, and the mu-law ring used when there is no psram.
+#include "arena.h"
+#include "sound_event.h"
+#include "test.h"
+
+#define RATE 16000  // Sample rate of the ring (Hz).
+#define BLOCK (RATE / 1000)  // Samples the microphone task steps through.
+#define PRE_MS 10   // Audio kept from before a trigger (ms).
+#define POST_MS 20  // Audio kept from after a trigger (ms).
+#define PRE (PRE_MS * BLOCK)
+#define POST (POST_MS * BLOCK)
+
+static bool psram = true;
+static int allocations = 0;
+static int32_t next_sample = 0;  // Value of the next sample fed in.
+
+void *arena_alloc(const char *owner, size_t size, uint32_t caps) {
+  if ((caps & MALLOC_CAP_SPIRAM) && !psram) return NULL;
+  ++allocations;
+  return malloc(size);
+}
+
+static void feed(int blocks) {
+  // a ramp, so every sample says where it came from
+  for (int b = 0; b < blocks; ++b) {
+    int32_t frames[BLOCK];
+    for (int i = 0; i < BLOCK; ++i) frames[i] = next_sample++ << 8;
+    sound_event_record(frames, BLOCK);
+    sound_event_update(1, true, 1);
+    sound_event_finish();
+  }
+}
+
+static int32_t trigger_in_block(int at) {
+  // records a block and triggers at sample `at` of it, returning the value of
+  // the sample the trigger fell on
+  int32_t frames[BLOCK];
+  const int32_t first = next_sample;
+  for (int i = 0; i < BLOCK; ++i) frames[i] = next_sample++ << 8;
+  sound_event_record(frames, BLOCK);
+  sound_event_trigger(first * 1000LL, BLOCK - at, 2);
+  sound_event_finish();
+  return first + at;
+}
+
+static int32_t get_pcm24(const uint8_t *p) {
+  return (int32_t)(p[0] << 8 | p[1] << 16 | p[2] << 24) >> 8;
+}
+
+static void test_capture() {
+  psram = true;
+  next_sample = 0;
+  CHECK(sound_event_alloc(RATE, PRE_MS, POST_MS) == ESP_OK);
+  CHECK(allocations == 1);
+  CHECK(sound_event_is_listening());
+
+  // nothing is held until a trigger has everything after it recorded
+  sph0645_event_t event;
+  float peak;
+  feed(50);
+  CHECK(sound_event_get(&event, &peak) == ESP_ERR_NOT_FOUND);
+  CHECK(sound_event_read(0, NULL, 0) == ESP_ERR_INVALID_STATE);
+  const int32_t trigger = trigger_in_block(5);
+  CHECK(sound_event_is_recording());
+  sound_event_trigger(0, 0, 3);  // ignored while recording
+  feed(POST_MS - 1);
+  CHECK(sound_event_get(&event, &peak) == ESP_ERR_NOT_FOUND);
+  feed(1);
+  CHECK(sound_event_get(&event, &peak) == ESP_OK);
+  CHECK(!sound_event_is_listening() && !sound_event_is_recording());
+
+  // the event is the audio before and after the trigger, one sample each
+  CHECK(event.id == 0);
+  CHECK(event.time == (trigger - 5) * 1000LL);
+  CHECK(event.pre_trigger == PRE_MS);
+  CHECK(event.sample_rate == RATE);
+  CHECK(event.format == SPH0645_EVENT_FORMAT_PCM24);
+  CHECK(event.size == (PRE + POST) * 3);
+  static uint8_t audio[(PRE + POST) * 3];
+  CHECK(sound_event_read(0, audio, event.size) == ESP_OK);
+  int mismatches = 0;
+  for (int i = 0; i < PRE + POST; ++i)
+    if (get_pcm24(audio + 3 * i) != trigger - PRE + i) ++mismatches;
+  CHECK(mismatches == 0);
+
+  // recording stops while the event is held
+  feed(10);
+  uint8_t again[(PRE + POST) * 3];
+  CHECK(sound_event_read(0, again, event.size) == ESP_OK);
+  CHECK(memcmp(audio, again, event.size) == 0);
+
+  // reads in odd pieces come out the same, however they cross the end of
+  // the ring, and reads beyond the event are refused
+  memset(again, 0, sizeof(again));
+  for (size_t offset = 0; offset < event.size; offset += 101) {
+    const size_t size = event.size - offset < 101 ? event.size - offset : 101;
+    CHECK(sound_event_read(offset, again + offset, size) == ESP_OK);
+  }
+  CHECK(memcmp(audio, again, event.size) == 0);
+  CHECK(sound_event_read(event.size, again, 0) == ESP_OK);
+  CHECK(sound_event_read(event.size + 1, again, 0) == ESP_ERR_INVALID_SIZE);
+  CHECK(sound_event_read(1, again, event.size) == ESP_ERR_INVALID_SIZE);
+
+  // releasing listens again, and an event soon after has less from before it
+  sound_event_release();
+  CHECK(sound_event_is_listening());
+  feed(3);
+  const int32_t second = trigger_in_block(0);
+  feed(POST_MS - 1);
+  CHECK(sound_event_get(&event, &peak) == ESP_OK);
+  CHECK(event.id == 1);
+  CHECK(event.pre_trigger == 3);
+  CHECK(event.size == (3 * BLOCK + POST) * 3);
+  CHECK(sound_event_read(0, audio, event.size) == ESP_OK);
+  CHECK(get_pcm24(audio) == second - 3 * BLOCK);
+  CHECK(get_pcm24(audio + event.size - 3) == second + POST - 1);
+  sound_event_release();
+}
+
+static void test_duration() {
+  // the duration is how long the level stayed above the threshold from the
+  // trigger, and the peak is the highest level
+  psram = true;
+  CHECK(sound_event_alloc(RATE, PRE_MS, POST_MS) == ESP_OK);
+  CHECK(allocations == 1);  // the buffer is kept
+  feed(PRE_MS);
+  trigger_in_block(0);
+  for (int ms = 0; ms < POST_MS - 1; ++ms) {
+    int32_t frames[BLOCK] = {0};
+    sound_event_record(frames, BLOCK);
+    sound_event_update(ms == 3 ? 7 : 2, ms < 5 || ms > 8, 1);
+    sound_event_finish();
+  }
+  sph0645_event_t event;
+  float peak;
+  CHECK(sound_event_get(&event, &peak) == ESP_OK);
+  CHECK(event.duration == 5);
+  CHECK(peak == 7);
+  sound_event_release();
+
+  // a trigger after all of the audio following it is in the ring finishes
+  // at once
+  feed(PRE_MS);
+  int32_t frames[POST];
+  for (int i = 0; i < POST; ++i) frames[i] = i << 8;
+  sound_event_record(frames, POST);
+  sound_event_trigger(0, POST, 2);
+  sound_event_finish();
+  CHECK(sound_event_get(&event, &peak) == ESP_OK);
+  sound_event_release();
+
+  // disabled rings record and trigger nothing
+  sound_event_disable();
+  CHECK(!sound_event_is_listening());
+  sound_event_trigger(0, 0, 2);
+  CHECK(!sound_event_is_recording());
+  CHECK(sound_event_alloc(RATE, PRE_MS, 0) == ESP_ERR_INVALID_ARG);
+}
+
+static int ulaw_decode(uint8_t u) {
+  // g.711 mu-law to 16 bits
+  u = ~u;
+  const int t = (((u & 0x0f) << 3) + 0x84) << ((u & 0x70) >> 4);
+  return u & 0x80 ? 0x84 - t : t - 0x84;
+}
+
+static void test_ulaw() {
+  // without psram the ring is a byte a sample of mu-law
+  psram = false;
+  CHECK(sound_event_alloc(RATE, PRE_MS, POST_MS * 2) == ESP_OK);
+  CHECK(allocations == 2);
+  feed(PRE_MS);
+  trigger_in_block(0);
+  int32_t frames[2 * POST - BLOCK];
+  for (int i = 0; i < 2 * POST - BLOCK; ++i) {
+    // 16-bit values over the whole range, and beyond what mu-law takes
+    const int32_t pcm = (i - POST) * 102 * (i % 2 ? 1 : -1);
+    frames[i] = pcm * 65536;
+  }
+  sound_event_record(frames, 2 * POST - BLOCK);
+  sound_event_finish();
+  sph0645_event_t event;
+  float peak;
+  CHECK(sound_event_get(&event, &peak) == ESP_OK);
+  CHECK(event.format == SPH0645_EVENT_FORMAT_ULAW);
+  CHECK(event.size == PRE + 2 * POST);
+  uint8_t audio[PRE + 2 * POST];
+  CHECK(sound_event_read(0, audio, event.size) == ESP_OK);
+
+  // each value comes back within a step of its segment, and the loudest
+  // are clipped
+  int errors = 0;
+  for (int i = 0; i < 2 * POST - BLOCK; ++i) {
+    int pcm = frames[i] / 65536;
+    if (pcm > 32635) pcm = 32635;
+    if (pcm < -32635) pcm = -32635;
+    const int decoded = ulaw_decode(audio[PRE + BLOCK + i]);
+    if (abs(decoded - pcm) > abs(pcm) / 16 + 8) ++errors;
+  }
+  CHECK(errors == 0);
+  CHECK(ulaw_decode(0xff) == 0);
+  sound_event_release();
+}
+
+int main() {
+  test_capture();
+  test_duration();
+  test_ulaw();
+  return test_result("sound_event");
+}
@@ -0,0 +1,173 @@
+// Steps the Fast, Slow and Impulse time weightings a millisecond at a time as
+// the microphone task does, and checks their time constants, tone burst
+// responses and decay rates against IEC 61672-1. Also times the weighting of
+// each millisecond of audio per sample.
+#include <time.h>
+
+#include "sos_iir_filter.h"
+#include "sph0645.h"
+#include "test.h"
+#include "time_weighting.h"
+
+#define STEP_MS 1      // Step of the time weighting in the microphone task.
+#define RATE 48000     // Sample rate the cost is measured at (Hz).
+#define BENCH_MS 20000  // Audio timed (ms).
+
+static const struct {
+  const char *name;
+  uint8_t time_weighting;
+  double rise_tau;  // Time constant while rising (s).
+  double fall_tau;  // Time constant while falling (s).
+} weightings[] = {
+    {"fast", SPH0645_TIME_WEIGHTING_FAST, 0.125, 0.125},
+    {"slow", SPH0645_TIME_WEIGHTING_SLOW, 1.0, 1.0},
+    {"impulse", SPH0645_TIME_WEIGHTING_IMPULSE, 0.035, 1.5},
+};
+#define NUM_WEIGHTINGS (sizeof(weightings) / sizeof(weightings[0]))
+
+// Tone bursts of IEC 61672-1 table 4 with their class 1 tolerances, which
+// are taken against the response of the exact time constant.
+static const struct {
+  int ms;
+  double upper;
+  double lower;
+} bursts[] = {{1000, 0.5, -0.5}, {500, 0.5, -0.5}, {200, 0.5, -0.5},
+              {100, 1.0, -1.0},  {50, 1.0, -1.0},  {20, 1.0, -1.0},
+              {10, 1.0, -1.0},   {5, 1.0, -1.5},   {2, 1.0, -1.5}};
+#define NUM_BURSTS (sizeof(bursts) / sizeof(bursts[0]))
+
+static float run(const time_weighting_t *weighting, float level,
+                 float mean_sqr, int ms) {
+  for (int i = 0; i < ms; i += STEP_MS)
+    level = time_weighting_step(weighting, level, mean_sqr);
+  return level;
+}
+
+static void test_time_constants() {
+  // a step up reaches 1 - 1/e of the way in one time constant, and a step
+  // down falls to 1/e
+  for (size_t i = 0; i < NUM_WEIGHTINGS; ++i) {
+    time_weighting_t weighting;
+    time_weighting_init(&weighting, weightings[i].time_weighting, STEP_MS);
+    const int rise_ms = lround(weightings[i].rise_tau * 1000);
+    const int fall_ms = lround(weightings[i].fall_tau * 1000);
+    CHECK_NEAR(run(&weighting, 0, 1, rise_ms), 1 - exp(-1), 1e-4);
+    CHECK_NEAR(run(&weighting, 1, 0, fall_ms), exp(-1), 1e-4);
+
+    // and a steady level stays put
+    CHECK(run(&weighting, 0.25, 0.25, 1000) == 0.25f);
+  }
+}
+
+static void test_bursts() {
+  // the highest level of a burst against the steady level of the tone
+  for (size_t i = 0; i < NUM_WEIGHTINGS; ++i) {
+    if (weightings[i].time_weighting == SPH0645_TIME_WEIGHTING_IMPULSE)
+      continue;
+    time_weighting_t weighting;
+    time_weighting_init(&weighting, weightings[i].time_weighting, STEP_MS);
+    for (size_t j = 0; j < NUM_BURSTS; ++j) {
+      const double max = run(&weighting, 0, 1, bursts[j].ms);
+      const double expected =
+          10 * log10(1 - exp(-bursts[j].ms / 1000.0 / weightings[i].rise_tau));
+      const double error = 10 * log10(max) - expected;
+      CHECK(error <= bursts[j].upper && error >= bursts[j].lower);
+    }
+  }
+
+  // the standard's own figures for fast and slow to a tenth of a dB
+  time_weighting_t fast, slow;
+  time_weighting_init(&fast, SPH0645_TIME_WEIGHTING_FAST, STEP_MS);
+  time_weighting_init(&slow, SPH0645_TIME_WEIGHTING_SLOW, STEP_MS);
+  CHECK_NEAR(10 * log10(run(&fast, 0, 1, 200)), -1.0, 0.05);
+  CHECK_NEAR(10 * log10(run(&fast, 0, 1, 2)), -18.0, 0.05);
+  CHECK_NEAR(10 * log10(run(&slow, 0, 1, 200)), -7.4, 0.05);
+  CHECK_NEAR(10 * log10(run(&slow, 0, 1, 2)), -27.0, 0.05);
+}
+
+static void test_decay() {
+  // after a steady tone stops, fast decays at 34.7 dB/s, which must be at
+  // least 25, slow at 4.3 within 3.4 to 5.3, and impulse at 2.9 dB/s
+  static const double rates[] = {34.7, 4.3, 2.9};
+  for (size_t i = 0; i < NUM_WEIGHTINGS; ++i) {
+    time_weighting_t weighting;
+    time_weighting_init(&weighting, weightings[i].time_weighting, STEP_MS);
+    const float level = run(&weighting, 1, 0, 500);
+    const double rate = -10 * log10(level) / 0.5;
+    CHECK_NEAR(rate, rates[i], 0.05);
+  }
+  time_weighting_t fast, slow;
+  time_weighting_init(&fast, SPH0645_TIME_WEIGHTING_FAST, STEP_MS);
+  time_weighting_init(&slow, SPH0645_TIME_WEIGHTING_SLOW, STEP_MS);
+  CHECK(-10 * log10(run(&fast, 1, 0, 1000)) >= 25);
+  const double slow_rate = -10 * log10(run(&slow, 1, 0, 1000));
+  CHECK(slow_rate >= 3.4 && slow_rate <= 5.3);
+
+  // impulse rises fast and falls slowly, so a burst is held
+  time_weighting_t impulse;
+  time_weighting_init(&impulse, SPH0645_TIME_WEIGHTING_IMPULSE, STEP_MS);
+  const float held = run(&impulse, run(&impulse, 0, 1, 35), 0, 100);
+  CHECK(held > run(&fast, run(&fast, 0, 1, 35), 0, 100));
+  CHECK_NEAR(held, (1 - exp(-1)) * exp(-0.1 / 1.5), 1e-4);
+}
+
+static double seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  return 0;
+#endif
+}
+
+static void bench() {
+  // the microphone task weights each millisecond and steps the time
+  // weighting once with its mean square, so the step is spread over a
+  // millisecond of samples
+  static float samples[RATE / 1000];
+  const size_t block = RATE / 1000;
+  for (size_t i = 0; i < block; ++i) samples[i] = sin(i * 0.3) * 1e5;
+  sos_iir_design(RATE);
+  time_weighting_t weighting;
+  time_weighting_init(&weighting, SPH0645_TIME_WEIGHTING_FAST, STEP_MS);
+
+  volatile float sink = 0;
+  double start = seconds();
+  uint64_t start_cycles = cycles();
+  for (int i = 0; i < BENCH_MS; ++i)
+    sink += weight_dBA(samples, samples, block) / block;
+  const double weight_time = seconds() - start;
+  const uint64_t weight_cycles = cycles() - start_cycles;
+
+  float level = 0;
+  start = seconds();
+  start_cycles = cycles();
+  for (int i = 0; i < BENCH_MS; ++i) {
+    const float mean_sqr = weight_dBA(samples, samples, block) / block;
+    level = time_weighting_step(&weighting, level, mean_sqr);
+  }
+  sink += level;
+  const double both_time = seconds() - start;
+  const uint64_t both_cycles = cycles() - start_cycles;
+
+  const double samples_run = (double)BENCH_MS * block;
+  printf("%-16s %10s %15s\n", "per sample", "ns", "host cycles");
+  printf("%-16s %10.2f %15.1f\n", "A-weighting",
+         weight_time / samples_run * 1e9, weight_cycles / samples_run);
+  printf("%-16s %10.2f %15.1f\n", "time weighting",
+         (both_time - weight_time) / samples_run * 1e9,
+         ((double)both_cycles - weight_cycles) / samples_run);
+}
+
+int main() {
+  test_time_constants();
+  test_bursts();
+  test_decay();
+  bench();
+  return test_result("time_weighting");
+}
@@ -0,0 +1,145 @@
+// Measures the A and C weightings that sos_iir_design() makes for each
+// sample rate the microphone can run at, by filtering tones, and checks them
+// against IEC 61672-1 and its class 1 tolerances. Also times the filters to
+// show how much less work the lower rates are.
+#include <time.h>
+
+#include "sos_iir_filter.h"
+#include "test.h"
+
+#define SETTLE_SECONDS 0.5  // Time the filters are left to settle (s).
+#define MEASURE_SECONDS 0.25  // Time the output is measured over (s).
+#define MAX_BLOCK 48  // Samples in a millisecond at the highest rate.
+#define BENCH_SECONDS 20  // Audio timed at each rate (s).
+
+// Poles of the weightings (Hz), as in IEC 61672-1 annex E.
+#define F1 20.598997
+#define F2 107.65265
+#define F3 737.86223
+#define F4 12194.217
+
+typedef float (*weighting_t)(float *input, float *output, size_t len);
+
+static const uint32_t rates[] = {16000, 24000, 32000, 48000};
+
+// Nominal frequencies and class 1 tolerances of IEC 61672-1 table 3 (dB),
+// -INFINITY where no lower limit is set.
+static const struct {
+  double nominal;
+  double upper;
+  double lower;
+} bands[] = {
+    {10, 3.5, -INFINITY}, {12.5, 3.0, -INFINITY}, {16, 2.5, -4.5},
+    {20, 2.5, -2.5},      {25, 2.5, -2.0},        {31.5, 2.0, -2.0},
+    {40, 1.5, -1.5},      {50, 1.5, -1.5},        {63, 1.5, -1.5},
+    {80, 1.5, -1.5},      {100, 1.5, -1.5},       {125, 1.5, -1.5},
+    {160, 1.5, -1.5},     {200, 1.5, -1.5},       {250, 1.4, -1.4},
+    {315, 1.4, -1.4},     {400, 1.4, -1.4},       {500, 1.4, -1.4},
+    {630, 1.4, -1.4},     {800, 1.4, -1.4},       {1000, 1.1, -1.1},
+    {1250, 1.4, -1.4},    {1600, 1.6, -1.6},      {2000, 1.6, -1.6},
+    {2500, 1.6, -1.6},    {3150, 1.6, -1.6},      {4000, 1.6, -1.6},
+    {5000, 2.1, -2.1},    {6300, 2.1, -2.6},      {8000, 2.1, -3.1},
+    {10000, 2.6, -3.6},   {12500, 3.0, -6.0},     {16000, 3.5, -17.0},
+    {20000, 4.0, -INFINITY}};
+#define NUM_BANDS (sizeof(bands) / sizeof(bands[0]))
+
+static float input[MAX_BLOCK], output[MAX_BLOCK];
+
+static double c_weighting(double f) {
+  // the C-weighting without its normalization (dB)
+  const double f2 = f * f;
+  return 20 * log10(F4 * F4 * f2 / ((f2 + F1 * F1) * (f2 + F4 * F4)));
+}
+
+static double a_weighting(double f) {
+  const double f2 = f * f;
+  return c_weighting(f) +
+         20 * log10(f2 / sqrt((f2 + F2 * F2) * (f2 + F3 * F3)));
+}
+
+static double tone_power(weighting_t weighting, uint32_t rate, double f,
+                         double phase) {
+  // sum of squares of the weighted tone once the filters have settled,
+  // filtered a millisecond at a time as the microphone task does
+  const size_t settle = SETTLE_SECONDS * rate, measure = MEASURE_SECONDS * rate;
+  const size_t block = rate / 1000;
+  double sum_sqr = 0;
+  sos_iir_design(rate);
+  for (size_t n = 0; n < settle + measure; n += block) {
+    for (size_t i = 0; i < block; ++i)
+      input[i] = sin(2 * M_PI * f * (n + i) / rate + phase);
+    const float block_sum_sqr = weighting(input, output, block);
+    if (n >= settle) sum_sqr += block_sum_sqr;
+  }
+  return sum_sqr;
+}
+
+static double response(weighting_t weighting, uint32_t rate, double f) {
+  // a sine and a cosine sum to a steady power, so the level is exact without
+  // measuring over whole periods
+  const double power = tone_power(weighting, rate, f, 0) +
+                       tone_power(weighting, rate, f, M_PI / 2);
+  return 10 * log10(power / (MEASURE_SECONDS * rate));
+}
+
+static double check_weighting(const char *name, weighting_t weighting,
+                              double (*nominal)(double), uint32_t rate) {
+  // the class 1 tolerances are checked up to a third of the sample rate,
+  // which is as far as the design keeps to them, and the worst error is
+  // returned
+  const double reference = nominal(1000);
+  double worst = 0;
+  for (size_t i = 0; i < NUM_BANDS; ++i) {
+    // the exact frequency of the band, not its nominal one
+    const double band = round(10 * log10(bands[i].nominal / 1000));
+    const double f = 1000 * pow(10, band / 10);
+    if (f > rate / 3.0) break;
+    const double error =
+        response(weighting, rate, f) - (nominal(f) - reference);
+    if (fabs(error) > fabs(worst)) worst = error;
+    if (error > bands[i].upper || error < bands[i].lower)
+      printf("%s at %u Hz: %.5g Hz off by %+.2f dB\n", name, rate, f, error);
+    CHECK(error <= bands[i].upper && error >= bands[i].lower);
+  }
+  return worst;
+}
+
+static double seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double bench(uint32_t rate) {
+  // time to equalize and weight a second of audio (s)
+  const size_t block = rate / 1000;
+  sos_iir_design(rate);
+  for (size_t i = 0; i < block; ++i) input[i] = sin(i * 0.1);
+  volatile float sink = 0;
+  const double start = seconds();
+  for (size_t n = 0; n < BENCH_SECONDS * 1000; ++n) {
+    sink += equalize(input, output, block);
+    sink += weight_dBA(output, output, block);
+  }
+  return (seconds() - start) / BENCH_SECONDS;
+}
+
+int main() {
+  CHECK(sos_iir_design(1000) == ESP_ERR_INVALID_ARG);
+
+  // the work is per sample, so it falls with the rate
+  const size_t num_rates = sizeof(rates) / sizeof(rates[0]);
+  double times[num_rates];
+  for (size_t i = 0; i < num_rates; ++i) times[i] = bench(rates[i]);
+
+  printf("%-8s %9s %9s %12s %7s\n", "rate", "worst A", "worst C",
+         "host us/s", "saved");
+  for (size_t i = 0; i < num_rates; ++i) {
+    CHECK(sos_iir_design(rates[i]) == ESP_OK);
+    const double a = check_weighting("A", weight_dBA, a_weighting, rates[i]);
+    const double c = check_weighting("C", weight_dBC, c_weighting, rates[i]);
+    printf("%-8u %+7.2fdB %+7.2fdB %12.0f %6.0f%%\n", rates[i], a, c,
+           times[i] * 1e6, (1 - times[i] / times[num_rates - 1]) * 100);
+  }
+  return test_result("weighting");
+}